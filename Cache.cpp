@@ -0,0 +1,77 @@
+/* sharded cache with a byte budget and TinyLFU admission
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "Cache.h"
+#include <sstream>
+
+uint64_t cacheKeyHash(const std::string& key) {
+	uint64_t h = 14695981039346656037ULL;
+	for(size_t i = 0; i < key.size(); ++i) {
+		h ^= (uint8_t)key[i];
+		h *= 1099511628211ULL;
+	}
+	// The DB entry ids are just a few bytes. FNV-1a alone leaves the upper bits (the shard)
+	// almost the same for them, so mix them (the MurmurHash3 finalizer).
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+CacheFrequencySketch::CacheFrequencySketch(size_t numCounters)
+: counters(numCounters), additions(0), resetAt(10 * numCounters) {}
+
+// The 4 counters of a key, from the lower 32 bits of its hash.
+static size_t __sketchIndex(uint64_t hash, int i, size_t size) {
+	uint32_t h = (uint32_t)hash + (uint32_t)i * (uint32_t)(hash >> 16) * 0x9e3779b9U;
+	h ^= h >> 15;
+	return h & (size - 1);
+}
+
+// Only the smallest counters are incremented (conservative update),
+// so that collisions with other keys overestimate less.
+void CacheFrequencySketch::add(uint64_t hash) {
+	unsigned int f = estimate(hash);
+	if(f >= 15) return;
+	for(int i = 0; i < 4; ++i) {
+		uint8_t& c = counters[__sketchIndex(hash, i, counters.size())];
+		if(c == f) ++c;
+	}
+	if(++additions >= resetAt) {
+		for(size_t i = 0; i < counters.size(); ++i)
+			counters[i] >>= 1;
+		additions /= 2;
+	}
+}
+
+unsigned int CacheFrequencySketch::estimate(uint64_t hash) const {
+	unsigned int f = 15;
+	for(int i = 0; i < 4; ++i) {
+		uint8_t c = counters[__sketchIndex(hash, i, counters.size())];
+		if(c < f) f = c;
+	}
+	return f;
+}
+
+void CacheStats::add(const CacheStats& other) {
+	hits += other.hits;
+	misses += other.misses;
+	evictions += other.evictions;
+	rejections += other.rejections;
+	hitBytes += other.hitBytes;
+	entries += other.entries;
+	bytes += other.bytes;
+}
+
+std::string CacheStats::summary() const {
+	std::ostringstream s;
+	s << hits << " hits";
+	if(hits + misses > 0) s << " (" << (hits * 100 / (hits + misses)) << "%)";
+	s << ", " << misses << " misses, " << evictions << " evictions, " << rejections << " rejections, "
+	<< entries << " entries, " << (bytes / 1024) << " KB, " << (hitBytes / 1024) << " KB saved";
+	return s.str();
+}
@@ -0,0 +1,196 @@
+/* sharded cache with a byte budget and TinyLFU admission
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#ifndef __AZ__CACHE_H__
+#define __AZ__CACHE_H__
+
+#include "Mutex.h"
+#include "Utils.h"
+#include "SmartPointer.h"
+#include <string>
+#include <list>
+#include <vector>
+#include <stdint.h>
+
+#ifndef CacheSketchSize
+#define CacheSketchSize 4096 // counters per shard, power of two
+#endif
+#define CacheMinBuckets 64 // of the index of a shard, power of two
+
+uint64_t cacheKeyHash(const std::string& key); // FNV-1a, mixed
+
+// Approximate recent access counts (count-min sketch, 4 counters per key, counting up to 15).
+// It should have more counters than the cache has entries.
+// All counters are halved after a while, so that old popularity fades out.
+struct CacheFrequencySketch {
+	std::vector<uint8_t> counters;
+	size_t additions, resetAt;
+	CacheFrequencySketch(size_t numCounters);
+	void add(uint64_t hash);
+	unsigned int estimate(uint64_t hash) const;
+};
+
+struct CacheStats {
+	uint64_t hits, misses, evictions, rejections;
+	uint64_t hitBytes; // the sizes of the hits, i.e. what the cache saved
+	size_t entries, bytes;
+	CacheStats() : hits(0), misses(0), evictions(0), rejections(0), hitBytes(0), entries(0), bytes(0) {}
+	void add(const CacheStats& other);
+	std::string summary() const; // for the tools
+};
+
+/* Each key belongs to one shard (by its hash). Each shard has its own lock, LRU list,
+ frequency sketch and an equal part of the byte budget.
+ Only get() counts as an access. If a shard gets over its budget, its least recently used
+ entries are evicted, but only if they were not accessed more often than the entry which needs
+ the space (TinyLFU). Otherwise that one goes. So a scan over many entries which are used only
+ once doesn't evict the often used ones.
+ The values are shared, so an evicted value stays valid for everyone who still has it.
+ The index of a shard is a hash table (chained, by the key hash) with at least as many
+ buckets as entries. */
+template<typename T>
+struct Cache : DontCopyTag {
+	struct Item {
+		std::string key;
+		SmartPointer<T> value;
+		size_t size;
+		uint64_t hash;
+	};
+	typedef std::list<Item> ItemList;
+	typedef std::vector<typename ItemList::iterator> Bucket;
+	struct Shard {
+		Mutex mutex;
+		ItemList items; // most recently used first
+		std::vector<Bucket> index; // by the lower bits of the hash
+		CacheFrequencySketch sketch;
+		size_t budget;
+		CacheStats stats;
+		Shard() : index(CacheMinBuckets), sketch(CacheSketchSize), budget(0) {}
+	};
+	Shard* shards;
+	size_t numShards;
+
+	Cache(size_t budget, size_t _numShards = 16) : numShards(_numShards ? _numShards : 1) {
+		shards = new Shard[numShards];
+		for(size_t i = 0; i < numShards; ++i)
+			shards[i].budget = budget / numShards;
+	}
+	~Cache() { delete[] shards; }
+
+	// Counts the access. Returns a NULL SmartPointer if it is not there.
+	SmartPointer<T> get(const std::string& key) {
+		uint64_t hash = cacheKeyHash(key);
+		Shard& s = shard(hash);
+		ScopedLock lock(s.mutex);
+		s.sketch.add(hash);
+		typename ItemList::iterator i = find(s, key, hash);
+		if(i == s.items.end()) {
+			s.stats.misses++;
+			return SmartPointer<T>();
+		}
+		s.stats.hits++;
+		s.stats.hitBytes += i->size;
+		s.items.splice(s.items.begin(), s.items, i);
+		return i->value;
+	}
+
+	// Replaces an existing entry. Returns false if it was not admitted.
+	bool put(const std::string& key, const SmartPointer<T>& value, size_t size) {
+		uint64_t hash = cacheKeyHash(key);
+		Shard& s = shard(hash);
+		ScopedLock lock(s.mutex);
+		typename ItemList::iterator i = find(s, key, hash);
+		if(i != s.items.end())
+			remove(s, i);
+		s.items.push_front(Item());
+		s.items.front().key = key;
+		s.items.front().value = value;
+		s.items.front().size = size;
+		s.items.front().hash = hash;
+		s.stats.entries++;
+		insert(s, s.items.begin());
+		s.stats.bytes += size;
+		if(makeRoom(s, s.items.begin())) return true;
+		s.stats.rejections++;
+		return false;
+	}
+
+	// The size of the value has changed, e.g. because it has grown. Only if the entry
+	// still has this value. This can evict other entries or this one.
+	void resize(const std::string& key, const T* value, size_t size) {
+		uint64_t hash = cacheKeyHash(key);
+		Shard& s = shard(hash);
+		ScopedLock lock(s.mutex);
+		typename ItemList::iterator i = find(s, key, hash);
+		if(i == s.items.end() || i->value.get() != value) return;
+		s.stats.bytes += size;
+		s.stats.bytes -= i->size;
+		i->size = size;
+		if(!makeRoom(s, i))
+			s.stats.evictions++;
+	}
+
+	CacheStats stats() {
+		CacheStats res;
+		for(size_t i = 0; i < numShards; ++i) {
+			ScopedLock lock(shards[i].mutex);
+			res.add(shards[i].stats);
+		}
+		return res;
+	}
+
+private:
+	Shard& shard(uint64_t hash) { return shards[(hash >> 32) % numShards]; }
+	static Bucket& bucket(Shard& s, uint64_t hash) { return s.index[hash & (s.index.size() - 1)]; }
+
+	// Returns s.items.end() if it is not there.
+	typename ItemList::iterator find(Shard& s, const std::string& key, uint64_t hash) {
+		Bucket& b = bucket(s, hash);
+		for(size_t i = 0; i < b.size(); ++i)
+			if(b[i]->hash == hash && b[i]->key == key) return b[i];
+		return s.items.end();
+	}
+
+	// s.stats.entries must already count it.
+	void insert(Shard& s, typename ItemList::iterator item) {
+		if(s.stats.entries > s.index.size()) {
+			std::vector<Bucket> oldIndex(s.index.size() * 2);
+			oldIndex.swap(s.index);
+			for(size_t i = 0; i < oldIndex.size(); ++i)
+				for(size_t j = 0; j < oldIndex[i].size(); ++j)
+					bucket(s, oldIndex[i][j]->hash).push_back(oldIndex[i][j]);
+		}
+		bucket(s, item->hash).push_back(item);
+	}
+
+	void remove(Shard& s, typename ItemList::iterator item) {
+		s.stats.entries--;
+		s.stats.bytes -= item->size;
+		Bucket& b = bucket(s, item->hash);
+		for(size_t i = 0; i < b.size(); ++i)
+			if(b[i] == item) {
+				b[i] = b.back();
+				b.pop_back();
+				break;
+			}
+		s.items.erase(item);
+	}
+
+	// Returns false if item itself was removed.
+	bool makeRoom(Shard& s, typename ItemList::iterator item) {
+		while(s.stats.bytes > s.budget) {
+			typename ItemList::iterator victim = --s.items.end();
+			if(victim == item || s.sketch.estimate(victim->hash) > s.sketch.estimate(item->hash)) {
+				remove(s, item);
+				return false;
+			}
+			remove(s, victim);
+			s.stats.evictions++;
+		}
+		return true;
+	}
+};
+
+#endif
@@ -5,6 +5,7 @@
  */
 
 #include "Crc.h"
+#include <stdint.h>
 
 /* Table of CRCs of all 8-bit messages. */
 static const uint32_t crc_table[256] = {
@@ -15,15 +16,189 @@ static const uint32_t crc_table[256] = {
 	2512341634, 3803740692, 2075208622, 213261112, 2463272603, 3855990285, 2094854071, 198958881, 2262029012, 4057260610, 1759359992, 534414190, 2176718541, 4139329115, 1873836001, 414664567, 2282248934, 4279200368, 1711684554, 285281116, 2405801727, 4167216745, 1634467795, 376229701, 2685067896, 3608007406, 1308918612, 956543938, 2808555105, 3495958263, 1231636301, 1047427035, 2932959818, 3654703836, 1088359270, 936918000, 2847714899, 3736837829, 1202900863, 817233897, 3183342108, 3401237130, 1404277552, 615818150, 3134207493, 3453421203, 1423857449, 601450431, 3009837614, 3294710456, 
 	1567103746, 711928724, 3020668471, 3272380065, 1510334235, 755167117 };
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define Crc_X86
+#endif
+
+static uint32_t __update_crc_bytewise(uint32_t c, const uint8_t* buf, size_t len) {
+	for (size_t n = 0; n < len; n++)
+		c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+	return c;
+}
+
+/* Slice-by-8: crc_tables[k][n] is the CRC of byte n followed by k zero bytes,
+ so 8 bytes are done with 8 independent table lookups. */
+struct CrcTables {
+	uint32_t t[8][256];
+	CrcTables() {
+		for(int n = 0; n < 256; ++n) {
+			t[0][n] = crc_table[n];
+			for(int k = 1; k < 8; ++k)
+				t[k][n] = crc_table[t[k-1][n] & 0xff] ^ (t[k-1][n] >> 8);
+		}
+	}
+};
+static const CrcTables crc_tables;
+
+static uint32_t __update_crc_slice8(uint32_t c, const uint8_t* buf, size_t len) {
+	const uint32_t (*t)[256] = crc_tables.t;
+	for(; len >= 8; len -= 8, buf += 8) {
+		// little endian byte order, independent of the host
+		uint32_t lo = c ^ (buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24));
+		uint32_t hi = buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((uint32_t)buf[7] << 24);
+		c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+			t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+	}
+	return __update_crc_bytewise(c, buf, len);
+}
+
+#ifdef Crc_X86
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#ifndef bit_PCLMUL
+#define bit_PCLMUL (1 << 1)
+#endif
+
+static bool __detectPclmul() {
+	unsigned int a, b, c, d;
+	if(!__get_cpuid(1, &a, &b, &c, &d)) return false;
+	return (c & bit_PCLMUL) && (c & bit_SSE4_1);
+}
+
+/* Folding with carry-less multiplication, from the Intel paper
+ "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ The constants are for the bit-reflected CRC-32 polynomial.
+ len must be >= 64 and a multiple of 16. */
+static __attribute__((target("pclmul,sse4.1")))
+uint32_t __update_crc_pclmul_blocks(uint32_t crc, const uint8_t* buf, size_t len) {
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	buf += 64;
+	len -= 64;
+
+	// fold by 4
+	for(; len >= 64; buf += 64, len -= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(buf + 0x30)));
+	}
+
+	// fold into 128 bits
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// the remaining 16 byte blocks
+	for(; len >= 16; buf += 16, len -= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*) buf)), x5);
+	}
+
+	// fold 128 bits to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t __update_crc_pclmul(uint32_t c, const uint8_t* buf, size_t len) {
+	if(len >= 64) {
+		size_t blocksLen = len & ~(size_t)15;
+		c = __update_crc_pclmul_blocks(c, buf, blocksLen);
+		buf += blocksLen;
+		len -= blocksLen;
+	}
+	return __update_crc_slice8(c, buf, len);
+}
+
+#else
+
+static bool __detectPclmul() { return false; }
+
+#endif // Crc_X86
+
+bool crc_cpu_supports(int impl) {
+	switch(impl) {
+		case CrcImpl_Bytewise:
+		case CrcImpl_Slice8:
+			return true;
+		case CrcImpl_PCLMUL: {
+			// the detection gives always the same, so it doesn't matter if two threads do it
+			static int pclmul = -1;
+			if(pclmul < 0) pclmul = __detectPclmul() ? 1 : 0;
+			return pclmul != 0;
+		}
+	}
+	return false;
+}
+
+const char* crc_impl_name(int impl) {
+	switch(impl) {
+		case CrcImpl_Bytewise: return "bytewise";
+		case CrcImpl_Slice8: return "slice-by-8";
+		case CrcImpl_PCLMUL: return "PCLMUL";
+	}
+	return "unknown";
+}
+
+uint32_t update_crc(uint32_t crc, const char *buf, size_t len, int impl) {
+	switch(impl) {
+		case CrcImpl_Bytewise: return __update_crc_bytewise(crc, (const uint8_t*) buf, len);
+		case CrcImpl_Slice8: return __update_crc_slice8(crc, (const uint8_t*) buf, len);
+#ifdef Crc_X86
+		case CrcImpl_PCLMUL: return __update_crc_pclmul(crc, (const uint8_t*) buf, len);
+#endif
+	}
+	return __update_crc_bytewise(crc, (const uint8_t*) buf, len);
+}
+
 /* Update a running CRC with the bytes buf[0..len-1]--the CRC
  should be initialized to all 1's, and the transmitted value
  is the 1's complement of the final running CRC (see the
  crc() routine below). */
 uint32_t update_crc(uint32_t crc, const char *buf, size_t len) {
-	uint32_t c = crc;
-	for (size_t n = 0; n < len; n++)
-		c = crc_table[(c ^ (unsigned char)buf[n]) & 0xff] ^ (c >> 8);
-	return c;
+	// most PNG chunks and DB chunks are small, there the tables are fastest
+	if(len >= 64 && crc_cpu_supports(CrcImpl_PCLMUL))
+		return __update_crc_pclmul(crc, (const uint8_t*) buf, len);
+	return __update_crc_slice8(crc, (const uint8_t*) buf, len);
 }
 
 /* Return the CRC of the bytes buf[0..len-1]. */
@@ -42,3 +217,47 @@ uint32_t calc_crc(const std::string& s1, const std::string& s2) {
 	return c ^ 0xffffffffL;
 }
 
+
+/* CRC combination as in zlib (crc32_combine): appending len2 bytes to the first message
+ multiplies its CRC by x^(8*len2) modulo the polynomial. */
+
+#define CrcPoly 0xedb88320 // reflected
+
+// a*b modulo the polynomial, in the reflected bit order (x^0 is the highest bit)
+static uint32_t __multmodp(uint32_t a, uint32_t b) {
+	uint32_t m = (uint32_t)1 << 31, p = 0;
+	while(true) {
+		if(a & m) {
+			p ^= b;
+			if((a & (m - 1)) == 0) break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CrcPoly : b >> 1;
+	}
+	return p;
+}
+
+// x2n_table[n] = x^(2^n) modulo the polynomial
+struct CrcX2nTable {
+	uint32_t t[32];
+	CrcX2nTable() {
+		uint32_t p = (uint32_t)1 << 30; // x^1
+		t[0] = p;
+		for(int n = 1; n < 32; ++n)
+			t[n] = p = __multmodp(p, p);
+	}
+};
+static const CrcX2nTable crc_x2n_table;
+
+// x^(n * 2^k) modulo the polynomial
+static uint32_t __x2nmodp(uint64_t n, unsigned k) {
+	uint32_t p = (uint32_t)1 << 31; // x^0
+	for(; n > 0; n >>= 1, k++)
+		if(n & 1)
+			p = __multmodp(crc_x2n_table.t[k & 31], p);
+	return p;
+}
+
+uint32_t crc_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+	return __multmodp(__x2nmodp(len2, 3), crc1) ^ crc2;
+}
@@ -8,10 +8,26 @@
 #define __AZ__CRC_H__
 
 #include <string>
+#include <stdint.h>
 
 uint32_t update_crc(uint32_t crc, const char *buf, size_t len);
 uint32_t calc_crc(const char *buf, size_t len);
 uint32_t calc_crc(const std::string& s);
 uint32_t calc_crc(const std::string& s1, const std::string& s2);
 
+// The CRC of the concatenation of two messages, from the CRCs (calc_crc) of both
+// and the length of the second one, so it doesn't need to go over the data again.
+uint32_t crc_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+// update_crc() uses slice-by-8 tables, and for bigger buffers
+// the carry-less multiplication (PCLMUL) if the CPU has it.
+#define CrcImpl_Bytewise 0 // the original one-table loop
+#define CrcImpl_Slice8 1
+#define CrcImpl_PCLMUL 2
+#define CrcImpl_Count 3
+
+bool crc_cpu_supports(int impl); // via cpuid
+const char* crc_impl_name(int impl);
+uint32_t update_crc(uint32_t crc, const char *buf, size_t len, int impl); // impl must be supported
+
 #endif
@@ -3,21 +3,16 @@
  * code under LGPL
  */
 
-#ifndef Z_CompressionLevel
-#define Z_CompressionLevel 9
-#endif
-
-#ifndef Z_BufSize
-#define Z_BufSize 1024*128
-#endif
-
 #include "Db.h"
 #include "Sha1.h"
+#include "Sha256.h"
+#include "DbHashIndex.h"
+#include "DbEntryCache.h"
 #include "StringUtils.h"
 #include "FileUtils.h"
 #include <cassert>
-#include <zlib.h>
 #include <cstdlib>
+#include <sstream>
 
 #include <iostream>
 using namespace std;
@@ -26,72 +21,313 @@ void DbEntry::calcSha1() {
 	sha1 = calc_sha1(data);
 }
 
-void DbEntry::compress() {
-	compressed = "";
-	
-	z_stream stream;
-	stream.zalloc = Z_NULL;
-	stream.zfree = Z_NULL;
-	stream.opaque = Z_NULL;
-	deflateInit(&stream, Z_CompressionLevel);
-	
-	stream.avail_in = data.size();
-	stream.next_in = (unsigned char*) &data[0];
-	while(true) {
-		char outputData[Z_BufSize];
-		stream.avail_out = sizeof(outputData);
-		stream.next_out = (unsigned char*) outputData;
-		int ret = deflate(&stream, Z_FINISH);
-		switch(ret) {
-			case Z_OK: break;
-			case Z_STREAM_END: break;
-			// these cases should not happen. but check anyway
-			case Z_STREAM_ERROR:
-			default:
-				cerr << "error to deflate " << data.size() << " bytes" << endl;
-				cerr << "remaining: " << stream.avail_in << " bytes" << endl;
-				cerr << "deflate ret: " << ret << endl;
-				assert(false);
-				return;
-		}
-		size_t out_size = sizeof(outputData) - stream.avail_out;
-		compressed += std::string(outputData, out_size);
-		if(ret == Z_STREAM_END) break;
+void DbEntry::calcSha256() {
+	sha256 = calc_sha256(data);
+}
+
+void prepareEntries(std::list<DbEntry>& entries, bool trustedHash) {
+	if(trustedHash) {
+		for(std::list<DbEntry>::iterator e = entries.begin(); e != entries.end(); ++e)
+			e->calcSha256();
+		return;
+	}
+	std::vector<const char*> data;
+	std::vector<size_t> sizes;
+	data.reserve(entries.size());
+	sizes.reserve(entries.size());
+	for(std::list<DbEntry>::iterator e = entries.begin(); e != entries.end(); ++e) {
+		data.push_back(e->data.data());
+		sizes.push_back(e->data.size());
 	}
-	deflateEnd(&stream);
+	if(data.empty()) return;
+	std::vector<std::string> digests(data.size());
+	calc_sha1_many(&digests[0], &data[0], &sizes[0], data.size());
+	size_t i = 0;
+	for(std::list<DbEntry>::iterator e = entries.begin(); e != entries.end(); ++e, ++i)
+		e->sha1.swap(digests[i]);
+}
+
+void DbEntry::compress(const DbCodec& codec) {
+	codec.compress(data, compressed);
 }
 
 Return DbEntry::uncompress() {
-	data = "";
-	
-	z_stream stream;
-	stream.zalloc = Z_NULL;
-	stream.zfree = Z_NULL;
-	stream.opaque = Z_NULL;
-	inflateInit(&stream);
-	
-	bool gotStreamEnd = false;
-	stream.avail_in = compressed.size();
-	stream.next_in = (unsigned char*) &compressed[0];
-	while(true) {
-		char outputData[Z_BufSize];
-		stream.avail_out = sizeof(outputData);
-		stream.next_out = (unsigned char*) outputData;
-		int ret = inflate(&stream, Z_NO_FLUSH);
-		switch(ret) {
-			case Z_STREAM_ERROR: inflateEnd(&stream); return "zlib stream error / invalid compression level";
-			case Z_NEED_DICT: inflateEnd(&stream); return "zlib need dict error";
-			case Z_DATA_ERROR: inflateEnd(&stream); return "zlib data error";
-			case Z_MEM_ERROR: inflateEnd(&stream); return "zlib out-of-memory error";
-			case Z_STREAM_END: gotStreamEnd = true;
+	return dbCodecUncompress(compressed, data);
+}
+
+void DbPushBatch::resolve(const std::vector< std::list<DbEntryId> >& refs, const std::map<DbEntryId, DbEntry>& candidates, DbStats& stats) {
+	std::map< std::string, std::list<size_t> > newBySha1;
+	for(size_t i = 0; i < entries.size(); ++i) {
+		const DbEntry& entry = entries[i];
+		sameAs[i] = i;
+		
+		bool found = false;
+		for(std::list<DbEntryId>::const_iterator r = refs[i].begin(); r != refs[i].end(); ++r) {
+			std::map<DbEntryId, DbEntry>::const_iterator other = candidates.find(*r);
+			if(other != candidates.end() && entry == other->second) {
+				ids[i] = *r;
+				found = true;
+				break;
+			}
+		}
+		
+		// entries which are new in this batch come after the ones already in the DB
+		std::list<size_t>& sameSha1 = newBySha1[entry.sha1];
+		for(std::list<size_t>::iterator j = sameSha1.begin(); !found && j != sameSha1.end(); ++j) {
+			if(entry == entries[*j]) {
+				sameAs[i] = *j;
+				found = true;
+			}
+		}
+		
+		if(found)
+			stats.countReuse(entry);
+		else {
+			newEntries.push_back(i);
+			sameSha1.push_back(i);
+			stats.pushNew++;
+		}
+	}
+}
+
+void DbPushBatch::resolveTrusted(const std::vector<DbEntryId>& refIds, DbStats& stats) {
+	std::map<std::string, size_t> newBySha256;
+	for(size_t i = 0; i < entries.size(); ++i) {
+		const DbEntry& entry = entries[i];
+		sameAs[i] = i;
+		
+		bool found = false;
+		if(!refIds[i].empty()) {
+			ids[i] = refIds[i];
+			found = true;
+		}
+		else {
+			std::map<std::string, size_t>::iterator j = newBySha256.find(entry.sha256);
+			if(j != newBySha256.end()) {
+				sameAs[i] = j->second;
+				found = true;
+			}
 		}
-		size_t out_size = sizeof(outputData) - stream.avail_out;
-		if(out_size == 0) break;
-		data += std::string(outputData, out_size);
-	}	
-	inflateEnd(&stream);
+		
+		if(found)
+			stats.countReuse(entry);
+		else {
+			newEntries.push_back(i);
+			newBySha256[entry.sha256] = i;
+			stats.pushNew++;
+		}
+	}
+}
+
+void DbIntf::compressForPush(const DbEntry& entry, /*out*/ std::string& compressed) {
+	if(entry.haveCompressed())
+		compressed = entry.compressed;
+	else
+		codecs.forEntry(entry.data).compress(entry.data, compressed);
+}
+
+void DbIntf::compressForPushMany(const std::vector<DbEntry>& entries, const std::vector<size_t>& newEntries, /*out*/ std::vector<std::string>& compressed) {
+	compressed = std::vector<std::string>(entries.size());
+	if(compressor != NULL && newEntries.size() > 1) {
+		compressor->compressMany(*this, entries, newEntries, compressed);
+		return;
+	}
+	for(size_t j = 0; j < newEntries.size(); ++j)
+		compressForPush(entries[newEntries[j]], compressed[newEntries[j]]);
+}
+
+bool DbIntf::mayHaveRef(const DbEntry& entry) {
+	if(hashIndex == NULL) return true;
+	if(hashIndex->mayContain(refHash(entry))) return true;
+	stats.refLookupsSkipped++;
+	return false;
+}
+
+void DbIntf::addRefToIndex(const DbEntry& entry) {
+	if(hashIndex != NULL)
+		hashIndex->add(refHash(entry));
+}
+
+Return DbIntf::initHashMode() {
+	std::string mode;
+	// no meta key (or no meta support at all) means the default SHA1 mode
+	if(!getMeta(mode, "hash")) return true;
+	if(mode == "sha256") trustedHash = true;
+	else if(mode != "sha1") return "DB: unknown hash mode '" + mode + "'";
+	return true;
+}
+
+Return DbIntf::initCodecs() {
+	std::string name;
+	// no meta key means deflate, like in older DBs
+	if(getMeta(name, "codec")) {
+		DbCodec codec;
+		ASSERT_EXT( DbCodec::FromName(codec, name), "DB meta codec" );
+		ASSERT( codecs.set("", codec) );
+	}
+	for(const char** t = DbCodecs::TypeNames; *t; ++t) {
+		if(!getMeta(name, std::string("codec.") + *t)) continue;
+		DbCodec codec;
+		ASSERT_EXT( DbCodec::FromName(codec, name), std::string("DB meta codec.") + *t );
+		ASSERT( codecs.set(*t, codec) );
+	}
+	// all dictionaries, also the older ones, for the entries compressed with them
+	std::string dictIds;
+	if(getMeta(dictIds, "zstd-dicts")) {
+		std::istringstream ids(dictIds);
+		std::string id;
+		while(ids >> id) {
+			std::string dict;
+			ASSERT_EXT( getMeta(dict, "zstd-dict." + id), "DB meta zstd-dict." + id );
+			uint32_t dictId = 0;
+			ASSERT_EXT( dbCodecAddDict(dict, dictId), "DB meta zstd-dict." + id );
+		}
+	}
+	std::string dictId;
+	if(getMeta(dictId, "zstd-dict"))
+		codecs.dictId = strtoul(dictId.c_str(), NULL, 10);
+	return true;
+}
+
+Return DbIntf::initRefGeneration() {
+	std::string value;
+	// no meta key means no process has pushed with this yet
+	refGeneration = getMeta(value, "hashgen") ? strtoull(value.c_str(), NULL, 10) : 0;
+	return true;
+}
+
+// So that a DbHashIndex snapshot is not used anymore when another process has pushed after
+// it was saved, or when the process which saved the one before has crashed before saving again.
+Return DbIntf::updateRefGeneration() {
+	if(refGenerationUpdated) return true;
+	std::string value;
+	uint64_t gen = getMeta(value, "hashgen") ? strtoull(value.c_str(), NULL, 10) : 0;
+	std::ostringstream genStr;
+	genStr << (gen + 1);
+	ASSERT( setMeta("hashgen", genStr.str()) );
+	refGeneration = gen + 1;
+	refGenerationUpdated = true;
+	return true;
+}
+
+Return DbIntf::initMeta() {
+	ASSERT( initHashMode() );
+	ASSERT( initRefGeneration() );
+	return initCodecs();
+}
+
+Return DbIntf::setCodec(const std::string& typeName, const DbCodec& codec) {
+	ASSERT( codecs.set(typeName, codec) );
+	return setMeta(typeName.empty() ? "codec" : ("codec." + typeName), codec.name());
+}
+
+Return DbIntf::addCodecDict(const std::string& dict) {
+	uint32_t id = 0;
+	ASSERT( dbCodecAddDict(dict, id) );
+	std::ostringstream idStr;
+	idStr << id;
+	ASSERT( setMeta("zstd-dict." + idStr.str(), dict) );
+	std::string dictIds;
+	if(!getMeta(dictIds, "zstd-dicts")) dictIds = "";
+	if((" " + dictIds + " ").find(" " + idStr.str() + " ") == std::string::npos)
+		ASSERT( setMeta("zstd-dicts", dictIds.empty() ? idStr.str() : (dictIds + " " + idStr.str())) );
+	ASSERT( setMeta("zstd-dict", idStr.str()) );
+	codecs.dictId = id;
+	return true;
+}
+
+Return DbIntf::setCodecFromSpec(const std::string& spec) {
+	std::string typeName;
+	DbCodec codec;
+	ASSERT( dbCodecParseSpec(spec, typeName, codec) );
+	return setCodec(typeName, codec);
+}
+
+struct __DbHashRefCounter : DbHashRefCallbackIntf {
+	size_t count;
+	__DbHashRefCounter() : count(0) {}
+	void hashRef(const std::string&) { count++; }
+};
+
+Return DbIntf::setTrustedHash() {
+	if(trustedHash) return true;
+	// The entries stored before have only SHA1 refs and would all be stored again.
+	__DbHashRefCounter sha1Refs;
+	ASSERT( iterateHashRefs(sha1Refs) );
+	if(sha1Refs.count > 0)
+		return "trusted hash mode can only be set on a new DB, this one has entries already";
+	ASSERT( setMeta("hash", "sha256") );
+	trustedHash = true;
+	return true;
+}
+
+Return DbIntf::pushMany(/*out*/ std::vector<DbEntryId>& ids, const std::vector<DbEntry>& entries) {
+	ids = std::vector<DbEntryId>(entries.size());
+	for(size_t i = 0; i < entries.size(); ++i)
+		ASSERT( push(ids[i], entries[i]) );
+	return true;
+}
+
+Return DbIntf::getMany(/*out*/ std::vector<DbEntry>& entries, const std::vector<DbEntryId>& ids) {
+	entries = std::vector<DbEntry>(ids.size());
+	for(size_t i = 0; i < ids.size(); ++i)
+		ASSERT( get(entries[i], ids[i]) );
+	return true;
+}
+
+Return DbIntf::existMany(/*out*/ std::vector<bool>& exist, const std::vector<DbEntryId>& ids) {
+	exist = std::vector<bool>(ids.size());
+	for(size_t i = 0; i < ids.size(); ++i) {
+		DbEntry entry;
+		exist[i] = get(entry, ids[i]);
+	}
+	return true;
+}
+
+Return DbIntf::getManyCached(/*out*/ std::vector<DbEntry>& entries, const std::vector<DbEntryId>& ids) {
+	if(entryCache == NULL) return getMany(entries, ids);
+	entries = std::vector<DbEntry>(ids.size());
+	std::vector<DbEntryId> missingIds;
+	std::vector<size_t> missing; // indices in ids
+	for(size_t i = 0; i < ids.size(); ++i) {
+		SmartPointer<std::string> data = entryCache->get(ids[i]);
+		if(data.get())
+			entries[i].data = *data.get();
+		else {
+			missingIds.push_back(ids[i]);
+			missing.push_back(i);
+		}
+	}
+	if(missing.empty()) return true;
 	
-	if(!gotStreamEnd)
-		return "zlib stream incomplete";
+	std::vector<DbEntry> fetched;
+	ASSERT( getMany(fetched, missingIds) );
+	for(size_t i = 0; i < missing.size(); ++i) {
+		entryCache->put(missingIds[i], new std::string(fetched[i].data), DbEntryCache::entrySize(missingIds[i], fetched[i].data));
+		entries[missing[i]].swap(fetched[i]);
+	}
+	return true;
+}
+
+Return DbIntf::getDirEntry(/*out*/ DbDirEntry& dirEntry, /*out*/ bool& found, const std::string& path, const std::string& name) {
+	std::list<DbDirEntry> dirList;
+	ASSERT( getDir(dirList, path) );
+	found = false;
+	for(std::list<DbDirEntry>::iterator i = dirList.begin(); i != dirList.end(); ++i)
+		if(i->name == name) {
+			dirEntry = *i;
+			found = true;
+			break;
+		}
+	return true;
+}
+
+Return DbIntf::getDirPart(/*out*/ std::list<DbDirEntry>& dirList, const std::string& path, /*inout*/ size_t& cursor, size_t) {
+	std::list<DbDirEntry> all;
+	ASSERT( getDir(all, path) );
+	std::list<DbDirEntry>::iterator i = all.begin();
+	for(size_t n = 0; n < cursor && i != all.end(); ++n) ++i;
+	for(; i != all.end(); ++i, ++cursor)
+		dirList.push_back(*i);
 	return true;
 }
@@ -8,7 +8,11 @@
 
 #include "Return.h"
 #include "StringUtils.h"
+#include "DbCodec.h"
 #include <string>
+#include <list>
+#include <vector>
+#include <map>
 #include <cassert>
 #include <stdint.h>
 #include <sys/stat.h>
@@ -16,48 +20,75 @@
 #define DbEntryType_PngContentList 1
 #define DbEntryType_PngChunk 2
 #define DbEntryType_PngBlock 3
+#define DbEntryType_PngContentListVersioned 4 // followed by the format version, see DbPng.h
+#define DbEntryType_PngBand 5 // a deflated block row, see DbPng.h
 
 struct DbEntry {
 	std::string data;
 	std::string sha1;
+	std::string sha256; // only used by DBs in trusted hash mode (DbIntf::trustedHash)
 	std::string compressed;
 	
 	DbEntry() {}
 	DbEntry(const std::string& d) : data(d) { prepare(); }
 	bool haveSha1() const { return !sha1.empty(); }
 	void calcSha1();
+	bool haveSha256() const { return !sha256.empty(); }
+	void calcSha256();
 	bool haveCompressed() const { return !compressed.empty(); }
-	void compress();
-	Return uncompress();
-	void prepare() { calcSha1(); compress(); }
+	void compress(const DbCodec& codec = DbCodec());
+	Return uncompress(); // any codec, see DbCodec.h
+	// We don't compress here. Most pushed entries are already in the DB,
+	// so the DB compresses only the new ones (see DbIntf::compressForPush).
+	void prepare(bool trustedHash = false) { if(trustedHash) calcSha256(); else calcSha1(); }
+	void swap(DbEntry& other) {
+		data.swap(other.data);
+		sha1.swap(other.sha1);
+		sha256.swap(other.sha256);
+		compressed.swap(other.compressed);
+	}
 	
 	bool operator==(const DbEntry& other) const {
 		assert(haveSha1());
-		assert(haveCompressed());
 		assert(other.haveSha1());
-		assert(other.haveCompressed());
 		if(sha1 != other.sha1) return false;
-		// Note: If we would ensure that the compression algorithm always works exactly
-		// the same way, we could just restrict the check on the compressed data.
-		// But as we don't want to restrict ourself to this, we can't.
-		if(compressed == other.compressed) return true;
+		// The compressed data depends only on the data and the codec (see DbCodec::compress),
+		// so equal compressed data means equal data. Different compressed data can still be the same data
+		// (e.g. from another codec or zlib version), so we must check the data then.
+		// DBs in trusted hash mode don't need this at all.
+		if(haveCompressed() && other.haveCompressed() && compressed == other.compressed) return true;
 		return data == other.data;
 	}
 };
 
+// Like DbEntry::prepare on each, but the SHA1s are calculated together (calc_sha1_many).
+void prepareEntries(std::list<DbEntry>& entries, bool trustedHash = false);
+
 typedef std::string DbEntryId; /* guaranteed to not contain \0 and to be not empty */
 
 struct DbStats {
 	size_t pushNew;
 	size_t pushReuse;
-	DbStats() : pushNew(0), pushReuse(0) {}
+	size_t compressSkipped; // reused entries which never needed to be compressed
+	size_t compressSkippedBytes; // uncompressed size of those
+	size_t refLookupsSkipped; // hash ref lookups answered by the hash index
+	DbStats() : pushNew(0), pushReuse(0), compressSkipped(0), compressSkippedBytes(0), refLookupsSkipped(0) {}
+	void countReuse(const DbEntry& entry) {
+		pushReuse++;
+		if(!entry.haveCompressed()) {
+			compressSkipped++;
+			compressSkippedBytes += entry.data.size();
+		}
+	}
 };
 
 struct DbDirEntry {
 	mode_t mode;
 	std::string name;
 	size_t size;
-	DbDirEntry(mode_t m = 0, const std::string& fn = "", size_t s = 0) : mode(m), name(fn), size(s) {}
+	DbEntryId ref; // the file ref, only if haveRef (see DbIntf::getDirPart). Not serialized.
+	bool haveRef;
+	DbDirEntry(mode_t m = 0, const std::string& fn = "", size_t s = 0) : mode(m), name(fn), size(s), haveRef(false) {}
 	std::string serialized() const { return rawString<uint16_t>(mode) + rawString<uint32_t>(size) + name; }
 	static DbDirEntry FromSerialized(const std::string& raw) {
 		if(raw.size() <= 6) return DbDirEntry();
@@ -67,24 +98,143 @@ struct DbDirEntry {
 	static DbDirEntry Dir(const std::string& fn) { return DbDirEntry(S_IFDIR | 0755, fn); }
 };
 
+// Helper for the pushMany implementations of the backends.
+// It decides which entries of a batch are new and which ones reuse either an existing
+// DB entry or an equal entry earlier in the same batch - exactly like pushing
+// the entries one by one would do.
+struct DbPushBatch {
+	const std::vector<DbEntry>& entries;
+	std::vector<DbEntryId>& ids;
+	std::vector<size_t> newEntries; // indices of the entries which must be written
+	std::vector<size_t> sameAs; // entries[i] gets the id of entries[sameAs[i]]
+	
+	DbPushBatch(std::vector<DbEntryId>& _ids, const std::vector<DbEntry>& _entries)
+	: entries(_entries), ids(_ids), sameAs(_entries.size()) { ids = std::vector<DbEntryId>(entries.size()); }
+	// refs[i] are the SHA1 refs of entries[i] in the DB, candidates are these entries fetched from the DB.
+	void resolve(const std::vector< std::list<DbEntryId> >& refs, const std::map<DbEntryId, DbEntry>& candidates, DbStats& stats);
+	// Call this once the ids of all newEntries are set.
+	// Trusted hash mode: refIds[i] is the id the DB has for the SHA256 of entries[i], or empty.
+	void resolveTrusted(const std::vector<DbEntryId>& refIds, DbStats& stats);
+	void finish() { for(size_t i = 0; i < ids.size(); ++i) if(sameAs[i] != i) ids[i] = ids[sameAs[i]]; }
+};
+
+struct DbHashIndex;
+struct DbEntryCache;
+struct DbIntf;
+
+struct DbHashRefCallbackIntf {
+	virtual void hashRef(const std::string& hash) = 0;
+};
+
+// Compresses the new entries of a pushMany on other threads, e.g. the workers of DbPngPipeline.
+struct DbCompressorIntf {
+	// Does db.compressForPush(entries[i], compressed[i]) for all i in indices and returns when all are done.
+	virtual void compressMany(DbIntf& db, const std::vector<DbEntry>& entries, const std::vector<size_t>& indices,
+							  /*out*/ std::vector<std::string>& compressed) = 0;
+};
+
 struct DbIntf {
 	DbStats stats;
+	// In trusted hash mode, entries are identified by their SHA256 and a hash hit is
+	// a reuse without reading and comparing the other entry.
+	// This is a per-DB setting, stored in the meta key "hash".
+	bool trustedHash;
+	
+	// Optional, not owned. If set, the backends don't look up hash refs which
+	// the index doesn't know. See DbHashIndex.h.
+	DbHashIndex* hashIndex;
+	// The generation of the hash refs (meta "hashgen"), which DbHashIndex snapshots are made for.
+	// It is increased once by each process which pushes, before its first push. See updateRefGeneration.
+	uint64_t refGeneration;
+	bool refGenerationUpdated;
+	
+	// The codecs for new entries, by entry type. Per-DB settings, see DbCodecs.
+	DbCodecs codecs;
+	
+	// Optional, not owned. Used by getManyCached. See DbEntryCache.h.
+	DbEntryCache* entryCache;
+	
+	// Optional, not owned. Used by compressForPushMany.
+	DbCompressorIntf* compressor;
+	
+	DbIntf() : trustedHash(false), hashIndex(NULL), refGeneration(0), refGenerationUpdated(false), entryCache(NULL), compressor(NULL) {}
 	virtual Return setReadOnly(bool ro) { return "Db::setReadOnly: not implemented"; }
 	virtual Return init() = 0;
 	virtual Return push(/*out*/ DbEntryId& id, const DbEntry& entry) = 0;
 	virtual Return get(/*out*/ DbEntry& entry, const DbEntryId& id) = 0;
+	// Batch versions. The results are the same as calling push/get one by one, in order.
+	// The default implementations do exactly that; the backends do it with fewer round trips.
+	virtual Return pushMany(/*out*/ std::vector<DbEntryId>& ids, const std::vector<DbEntry>& entries);
+	virtual Return getMany(/*out*/ std::vector<DbEntry>& entries, const std::vector<DbEntryId>& ids);
+	virtual Return existMany(/*out*/ std::vector<bool>& exist, const std::vector<DbEntryId>& ids);
+	// Like getMany, but with entryCache (if set) for the data. The entries from the cache have no SHA1.
+	Return getManyCached(/*out*/ std::vector<DbEntry>& entries, const std::vector<DbEntryId>& ids);
+	// For the backends: gives the data to store for a new entry. Compresses it if not done yet.
+	void compressForPush(const DbEntry& entry, /*out*/ std::string& compressed);
+	// For the backends: compressForPush for entries[i] into compressed[i] (it gets the size of entries)
+	// for all i in newEntries, i.e. once the refs are resolved (see DbPushBatch). Uses compressor if set.
+	void compressForPushMany(const std::vector<DbEntry>& entries, const std::vector<size_t>& newEntries, /*out*/ std::vector<std::string>& compressed);
+	// For the backends: the hash which is used for the refs.
+	const std::string& refHash(const DbEntry& entry) const { return trustedHash ? entry.sha256 : entry.sha1; }
+	// For the backends: false if the hash index knows that there is no ref for this entry.
+	bool mayHaveRef(const DbEntry& entry);
+	// For the backends: call this after a new ref was added.
+	void addRefToIndex(const DbEntry& entry);
+	// For the backends: call this at the beginning of push and pushMany. Only the first call does something.
+	Return updateRefGeneration();
+	// Calls the callback for every hash ref (SHA1 or SHA256, depending on the hash mode).
+	// Some backends (Redis) can give a hash more than once.
+	virtual Return iterateHashRefs(DbHashRefCallbackIntf& callback) {
+		return "Db::iterateHashRefs: not implemented";
+	}
+	// Small DB-wide settings, like the hash mode.
+	virtual Return getMeta(/*out*/ std::string& value, const std::string& key) {
+		return "Db::getMeta: not implemented";
+	}
+	virtual Return setMeta(const std::string& key, const std::string& value) {
+		return "Db::setMeta: not implemented";
+	}
+	// Reads the DB-wide settings (hash mode, codecs). The backends call this in init().
+	Return initMeta();
+	Return initHashMode();
+	Return initRefGeneration();
+	Return initCodecs();
+	// Sets the codec for new entries of the given type (see DbCodecs), or the default one if typeName is empty.
+	Return setCodec(const std::string& typeName, const DbCodec& codec);
+	Return setCodecFromSpec(const std::string& spec); // see dbCodecParseSpec
+	// Stores the zstd dictionary in the DB and makes it the one for new entries (see dbCodecAddDict).
+	Return addCodecDict(const std::string& dict);
+	// Switches the DB to trusted hash mode. Only possible on a new DB (without SHA1 refs),
+	// as the entries pushed before would not be deduplicated against later ones.
+	Return setTrustedHash();
 	virtual Return pushToDir(const std::string& path, const DbDirEntry& dirEntry) {
 		return "Db::pushToDir: not implemented";
 	}
 	virtual Return getDir(/*out*/ std::list<DbDirEntry>& dirList, const std::string& path) {
 		return "Db::getDir: not implemented";
 	}
+	// The entry with this name in the dir. The default implementation searches the getDir list.
+	virtual Return getDirEntry(/*out*/ DbDirEntry& dirEntry, /*out*/ bool& found, const std::string& path, const std::string& name);
+	// A part of the getDir list: up to maxCount entries from the position cursor on (start with 0).
+	// The cursor is moved behind them; there are no more entries if not exactly maxCount were added.
+	// Backends with a dir index (see DbDirIndex.h) also set the file refs of the entries.
+	// Without one, the default implementation has to read the whole getDir list anyway,
+	// so it adds all the rest at once, also if that is more than maxCount.
+	virtual Return getDirPart(/*out*/ std::list<DbDirEntry>& dirList, const std::string& path, /*inout*/ size_t& cursor, size_t maxCount);
 	virtual Return setFileRef(/*can be empty*/ const DbEntryId& id, const std::string& path) {
 		return "Db::setFileRef: not implemented";
 	}
 	virtual Return getFileRef(/*out (can be empty)*/ DbEntryId& id, const std::string& path) {
 		return "Db::getFileRef: not implemented";
 	}
+	// The exact size of the extracted file (see DbPngEntryWriter::contentOutputSize). 0 means unknown.
+	// getFileSize fails if it is unknown.
+	virtual Return setFileSize(uint64_t size, const std::string& path) {
+		return "Db::setFileSize: not implemented";
+	}
+	virtual Return getFileSize(/*out*/ uint64_t& size, const std::string& path) {
+		return "Db::getFileSize: not implemented";
+	}
 };
 
 #endif
@@ -0,0 +1,413 @@
+/* codecs for the stored DB entries
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#ifndef Z_CompressionLevel
+#define Z_CompressionLevel 9
+#endif
+
+#ifndef Z_BufSize
+#define Z_BufSize 1024*128
+#endif
+
+#include "DbCodec.h"
+#include "Db.h"
+#include "Lz4.h"
+#include "StringUtils.h"
+#include "Mutex.h"
+#include "zstd/zstd.h"
+#include "zstd/zdict.h"
+#include <zlib.h>
+#include <pthread.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+using namespace std;
+
+DbCodec::DbCodec() : id(DbCodec_Deflate), level(Z_CompressionLevel), dictId(0) {}
+
+Return DbCodec::FromName(/*out*/ DbCodec& codec, const std::string& name) {
+	std::string base = name;
+	int level = -1;
+	size_t dash = name.find('-');
+	if(name.compare(0, 9, "zstd-dict") == 0)
+		dash = (name.size() > 9) ? 9 : std::string::npos;
+	if(dash != std::string::npos) {
+		base = name.substr(0, dash);
+		char* end = NULL;
+		level = strtol(name.c_str() + dash + 1, &end, 10);
+		if(dash + 1 == name.size() || *end != '\0') return "codec '" + name + "': invalid level";
+	}
+	if(base == "deflate") {
+		if(level < 0) level = Z_CompressionLevel;
+		if(level > 9) return "codec '" + name + "': deflate levels are 0-9";
+		codec = DbCodec(DbCodec_Deflate, level);
+	}
+	else if(base == "zstd" || base == "zstd-dict") {
+		if(level < 0) level = ZSTD_CLEVEL_DEFAULT;
+		if(level < 1 || level > ZSTD_maxCLevel()) return "codec '" + name + "': invalid zstd level";
+		codec = DbCodec(base == "zstd" ? DbCodec_Zstd : DbCodec_ZstdDict, level);
+	}
+	else if(base == "lz4" || base == "stored") {
+		if(level >= 0) return "codec '" + name + "': has no level";
+		codec = DbCodec(base == "lz4" ? DbCodec_Lz4 : DbCodec_Stored, 0);
+	}
+	else
+		return "unknown codec '" + name + "'";
+	return true;
+}
+
+std::string DbCodec::name() const {
+	char levelStr[16];
+	sprintf(levelStr, "-%i", level);
+	switch(id) {
+		case DbCodec_Deflate: return "deflate" + std::string(levelStr);
+		case DbCodec_Zstd: return "zstd" + std::string(levelStr);
+		case DbCodec_ZstdDict: return "zstd-dict" + std::string(levelStr);
+		case DbCodec_Lz4: return "lz4";
+		case DbCodec_Stored: return "stored";
+	}
+	return "unknown";
+}
+
+static void __deflate(int level, const std::string& data, /*out*/ std::string& compressed) {
+	z_stream stream;
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+	// All parameters are given explicitly so that the output only depends on the data
+	// (and the zlib version). See DbEntry::operator==.
+	// The 32k window also gives the codec id as the first byte.
+	deflateInit2(&stream, level, Z_DEFLATED, /*windowBits*/15, /*memLevel*/8, Z_DEFAULT_STRATEGY);
+	
+	stream.avail_in = data.size();
+	stream.next_in = (unsigned char*) &data[0];
+	while(true) {
+		char outputData[Z_BufSize];
+		stream.avail_out = sizeof(outputData);
+		stream.next_out = (unsigned char*) outputData;
+		int ret = deflate(&stream, Z_FINISH);
+		switch(ret) {
+			case Z_OK: break;
+			case Z_STREAM_END: break;
+			// these cases should not happen. but check anyway
+			case Z_STREAM_ERROR:
+			default:
+				cerr << "error to deflate " << data.size() << " bytes" << endl;
+				cerr << "remaining: " << stream.avail_in << " bytes" << endl;
+				cerr << "deflate ret: " << ret << endl;
+				assert(false);
+				return;
+		}
+		size_t out_size = sizeof(outputData) - stream.avail_out;
+		compressed += std::string(outputData, out_size);
+		if(ret == Z_STREAM_END) break;
+	}
+	deflateEnd(&stream);
+}
+
+static Return __inflate(const char* compressed, size_t compressedSize, /*out*/ std::string& data) {
+	z_stream stream;
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+	inflateInit(&stream);
+	
+	bool gotStreamEnd = false;
+	stream.avail_in = compressedSize;
+	stream.next_in = (unsigned char*) compressed;
+	while(true) {
+		char outputData[Z_BufSize];
+		stream.avail_out = sizeof(outputData);
+		stream.next_out = (unsigned char*) outputData;
+		int ret = inflate(&stream, Z_NO_FLUSH);
+		switch(ret) {
+			case Z_STREAM_ERROR: inflateEnd(&stream); return "zlib stream error / invalid compression level";
+			case Z_NEED_DICT: inflateEnd(&stream); return "zlib need dict error";
+			case Z_DATA_ERROR: inflateEnd(&stream); return "zlib data error";
+			case Z_MEM_ERROR: inflateEnd(&stream); return "zlib out-of-memory error";
+			case Z_STREAM_END: gotStreamEnd = true;
+		}
+		size_t out_size = sizeof(outputData) - stream.avail_out;
+		if(out_size == 0) break;
+		data += std::string(outputData, out_size);
+	}	
+	inflateEnd(&stream);
+	
+	if(!gotStreamEnd)
+		return "zlib stream incomplete";
+	return true;
+}
+
+// The zstd contexts are expensive to create, esp. for the small entries.
+// So each thread keeps its own ones.
+struct ZstdContexts {
+	ZSTD_CCtx* c;
+	ZSTD_DCtx* d;
+	ZstdContexts() : c(NULL), d(NULL) {}
+	~ZstdContexts() {
+		if(c) ZSTD_freeCCtx(c);
+		if(d) ZSTD_freeDCtx(d);
+	}
+};
+
+static pthread_key_t __zstdContextsKey;
+static pthread_once_t __zstdContextsKeyOnce = PTHREAD_ONCE_INIT;
+
+static void __zstdContextsFree(void* p) { delete (ZstdContexts*) p; }
+static void __zstdContextsKeyCreate() { pthread_key_create(&__zstdContextsKey, __zstdContextsFree); }
+
+static ZstdContexts& __zstdContexts() {
+	pthread_once(&__zstdContextsKeyOnce, __zstdContextsKeyCreate);
+	ZstdContexts* ctxs = (ZstdContexts*) pthread_getspecific(__zstdContextsKey);
+	if(ctxs == NULL) {
+		ctxs = new ZstdContexts();
+		pthread_setspecific(__zstdContextsKey, ctxs);
+	}
+	return *ctxs;
+}
+
+// The buffer is big enough, so this only fails if zstd cannot allocate its memory.
+// compressed is as before then.
+static bool __zstdCompress(int level, const std::string& data, /*out*/ std::string& compressed) {
+	ZstdContexts& ctxs = __zstdContexts();
+	if(ctxs.c == NULL) ctxs.c = ZSTD_createCCtx();
+	if(ctxs.c == NULL) return false;
+	size_t offset = compressed.size();
+	compressed.resize(offset + ZSTD_compressBound(data.size()));
+	size_t size = ZSTD_compressCCtx(ctxs.c, &compressed[offset], compressed.size() - offset, data.data(), data.size(), level);
+	if(ZSTD_isError(size)) {
+		compressed.resize(offset);
+		return false;
+	}
+	compressed.resize(offset + size);
+	return true;
+}
+
+static Return __zstdUncompress(const char* frame, size_t frameSize, /*out*/ std::string& data) {
+	unsigned long long size = ZSTD_getFrameContentSize(frame, frameSize);
+	if(size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+		return "zstd: invalid frame header";
+	if(size > DbCodecZstdMaxSize) return "zstd: frame content size too big";
+	ZstdContexts& ctxs = __zstdContexts();
+	if(ctxs.d == NULL) ctxs.d = ZSTD_createDCtx();
+	data.resize(size);
+	size_t ret = ZSTD_decompressDCtx(ctxs.d, size > 0 ? &data[0] : NULL, size, frame, frameSize);
+	if(ZSTD_isError(ret)) return std::string() + "zstd: " + ZSTD_getErrorName(ret);
+	if(ret != size) return "zstd: size mismatch";
+	return true;
+}
+
+struct ZstdDict {
+	std::string data;
+	ZSTD_DDict* ddict;
+	std::map<int, ZSTD_CDict*> cdicts; // by level, created on demand
+};
+
+static Mutex __zstdDictsMutex;
+static std::map<uint32_t, ZstdDict*> __zstdDicts; // never removed
+
+static ZstdDict* __zstdDict(uint32_t id) {
+	ScopedLock lock(__zstdDictsMutex);
+	std::map<uint32_t, ZstdDict*>::iterator i = __zstdDicts.find(id);
+	if(i == __zstdDicts.end()) return NULL;
+	return i->second;
+}
+
+static ZSTD_CDict* __zstdCDict(ZstdDict& dict, int level) {
+	ScopedLock lock(__zstdDictsMutex);
+	ZSTD_CDict*& cdict = dict.cdicts[level];
+	if(cdict == NULL) cdict = ZSTD_createCDict(dict.data.data(), dict.data.size(), level);
+	return cdict;
+}
+
+Return dbCodecAddDict(const std::string& dict, /*out*/ uint32_t& id) {
+	id = ZDICT_getDictID(dict.data(), dict.size());
+	if(id == 0) return "not a zstd dictionary";
+	ScopedLock lock(__zstdDictsMutex);
+	if(__zstdDicts.find(id) != __zstdDicts.end()) return true;
+	ZstdDict* d = new ZstdDict();
+	d->data = dict;
+	d->ddict = ZSTD_createDDict(dict.data(), dict.size());
+	if(d->ddict == NULL) {
+		delete d;
+		return "invalid zstd dictionary";
+	}
+	__zstdDicts[id] = d;
+	return true;
+}
+
+Return dbCodecTrainDict(const std::vector<std::string>& samples, size_t dictSize, /*out*/ std::string& dict) {
+	std::string buffer;
+	std::vector<size_t> sizes;
+	sizes.reserve(samples.size());
+	for(size_t i = 0; i < samples.size(); ++i) {
+		buffer += samples[i];
+		sizes.push_back(samples[i].size());
+	}
+	if(sizes.empty()) return "no samples to train the dictionary on";
+	dict.resize(dictSize);
+	size_t size = ZDICT_trainFromBuffer(&dict[0], dict.size(), buffer.data(), &sizes[0], sizes.size());
+	if(ZDICT_isError(size)) return std::string() + "dictionary training failed: " + ZDICT_getErrorName(size);
+	dict.resize(size);
+	return true;
+}
+
+// Like __zstdCompress, and false if the dictionary is not loaded.
+static bool __zstdDictCompress(uint32_t dictId, int level, const std::string& data, /*out*/ std::string& compressed) {
+	ZstdDict* dict = dictId ? __zstdDict(dictId) : NULL;
+	if(dict == NULL) return false;
+	ZSTD_CDict* cdict = __zstdCDict(*dict, level);
+	ZstdContexts& ctxs = __zstdContexts();
+	if(ctxs.c == NULL) ctxs.c = ZSTD_createCCtx();
+	if(cdict == NULL || ctxs.c == NULL) return false;
+	// The context is shared with __zstdCompress, which ignores these settings.
+	// The dict id is in front of the frame already, so it is not in the frame header.
+	ZSTD_CCtx_reset(ctxs.c, ZSTD_reset_session_and_parameters);
+	if(ZSTD_isError(ZSTD_CCtx_refCDict(ctxs.c, cdict))) return false;
+	if(ZSTD_isError(ZSTD_CCtx_setParameter(ctxs.c, ZSTD_c_dictIDFlag, 0))) return false;
+	size_t start = compressed.size();
+	compressed += (char) DbCodec_ZstdDict;
+	compressed += rawString<uint32_t>(dictId);
+	size_t offset = compressed.size();
+	compressed.resize(offset + ZSTD_compressBound(data.size()));
+	size_t size = ZSTD_compress2(ctxs.c, &compressed[offset], compressed.size() - offset, data.data(), data.size());
+	if(ZSTD_isError(size)) {
+		compressed.resize(start);
+		return false;
+	}
+	compressed.resize(offset + size);
+	return true;
+}
+
+static Return __zstdDictUncompress(const char* payload, size_t payloadSize, /*out*/ std::string& data) {
+	if(payloadSize < sizeof(uint32_t)) return "zstd dict entry too short";
+	uint32_t dictId = valueFromRaw<uint32_t>(payload);
+	ZstdDict* dict = __zstdDict(dictId);
+	if(dict == NULL) return "zstd dictionary " + hexString(dictId) + " is not loaded";
+	const char* frame = payload + sizeof(uint32_t);
+	size_t frameSize = payloadSize - sizeof(uint32_t);
+	unsigned long long size = ZSTD_getFrameContentSize(frame, frameSize);
+	if(size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+		return "zstd: invalid frame header";
+	if(size > DbCodecZstdMaxSize) return "zstd: frame content size too big";
+	ZstdContexts& ctxs = __zstdContexts();
+	if(ctxs.d == NULL) ctxs.d = ZSTD_createDCtx();
+	data.resize(size);
+	size_t ret = ZSTD_decompress_usingDDict(ctxs.d, size > 0 ? &data[0] : NULL, size, frame, frameSize, dict->ddict);
+	if(ZSTD_isError(ret)) return std::string() + "zstd: " + ZSTD_getErrorName(ret);
+	if(ret != size) return "zstd: size mismatch";
+	return true;
+}
+
+void DbCodec::compress(const std::string& data, /*out*/ std::string& compressed) const {
+	compressed = "";
+	switch(id) {
+		case DbCodec_Deflate:
+			__deflate(level, data, compressed);
+			return;
+		case DbCodec_ZstdDict:
+			if(__zstdDictCompress(dictId, level, data, compressed))
+				return;
+			// without the dictionary, it is like DbCodec_Zstd
+			/* fall through */
+		case DbCodec_Zstd:
+			compressed += (char) DbCodec_Zstd;
+			if(__zstdCompress(level, data, compressed))
+				return;
+			// stored then, it can still be read
+			compressed = (char) DbCodec_Stored;
+			compressed += data;
+			return;
+		case DbCodec_Lz4:
+			compressed += (char) id;
+			compressed += rawString<uint32_t>(data.size());
+			lz4_compress(data.data(), data.size(), compressed);
+			return;
+		case DbCodec_Stored:
+			compressed += (char) id;
+			compressed += data;
+			return;
+	}
+	assert(false);
+}
+
+Return dbCodecUncompress(const std::string& compressed, /*out*/ std::string& data) {
+	return dbCodecUncompress(compressed.data(), compressed.size(), data);
+}
+
+Return dbCodecUncompress(const char* compressed, size_t compressedSize, /*out*/ std::string& data) {
+	data = "";
+	if(compressedSize == 0) return "stored entry is empty";
+	const char* payload = compressed + 1;
+	size_t payloadSize = compressedSize - 1;
+	switch((uint8_t) compressed[0]) {
+		case DbCodec_Deflate:
+			return __inflate(compressed, compressedSize, data);
+		case DbCodec_Zstd:
+			return __zstdUncompress(payload, payloadSize, data);
+		case DbCodec_ZstdDict:
+			return __zstdDictUncompress(payload, payloadSize, data);
+		case DbCodec_Lz4:
+			if(payloadSize < sizeof(uint32_t)) return "LZ4 entry too short";
+			return lz4_uncompress(payload + sizeof(uint32_t), payloadSize - sizeof(uint32_t),
+								  valueFromRaw<uint32_t>(payload), data);
+		case DbCodec_Stored:
+			data = std::string(payload, payloadSize);
+			return true;
+	}
+	return "stored entry has an unknown codec id " + hexString(compressed[0]);
+}
+
+const char* DbCodecs::TypeNames[] = { "summary", "chunk", "block", "band", NULL };
+
+DbCodecs::DbCodecs() : dictId(0) {
+	byType[DbEntryType_PngBand] = DbCodec(DbCodec_Stored, 0);
+}
+
+static int __entryTypesFromName(const std::string& name, uint8_t types[2]) {
+	if(name == "summary") {
+		types[0] = DbEntryType_PngContentList;
+		types[1] = DbEntryType_PngContentListVersioned;
+		return 2;
+	}
+	if(name == "chunk") { types[0] = DbEntryType_PngChunk; return 1; }
+	if(name == "block") { types[0] = DbEntryType_PngBlock; return 1; }
+	if(name == "band") { types[0] = DbEntryType_PngBand; return 1; }
+	return 0;
+}
+
+DbCodec DbCodecs::forEntry(const std::string& data) const {
+	DbCodec codec = def;
+	if(!data.empty()) {
+		std::map<uint8_t, DbCodec>::const_iterator i = byType.find(data[0]);
+		if(i != byType.end()) codec = i->second;
+	}
+	codec.dictId = dictId;
+	return codec;
+}
+
+Return DbCodecs::set(const std::string& typeName, const DbCodec& codec) {
+	if(typeName.empty()) {
+		def = codec;
+		return true;
+	}
+	uint8_t types[2];
+	int n = __entryTypesFromName(typeName, types);
+	if(n == 0) return "unknown entry type '" + typeName + "'";
+	for(int i = 0; i < n; ++i)
+		byType[types[i]] = codec;
+	return true;
+}
+
+Return dbCodecParseSpec(const std::string& spec, /*out*/ std::string& typeName, /*out*/ DbCodec& codec) {
+	size_t eq = spec.find('=');
+	typeName = (eq == std::string::npos) ? "" : spec.substr(0, eq);
+	ASSERT( DbCodec::FromName(codec, spec.substr(eq == std::string::npos ? 0 : eq + 1)) );
+	if(typeName.empty()) return true;
+	uint8_t types[2];
+	if(__entryTypesFromName(typeName, types) == 0) return "unknown entry type '" + typeName + "'";
+	return true;
+}
@@ -0,0 +1,79 @@
+/* codecs for the stored DB entries
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#ifndef __AZ__DBCODEC_H__
+#define __AZ__DBCODEC_H__
+
+#include "Return.h"
+#include <string>
+#include <map>
+#include <vector>
+#include <stdint.h>
+
+/* A stored (compressed) entry starts with the id of its codec:
+ - DbCodec_Deflate: the plain zlib stream (32k window), its first byte (0x78) is the id.
+   All entries of older DBs are like this.
+ - DbCodec_Stored: [id] data
+ - DbCodec_Zstd: [id] zstd frame (with the content size)
+ - DbCodec_Lz4: [id] [uint32 data size] LZ4 block (see Lz4.h)
+ - DbCodec_ZstdDict: [id] [uint32 dict id] zstd frame, compressed with that dictionary
+ The data size in a zstd frame or LZ4 entry is checked before the memory for it is allocated,
+ so a corrupt entry gives an error and not a huge allocation.
+ */
+#define DbCodec_Stored 1
+#define DbCodec_Zstd 2
+#define DbCodec_Lz4 3
+#define DbCodec_ZstdDict 4
+#define DbCodec_Deflate 0x78
+
+#define DbCodecZstdMaxSize (256 * 1024 * 1024) // bigger content sizes in a zstd frame are taken as corrupt
+
+struct DbCodec {
+	uint8_t id;
+	int level; // for deflate and zstd
+	uint32_t dictId; // for DbCodec_ZstdDict, the current dictionary of the DB (DbCodecs::dictId)
+	DbCodec(); // deflate at Z_CompressionLevel, like all older DBs
+	DbCodec(uint8_t _id, int _level) : id(_id), level(_level), dictId(0) {}
+	// "deflate", "zstd", "zstd-dict", "lz4" or "stored", with an optional level like "zstd-19".
+	// Without a dictionary (dictId 0 or not loaded), zstd-dict compresses like zstd.
+	static Return FromName(/*out*/ DbCodec& codec, const std::string& name);
+	std::string name() const;
+	// The output only depends on the data and the codec (and the library version). See DbEntry::operator==.
+	void compress(const std::string& data, /*out*/ std::string& compressed) const;
+};
+
+// Any codec, by the id in front.
+Return dbCodecUncompress(const std::string& compressed, /*out*/ std::string& data);
+// The same on a view of the stored data, e.g. into a mapped DB file (see DbFileBackend).
+Return dbCodecUncompress(const char* compressed, size_t compressedSize, /*out*/ std::string& data);
+
+/* The codecs for new entries, by their type (the first data byte, DbEntryType_*).
+ Entry types by name: "summary" (the content lists), "chunk", "block" and "band".
+ The bands are deflated already, so they are stored by default.
+ It is a per-DB setting, stored in the meta keys "codec" (the default) and "codec.<type name>". */
+struct DbCodecs {
+	DbCodec def;
+	std::map<uint8_t, DbCodec> byType;
+	uint32_t dictId; // the zstd dictionary for new entries, meta "zstd-dict". 0 if there is none
+	DbCodecs();
+	DbCodec forEntry(const std::string& data) const;
+	// typeName empty means the default.
+	Return set(const std::string& typeName, const DbCodec& codec);
+	static const char* TypeNames[]; // NULL terminated
+};
+
+/* The zstd dictionaries, trained on the entries of a DB (see db-train-dict).
+ They are process-wide, so that dbCodecUncompress can use them. The id comes from the
+ dictionary content (ZDICT_getDictID), so dictionaries of different DBs don't collide.
+ A DB keeps all its dictionaries, so entries compressed with an older one can still be read:
+ meta "zstd-dict.<id>" is the dictionary, meta "zstd-dicts" the ids of all of them. */
+Return dbCodecAddDict(const std::string& dict, /*out*/ uint32_t& id);
+// Trains a dictionary on the given samples (ZDICT_trainFromBuffer).
+Return dbCodecTrainDict(const std::vector<std::string>& samples, size_t dictSize, /*out*/ std::string& dict);
+
+// "[type name=]codec name", as given on the command line, e.g. "block=lz4" or "zstd-19".
+Return dbCodecParseSpec(const std::string& spec, /*out*/ std::string& typeName, /*out*/ DbCodec& codec);
+
+#endif
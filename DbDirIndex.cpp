@@ -0,0 +1,186 @@
+/* directory index on top of a key/value backend
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "DbDirIndex.h"
+#include "StringUtils.h"
+#include <vector>
+#include <map>
+#include <sstream>
+
+static std::string __countKey(const std::string& dir) { return "fsdir." + dir; }
+static std::string __entryKey(const std::string& dir, const std::string& name) { return "fsent." + dir + "/" + name; }
+
+static std::string __pageKey(const std::string& dir, size_t page) {
+	std::ostringstream s;
+	s << "fspage." << dir << "." << page;
+	return s.str();
+}
+
+static bool __getCount(DbKeyValueIntf& db, const std::string& dir, /*out*/ size_t& count) {
+	std::string value;
+	if(!db.get(value, __countKey(dir)) || value.size() != sizeof(uint32_t)) return false;
+	count = valueFromRaw<uint32_t>(&value[0]);
+	return true;
+}
+
+static Return __readPage(DbKeyValueIntf& db, const std::string& dir, size_t page, /*out*/ std::vector<DbDirEntry>& entries) {
+	std::string value;
+	if(!db.get(value, __pageKey(dir, page)))
+		return "dir index page is missing";
+	size_t i = 0;
+	while(i < value.size()) {
+		uint8_t size = value[i];
+		++i;
+		if(i + size >= value.size())
+			return "dir index page is inconsistent";
+		entries.push_back( DbDirEntry::FromSerialized(value.substr(i, size)) );
+		i += size;
+		uint8_t refSize = value[i];
+		++i;
+		if(i + refSize > value.size())
+			return "dir index page is inconsistent";
+		entries.back().ref = value.substr(i, refSize);
+		entries.back().haveRef = true;
+		i += refSize;
+	}
+	return true;
+}
+
+static Return __writePage(DbKeyValueIntf& db, const std::string& dir, size_t page, const std::vector<DbDirEntry>& entries) {
+	std::string value;
+	for(size_t i = 0; i < entries.size(); ++i) {
+		std::string entryRaw = entries[i].serialized();
+		if(entryRaw.size() > 255 || entries[i].ref.size() > 255)
+			return "cannot add dir entries with size>255 to the dir index";
+		value += rawString<uint8_t>(entryRaw.size()) + entryRaw;
+		value += rawString<uint8_t>(entries[i].ref.size()) + entries[i].ref;
+	}
+	return db.set(__pageKey(dir, page), value);
+}
+
+// Builds the index from the old list of the dir, if there is one.
+static Return __migrate(DbKeyValueIntf& db, const std::string& dir) {
+	std::string value;
+	std::vector<DbDirEntry> entries;
+	std::map<std::string, size_t> positions;
+	if(db.get(value, "fs." + dir)) {
+		size_t i = 0;
+		while(i < value.size()) {
+			uint8_t size = value[i];
+			++i;
+			if(i + size > value.size())
+				return "entry list data is inconsistent";
+			DbDirEntry dirEntry = DbDirEntry::FromSerialized(value.substr(i, size));
+			i += size;
+			if(dirEntry.mode & S_IFREG)
+				db.get(dirEntry.ref, "fs." + dir + "/" + dirEntry.name);
+			dirEntry.haveRef = true;
+			// the same name pushed again: the entry is replaced, like dbDirIndexAdd does
+			std::map<std::string, size_t>::iterator p = positions.find(dirEntry.name);
+			if(p != positions.end())
+				entries[p->second] = dirEntry;
+			else {
+				positions[dirEntry.name] = entries.size();
+				entries.push_back(dirEntry);
+			}
+		}
+	}
+
+	for(size_t page = 0; page * DbDirIndexPageSize < entries.size(); ++page) {
+		std::vector<DbDirEntry>::iterator begin = entries.begin() + page * DbDirIndexPageSize;
+		std::vector<DbDirEntry>::iterator end = entries.end();
+		if(end - begin > DbDirIndexPageSize) end = begin + DbDirIndexPageSize;
+		ASSERT( __writePage(db, dir, page, std::vector<DbDirEntry>(begin, end)) );
+	}
+	for(size_t i = 0; i < entries.size(); ++i)
+		ASSERT( db.set(__entryKey(dir, entries[i].name), rawString<uint32_t>(i) + entries[i].serialized()) );
+	ASSERT( db.set(__countKey(dir), rawString<uint32_t>(entries.size())) );
+	return true;
+}
+
+bool dbDirIndexHave(DbKeyValueIntf& db, const std::string& dir) {
+	size_t count;
+	return __getCount(db, dir, count);
+}
+
+Return dbDirIndexAdd(DbKeyValueIntf& db, const std::string& dir, const DbDirEntry& dirEntry) {
+	size_t count = 0;
+	if(!__getCount(db, dir, count)) {
+		ASSERT( __migrate(db, dir) );
+		if(!__getCount(db, dir, count))
+			return "dir index: cannot read the entry count";
+	}
+
+	std::string entryKey = __entryKey(dir, dirEntry.name);
+	std::string value;
+	if(db.get(value, entryKey) && value.size() >= sizeof(uint32_t)) {
+		size_t pos = valueFromRaw<uint32_t>(&value[0]);
+		std::vector<DbDirEntry> entries;
+		ASSERT( __readPage(db, dir, pos / DbDirIndexPageSize, entries) );
+		if(pos % DbDirIndexPageSize >= entries.size())
+			return "dir index is inconsistent";
+		DbDirEntry& old = entries[pos % DbDirIndexPageSize];
+		DbEntryId ref = old.ref; // until the next setFileRef
+		old = dirEntry;
+		old.ref = ref;
+		old.haveRef = true;
+		ASSERT( __writePage(db, dir, pos / DbDirIndexPageSize, entries) );
+		ASSERT( db.set(entryKey, rawString<uint32_t>(pos) + dirEntry.serialized()) );
+		return true;
+	}
+
+	std::vector<DbDirEntry> entries;
+	if(count % DbDirIndexPageSize != 0)
+		ASSERT( __readPage(db, dir, count / DbDirIndexPageSize, entries) );
+	entries.push_back(dirEntry);
+	entries.back().ref = "";
+	entries.back().haveRef = true;
+	ASSERT( __writePage(db, dir, count / DbDirIndexPageSize, entries) );
+	ASSERT( db.set(entryKey, rawString<uint32_t>(count) + dirEntry.serialized()) );
+	ASSERT( db.set(__countKey(dir), rawString<uint32_t>(count + 1)) );
+	return true;
+}
+
+Return dbDirIndexSetRef(DbKeyValueIntf& db, const std::string& path, const DbEntryId& id) {
+	size_t p = path.rfind('/');
+	if(p == std::string::npos) return true;
+	std::string dir = path.substr(0, p);
+	std::string value;
+	if(!db.get(value, __entryKey(dir, path.substr(p + 1))) || value.size() < sizeof(uint32_t)) return true;
+	size_t pos = valueFromRaw<uint32_t>(&value[0]);
+
+	std::vector<DbDirEntry> entries;
+	ASSERT( __readPage(db, dir, pos / DbDirIndexPageSize, entries) );
+	if(pos % DbDirIndexPageSize >= entries.size())
+		return "dir index is inconsistent";
+	if(entries[pos % DbDirIndexPageSize].ref == id) return true;
+	entries[pos % DbDirIndexPageSize].ref = id;
+	return __writePage(db, dir, pos / DbDirIndexPageSize, entries);
+}
+
+Return dbDirIndexLookup(DbKeyValueIntf& db, const std::string& dir, const std::string& name, /*out*/ DbDirEntry& dirEntry, /*out*/ bool& found) {
+	std::string value;
+	found = db.get(value, __entryKey(dir, name)) && value.size() > sizeof(uint32_t);
+	if(found)
+		dirEntry = DbDirEntry::FromSerialized(value.substr(sizeof(uint32_t)));
+	return true;
+}
+
+Return dbDirIndexList(DbKeyValueIntf& db, const std::string& dir, /*out*/ std::list<DbDirEntry>& dirList, /*inout*/ size_t& cursor, size_t maxCount) {
+	size_t count = 0;
+	if(!__getCount(db, dir, count))
+		return "dir has no index";
+
+	while(cursor < count && maxCount > 0) {
+		std::vector<DbDirEntry> entries;
+		ASSERT( __readPage(db, dir, cursor / DbDirIndexPageSize, entries) );
+		size_t i = cursor % DbDirIndexPageSize;
+		if(i >= entries.size())
+			return "dir index is inconsistent";
+		for(; i < entries.size() && maxCount > 0; ++i, --maxCount, ++cursor)
+			dirList.push_back(entries[i]);
+	}
+	return true;
+}
@@ -0,0 +1,48 @@
+/* directory index on top of a key/value backend
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#ifndef __AZ__DBDIRINDEX_H__
+#define __AZ__DBDIRINDEX_H__
+
+#include "Db.h"
+#include "Return.h"
+#include <string>
+#include <list>
+
+/*
+ The old directory list ("fs." dir -> [uint8 len][DbDirEntry]*) is one value which grows with
+ each file. A lookup of one name or a part of the listing must read and parse all of it.
+ The index splits it up:
+
+ - ("fsdir." dir -> [uint32 count]) the number of entries. Only there if the dir uses the index.
+ - ("fspage." dir "." page -> ([uint8 len][DbDirEntry][uint8 len][ref])*) the entries in push order,
+   DbDirIndexPageSize entries per page. ref is the file ref ("fs." path), so a listing has them too.
+ - ("fsent." dir "/" name -> [uint32 position][DbDirEntry]) for the lookup by name
+
+ A dir gets the index with the first push to it. The entries of its old list (if there is one)
+ are taken over then. The backends still append each pushed entry to the old list (that is cheap),
+ so older tools, which only know that one, see all the files. Only the index is read then.
+ Pushing the same name again replaces the entry in place (the old list has it twice then, like before).
+ */
+
+#define DbDirIndexPageSize 64
+
+// The raw key/value access of a backend, for the functions below.
+// The backend does the locking around them.
+struct DbKeyValueIntf {
+	virtual bool get(/*out*/ std::string& value, const std::string& key) = 0; // false if there is no such key
+	virtual Return set(const std::string& key, const std::string& value) = 0;
+};
+
+bool dbDirIndexHave(DbKeyValueIntf& db, const std::string& dir);
+Return dbDirIndexAdd(DbKeyValueIntf& db, const std::string& dir, const DbDirEntry& dirEntry);
+// path is dir + "/" + name, like for DbIntf::setFileRef. Does nothing if it is not in the index.
+Return dbDirIndexSetRef(DbKeyValueIntf& db, const std::string& path, const DbEntryId& id);
+// The entry without its ref.
+Return dbDirIndexLookup(DbKeyValueIntf& db, const std::string& dir, const std::string& name, /*out*/ DbDirEntry& dirEntry, /*out*/ bool& found);
+// Appends up to maxCount entries from the position cursor on and moves the cursor behind them.
+Return dbDirIndexList(DbKeyValueIntf& db, const std::string& dir, /*out*/ std::list<DbDirEntry>& dirList, /*inout*/ size_t& cursor, size_t maxCount);
+
+#endif
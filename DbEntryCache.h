@@ -0,0 +1,34 @@
+/* cache of decoded DB entries, shared by all readers of a process
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#ifndef __AZ__DBENTRYCACHE_H__
+#define __AZ__DBENTRYCACHE_H__
+
+#include "Cache.h"
+#include "Db.h"
+#include <string>
+
+#ifndef DbEntryCacheShards
+#define DbEntryCacheShards 16
+#endif
+#define DbEntryCacheOverhead 64 // bytes per entry, in addition to the data and the id
+#define DbEntryCacheDefaultSize 64 // MB, --entry-cache-size of the tools
+
+/*
+ The uncompressed data (DbEntry::data) by entry id. Entries never change, so it can't get stale.
+ Consecutive screenshots share most of their blocks. These are read again and again,
+ so they stay in the cache, while the blocks of a single image are not admitted
+ in place of them (see Cache). The hit bytes in the stats are the data which was not
+ read from the DB and uncompressed again.
+ See DbIntf::getManyCached.
+ */
+struct DbEntryCache : Cache<std::string> {
+	DbEntryCache(size_t budget) : Cache<std::string>(budget, DbEntryCacheShards) {}
+	static size_t entrySize(const DbEntryId& id, const std::string& data) {
+		return data.size() + id.size() + DbEntryCacheOverhead;
+	}
+};
+
+#endif
@@ -4,51 +4,185 @@
  */
 
 #include "DbFileBackend.h"
+#include "DbDirIndex.h"
 #include "StringUtils.h"
 #include "Utils.h"
 #include "FileUtils.h"
 #include "Crc.h"
 
 #include <algorithm>
+#include <map>
+#include <sstream>
+#include <vector>
 #include <utility>
 #include <cstdio>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 #include <stdint.h>
 
 #include <iostream>
 using namespace std;
 
-static Return __db_ftell(DbFileBackend& db, /*out*/ size_t& pos) {
-	long p = ftell(db.file);
-	if(p < 0)
-		return "error on telling file stream possition / non-seekable stream?";
-	pos = p;
+/*
+ The writes don't go to the file right away. They are collected in DbFile_Writes and written
+ with __db_flush at the end of each change (e.g. a push, or all of a pushMany), so one push
+ doesn't do a seek and write per field. Writes which follow each other in the file (like all the
+ new chunks at the end of it) or which overwrite a pending one (like a trie node or B+tree page
+ which was just written) are merged, so each merged range is one pwrite.
+ The reads (__db_read) see the pending writes. fileSize includes them.
+ */
+
+#define DbFileMaxPendingBytes (1024 * 1024) // more are flushed right away
+#define DbFileReadAhead 4096 // of a value chunk, so that it is mostly a single read
+
+struct DbFile_Writes {
+	std::map<size_t, std::string> pending; // offset -> data. They don't overlap or touch.
+	size_t pendingBytes; // written since the last flush
+	size_t diskSize; // the file size without the pending writes
+	std::string chunk; // reused to put a chunk together
+	DbFile_Writes() : pendingBytes(0), diskSize(0) {}
+};
+
+static Return __db_pwrite(DbFileBackend& db, size_t offset, const char* d, size_t s) {
+	while(s > 0) {
+		ssize_t n = pwrite(db.fd, d, s, offset);
+		db.ioStats.writeCalls++;
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return std::string() + "error writing DB file: " + strerror(errno);
+		db.ioStats.writeBytes += n;
+		d += n;
+		s -= n;
+		offset += n;
+	}
 	return true;
 }
 
-static Return __db_fseek(DbFileBackend& db, size_t pos) {
-	if(fseek(db.file, pos, SEEK_SET) < 0)
-		return "error seeking in file stream";
+static Return __db_flush(DbFileBackend& db) {
+	DbFile_Writes& writes = *db.writes;
+	if(writes.pending.empty()) return true;
+	db.ioStats.flushes++;
+	// The new chunks at the end go first. The overwritten ones (e.g. a B+tree page or the root)
+	// can refer to them, but not the other way around.
+	std::map<size_t, std::string>::iterator appended = writes.pending.upper_bound(writes.diskSize);
+	if(appended != writes.pending.begin()) {
+		std::map<size_t, std::string>::iterator prev = appended;
+		--prev;
+		if(prev->first + prev->second.size() > writes.diskSize) appended = prev;
+	}
+	for(std::map<size_t, std::string>::iterator i = appended; i != writes.pending.end(); ++i)
+		ASSERT( __db_pwrite(db, i->first, i->second.data(), i->second.size()) );
+	for(std::map<size_t, std::string>::iterator i = writes.pending.begin(); i != appended; ++i)
+		ASSERT( __db_pwrite(db, i->first, i->second.data(), i->second.size()) );
+	writes.pending.clear();
+	writes.pendingBytes = 0;
+	writes.diskSize = db.fileSize;
 	return true;
 }
 
-static Return __db_fwrite(DbFileBackend& db, const char* d, size_t s) {
-	ASSERT( fwrite_bytes(db.file, d, s) );
-	size_t curPos = 0;
-	ASSERT( __db_ftell(db, curPos) );
-	db.fileSize = std::max(curPos, db.fileSize);
+static Return __db_write(DbFileBackend& db, size_t offset, const char* d, size_t s) {
+	DbFile_Writes& writes = *db.writes;
+	std::map<size_t, std::string>& pending = writes.pending;
+	
+	// the pending write which reaches offset, if there is one
+	std::map<size_t, std::string>::iterator i = pending.upper_bound(offset);
+	if(i != pending.begin()) {
+		std::map<size_t, std::string>::iterator prev = i;
+		--prev;
+		if(prev->first + prev->second.size() >= offset) i = prev;
+	}
+	if(i == pending.end() || i->first > offset)
+		i = pending.insert(i, std::make_pair(offset, std::string()));
+	
+	std::string& data = i->second;
+	size_t pos = offset - i->first;
+	if(pos + s > data.size()) data.resize(pos + s);
+	memcpy(&data[pos], d, s);
+	
+	// the following ones which it reaches are merged into it
+	std::map<size_t, std::string>::iterator next = i;
+	++next;
+	while(next != pending.end() && next->first <= i->first + data.size()) {
+		if(next->first + next->second.size() > i->first + data.size())
+			data.append(next->second, i->first + data.size() - next->first, std::string::npos);
+		pending.erase(next++);
+	}
+	
+	db.fileSize = std::max(offset + s, db.fileSize);
+	writes.pendingBytes += s;
+	if(writes.pendingBytes > DbFileMaxPendingBytes)
+		return __db_flush(db);
 	return true;
 }
 
-static Return __db_fwrite(DbFileBackend& db, const std::string& d) {
-	return __db_fwrite(db, &d[0], d.size());
+static Return __db_write(DbFileBackend& db, size_t offset, const std::string& d) {
+	return __db_write(db, offset, d.data(), d.size());
+}
+
+static Return __db_read(DbFileBackend& db, size_t offset, char* d, size_t s) {
+	if(offset > db.fileSize || s > db.fileSize - offset)
+		return "DB file: read behind the end of the file";
+	DbFile_Writes& writes = *db.writes;
+	
+	std::map<size_t, std::string>::iterator i = writes.pending.upper_bound(offset);
+	if(i != writes.pending.begin()) --i;
+	if(i != writes.pending.end() && i->first <= offset && i->first + i->second.size() >= offset + s) {
+		// all of it is pending
+		memcpy(d, &i->second[offset - i->first], s);
+		return true;
+	}
+	
+	for(size_t n = 0; n < s && offset + n < writes.diskSize; ) {
+		ssize_t r = pread(db.fd, d + n, std::min(s - n, writes.diskSize - offset - n), offset + n);
+		db.ioStats.readCalls++;
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) return std::string() + "error reading DB file: " + ((r < 0) ? strerror(errno) : "end-of-file");
+		n += r;
+	}
+	
+	// the pending writes over it
+	for(; i != writes.pending.end() && i->first < offset + s; ++i) {
+		size_t begin = std::max(i->first, offset);
+		size_t end = std::min(i->first + i->second.size(), offset + s);
+		if(begin < end)
+			memcpy(d + (begin - offset), &i->second[begin - i->first], end - begin);
+	}
+	return true;
 }
 
 #define ChunkType_Tree 1
 #define ChunkType_Value 2
-#define ChunkType_FreeSpace 255 // not used/implemented currently
+#define ChunkType_BTreeRoot 3
+#define ChunkType_BTreePage 4
+#define ChunkType_FreeSpace 255 // [type][uint64 size], see DbFile_FreeSpace
+
+// For the iteration over the keys, with the offset of their value chunk.
+struct DbFile_KeyCallback {
+	virtual Return key(const std::string& key, uint64_t ref) = 0;
+};
+
+struct DbFile_ValueChunk;
+static Return __db_allocValueChunk(DbFileBackend& db, size_t dataSize, DbFile_ValueChunk& chunk);
+static Return __db_freeValueChunks(DbFileBackend& db, uint64_t ref);
+
+// type, data size, initialSize, refNextValueChunk and CRC. The chunk takes this + initialSize.
+#define DbFile_ValueChunkOverhead (1 + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t))
+
+/*
+ If a value doesn't fit into its chunk anymore, the rest goes into a new chunk after it.
+ These get DbFile_ChainGrowth times the space of the one before (up to DbFile_ChainMaxReserve),
+ so a value which grows by many appends (like a dir list of older DBs) or rewrites (like a dir
+ index page) has only a few chunks. Appending to it or reading it takes only a few reads then.
+ */
+#define DbFile_ChainGrowth 2
+#define DbFile_ChainMaxReserve (1024 * 1024)
+
+static size_t __chainReserve(size_t prevSize, size_t needed) {
+	return std::max(needed, std::min(prevSize * DbFile_ChainGrowth, (size_t)DbFile_ChainMaxReserve));
+}
 
 
 struct DbFile_ValueChunk {
@@ -80,7 +214,8 @@ struct DbFile_ValueChunk {
 		}
 		
 		DbFile_ValueChunk chunk;
-		chunk.selfOffset = refNextValueChunk = db.fileSize;
+		ASSERT( __db_allocValueChunk(db, __chainReserve(initialSize, d.size()), chunk) );
+		refNextValueChunk = chunk.selfOffset;
 		ASSERT( write(db) ); // write because of new refNextValueChunk
 		return chunk.appendData(db, d);
 	}
@@ -94,9 +229,10 @@ struct DbFile_ValueChunk {
 		
 		if(d.size() <= initialSize) {
 			data = d;
-			refNextValueChunk = 0; // NOTE: loosing chunk ref here!
+			uint64_t rest = refNextValueChunk;
+			refNextValueChunk = 0;
 			ASSERT( write(db) );
-			return true;
+			return __db_freeValueChunks(db, rest);
 		}
 		
 		data = d.substr(0, initialSize);
@@ -104,7 +240,7 @@ struct DbFile_ValueChunk {
 
 		DbFile_ValueChunk chunk;
 		if(refNextValueChunk == 0) {
-			chunk.selfOffset = db.fileSize;
+			ASSERT( __db_allocValueChunk(db, __chainReserve(initialSize, d.size() - initialSize), chunk) );
 			ASSERT( chunk.overwriteData(db, d.substr(initialSize)) );
 			refNextValueChunk = chunk.selfOffset;
 			ASSERT( write(db) ); // write again because of changed refNextValueChunk
@@ -117,57 +253,61 @@ struct DbFile_ValueChunk {
 	}
 	
 	Return getData(DbFileBackend& db, /*out*/std::string& d) {
-		if(refNextValueChunk == 0) { d = data; return true; }
+		d = data;
 		DbFile_ValueChunk chunk;
-		ASSERT( chunk.read(db, refNextValueChunk) );
-		std::string nextData;
-		ASSERT( chunk.getData(db, nextData) );
-		d = data + nextData;
+		for(uint64_t next = refNextValueChunk; next != 0; next = chunk.refNextValueChunk) {
+			ASSERT( chunk.read(db, next) );
+			d += chunk.data;
+		}
 		return true;
 	}
 	
 	Return write(DbFileBackend& db) {
-		if(!hasBeenWritten) {
-			initialSize = data.size();
+		bool first = !hasBeenWritten;
+		if(first) {
+			// more if it is in a free extent or in a chain, see __db_allocValueChunk
+			initialSize = std::max((size_t)initialSize, data.size());
 			hasBeenWritten = true;
 		}
-		ASSERT( __db_fseek(db, selfOffset) );
-		ASSERT( __db_fwrite(db, rawString<uint8_t>(ChunkType_Value)) );
-		ASSERT( __db_fwrite(db, rawString<uint32_t>(data.size())) );
-		ASSERT( __db_fwrite(db, data) );
-		ASSERT( __db_fwrite(db, rawString<uint32_t>(initialSize)) );		
-		ASSERT( __db_fwrite(db, rawString<uint64_t>(refNextValueChunk)) );		
-		ASSERT( __db_fwrite(db, rawString<uint32_t>(calc_crc(data,
-															 rawString<uint32_t>(initialSize) +
-															 rawString<uint64_t>(refNextValueChunk)
-															 ))) );
-		return true;
+		std::string& raw = db.writes->chunk;
+		raw = rawString<uint8_t>(ChunkType_Value);
+		raw += rawString<uint32_t>(data.size());
+		raw += data;
+		raw += rawString<uint32_t>(initialSize);
+		raw += rawString<uint64_t>(refNextValueChunk);
+		// the CRC is over the data, initialSize and refNextValueChunk
+		raw += rawString<uint32_t>(calc_crc(&raw[1 + sizeof(uint32_t)], raw.size() - 1 - sizeof(uint32_t)));
+		if(first) raw.resize(DbFile_ValueChunkOverhead + initialSize, '\0'); // the space is taken from now on
+		return __db_write(db, selfOffset, raw);
 	}
 	
 	Return read(DbFileBackend& db, size_t _selfOffset) {
 		selfOffset = _selfOffset;
 		hasBeenWritten = true;
-		ASSERT( __db_fseek(db, selfOffset) );
-		
-		uint8_t chunkType = 0;
-		ASSERT( fread_bigendian<uint8_t>(db.file, chunkType) );
-		if(chunkType != ChunkType_Value) return "ValueChunk read: chunk type invalid";
+		if(selfOffset >= db.fileSize) return "ValueChunk read: behind the end of the file";
 		
-		size_t len = 0;
-		ASSERT( fread_bigendian<uint32_t>(db.file, len) );
-		
-		data = std::string(len, '\0');
-		ASSERT( fread_bytes(db.file, &data[0], data.size()) );
+		// mostly, the whole chunk is in the read-ahead
+		const size_t headerSize = 1 + sizeof(uint32_t);
+		const size_t trailerSize = sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t);
+		std::string raw(std::min((size_t)DbFileReadAhead, db.fileSize - selfOffset), '\0');
+		if(raw.size() < headerSize) return "ValueChunk read: chunk too short";
+		ASSERT( __db_read(db, selfOffset, &raw[0], raw.size()) );
+		if(raw[0] != ChunkType_Value) return "ValueChunk read: chunk type invalid";
+		size_t len = valueFromRaw<uint32_t>(&raw[1]);
+		if(raw.size() < headerSize + len + trailerSize) {
+			size_t have = raw.size();
+			raw.resize(headerSize + len + trailerSize);
+			ASSERT( __db_read(db, selfOffset + have, &raw[have], raw.size() - have) );
+		}
+		const char* p = &raw[headerSize];
 		
-		ASSERT( fread_bigendian<uint32_t>(db.file, initialSize) );
+		data = std::string(p, len);
+		initialSize = valueFromRaw<uint32_t>(p + len);
 		if(initialSize < len) return "ValueChunk read: initialSize invalid";
+		refNextValueChunk = valueFromRaw<uint64_t>(p + len + sizeof(uint32_t));
 		
-		ASSERT( fread_bigendian<uint64_t>(db.file, refNextValueChunk) );
-
-		uint32_t crc = 0;
-		ASSERT( fread_bigendian<uint32_t>(db.file, crc) );
-		
-		if(crc != calc_crc(data, rawString<uint32_t>(initialSize) + rawString<uint64_t>(refNextValueChunk)))
+		size_t crcLen = len + sizeof(uint32_t) + sizeof(uint64_t);
+		if(valueFromRaw<uint32_t>(p + crcLen) != calc_crc(p, crcLen))
 			return "CRC missmatch on ValueChunk read";
 		
 		return true;
@@ -225,40 +365,29 @@ struct DbFile_TreeChunk {
 	}
 		
 	Return write(DbFileBackend& db) {
-		ASSERT( __db_fseek(db, selfOffset) );
-		ASSERT( __db_fwrite(db, rawString<uint8_t>(ChunkType_Tree)) );
-
-		std::string data;		
+		std::string data;
 		data += rawString<uint64_t>(valueRef);
 		for(short i = 0; i < sizeof(subtreeRefs)/sizeof(subtreeRefs[0]); ++i)
 			data += rawString<uint64_t>(subtreeRefs[i]);
 		
 		data += rawString<uint32_t>(calc_crc(data));
-		data = rawString<uint32_t>(data.size() - sizeof(uint32_t)) + data;
+		data = rawString<uint8_t>(ChunkType_Tree) + rawString<uint32_t>(data.size() - sizeof(uint32_t)) + data;
 		
-		return __db_fwrite(db, data);
+		return __db_write(db, selfOffset, data);
 	}
 	
 	Return read(DbFileBackend& db, size_t _selfOffset) {
 		selfOffset = _selfOffset;
-		ASSERT( __db_fseek(db, selfOffset) );
-
-		uint8_t chunkType = 0;
-		ASSERT( fread_bigendian<uint8_t>(db.file, chunkType) );
-		if(chunkType != ChunkType_Tree) return "TreeChunk read: chunk type invalid";
 		
-		size_t len = 0;
-		ASSERT( fread_bigendian<uint32_t>(db.file, len) );
-		if(len != sizeof(valueRef) + sizeof(subtreeRefs))
+		const size_t len = sizeof(valueRef) + sizeof(subtreeRefs);
+		char raw[1 + sizeof(uint32_t) + len + sizeof(uint32_t)];
+		ASSERT( __db_read(db, selfOffset, raw, sizeof(raw)) );
+		if(raw[0] != ChunkType_Tree) return "TreeChunk read: chunk type invalid";
+		if(valueFromRaw<uint32_t>(&raw[1]) != len)
 			return "TreeChunk data size missmatch";
 		
-		std::string data(len, '\0');
-		ASSERT( fread_bytes(db.file, &data[0], data.size()) );
-		
-		uint32_t crc = 0;
-		ASSERT( fread_bigendian<uint32_t>(db.file, crc) );
-		
-		if(crc != calc_crc(data))
+		const char* data = &raw[1 + sizeof(uint32_t)];
+		if(valueFromRaw<uint32_t>(data + len) != calc_crc(data, len))
 			return "CRC missmatch on TreeChunk read";
 		
 		uint32_t offset = 0;
@@ -278,100 +407,930 @@ struct DbFile_TreeChunk {
 static const char DbFile_Signature[] = {137,'A','Z','P','N','G','D','B',13,10,26,10};
 #define TreeRootOffset sizeof(DbFile_Signature)
 
-void DbFileBackend::reset() {
-	if(file != NULL) {
-		fclose(file);
-		file = NULL;
+/*
+ Newer DB files have a B+tree instead of the trie (DbFile_TreeChunk). The trie has 2 key bits
+ per node, so a lookup of a key like "sha1ref." + SHA1 reads over 100 nodes. The B+tree
+ has fixed-size pages with many keys each, so it needs only a few page reads, and the inner pages
+ are all kept in memory (DbFile_BTree::innerPages), so that is just the leaf.
+
+ - root chunk (at TreeRootOffset): [type][uint32 len][uint64 root page offset][uint32 crc]
+ - page: [type][uint32 len][data][uint32 crc], always BTreePageSize bytes, so it is overwritten in place.
+   data: [uint8 level][uint16 count][uint16 prefix len][prefix] ([uint16 len][key suffix][uint64 ref])*
+   The keys are sorted and stored without their common prefix.
+   Level 0 (leaf): ref is the offset of the value chunk.
+   Inner page: ref i is the child page with the keys in [key i, key i+1). Key 0 is empty
+   (it stands for everything below key 1) and doesn't count for the prefix.
+
+ The older DB files with the trie can still be read and written. db-file-convert converts them.
+ */
+
+#define BTreePageSize 4096 // with the chunk type, size and CRC
+#define BTreePageDataSize (BTreePageSize - 1 - 2 * sizeof(uint32_t))
+#define BTreeMaxKeySize 1024 // so that a split always gives two pages which fit
+
+struct DbFile_BTreePage {
+	size_t selfOffset;
+	uint8_t level; // 0 = leaf
+	std::vector<std::string> keys;
+	std::vector<uint64_t> refs;
+	
+	DbFile_BTreePage() : selfOffset(0), level(0) {}
+	
+	size_t firstPrefixed() const { return (level > 0) ? 1 : 0; }
+	
+	// The keys are sorted, so it is the common prefix of the first and the last one.
+	size_t prefixSize() const {
+		if(keys.size() <= firstPrefixed()) return 0;
+		const std::string& first = keys[firstPrefixed()];
+		const std::string& last = keys.back();
+		size_t n = 0;
+		while(n < first.size() && n < last.size() && first[n] == last[n]) ++n;
+		return n;
 	}
 	
-	if(rootChunk != NULL) {
-		delete rootChunk;
-		rootChunk = NULL;
+	size_t entrySize(size_t i, size_t prefix) const {
+		return sizeof(uint16_t) + ((i < firstPrefixed()) ? 0 : (keys[i].size() - prefix)) + sizeof(uint64_t);
+	}
+	
+	bool fits() const {
+		size_t prefix = prefixSize();
+		size_t size = 1 + 2 * sizeof(uint16_t) + prefix;
+		for(size_t i = 0; i < keys.size(); ++i)
+			size += entrySize(i, prefix);
+		return size <= BTreePageDataSize;
+	}
+	
+	// Leaf: the position of key, or where it would be inserted. Inner page: the child for key.
+	size_t find(const std::string& key) const {
+		if(level == 0)
+			return std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+		return (std::upper_bound(keys.begin() + 1, keys.end(), key) - keys.begin()) - 1;
+	}
+	
+	void insert(size_t i, const std::string& key, uint64_t ref) {
+		keys.insert(keys.begin() + i, key);
+		refs.insert(refs.begin() + i, ref);
+	}
+	
+	// Moves the upper half (by size) to right. If the last key was just added and is the biggest
+	// one in the tree (the keys come in order, like in a compaction), only that one, so that
+	// the pages are full. Otherwise, the pages left of it would stay full and split on each insert.
+	void split(DbFile_BTreePage& right, bool lastAdded) {
+		size_t total = 0;
+		for(size_t i = 0; i < keys.size(); ++i)
+			total += entrySize(i, 0);
+		size_t m = 0, size = 0;
+		if(lastAdded)
+			m = keys.size() - 1;
+		else
+			while(m < keys.size() - 1 && (m == 0 || size + entrySize(m, 0) <= total / 2))
+				size += entrySize(m++, 0);
+		right.level = level;
+		right.keys.assign(keys.begin() + m, keys.end());
+		right.refs.assign(refs.begin() + m, refs.end());
+		keys.erase(keys.begin() + m, keys.end());
+		refs.erase(refs.begin() + m, refs.end());
+	}
+	
+	Return write(DbFileBackend& db) {
+		size_t prefix = prefixSize();
+		std::string data;
+		data.reserve(BTreePageDataSize);
+		data += rawString<uint8_t>(level);
+		data += rawString<uint16_t>(keys.size());
+		data += rawString<uint16_t>(prefix);
+		if(prefix > 0)
+			data += keys[firstPrefixed()].substr(0, prefix);
+		for(size_t i = 0; i < keys.size(); ++i) {
+			std::string suffix = (i < firstPrefixed()) ? "" : keys[i].substr(prefix);
+			data += rawString<uint16_t>(suffix.size()) + suffix + rawString<uint64_t>(refs[i]);
+		}
+		if(data.size() > BTreePageDataSize)
+			return "BTreePage write: page too big";
+		data.resize(BTreePageDataSize, '\0');
+		
+		return __db_write(db, selfOffset,
+						  rawString<uint8_t>(ChunkType_BTreePage) + rawString<uint32_t>(data.size()) +
+						  data + rawString<uint32_t>(calc_crc(data)));
+	}
+	
+	Return read(DbFileBackend& db, size_t _selfOffset) {
+		selfOffset = _selfOffset;
+		std::string raw(BTreePageSize, '\0');
+		ASSERT( __db_read(db, selfOffset, &raw[0], raw.size()) );
+		if(raw[0] != ChunkType_BTreePage) return "BTreePage read: chunk type invalid";
+		if(valueFromRaw<uint32_t>(&raw[1]) != BTreePageDataSize) return "BTreePage data size missmatch";
+		const char* data = &raw[1 + sizeof(uint32_t)];
+		if(valueFromRaw<uint32_t>(data + BTreePageDataSize) != calc_crc(data, BTreePageDataSize))
+			return "CRC missmatch on BTreePage read";
+		
+		size_t p = 0;
+		level = data[p];
+		p += 1;
+		size_t count = valueFromRaw<uint16_t>(data + p);
+		p += sizeof(uint16_t);
+		size_t prefixLen = valueFromRaw<uint16_t>(data + p);
+		p += sizeof(uint16_t);
+		if(p + prefixLen > BTreePageDataSize) return "BTreePage data is inconsistent";
+		std::string prefix(data + p, prefixLen);
+		p += prefixLen;
+		
+		keys = std::vector<std::string>(count);
+		refs = std::vector<uint64_t>(count);
+		for(size_t i = 0; i < count; ++i) {
+			if(p + sizeof(uint16_t) > BTreePageDataSize) return "BTreePage data is inconsistent";
+			size_t len = valueFromRaw<uint16_t>(data + p);
+			p += sizeof(uint16_t);
+			if(p + len + sizeof(uint64_t) > BTreePageDataSize) return "BTreePage data is inconsistent";
+			if(i >= firstPrefixed())
+				keys[i] = prefix + std::string(data + p, len);
+			p += len;
+			refs[i] = valueFromRaw<uint64_t>(data + p);
+			p += sizeof(uint64_t);
+		}
+		if(level > 0 && count == 0) return "BTreePage: inner page without children";
+		return true;
+	}
+};
+
+struct DbFile_BTree {
+	size_t rootOffset;
+	// All inner pages which were read or written. There are about 100 times less than leaves.
+	std::map<size_t, DbFile_BTreePage> innerPages;
+	
+	DbFile_BTree() : rootOffset(0) {}
+	
+	// page points to the pinned page or, for leaves, to buf.
+	Return getPage(DbFileBackend& db, size_t offset, DbFile_BTreePage& buf, /*out*/ DbFile_BTreePage*& page) {
+		std::map<size_t, DbFile_BTreePage>::iterator i = innerPages.find(offset);
+		if(i != innerPages.end()) {
+			page = &i->second;
+			return true;
+		}
+		ASSERT( buf.read(db, offset) );
+		page = &buf;
+		if(buf.level > 0)
+			page = &(innerPages[offset] = buf);
+		return true;
+	}
+	
+	Return writePage(DbFileBackend& db, const DbFile_BTreePage& page) {
+		if(page.level > 0)
+			innerPages[page.selfOffset] = page;
+		return const_cast<DbFile_BTreePage&>(page).write(db);
+	}
+	
+	Return writeRoot(DbFileBackend& db) {
+		std::string data = rawString<uint64_t>(rootOffset);
+		return __db_write(db, TreeRootOffset,
+						  rawString<uint8_t>(ChunkType_BTreeRoot) + rawString<uint32_t>(data.size()) +
+						  data + rawString<uint32_t>(calc_crc(data)));
+	}
+	
+	Return readRoot(DbFileBackend& db) {
+		std::string raw(1 + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t), '\0');
+		ASSERT( __db_read(db, TreeRootOffset, &raw[0], raw.size()) );
+		if(raw[0] != ChunkType_BTreeRoot) return "BTreeRoot read: chunk type invalid";
+		if(valueFromRaw<uint32_t>(&raw[1]) != sizeof(uint64_t)) return "BTreeRoot data size missmatch";
+		std::string data = raw.substr(1 + sizeof(uint32_t), sizeof(uint64_t));
+		if(valueFromRaw<uint32_t>(&raw[1 + sizeof(uint32_t) + sizeof(uint64_t)]) != calc_crc(data))
+			return "CRC missmatch on BTreeRoot read";
+		rootOffset = valueFromRaw<uint64_t>(&data[0]);
+		return true;
+	}
+	
+	// An empty leaf as root.
+	Return create(DbFileBackend& db) {
+		DbFile_BTreePage root;
+		root.selfOffset = db.fileSize + 1 + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t);
+		rootOffset = root.selfOffset;
+		ASSERT( writeRoot(db) );
+		return writePage(db, root);
 	}
+	
+	Return lookup(DbFileBackend& db, const std::string& key, /*out*/ uint64_t& ref, /*out*/ bool& found) {
+		DbFile_BTreePage buf;
+		DbFile_BTreePage* page = NULL;
+		ASSERT( getPage(db, rootOffset, buf, page) );
+		while(page->level > 0)
+			ASSERT( getPage(db, page->refs[page->find(key)], buf, page) );
+		size_t i = page->find(key);
+		found = i < page->keys.size() && page->keys[i] == key;
+		if(found) ref = page->refs[i];
+		return true;
+	}
+	
+	// Sets the ref of key. Full pages are split, the new ones are at the end of the file.
+	Return insert(DbFileBackend& db, const std::string& key, uint64_t ref) {
+		if(key.size() > BTreeMaxKeySize)
+			return "key is too long for the B+tree";
+		
+		std::vector<size_t> path, pathPos; // the inner pages down to the leaf
+		std::vector<bool> pathRightmost; // if the page is the last one on its level
+		bool rightmost = true;
+		DbFile_BTreePage buf;
+		DbFile_BTreePage* page = NULL;
+		ASSERT( getPage(db, rootOffset, buf, page) );
+		while(page->level > 0) {
+			path.push_back(page->selfOffset);
+			pathPos.push_back(page->find(key));
+			pathRightmost.push_back(rightmost);
+			rightmost = rightmost && pathPos.back() == page->keys.size() - 1;
+			ASSERT( getPage(db, page->refs[pathPos.back()], buf, page) );
+		}
+		
+		DbFile_BTreePage cur = *page;
+		size_t i = cur.find(key);
+		if(i < cur.keys.size() && cur.keys[i] == key) {
+			cur.refs[i] = ref;
+			return writePage(db, cur);
+		}
+		cur.insert(i, key, ref);
+		size_t added = i;
+		
+		while(!cur.fits()) {
+			DbFile_BTreePage right;
+			cur.split(right, rightmost && added == cur.keys.size() - 1);
+			std::string separator = right.keys[0];
+			if(right.level > 0) right.keys[0] = "";
+			right.selfOffset = db.fileSize;
+			ASSERT( writePage(db, right) );
+			ASSERT( writePage(db, cur) );
+			
+			if(path.empty()) {
+				DbFile_BTreePage root;
+				root.level = cur.level + 1;
+				root.insert(0, "", cur.selfOffset);
+				root.insert(1, separator, right.selfOffset);
+				root.selfOffset = db.fileSize;
+				ASSERT( writePage(db, root) );
+				rootOffset = root.selfOffset;
+				return writeRoot(db);
+			}
+			
+			cur = innerPages[path.back()];
+			added = pathPos.back() + 1;
+			rightmost = pathRightmost.back();
+			cur.insert(added, separator, right.selfOffset);
+			path.pop_back();
+			pathPos.pop_back();
+			pathRightmost.pop_back();
+		}
+		return writePage(db, cur);
+	}
+	
+	// Removes key, if it is there. The page can get empty, it is not merged with others.
+	Return remove(DbFileBackend& db, const std::string& key) {
+		DbFile_BTreePage buf;
+		DbFile_BTreePage* page = NULL;
+		ASSERT( getPage(db, rootOffset, buf, page) );
+		while(page->level > 0)
+			ASSERT( getPage(db, page->refs[page->find(key)], buf, page) );
+		size_t i = page->find(key);
+		if(i >= page->keys.size() || page->keys[i] != key) return true;
+		DbFile_BTreePage cur = *page;
+		cur.keys.erase(cur.keys.begin() + i);
+		cur.refs.erase(cur.refs.begin() + i);
+		return writePage(db, cur);
+	}
+	
+	// Calls the callback for all keys with the given prefix (with the prefix removed).
+	Return iterate(DbFileBackend& db, size_t offset, const std::string& prefix, DbFile_KeyCallback& callback) {
+		DbFile_BTreePage buf;
+		DbFile_BTreePage* page = NULL;
+		ASSERT( getPage(db, offset, buf, page) );
+		size_t first = page->find(prefix);
+		if(page->level == 0) {
+			// copy it, the callback could change the tree
+			DbFile_BTreePage leaf = *page;
+			for(size_t i = first; i < leaf.keys.size(); ++i) {
+				if(leaf.keys[i].compare(0, prefix.size(), prefix) != 0) break;
+				ASSERT( callback.key(leaf.keys[i].substr(prefix.size()), leaf.refs[i]) );
+			}
+			return true;
+		}
+		// The pinned pages stay where they are, but copy it anyway, the callback could push.
+		DbFile_BTreePage inner = *page;
+		for(size_t i = first; i < inner.keys.size(); ++i) {
+			if(i > first && inner.keys[i].compare(0, prefix.size(), prefix) != 0) break;
+			ASSERT( iterate(db, inner.refs[i], prefix, callback) );
+		}
+		return true;
+	}
+	
+	// The bytes of all pages below offset.
+	Return pagesSize(DbFileBackend& db, size_t offset, /*out*/ size_t& size) {
+		DbFile_BTreePage buf;
+		DbFile_BTreePage* page = NULL;
+		ASSERT( getPage(db, offset, buf, page) );
+		size += BTreePageSize;
+		if(page->level == 0) return true;
+		std::vector<uint64_t> children = page->refs;
+		for(size_t i = 0; i < children.size(); ++i)
+			ASSERT( pagesSize(db, children[i], size) );
+		return true;
+	}
+};
+
+/*
+ Free space, only in newer DB files with the B+tree. The value chunks which are not used anymore
+ (the rest of the chain when a value got shorter, see DbFile_ValueChunk::overwriteData)
+ are marked as ChunkType_FreeSpace and become a free extent. Neighbouring extents are merged.
+ A new value chunk goes into the smallest extent where it fits (the rest stays free if it is
+ at least DbFileMinFreeExtent, otherwise the chunk gets it as unused space) or at the end of the file.
+ The extents are keys in the B+tree (DbFileFreeKeyPrefix [uint64 offset], the ref is the size),
+ so the file has them, and they are kept here.
+ The older files with the trie only get free space back by compaction (DbFileBackend::compact).
+ */
+
+#define DbFileMinFreeExtent 64
+#define DbFileInternalKeyPrefix "dbfile." // the keys of the backend itself, they are not copied
+#define DbFileFreeKeyPrefix DbFileInternalKeyPrefix "free."
+
+struct DbFile_FreeSpace {
+	std::map<size_t, size_t> byOffset; // offset -> size
+	std::multimap<size_t, size_t> bySize; // size -> offset
+	size_t bytes;
+	
+	DbFile_FreeSpace() : bytes(0) {}
+	
+	void add(size_t offset, size_t size) {
+		byOffset[offset] = size;
+		bySize.insert(std::make_pair(size, offset));
+		bytes += size;
+	}
+	
+	void remove(size_t offset) {
+		std::map<size_t, size_t>::iterator i = byOffset.find(offset);
+		if(i == byOffset.end()) return;
+		std::multimap<size_t, size_t>::iterator j = bySize.lower_bound(i->second);
+		while(j != bySize.end() && j->second != offset) ++j;
+		if(j != bySize.end()) bySize.erase(j);
+		bytes -= i->second;
+		byOffset.erase(i);
+	}
+};
+
+static std::string __freeKey(size_t offset) {
+	return DbFileFreeKeyPrefix + rawString<uint64_t>(offset);
 }
 
-Return DbFileBackend::init() {
-	reset();
+static Return __db_addFree(DbFileBackend& db, size_t offset, size_t size) {
+	DbFile_FreeSpace& freeSpace = *db.freeSpace;
+	std::map<size_t, size_t>::iterator next = freeSpace.byOffset.lower_bound(offset);
+	if(next != freeSpace.byOffset.begin()) {
+		std::map<size_t, size_t>::iterator prev = next;
+		--prev;
+		if(prev->first + prev->second == offset) {
+			offset = prev->first;
+			size += prev->second;
+			freeSpace.remove(prev->first); // its key stays, it gets the new size below
+		}
+	}
+	if(next != freeSpace.byOffset.end() && next->first == offset + size) {
+		size_t nextOffset = next->first;
+		size += next->second;
+		freeSpace.remove(nextOffset);
+		ASSERT( db.btree->remove(db, __freeKey(nextOffset)) );
+	}
+	
+	ASSERT( __db_write(db, offset, rawString<uint8_t>(ChunkType_FreeSpace) + rawString<uint64_t>(size)) );
+	freeSpace.add(offset, size);
+	return db.btree->insert(db, __freeKey(offset), size);
+}
+
+// Where a new value chunk for dataSize bytes goes, see DbFile_FreeSpace. Sets its selfOffset and initialSize.
+static Return __db_allocValueChunk(DbFileBackend& db, size_t dataSize, DbFile_ValueChunk& chunk) {
+	chunk.selfOffset = db.fileSize;
+	chunk.initialSize = dataSize;
+	if(db.freeSpace == NULL) return true;
+	size_t need = dataSize + DbFile_ValueChunkOverhead;
+	std::multimap<size_t, size_t>::iterator i = db.freeSpace->bySize.lower_bound(need);
+	if(i == db.freeSpace->bySize.end()) return true;
+	
+	size_t offset = i->second;
+	size_t size = i->first;
+	db.freeSpace->remove(offset);
+	ASSERT( db.btree->remove(db, __freeKey(offset)) );
+	if(size - need >= DbFileMinFreeExtent) {
+		ASSERT( __db_addFree(db, offset + need, size - need) );
+		size = need;
+	}
+	chunk.selfOffset = offset;
+	chunk.initialSize = size - DbFile_ValueChunkOverhead;
+	return true;
+}
+
+// Frees the value chunk at ref and the ones after it.
+static Return __db_freeValueChunks(DbFileBackend& db, uint64_t ref) {
+	if(db.freeSpace == NULL) return true; // they are dead then
+	while(ref != 0) {
+		DbFile_ValueChunk chunk;
+		ASSERT( chunk.read(db, ref) );
+		ASSERT( __db_addFree(db, ref, chunk.initialSize + DbFile_ValueChunkOverhead) );
+		ref = chunk.refNextValueChunk;
+	}
+	return true;
+}
+
+struct __DbFileLoadFreeSpace : DbFile_KeyCallback {
+	DbFile_FreeSpace& freeSpace;
+	__DbFileLoadFreeSpace(DbFile_FreeSpace& f) : freeSpace(f) {}
+	Return key(const std::string& key, uint64_t ref) {
+		if(key.size() != sizeof(uint64_t)) return "free space key is invalid";
+		freeSpace.add(valueFromRaw<uint64_t>(&key[0]), ref);
+		return true;
+	}
+};
+
+/*
+ In read-only mode, the file is mapped (DbFile_Map). A lookup then just walks over the trie chunks
+ or the B+tree pages in the mapping and a value in a single chunk (that are almost all of them)
+ goes from there right into the decompressor, without any copy (see __get).
+ get(), getMany() and existMany() don't lock db.mutex then, so several threads can read at once.
+ No other process may write to the file while it is read: a writer overwrites the B+tree pages
+ and reuses the free value chunks in place, so a reader could see a half-written page or chunk.
+ If the file was written to between the reads, the reader sees the new root and a chunk behind
+ the end of the mapping maps the file again with its new size. Each reader holds the mapping
+ which it reads from (DbFile_MapView), and a superseded one is unmapped when the last one lets it go.
+ */
+
+struct DbFile_Mapping {
+	const char* data;
+	size_t size;
+	size_t refCount; // the DbFile_Map while it is the newest one, and the views
+	DbFile_Mapping(const char* _data, size_t _size) : data(_data), size(_size), refCount(1) {}
+};
+
+struct DbFile_Map;
+
+struct DbFile_MapView : DontCopyTag {
+	DbFile_Map& map;
+	DbFile_Mapping* mapping; // NULL if the file is not mapped yet
+	const char* data;
+	size_t size;
+	DbFile_MapView(DbFile_Map& _map);
+	~DbFile_MapView();
+	void set(DbFile_Mapping* m) {
+		mapping = m;
+		data = m ? m->data : NULL;
+		size = m ? m->size : 0;
+	}
+};
+
+struct DbFile_Map : DontCopyTag {
+	Mutex mutex; // for cur and the refCounts
+	int fd;
+	DbFile_Mapping* cur;
+	
+	DbFile_Map(int _fd) : fd(_fd), cur(NULL) {}
+	~DbFile_Map() { unref(cur); } // all views are gone
 	
-	int fd = open(filename.c_str(), readonly ? O_RDONLY : (O_RDWR|O_CREAT), 0644);
-	if(fd < 0)
-		return "failed to open DB file " + filename;
+	// Expects that mutex is locked.
+	void unref(DbFile_Mapping* m) {
+		if(m == NULL) return;
+		if(--m->refCount > 0) return;
+		munmap((void*) m->data, m->size);
+		delete m;
+	}
+	
+	DbFile_Mapping* ref() {
+		ScopedLock lock(mutex);
+		if(cur != NULL) cur->refCount++;
+		return cur;
+	}
+	
+	void release(DbFile_Mapping* m) {
+		ScopedLock lock(mutex);
+		unref(m);
+	}
+	
+	// Maps the file again if it has grown. view gets the newest mapping.
+	Return remap(DbFile_MapView& view) {
+		ScopedLock lock(mutex);
+		struct stat st;
+		if(fstat(fd, &st) != 0)
+			return "DB file: fstat failed";
+		if(cur == NULL || (size_t)st.st_size > cur->size) {
+			void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if(p == MAP_FAILED)
+				return "DB file: mmap failed";
+			unref(cur);
+			cur = new DbFile_Mapping((const char*) p, st.st_size);
+		}
+		if(view.mapping != cur) {
+			unref(view.mapping);
+			cur->refCount++;
+			view.set(cur);
+		}
+		return true;
+	}
+};
+
+DbFile_MapView::DbFile_MapView(DbFile_Map& _map) : map(_map) { set(map.ref()); }
+DbFile_MapView::~DbFile_MapView() { map.release(mapping); }
+
+// Makes sure that the view has [offset, offset + size).
+static Return __map_need(DbFile_Map& map, DbFile_MapView& view, uint64_t offset, size_t size) {
+	if(offset <= view.size && size <= view.size - offset) return true;
+	ASSERT( map.remap(view) );
+	if(offset <= view.size && size <= view.size - offset) return true;
+	return "DB file: chunk is behind the end of the file";
+}
+
+// refs points to the valueRef, followed by the subtreeRefs, like in DbFile_TreeChunk::read.
+static Return __map_readTree(DbFile_Map& map, DbFile_MapView& view, uint64_t offset, /*out*/ const char*& refs) {
+	const size_t len = sizeof(uint64_t) * 5;
+	ASSERT( __map_need(map, view, offset, 1 + sizeof(uint32_t) + len + sizeof(uint32_t)) );
+	const char* p = view.data + offset;
+	if(p[0] != ChunkType_Tree) return "TreeChunk read: chunk type invalid";
+	if(valueFromRaw<uint32_t>(p + 1) != len) return "TreeChunk data size missmatch";
+	refs = p + 1 + sizeof(uint32_t);
+	if(valueFromRaw<uint32_t>(refs + len) != calc_crc(refs, len))
+		return "CRC missmatch on TreeChunk read";
+	return true;
+}
+
+// Like DbFile_BTreePage::read + find, but right on the page data.
+// Leaf: ref is the value of key, if found. Inner page: ref is the child for key.
+static Return __map_findInPage(DbFile_Map& map, DbFile_MapView& view, uint64_t offset, const std::string& key,
+							   /*out*/ uint8_t& level, /*out*/ uint64_t& ref, /*out*/ bool& found) {
+	ASSERT( __map_need(map, view, offset, BTreePageSize) );
+	const char* raw = view.data + offset;
+	if(raw[0] != ChunkType_BTreePage) return "BTreePage read: chunk type invalid";
+	if(valueFromRaw<uint32_t>(raw + 1) != BTreePageDataSize) return "BTreePage data size missmatch";
+	const char* data = raw + 1 + sizeof(uint32_t);
+	if(valueFromRaw<uint32_t>(data + BTreePageDataSize) != calc_crc(data, BTreePageDataSize))
+		return "CRC missmatch on BTreePage read";
+	
+	size_t p = 0;
+	level = data[p];
+	p += 1;
+	size_t count = valueFromRaw<uint16_t>(data + p);
+	p += sizeof(uint16_t);
+	size_t prefixLen = valueFromRaw<uint16_t>(data + p);
+	p += sizeof(uint16_t);
+	if(p + prefixLen > BTreePageDataSize) return "BTreePage data is inconsistent";
+	const char* prefix = data + p;
+	p += prefixLen;
+	if(level > 0 && count == 0) return "BTreePage: inner page without children";
+	size_t firstPrefixed = (level > 0) ? 1 : 0;
+	
+	// All prefixed keys start with the prefix. If key doesn't, it is below or above all of them.
+	int prefixCmp = memcmp(key.data(), prefix, std::min(key.size(), prefixLen));
+	if(prefixCmp == 0 && key.size() < prefixLen) prefixCmp = -1;
+	
+	found = false;
+	for(size_t i = 0; i < count; ++i) {
+		if(p + sizeof(uint16_t) > BTreePageDataSize) return "BTreePage data is inconsistent";
+		size_t len = valueFromRaw<uint16_t>(data + p);
+		p += sizeof(uint16_t);
+		if(p + len + sizeof(uint64_t) > BTreePageDataSize) return "BTreePage data is inconsistent";
+		const char* suffix = data + p;
+		uint64_t r = valueFromRaw<uint64_t>(data + p + len);
+		p += len + sizeof(uint64_t);
 		
-	file = fdopen(fd, readonly ? "rb" : "w+b");
-	if(file == NULL) {
+		int c = 1; // key compared to key i. The empty key 0 of an inner page is below any key.
+		if(i >= firstPrefixed) {
+			c = prefixCmp;
+			if(c == 0) {
+				size_t rest = key.size() - prefixLen;
+				c = memcmp(key.data() + prefixLen, suffix, std::min(rest, len));
+				if(c == 0) c = (rest < len) ? -1 : (rest > len) ? 1 : 0;
+			}
+		}
+		
+		if(level == 0) {
+			if(c == 0) { ref = r; found = true; }
+			if(c <= 0) break;
+		}
+		else {
+			if(c < 0) break;
+			ref = r;
+			found = true;
+		}
+	}
+	return true;
+}
+
+static Return __map_findValue(DbFileBackend& db, DbFile_MapView& view, const std::string& key,
+							  /*out*/ uint64_t& ref, /*out*/ bool& found) {
+	DbFile_Map& map = *db.map;
+	found = false;
+	
+	if(db.btree != NULL) {
+		// The root is read each time, the file could have been written to since the last read.
+		const size_t len = sizeof(uint64_t);
+		ASSERT( __map_need(map, view, TreeRootOffset, 1 + sizeof(uint32_t) + len + sizeof(uint32_t)) );
+		const char* p = view.data + TreeRootOffset;
+		if(p[0] != ChunkType_BTreeRoot) return "BTreeRoot read: chunk type invalid";
+		if(valueFromRaw<uint32_t>(p + 1) != len) return "BTreeRoot data size missmatch";
+		p += 1 + sizeof(uint32_t);
+		if(valueFromRaw<uint32_t>(p + len) != calc_crc(p, len))
+			return "CRC missmatch on BTreeRoot read";
+		uint64_t offset = valueFromRaw<uint64_t>(p);
+		while(true) {
+			uint8_t level = 0;
+			uint64_t next = 0;
+			ASSERT( __map_findInPage(map, view, offset, key, level, next, found) );
+			if(level == 0) {
+				ref = next;
+				return true;
+			}
+			if(!found) return "BTreePage: no child for key";
+			offset = next;
+		}
+	}
+	
+	// same bit order as in DbFile_TreeChunk::getValue
+	const char* refs = NULL;
+	ASSERT( __map_readTree(map, view, TreeRootOffset, refs) );
+	for(uint64_t bitOffset = 0; bitOffset < key.size()*8; bitOffset += 2) {
+		uint8_t next = key[bitOffset / 8];
+		next >>= bitOffset % 8;
+		next &= 3;
+		uint64_t offset = valueFromRaw<uint64_t>(refs + sizeof(uint64_t) * (1 + next));
+		if(offset == 0) return true;
+		ASSERT( __map_readTree(map, view, offset, refs) );
+	}
+	ref = valueFromRaw<uint64_t>(refs);
+	found = ref != 0;
+	return true;
+}
+
+// Like DbFile_ValueChunk::read + getData. If the value is in a single chunk, data points into
+// the mapping. Otherwise the chunks are put together in buf.
+static Return __map_getValue(DbFile_Map& map, DbFile_MapView& view, uint64_t ref,
+							 /*out*/ const char*& data, /*out*/ size_t& size, std::string& buf) {
+	buf = "";
+	for(bool first = true; ; first = false) {
+		ASSERT( __map_need(map, view, ref, 1 + sizeof(uint32_t)) );
+		if(view.data[ref] != ChunkType_Value) return "ValueChunk read: chunk type invalid";
+		size_t len = valueFromRaw<uint32_t>(view.data + ref + 1);
+		// the CRC is over the data, initialSize and refNextValueChunk, which follow each other
+		size_t crcLen = len + sizeof(uint32_t) + sizeof(uint64_t);
+		ASSERT( __map_need(map, view, ref, 1 + sizeof(uint32_t) + crcLen + sizeof(uint32_t)) );
+		const char* p = view.data + ref + 1 + sizeof(uint32_t);
+		if(valueFromRaw<uint32_t>(p + len) < len) return "ValueChunk read: initialSize invalid";
+		uint64_t next = valueFromRaw<uint64_t>(p + len + sizeof(uint32_t));
+		if(valueFromRaw<uint32_t>(p + crcLen) != calc_crc(p, crcLen))
+			return "CRC missmatch on ValueChunk read";
+		
+		if(first && next == 0) {
+			data = p;
+			size = len;
+			return true;
+		}
+		buf.append(p, len);
+		if(next == 0) break;
+		ref = next;
+	}
+	data = buf.data();
+	size = buf.size();
+	return true;
+}
+
+// See __map_getValue. This doesn't need db.mutex. data is only valid as long as view is there.
+static Return __map_get(DbFileBackend& db, DbFile_MapView& view, const std::string& key,
+						/*out*/ const char*& data, /*out*/ size_t& size, std::string& buf) {
+	uint64_t ref = 0;
+	bool found = false;
+	ASSERT( __map_findValue(db, view, key, ref, found) );
+	if(!found) return "entry not found";
+	return __map_getValue(*db.map, view, ref, data, size, buf);
+}
+
+void DbFileBackend::reset() {
+	if(map != NULL) {
+		delete map;
+		map = NULL;
+	}
+	
+	if(writes != NULL) {
+		if(fd >= 0) {
+			Return r = __db_flush(*this);
+			if(!r) cerr << "DbFileBackend: " << r.errmsg << endl;
+		}
+		delete writes;
+		writes = NULL;
+	}
+	
+	if(fd >= 0) {
 		close(fd);
-		return "failed to open DB file handle";
+		fd = -1;
+	}
+	
+	if(rootChunk != NULL) {
+		delete rootChunk;
+		rootChunk = NULL;
+	}
+	
+	if(btree != NULL) {
+		delete btree;
+		btree = NULL;
 	}
 	
-	fseek(file, 0, SEEK_END);
-	fileSize = ftell(file);
-	fseek(file, 0, SEEK_SET);
+	if(freeSpace != NULL) {
+		delete freeSpace;
+		freeSpace = NULL;
+	}
+}
 
-	rootChunk = new DbFile_TreeChunk();
+// Everything of init() but the DB-wide settings (initMeta).
+static Return __db_open(DbFileBackend& db) {
+	db.reset();
+	
+	db.fd = open(db.filename.c_str(), db.readonly ? O_RDONLY : (O_RDWR|O_CREAT), 0644);
+	if(db.fd < 0)
+		return "failed to open DB file " + db.filename;
 	
-	if(fileSize == 0) {
+	struct stat st;
+	if(fstat(db.fd, &st) != 0)
+		return "failed to stat DB file " + db.filename;
+	db.fileSize = st.st_size;
+	db.writes = new DbFile_Writes();
+	db.writes->diskSize = db.fileSize;
+
+	if(db.fileSize == 0) {
 		// init new file
-		ASSERT( __db_fwrite(*this, DbFile_Signature, sizeof(DbFile_Signature)) );
-		rootChunk->selfOffset = TreeRootOffset;
-		ASSERT( rootChunk->write(*this) );
+		ASSERT( __db_write(db, 0, DbFile_Signature, sizeof(DbFile_Signature)) );
+		db.btree = new DbFile_BTree();
+		ASSERT( db.btree->create(db) );
+		db.freeSpace = new DbFile_FreeSpace();
 	}
-	else if(fileSize < sizeof(DbFile_Signature))
+	else if(db.fileSize < sizeof(DbFile_Signature) + 1)
 		return "DB file even too small for the signature";
 	else {
-		char tmp[sizeof(DbFile_Signature)];
-		ASSERT( fread_bytes(file, tmp, sizeof(tmp)) );
-		if(memcmp(tmp, DbFile_Signature, sizeof(tmp)) != 0)
+		char tmp[sizeof(DbFile_Signature) + 1];
+		ASSERT( __db_read(db, 0, tmp, sizeof(tmp)) );
+		if(memcmp(tmp, DbFile_Signature, sizeof(DbFile_Signature)) != 0)
 			return "DB file signature wrong";
 		
-		ASSERT_EXT( rootChunk->read(*this, TreeRootOffset), "error reading root chunk" );
-		//ASSERT( rootChunk->debugDump(*this) );
+		uint8_t rootType = tmp[sizeof(DbFile_Signature)];
+		if(rootType == ChunkType_BTreeRoot) {
+			db.btree = new DbFile_BTree();
+			ASSERT_EXT( db.btree->readRoot(db), "error reading root chunk" );
+			if(!db.readonly) {
+				db.freeSpace = new DbFile_FreeSpace();
+				__DbFileLoadFreeSpace callback(*db.freeSpace);
+				ASSERT_EXT( db.btree->iterate(db, db.btree->rootOffset, DbFileFreeKeyPrefix, callback), "error reading free space" );
+			}
+		}
+		else {
+			// older DB file with the trie
+			db.rootChunk = new DbFile_TreeChunk();
+			ASSERT_EXT( db.rootChunk->read(db, TreeRootOffset), "error reading root chunk" );
+			//ASSERT( rootChunk->debugDump(*this) );
+		}
 	}
 	
+	if(db.readonly && db.useMmap) {
+		db.map = new DbFile_Map(db.fd);
+		bool mapped = false;
+		{
+			DbFile_MapView view(*db.map);
+			mapped = db.map->remap(view);
+		}
+		if(!mapped) {
+			// the normal reads still work
+			delete db.map;
+			db.map = NULL;
+		}
+	}
 	return true;
 }
 
+Return DbFileBackend::init() {
+	ASSERT( __db_open(*this) );
+	ASSERT( initMeta() );
+	return __db_flush(*this);
+}
+
+// The __db_* functions expect that db.mutex is locked.
+
+// Finds the value chunk of key. If it doesn't exist and createIfNotExist is set,
+// chunk is a new one at the end of the file. The trie has it already then.
+// For the B+tree, isNew is set. __db_allocValueChunk gives it its place
+// and __db_addKey must be called once it was written.
+static Return __db_findValue(DbFileBackend& db, const std::string& key, /*out*/ DbFile_ValueChunk& chunk,
+							 bool createIfNotExist, bool mustCreateNew, /*out*/ bool& isNew) {
+	isNew = false;
+	if(db.btree != NULL) {
+		uint64_t ref = 0;
+		bool found = false;
+		ASSERT( db.btree->lookup(db, key, ref, found) );
+		if(found) {
+			if(mustCreateNew) return "entry does already exist";
+			return chunk.read(db, ref);
+		}
+		if(!createIfNotExist) return "entry not found";
+		chunk.selfOffset = db.fileSize;
+		isNew = true;
+		return true;
+	}
+	if(db.rootChunk == NULL) return "db not initialized";
+	return db.rootChunk->getValue(db, key, chunk, createIfNotExist, mustCreateNew);
+}
+
+static Return __db_addKey(DbFileBackend& db, const std::string& key, const DbFile_ValueChunk& chunk) {
+	return db.btree->insert(db, key, chunk.selfOffset);
+}
+
 // creates or append to an entry
 static Return __db_append(DbFileBackend& db, const std::string& key, const std::string& value) {
-	if(db.rootChunk == NULL) return "db append: db not initialized";
-	ScopedLock lock(db.mutex);
-
 	DbFile_ValueChunk chunk;
-	ASSERT( db.rootChunk->getValue(db, key, chunk, /*createIfNotExist*/true, /*mustCreateNew*/false) );
+	bool isNew = false;
+	ASSERT( __db_findValue(db, key, chunk, /*createIfNotExist*/true, /*mustCreateNew*/false, isNew) );
+	if(isNew) ASSERT( __db_allocValueChunk(db, value.size(), chunk) );
 	ASSERT( chunk.appendData(db, value) );
+	if(isNew) ASSERT( __db_addKey(db, key, chunk) );
 	return true;
 }
 
 static Return __db_set(DbFileBackend& db, const std::string& key, const std::string& value) {
-	if(db.rootChunk == NULL) return "db set: db not initialized";
-	ScopedLock lock(db.mutex);
-
 	DbFile_ValueChunk chunk;
-	ASSERT( db.rootChunk->getValue(db, key, chunk, /*createIfNotExist*/true, /*mustCreateNew*/false) );
+	bool isNew = false;
+	ASSERT( __db_findValue(db, key, chunk, /*createIfNotExist*/true, /*mustCreateNew*/false, isNew) );
+	if(isNew) ASSERT( __db_allocValueChunk(db, value.size(), chunk) );
 	ASSERT( chunk.overwriteData(db, value) );
+	if(isNew) ASSERT( __db_addKey(db, key, chunk) );
 	return true;
 }
 
 static Return __db_get(DbFileBackend& db, const std::string& key, /*out*/ std::string& value) {
-	if(db.rootChunk == NULL) return "db get: db not initialized";
-	ScopedLock lock(db.mutex);
-
+	if(db.map != NULL) {
+		DbFile_MapView view(*db.map);
+		const char* data = NULL;
+		size_t size = 0;
+		ASSERT( __map_get(db, view, key, data, size, value) );
+		if(data != value.data()) value.assign(data, size);
+		return true;
+	}
 	DbFile_ValueChunk chunk;
-	ASSERT( db.rootChunk->getValue(db, key, chunk, /*createIfNotExist*/false, /*mustCreateNew*/false) );
+	bool isNew = false;
+	ASSERT( __db_findValue(db, key, chunk, /*createIfNotExist*/false, /*mustCreateNew*/false, isNew) );
 	ASSERT( chunk.getData(db, value) );
 	return true;
 }
 
 // adds. if it exists, it fails
 static Return __db_add(DbFileBackend& db, const std::string& key, const std::string& value) {
-	if(db.rootChunk == NULL) return "db add: db not initialized";
-	ScopedLock lock(db.mutex);
-
 	DbFile_ValueChunk chunk;
-	ASSERT( db.rootChunk->getValue(db, key, chunk, /*createIfNotExist*/true, /*mustCreateNew*/true) );
+	bool isNew = false;
+	ASSERT( __db_findValue(db, key, chunk, /*createIfNotExist*/true, /*mustCreateNew*/true, isNew) );
+	if(isNew) ASSERT( __db_allocValueChunk(db, value.size(), chunk) );
 	ASSERT( chunk.overwriteData(db, value) );
+	if(isNew) ASSERT( __db_addKey(db, key, chunk) );
 	return true;
 }
 
+// Calls the callback for all keys with a value below the given tree node.
+// suffix is the key part below the start node, with bits valid bits.
+static Return __db_iterateSubtree(DbFileBackend& db, const DbFile_TreeChunk& tree,
+								  std::string& suffix, uint64_t bits, DbFile_KeyCallback& callback) {
+	if(bits % 8 == 0 && tree.valueRef != 0 && !suffix.empty())
+		ASSERT( callback.key(suffix, tree.valueRef) );
+	for(size_t i = 0; i < sizeof(tree.subtreeRefs)/sizeof(tree.subtreeRefs[0]); ++i) {
+		if(tree.subtreeRefs[i] == 0) continue;
+		DbFile_TreeChunk subtree;
+		ASSERT( subtree.read(db, tree.subtreeRefs[i]) );
+		// same bit order as in DbFile_TreeChunk::getValue
+		if(bits % 8 == 0) suffix += '\0';
+		suffix[suffix.size() - 1] |= (char)(i << (bits % 8));
+		ASSERT( __db_iterateSubtree(db, subtree, suffix, bits + 2, callback) );
+		suffix[suffix.size() - 1] &= (char)~(3 << (bits % 8));
+		if(bits % 8 == 0) suffix.erase(suffix.size() - 1);
+	}
+	return true;
+}
+
+// Calls the callback for all keys with the given prefix (with the prefix removed).
+static Return __db_iterateKeys(DbFileBackend& db, const std::string& prefix, DbFile_KeyCallback& callback) {
+	if(db.btree != NULL) return db.btree->iterate(db, db.btree->rootOffset, prefix, callback);
+	if(db.rootChunk == NULL) return "db iterate: db not initialized";
+	
+	DbFile_TreeChunk tree = *db.rootChunk;
+	for(uint64_t bitOffset = 0; bitOffset < prefix.size()*8; bitOffset += 2) {
+		uint8_t next = prefix[bitOffset / 8];
+		next >>= bitOffset % 8;
+		next &= 3;
+		if(tree.subtreeRefs[next] == 0) return true; // no such keys
+		uint64_t ref = tree.subtreeRefs[next];
+		ASSERT( tree.read(db, ref) );
+	}
+	
+	std::string suffix;
+	return __db_iterateSubtree(db, tree, suffix, 0, callback);
+}
+
+struct __DbFileHashRefCallback : DbFile_KeyCallback {
+	DbHashRefCallbackIntf& callback;
+	__DbFileHashRefCallback(DbHashRefCallbackIntf& c) : callback(c) {}
+	Return key(const std::string& key, uint64_t) {
+		callback.hashRef(key);
+		return true;
+	}
+};
 
 static Return __addEntryToList(DbFileBackend& db, const std::string& key, const std::string& entry) {
 	if(entry.size() > 255)
@@ -415,58 +1374,366 @@ static Return __saveNewDbEntry(DbFileBackend& db, DbEntryId& id, const std::stri
 	return __saveNewDbEntry(db, id, content);
 }
 
-Return DbFileBackend::push(/*out*/ DbEntryId& id, const DbEntry& entry) {
+static Return __get(DbFileBackend& db, /*out*/ DbEntry& entry, const DbEntryId& id) {
+	std::string key = "data." + id;
+	if(db.map != NULL) {
+		// uncompressed right from the mapping. entry.compressed is only set if it was in several chunks
+		DbFile_MapView view(*db.map);
+		const char* compressed = NULL;
+		size_t size = 0;
+		ASSERT( __map_get(db, view, key, compressed, size, entry.compressed) );
+		ASSERT( dbCodecUncompress(compressed, size, entry.data) );
+	}
+	else {
+		ASSERT( __db_get(db, key, entry.compressed) );
+		ASSERT( entry.uncompress() );
+	}
+	entry.calcSha1();
+	
+	return true;
+}
+
+// Trusted hash mode: the SHA256 ref is just the id and a hit needs no further read.
+static Return __pushTrusted(DbFileBackend& db, /*out*/ DbEntryId& id, const DbEntry& entry) {
+	if(!entry.haveSha256())
+		return "DB push: entry SHA256 not calculated";
+	
+	std::string sha256refkey = "sha256ref." + entry.sha256;
+	if(db.mayHaveRef(entry) && __db_get(db, sha256refkey, id) && !id.empty()) {
+		db.stats.countReuse(entry);
+		return true;
+	}
+	
+	std::string compressed;
+	db.compressForPush(entry, compressed);
+	id = "";
+	ASSERT( __saveNewDbEntry(db, id, compressed) );
+	ASSERT( __db_set(db, sha256refkey, id) );
+	db.addRefToIndex(entry);
+	
+	db.stats.pushNew++;
+	return true;
+}
+
+static Return __push(DbFileBackend& db, /*out*/ DbEntryId& id, const DbEntry& entry) {
+	if(db.trustedHash)
+		return __pushTrusted(db, id, entry);
 	if(!entry.haveSha1())
 		return "DB push: entry SHA1 not calculated";
-	if(!entry.haveCompressed())
-		return "DB push: entry compression not calculated";
 	
 	// search for existing entry
 	std::string sha1refkey = "sha1ref." + entry.sha1;
 	std::list<std::string> sha1refs;
-	if(__getEntryList(*this, sha1refkey, sha1refs))
+	if(db.mayHaveRef(entry) && __getEntryList(db, sha1refkey, sha1refs))
 		for(std::list<std::string>::iterator i = sha1refs.begin(); i != sha1refs.end(); ++i) {
 			DbEntryId otherId = *i;
 			DbEntry otherEntry;
-			if(get(otherEntry, otherId)) {
+			if(__get(db, otherEntry, otherId)) {
 				if(entry == otherEntry) {
 					// found
 					id = otherId;
-					stats.pushReuse++;
+					db.stats.countReuse(entry);
 					return true;
 				}
 			}
 		}
 
 	// write DB entry
+	std::string compressed;
+	db.compressForPush(entry, compressed);
 	id = "";
-	ASSERT( __saveNewDbEntry(*this, id, entry.compressed) );
+	ASSERT( __saveNewDbEntry(db, id, compressed) );
 	
 	// create sha1 ref
-	ASSERT( __addEntryToList(*this, sha1refkey, id) );
+	ASSERT( __addEntryToList(db, sha1refkey, id) );
+	db.addRefToIndex(entry);
 	
-	stats.pushNew++;
+	db.stats.pushNew++;
 	return true;
 }
 
+Return DbFileBackend::push(/*out*/ DbEntryId& id, const DbEntry& entry) {
+	ASSERT( updateRefGeneration() );
+	ScopedLock lock(mutex);
+	ASSERT( __push(*this, id, entry) );
+	return __db_flush(*this);
+}
+
 Return DbFileBackend::get(/*out*/ DbEntry& entry, const DbEntryId& id) {
-	std::string key = "data." + id;
-	ASSERT( __db_get(*this, key, entry.compressed) );
+	if(map != NULL) return __get(*this, entry, id); // needs no lock, see DbFile_Map
+	ScopedLock lock(mutex);
+	return __get(*this, entry, id);
+}
+
+// The batch operations only need to take the lock once.
+// Otherwise, they are just the same as the single ones.
+
+// Looks up the refs of all entries, like DbKyotoBackend::pushMany.
+static Return __resolvePushMany(DbFileBackend& db, DbPushBatch& batch) {
+	const std::vector<DbEntry>& entries = batch.entries;
+	if(db.trustedHash) {
+		std::vector<DbEntryId> refIds(entries.size());
+		for(size_t i = 0; i < entries.size(); ++i) {
+			if(!entries[i].haveSha256())
+				return "DB push: entry SHA256 not calculated";
+			if(db.mayHaveRef(entries[i]) && !__db_get(db, "sha256ref." + entries[i].sha256, refIds[i]))
+				refIds[i] = "";
+		}
+		batch.resolveTrusted(refIds, db.stats);
+		return true;
+	}
 	
-	ASSERT( entry.uncompress() );
-	entry.calcSha1();
+	std::vector< std::list<DbEntryId> > refs(entries.size());
+	std::map<DbEntryId, DbEntry> candidates;
+	for(size_t i = 0; i < entries.size(); ++i) {
+		if(!entries[i].haveSha1())
+			return "DB push: entry SHA1 not calculated";
+		if(!db.mayHaveRef(entries[i]) || !__getEntryList(db, "sha1ref." + entries[i].sha1, refs[i])) continue;
+		for(std::list<DbEntryId>::iterator r = refs[i].begin(); r != refs[i].end(); ++r) {
+			if(candidates.find(*r) != candidates.end()) continue;
+			DbEntry otherEntry;
+			if(__get(db, otherEntry, *r)) candidates[*r] = otherEntry;
+		}
+	}
+	batch.resolve(refs, candidates, db.stats);
+	return true;
+}
+
+Return DbFileBackend::pushMany(/*out*/ std::vector<DbEntryId>& ids, const std::vector<DbEntry>& entries) {
+	ASSERT( updateRefGeneration() );
+	DbPushBatch batch(ids, entries);
+	{
+		ScopedLock lock(mutex);
+		ASSERT( __resolvePushMany(*this, batch) );
+	}
+	
+	// Outside of the lock. A concurrent push of the same data in between
+	// would just store it twice.
+	std::vector<std::string> compressed;
+	compressForPushMany(entries, batch.newEntries, compressed);
 	
+	ScopedLock lock(mutex);
+	for(size_t j = 0; j < batch.newEntries.size(); ++j) {
+		size_t i = batch.newEntries[j];
+		ASSERT( __saveNewDbEntry(*this, ids[i], compressed[i]) );
+		if(trustedHash) {
+			ASSERT( __db_set(*this, "sha256ref." + entries[i].sha256, ids[i]) );
+		}
+		else {
+			ASSERT( __addEntryToList(*this, "sha1ref." + entries[i].sha1, ids[i]) );
+		}
+		addRefToIndex(entries[i]);
+	}
+	batch.finish();
+	return __db_flush(*this); // all of them together
+}
+
+static Return __getMany(DbFileBackend& db, /*out*/ std::vector<DbEntry>& entries, const std::vector<DbEntryId>& ids) {
+	entries = std::vector<DbEntry>(ids.size());
+	for(size_t i = 0; i < ids.size(); ++i)
+		ASSERT( __get(db, entries[i], ids[i]) );
 	return true;
 }
 
-Return DbFileBackend::pushToDir(const std::string& path, const DbDirEntry& dirEntry) {
-	std::string key = "fs." + path;
-	std::string dirEntryRaw = dirEntry.serialized();
-	ASSERT( __addEntryToList(*this, key, dirEntryRaw) );
+Return DbFileBackend::getMany(/*out*/ std::vector<DbEntry>& entries, const std::vector<DbEntryId>& ids) {
+	if(map != NULL) return __getMany(*this, entries, ids); // needs no lock, see DbFile_Map
+	ScopedLock lock(mutex);
+	return __getMany(*this, entries, ids);
+}
+
+static Return __existMany(DbFileBackend& db, /*out*/ std::vector<bool>& exist, const std::vector<DbEntryId>& ids) {
+	exist = std::vector<bool>(ids.size());
+	if(db.map != NULL) {
+		DbFile_MapView view(*db.map);
+		for(size_t i = 0; i < ids.size(); ++i) {
+			uint64_t ref = 0;
+			bool found = false;
+			exist[i] = __map_findValue(db, view, "data." + ids[i], ref, found) && found;
+		}
+		return true;
+	}
+	for(size_t i = 0; i < ids.size(); ++i) {
+		DbFile_ValueChunk chunk;
+		bool isNew = false;
+		exist[i] = __db_findValue(db, "data." + ids[i], chunk, /*createIfNotExist*/false, /*mustCreateNew*/false, isNew);
+	}
+	return true;
+}
+
+Return DbFileBackend::existMany(/*out*/ std::vector<bool>& exist, const std::vector<DbEntryId>& ids) {
+	if(map != NULL) return __existMany(*this, exist, ids); // needs no lock, see DbFile_Map
+	ScopedLock lock(mutex);
+	return __existMany(*this, exist, ids);
+}
+
+Return DbFileBackend::iterateHashRefs(DbHashRefCallbackIntf& callback) {
+	ScopedLock lock(mutex);
+	__DbFileHashRefCallback keyCallback(callback);
+	return __db_iterateKeys(*this, trustedHash ? "sha256ref." : "sha1ref.", keyCallback);
+}
+
+// The values are copied in key order, so values of neighbouring keys are together in dest.
+struct __DbFileCopyCallback : DbFile_KeyCallback {
+	DbFileBackend& src;
+	DbFileBackend& dest;
+	size_t numKeys;
+	__DbFileCopyCallback(DbFileBackend& _src, DbFileBackend& _dest) : src(_src), dest(_dest), numKeys(0) {}
+	Return key(const std::string& key, uint64_t) {
+		if(key.compare(0, strlen(DbFileInternalKeyPrefix), DbFileInternalKeyPrefix) == 0) return true;
+		std::string value;
+		ASSERT( __db_get(src, key, value) );
+		ASSERT( __db_set(dest, key, value) );
+		numKeys++;
+		return true;
+	}
+};
+
+Return DbFileBackend::copyTo(DbFileBackend& dest, /*out*/ size_t& numKeys) {
+	ScopedLock lock(mutex);
+	ScopedLock destLock(dest.mutex);
+	__DbFileCopyCallback callback(*this, dest);
+	ASSERT( __db_iterateKeys(*this, "", callback) );
+	numKeys = callback.numKeys;
+	return __db_flush(dest);
+}
+
+std::string DbFileSpaceStats::summary() const {
+	std::ostringstream s;
+	s << (fileSize / 1024) << " KB: " << (treeBytes / 1024) << " KB tree";
+	if(treeLevels > 0) s << " (" << treeLevels << " levels)";
+	s << ", "
+	<< valueChunks << " value chunks with " << (valueBytes / 1024) << " KB (" << (valueDataBytes / 1024) << " KB used), "
+	<< freeExtents << " free extents with " << (freeBytes / 1024) << " KB, " << (deadBytes / 1024) << " KB dead";
+	return s.str();
+}
+
+struct __DbFileSpaceStatsCallback : DbFile_KeyCallback {
+	DbFileBackend& db;
+	DbFileSpaceStats& stats;
+	__DbFileSpaceStatsCallback(DbFileBackend& _db, DbFileSpaceStats& _stats) : db(_db), stats(_stats) {}
+	Return key(const std::string& key, uint64_t ref) {
+		if(key.compare(0, strlen(DbFileInternalKeyPrefix), DbFileInternalKeyPrefix) == 0) return true;
+		while(ref != 0) {
+			DbFile_ValueChunk chunk;
+			ASSERT( chunk.read(db, ref) );
+			stats.valueChunks++;
+			stats.valueBytes += chunk.initialSize + DbFile_ValueChunkOverhead;
+			stats.valueDataBytes += chunk.data.size();
+			ref = chunk.refNextValueChunk;
+		}
+		return true;
+	}
+};
+
+static Return __db_trieSize(DbFileBackend& db, const DbFile_TreeChunk& tree, /*out*/ size_t& size) {
+	size += 1 + sizeof(uint32_t) + sizeof(tree.valueRef) + sizeof(tree.subtreeRefs) + sizeof(uint32_t);
+	for(size_t i = 0; i < sizeof(tree.subtreeRefs)/sizeof(tree.subtreeRefs[0]); ++i) {
+		if(tree.subtreeRefs[i] == 0) continue;
+		DbFile_TreeChunk subtree;
+		ASSERT( subtree.read(db, tree.subtreeRefs[i]) );
+		ASSERT( __db_trieSize(db, subtree, size) );
+	}
+	return true;
+}
+
+// Everything which is reachable from the root is used. The rest is free or dead.
+Return DbFileBackend::spaceStats(/*out*/ DbFileSpaceStats& stats) {
+	ScopedLock lock(mutex);
+	stats = DbFileSpaceStats();
+	stats.fileSize = fileSize;
+	if(btree != NULL) {
+		stats.treeBytes = 1 + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t); // the root chunk
+		ASSERT( btree->pagesSize(*this, btree->rootOffset, stats.treeBytes) );
+		DbFile_BTreePage buf;
+		DbFile_BTreePage* root = NULL;
+		ASSERT( btree->getPage(*this, btree->rootOffset, buf, root) );
+		stats.treeLevels = root->level + 1;
+	}
+	else if(rootChunk != NULL)
+		ASSERT( __db_trieSize(*this, *rootChunk, stats.treeBytes) );
+	__DbFileSpaceStatsCallback callback(*this, stats);
+	ASSERT( __db_iterateKeys(*this, "", callback) );
+	if(freeSpace != NULL) {
+		stats.freeExtents = freeSpace->byOffset.size();
+		stats.freeBytes = freeSpace->bytes;
+	}
+	else if(btree != NULL) {
+		// read-only, so not loaded
+		DbFile_FreeSpace loaded;
+		__DbFileLoadFreeSpace loadCallback(loaded);
+		ASSERT( __db_iterateKeys(*this, DbFileFreeKeyPrefix, loadCallback) );
+		stats.freeExtents = loaded.byOffset.size();
+		stats.freeBytes = loaded.bytes;
+	}
+	size_t used = sizeof(DbFile_Signature) + stats.treeBytes + stats.valueBytes + stats.freeBytes;
+	stats.deadBytes = (fileSize > used) ? (fileSize - used) : 0;
 	return true;
 }
 
+/*
+ The compaction copies all keys with their values into a new file (see copyTo), which has no
+ free or dead space then and each value in a single chunk. Then the new file replaces this one
+ (by rename, so the DB file is always either the old or the new one) and is used from then on.
+ Other processes which have the DB open still have the old file.
+ */
+Return DbFileBackend::compact() {
+	ScopedLock lock(mutex);
+	if(readonly) return "cannot compact a read-only DB";
+	ASSERT( __db_flush(*this) );
+	
+	std::string tmpFilename = filename + ".compact";
+	remove(tmpFilename.c_str());
+	{
+		DbFileBackend dest(tmpFilename);
+		ASSERT( __db_open(dest) );
+		__DbFileCopyCallback callback(*this, dest);
+		ASSERT( __db_iterateKeys(*this, "", callback) );
+		ASSERT( __db_flush(dest) );
+		if(fsync(dest.fd) != 0)
+			return "compact: failed to sync " + tmpFilename;
+	}
+	if(rename(tmpFilename.c_str(), filename.c_str()) != 0)
+		return "compact: failed to rename " + tmpFilename + " to " + filename;
+	return __db_open(*this);
+}
+
+Return DbFileBackend::getMeta(/*out*/ std::string& value, const std::string& key) {
+	ScopedLock lock(mutex);
+	ASSERT( __db_get(*this, "meta." + key, value) );
+	return true;
+}
+
+Return DbFileBackend::setMeta(const std::string& key, const std::string& value) {
+	ScopedLock lock(mutex);
+	ASSERT( __db_set(*this, "meta." + key, value) );
+	return __db_flush(*this);
+}
+
+// Expects that db.mutex is locked, like the __db_* functions.
+struct __DbFileKeyValue : DbKeyValueIntf {
+	DbFileBackend& db;
+	__DbFileKeyValue(DbFileBackend& _db) : db(_db) {}
+	bool get(/*out*/ std::string& value, const std::string& key) { return __db_get(db, key, value); }
+	Return set(const std::string& key, const std::string& value) { return __db_set(db, key, value); }
+};
+
+Return DbFileBackend::pushToDir(const std::string& path, const DbDirEntry& dirEntry) {
+	ScopedLock lock(mutex);
+	__DbFileKeyValue kv(*this);
+	ASSERT( dbDirIndexAdd(kv, path, dirEntry) );
+	// the old list too, for older tools, see DbDirIndex.h
+	ASSERT( __addEntryToList(*this, "fs." + path, dirEntry.serialized()) );
+	return __db_flush(*this);
+}
+
 Return DbFileBackend::getDir(/*out*/ std::list<DbDirEntry>& dirList, const std::string& path) {
+	ScopedLock lock(mutex);
+	__DbFileKeyValue kv(*this);
+	if(dbDirIndexHave(kv, path)) {
+		size_t cursor = 0;
+		return dbDirIndexList(kv, path, dirList, cursor, (size_t)-1);
+	}
+	
 	std::string key = "fs." + path;
 	std::list<std::string> entries;
 	ASSERT( __getEntryList(*this, key, entries) );
@@ -476,15 +1743,55 @@ Return DbFileBackend::getDir(/*out*/ std::list<DbDirEntry>& dirList, const std::
 	return true;
 }
 
+Return DbFileBackend::getDirEntry(/*out*/ DbDirEntry& dirEntry, /*out*/ bool& found, const std::string& path, const std::string& name) {
+	{
+		ScopedLock lock(mutex);
+		__DbFileKeyValue kv(*this);
+		if(dbDirIndexHave(kv, path))
+			return dbDirIndexLookup(kv, path, name, dirEntry, found);
+	}
+	return DbIntf::getDirEntry(dirEntry, found, path, name);
+}
+
+Return DbFileBackend::getDirPart(/*out*/ std::list<DbDirEntry>& dirList, const std::string& path, /*inout*/ size_t& cursor, size_t maxCount) {
+	{
+		ScopedLock lock(mutex);
+		__DbFileKeyValue kv(*this);
+		if(dbDirIndexHave(kv, path))
+			return dbDirIndexList(kv, path, dirList, cursor, maxCount);
+	}
+	return DbIntf::getDirPart(dirList, path, cursor, maxCount);
+}
+
 Return DbFileBackend::setFileRef(/*can be empty*/ const DbEntryId& id, const std::string& path) {
+	ScopedLock lock(mutex);
 	std::string key = "fs." + path;
 	ASSERT( __db_set(*this, key, id) );
-	return true;
+	__DbFileKeyValue kv(*this);
+	ASSERT( dbDirIndexSetRef(kv, path, id) );
+	return __db_flush(*this);
 }
 
 Return DbFileBackend::getFileRef(/*out (can be empty)*/ DbEntryId& id, const std::string& path) {
+	ScopedLock lock(mutex);
 	std::string key = "fs." + path;
 	ASSERT( __db_get(*this, key, id) );
 	return true;
 }
 
+Return DbFileBackend::setFileSize(uint64_t size, const std::string& path) {
+	ScopedLock lock(mutex);
+	ASSERT( __db_set(*this, "fssize." + path, rawString<uint64_t>(size)) );
+	return __db_flush(*this);
+}
+
+Return DbFileBackend::getFileSize(/*out*/ uint64_t& size, const std::string& path) {
+	ScopedLock lock(mutex);
+	std::string value;
+	ASSERT( __db_get(*this, "fssize." + path, value) );
+	if(value.size() != sizeof(uint64_t) || valueFromRaw<uint64_t>(&value[0]) == 0)
+		return "DB getFileSize: size unknown";
+	size = valueFromRaw<uint64_t>(&value[0]);
+	return true;
+}
+
@@ -10,27 +10,78 @@
 #include "Mutex.h"
 
 struct DbFile_TreeChunk;
+struct DbFile_BTree;
+struct DbFile_Map;
+struct DbFile_Writes;
+struct DbFile_FreeSpace;
+
+// The syscalls of a DbFileBackend, see bench-file-backend.
+struct DbFileIoStats {
+	size_t readCalls;
+	size_t writeCalls;
+	size_t writeBytes;
+	size_t flushes;
+	DbFileIoStats() : readCalls(0), writeCalls(0), writeBytes(0), flushes(0) {}
+};
+
+// Where the bytes of a DbFileBackend file are, see DbFileBackend::spaceStats.
+struct DbFileSpaceStats {
+	size_t fileSize;
+	size_t treeBytes; // the trie chunks or the B+tree pages with the root chunk
+	size_t treeLevels; // of the B+tree, 1 if the root is a leaf. 0 with the trie
+	size_t valueChunks;
+	size_t valueBytes; // the value chunks, with their unused space
+	size_t valueDataBytes; // the values in them
+	size_t freeExtents;
+	size_t freeBytes; // can be used by new value chunks
+	size_t deadBytes; // not used at all, until the next compaction
+	DbFileSpaceStats() : fileSize(0), treeBytes(0), treeLevels(0), valueChunks(0), valueBytes(0), valueDataBytes(0),
+	freeExtents(0), freeBytes(0), deadBytes(0) {}
+	std::string summary() const; // for the tools
+};
 
 struct DbFileBackend : DbIntf {
 	Mutex mutex;
-	FILE* file;
-	DbFile_TreeChunk* rootChunk;
+	int fd;
+	DbFile_Writes* writes; // not yet written, see DbFileBackend.cpp
+	DbFileIoStats ioStats;
+	DbFile_TreeChunk* rootChunk; // older DB files
+	DbFile_BTree* btree; // newer DB files, see DbFileBackend.cpp
+	DbFile_FreeSpace* freeSpace; // only with the B+tree and if not read-only
 	size_t fileSize;
 	std::string filename;
 	bool readonly;
+	bool useMmap; // in read-only mode, read via a mapping of the file, see DbFileBackend.cpp
+	DbFile_Map* map; // NULL if not mapped
 	
 	DbFileBackend(const std::string& dbfilename = "db.pngdb", bool ro = false)
-	: file(NULL), rootChunk(NULL), fileSize(0), filename(dbfilename), readonly(ro) {}
+	: fd(-1), writes(NULL), rootChunk(NULL), btree(NULL), freeSpace(NULL), fileSize(0), filename(dbfilename), readonly(ro), useMmap(true), map(NULL) {}
 	~DbFileBackend() { reset(); }
 	void reset();
 	Return setReadOnly(bool ro) { readonly = ro; return true; }
 	Return init();
 	Return push(/*out*/ DbEntryId& id, const DbEntry& entry);
 	Return get(/*out*/ DbEntry& entry, const DbEntryId& id);
+	Return pushMany(/*out*/ std::vector<DbEntryId>& ids, const std::vector<DbEntry>& entries);
+	Return getMany(/*out*/ std::vector<DbEntry>& entries, const std::vector<DbEntryId>& ids);
+	Return existMany(/*out*/ std::vector<bool>& exist, const std::vector<DbEntryId>& ids);
+	Return iterateHashRefs(DbHashRefCallbackIntf& callback);
+	bool hasTrie() const { return rootChunk != NULL; } // older DB file, see DbFileBackend.cpp
+	// Copies all keys with their values. dest is a new DB, which has the B+tree. See db-file-convert.
+	Return copyTo(DbFileBackend& dest, /*out*/ size_t& numKeys);
+	Return spaceStats(/*out*/ DbFileSpaceStats& stats);
+	// Copies everything into a new file, which then replaces this one. See db-file-compact.
+	Return compact();
+	Return getMeta(/*out*/ std::string& value, const std::string& key);
+	Return setMeta(const std::string& key, const std::string& value);
 	Return pushToDir(const std::string& path, const DbDirEntry& dirEntry);
 	Return getDir(/*out*/ std::list<DbDirEntry>& dirList, const std::string& path);
+	Return getDirEntry(/*out*/ DbDirEntry& dirEntry, /*out*/ bool& found, const std::string& path, const std::string& name);
+	Return getDirPart(/*out*/ std::list<DbDirEntry>& dirList, const std::string& path, /*inout*/ size_t& cursor, size_t maxCount);
 	Return setFileRef(/*can be empty*/ const DbEntryId& id, const std::string& path);
 	Return getFileRef(/*out (can be empty)*/ DbEntryId& id, const std::string& path);
+	Return setFileSize(uint64_t size, const std::string& path);
+	Return getFileSize(/*out*/ uint64_t& size, const std::string& path);
 };
 
 #endif
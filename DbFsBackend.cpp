@@ -5,6 +5,7 @@
 
 #include "DbFsBackend.h"
 #include "Sha1.h"
+#include "Sha256.h"
 #include "StringUtils.h"
 #include "FileUtils.h"
 #include <cassert>
@@ -24,17 +25,25 @@ static std::string __filenameForDbEntryId(const DbEntryId& id) {
 	return ret;
 }
 
-static std::string __dirnameForSha1Ref(const std::string& sha1) {
-	assert(sha1.size() == SHA1_DIGEST_SIZE);
-	
-	std::string ret = "sha1refs/";
-	for(size_t i = 0; i < sha1.size(); ++i) {
+static std::string __dirnameForHashRef(const std::string& refsDir, const std::string& hash) {
+	std::string ret = refsDir + "/";
+	for(size_t i = 0; i < hash.size(); ++i) {
 		if(i % 5 == 0 && i > 0) ret += "/";
-		ret += hexString(sha1[i]);
+		ret += hexString(hash[i]);
 	}
 	return ret;
 }
 
+static std::string __dirnameForSha1Ref(const std::string& sha1) {
+	assert(sha1.size() == SHA1_DIGEST_SIZE);
+	return __dirnameForHashRef("sha1refs", sha1);
+}
+
+static std::string __dirnameForSha256Ref(const std::string& sha256) {
+	assert(sha256.size() == SHA256_DIGEST_SIZE);
+	return __dirnameForHashRef("sha256refs", sha256);
+}
+
 static int __hexnumFromChar(char c) {
 	if(c >= '0' && c <= '9') return c - '0';
 	if(c >= 'A' && c <= 'F') return 10 + c - 'A';
@@ -42,7 +51,20 @@ static int __hexnumFromChar(char c) {
 	return -1;
 }
 
-static DbEntryId __entryIdFromSha1RefFilename(const std::string& fn) {
+// Returns "" if s is not a hex string.
+static std::string __rawFromHexString(const std::string& s) {
+	if(s.size() % 2 != 0) return "";
+	std::string raw;
+	for(size_t i = 0; i + 1 < s.size(); i += 2) {
+		int n1 = __hexnumFromChar(s[i]);
+		int n2 = __hexnumFromChar(s[i+1]);
+		if(n1 < 0 || n2 < 0) return "";
+		raw += (char)(unsigned char)(n1 * 16 + n2);
+	}
+	return raw;
+}
+
+static DbEntryId __entryIdFromRefFilename(const std::string& fn) {
 	DbEntryId id;
 	size_t i = 0;
 	for(; i + 1 < fn.size(); i += 2) {
@@ -77,46 +99,83 @@ static Return __openNewDbEntry(const std::string& baseDir, DbEntryId& id, FILE*&
 	return __openNewDbEntry(baseDir, id, f);
 }
 
+static Return __writeNewDbEntry(DbFsBackend& db, /*out*/ DbEntryId& id, const DbEntry& entry) {
+	id = "";
+	FILE* f = NULL;
+	ASSERT( __openNewDbEntry(db.baseDir, id, f) );
+	std::string compressed;
+	db.compressForPush(entry, compressed);
+	Return r = fwrite_all(f, compressed);
+	fclose(f);
+	return r;
+}
+
+static Return __createRef(const std::string& baseDir, const std::string& refdir, const DbEntryId& id) {
+	std::string reffn = baseDir + "/" + refdir + "/" + hexString(id) + ".ref";
+	ASSERT( createRecDir(reffn, false) );
+	FILE* f = fopen(reffn.c_str(), "w");
+	if(f == NULL)
+		return "DB push: cannot create ref: cannot create file '" + reffn + "'";
+	fclose(f);
+	return true;
+}
+
+// Trusted hash mode: any ref in the SHA256 ref dir is taken without reading it.
+static Return __pushTrusted(DbFsBackend& db, /*out*/ DbEntryId& id, const DbEntry& entry) {
+	if(!entry.haveSha256())
+		return "DB push: entry SHA256 not calculated";
+	
+	std::string sha256refdir = __dirnameForSha256Ref(entry.sha256);
+	if(db.mayHaveRef(entry)) {
+		for(DirIter dir(db.baseDir + "/" + sha256refdir); dir; dir.next()) {
+			DbEntryId otherId = __entryIdFromRefFilename(dir.filename);
+			if(otherId != "") {
+				id = otherId;
+				db.stats.countReuse(entry);
+				return true;
+			}
+		}
+	}
+	
+	ASSERT( __writeNewDbEntry(db, id, entry) );
+	ASSERT( __createRef(db.baseDir, sha256refdir, id) );
+	db.addRefToIndex(entry);
+	db.stats.pushNew++;
+	return true;
+}
+
 Return DbFsBackend::push(/*out*/ DbEntryId& id, const DbEntry& entry) {
+	ASSERT( updateRefGeneration() );
+	if(trustedHash)
+		return __pushTrusted(*this, id, entry);
 	if(!entry.haveSha1())
 		return "DB push: entry SHA1 not calculated";
-	if(!entry.haveCompressed())
-		return "DB push: entry compression not calculated";
 	
 	// search for existing entry
 	std::string sha1refdir = __dirnameForSha1Ref(entry.sha1);
-	for(DirIter dir(baseDir + "/" + sha1refdir); dir; dir.next()) {
-		DbEntryId otherId = __entryIdFromSha1RefFilename(dir.filename);
-		if(otherId != "") {
-			DbEntry otherEntry;
-			if(get(otherEntry, otherId)) {
-				if(entry == otherEntry) {
-					// found
-					id = otherId;
-					stats.pushReuse++;
-					return true;
+	if(mayHaveRef(entry)) {
+		for(DirIter dir(baseDir + "/" + sha1refdir); dir; dir.next()) {
+			DbEntryId otherId = __entryIdFromRefFilename(dir.filename);
+			if(otherId != "") {
+				DbEntry otherEntry;
+				if(get(otherEntry, otherId)) {
+					if(entry == otherEntry) {
+						// found
+						id = otherId;
+						stats.countReuse(entry);
+						return true;
+					}
 				}
 			}
 		}
 	}
 	
 	// write DB entry
-	id = "";
-	FILE* f = NULL;
-	ASSERT( __openNewDbEntry(baseDir, id, f) );
-	{
-		Return r = fwrite_all(f, entry.compressed);
-		fclose(f);
-		if(!r) return r;
-	}
+	ASSERT( __writeNewDbEntry(*this, id, entry) );
 	
 	// create sha1 ref
-	std::string sha1reffn = baseDir + "/" + sha1refdir + "/" + hexString(id) + ".ref";
-	ASSERT( createRecDir(sha1reffn, false) );
-	f = fopen(sha1reffn.c_str(), "w");
-	if(f == NULL)
-		return "DB push: cannot create SHA1 ref: cannot create file '" + sha1reffn + "'";
-	fclose(f);
+	ASSERT( __createRef(baseDir, sha1refdir, id) );
+	addRefToIndex(entry);
 	
 	stats.pushNew++;
 	return true;
@@ -139,3 +198,50 @@ Return DbFsBackend::get(/*out*/ DbEntry& entry, const DbEntryId& id) {
 	
 	return true;
 }
+
+// hashHex is the hash so far, from the dir names (see __dirnameForHashRef).
+static void __iterateHashRefDirs(const std::string& dirname, const std::string& hashHex, size_t hashSize, DbHashRefCallbackIntf& callback) {
+	if(hashHex.size() >= hashSize * 2) {
+		for(DirIter dir(dirname); dir; dir.next()) {
+			if(__entryIdFromRefFilename(dir.filename) != "") {
+				callback.hashRef(__rawFromHexString(hashHex));
+				break;
+			}
+		}
+		return;
+	}
+	for(DirIter dir(dirname); dir; dir.next()) {
+		if(dir.filename[0] == '.') continue;
+		if(__rawFromHexString(dir.filename) == "") continue;
+		__iterateHashRefDirs(dirname + "/" + dir.filename, hashHex + dir.filename, hashSize, callback);
+	}
+}
+
+Return DbFsBackend::iterateHashRefs(DbHashRefCallbackIntf& callback) {
+	if(trustedHash)
+		__iterateHashRefDirs(baseDir + "/sha256refs", "", SHA256_DIGEST_SIZE, callback);
+	else
+		__iterateHashRefDirs(baseDir + "/sha1refs", "", SHA1_DIGEST_SIZE, callback);
+	return true;
+}
+
+Return DbFsBackend::getMeta(/*out*/ std::string& value, const std::string& key) {
+	std::string filename = baseDir + "/meta/" + key;
+	FILE* f = fopen(filename.c_str(), "rb");
+	if(f == NULL)
+		return "Db::getMeta: cannot open file '" + filename + "'";
+	Return r = fread_all(f, value);
+	fclose(f);
+	return r;
+}
+
+Return DbFsBackend::setMeta(const std::string& key, const std::string& value) {
+	std::string filename = baseDir + "/meta/" + key;
+	ASSERT( createRecDir(filename, false) );
+	FILE* f = fopen(filename.c_str(), "wb");
+	if(f == NULL)
+		return "Db::setMeta: cannot create file '" + filename + "'";
+	Return r = fwrite_all(f, value);
+	fclose(f);
+	return r;
+}
@@ -12,9 +12,12 @@ struct DbFsBackend : DbIntf {
 	std::string baseDir;
 	
 	DbFsBackend(const std::string& d = "db") : baseDir(d) {}
-	Return init() { return true; }
+	Return init() { return initMeta(); }
 	Return push(/*out*/ DbEntryId& id, const DbEntry& entry);
 	Return get(/*out*/ DbEntry& entry, const DbEntryId& id);
+	Return iterateHashRefs(DbHashRefCallbackIntf& callback);
+	Return getMeta(/*out*/ std::string& value, const std::string& key);
+	Return setMeta(const std::string& key, const std::string& value);
 };
 
 #endif
@@ -0,0 +1,166 @@
+/* in-memory index of the hash refs of a DB
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "DbHashIndex.h"
+#include "Db.h"
+#include "StringUtils.h"
+#include "FileUtils.h"
+#include <cstdio>
+#include <algorithm>
+
+#define TableMinSize 1024
+#define BloomMinCapacity (1024*16)
+
+static const char DbHashIndex_Signature[] = {'A','Z','H','I','D','X','0','2'};
+
+uint64_t DbHashIndex::keyForHash(const std::string& hash) {
+	uint64_t key = 0;
+	for(size_t i = 0; i < 8 && i < hash.size(); ++i)
+		key = (key << 8) | (uint8_t)hash[i];
+	return key ? key : 1;
+}
+
+void DbHashIndex::clear() {
+	table = std::vector<uint64_t>(TableMinSize);
+	count = 0;
+	rebuildBloom(BloomMinCapacity);
+}
+
+// The key is the hash prefix, so its bits are already random.
+// The Bloom filter uses the lower and the upper 32 bits as its two base hashes
+// (double hashing), the table position comes from the bits above the lowest 16.
+
+void DbHashIndex::bloomInsert(uint64_t key) {
+	size_t numBits = bloom.size() * 64;
+	uint32_t h1 = (uint32_t)key, h2 = (uint32_t)(key >> 32) | 1;
+	for(short i = 0; i < BloomNumHashes; ++i) {
+		size_t bit = (h1 + i * h2) % numBits;
+		bloom[bit / 64] |= uint64_t(1) << (bit % 64);
+	}
+}
+
+void DbHashIndex::rebuildBloom(size_t capacity) {
+	bloomCapacity = capacity;
+	bloom = std::vector<uint64_t>((capacity * BloomBitsPerEntry + 63) / 64);
+	for(size_t i = 0; i < table.size(); ++i)
+		if(table[i]) bloomInsert(table[i]);
+}
+
+bool DbHashIndex::mayContain(const std::string& hash) const {
+	uint64_t key = keyForHash(hash);
+	
+	size_t numBits = bloom.size() * 64;
+	uint32_t h1 = (uint32_t)key, h2 = (uint32_t)(key >> 32) | 1;
+	for(short i = 0; i < BloomNumHashes; ++i) {
+		size_t bit = (h1 + i * h2) % numBits;
+		if(!(bloom[bit / 64] & (uint64_t(1) << (bit % 64))))
+			return false;
+	}
+	
+	size_t mask = table.size() - 1;
+	for(size_t pos = (key >> 16) & mask; table[pos]; pos = (pos + 1) & mask)
+		if(table[pos] == key) return true;
+	return false;
+}
+
+void DbHashIndex::insertKey(uint64_t key) {
+	size_t mask = table.size() - 1;
+	size_t pos = (key >> 16) & mask;
+	for(; table[pos]; pos = (pos + 1) & mask)
+		if(table[pos] == key) return;
+	table[pos] = key;
+	count++;
+	bloomInsert(key);
+}
+
+void DbHashIndex::add(const std::string& hash) {
+	if((count + 1) * 4 > table.size() * 3) {
+		std::vector<uint64_t> oldTable(table.size() * 2);
+		oldTable.swap(table);
+		count = 0;
+		for(size_t i = 0; i < oldTable.size(); ++i)
+			if(oldTable[i]) insertKey(oldTable[i]);
+	}
+	// insertKey also inserts into the Bloom filter, so only rebuild it when it becomes too full
+	if(count + 1 > bloomCapacity)
+		rebuildBloom(bloomCapacity * 2);
+	insertKey(keyForHash(hash));
+}
+
+size_t DbHashIndex::memoryUsage() const {
+	return table.size() * sizeof(table[0]) + bloom.size() * sizeof(bloom[0]);
+}
+
+struct DbHashIndexBuilder : DbHashRefCallbackIntf {
+	DbHashIndex& index;
+	DbHashIndexBuilder(DbHashIndex& i) : index(i) {}
+	void hashRef(const std::string& hash) { index.add(hash); }
+};
+
+Return DbHashIndex::build(DbIntf& db) {
+	clear();
+	DbHashIndexBuilder builder(*this);
+	ASSERT( db.iterateHashRefs(builder) );
+	return true;
+}
+
+/*
+ snapshot file format:
+ signature, uint8 hash type (1: SHA1, 2: SHA256), uint64 ref generation (DbIntf::refGeneration),
+ uint64 count, count * uint64 keys
+ */
+
+Return DbHashIndex::load(const std::string& filename, const DbIntf& db) {
+	FILE* f = fopen(filename.c_str(), "rb");
+	if(f == NULL)
+		return "cannot open hash index snapshot " + filename;
+	
+	std::string data;
+	Return r = fread_all(f, data);
+	fclose(f);
+	if(!r) return r;
+	
+	size_t headerSize = sizeof(DbHashIndex_Signature) + 1 + 8 + 8;
+	if(data.size() < headerSize || data.compare(0, sizeof(DbHashIndex_Signature), DbHashIndex_Signature, sizeof(DbHashIndex_Signature)) != 0)
+		return "hash index snapshot: signature wrong";
+	if(data[sizeof(DbHashIndex_Signature)] != (db.trustedHash ? 2 : 1))
+		return "hash index snapshot: hash type does not match the DB";
+	if(valueFromRaw<uint64_t>(&data[sizeof(DbHashIndex_Signature) + 1]) != db.refGeneration)
+		return "hash index snapshot: the DB was pushed to after it was saved";
+	uint64_t n = valueFromRaw<uint64_t>(&data[sizeof(DbHashIndex_Signature) + 1 + 8]);
+	if(data.size() != headerSize + n * 8)
+		return "hash index snapshot: size inconsistent";
+	
+	size_t tableSize = TableMinSize;
+	while(n * 4 > tableSize * 3) tableSize *= 2;
+	table = std::vector<uint64_t>(tableSize);
+	count = 0;
+	rebuildBloom(std::max(size_t(n), size_t(BloomMinCapacity)));
+	for(size_t i = 0; i < n; ++i)
+		insertKey(valueFromRaw<uint64_t>(&data[headerSize + i * 8]));
+	return true;
+}
+
+Return DbHashIndex::save(const std::string& filename, const DbIntf& db) const {
+	std::string data(DbHashIndex_Signature, sizeof(DbHashIndex_Signature));
+	data += rawString<uint8_t>(db.trustedHash ? 2 : 1);
+	data += rawString<uint64_t>(db.refGeneration);
+	data += rawString<uint64_t>(count);
+	data.reserve(data.size() + count * 8);
+	for(size_t i = 0; i < table.size(); ++i)
+		if(table[i]) data += rawString<uint64_t>(table[i]);
+	
+	// write to a temp file first, so that we never leave a broken snapshot behind
+	std::string tmpFilename = filename + ".tmp";
+	FILE* f = fopen(tmpFilename.c_str(), "wb");
+	if(f == NULL)
+		return "cannot create hash index snapshot " + tmpFilename;
+	Return r = fwrite_all(f, data);
+	fclose(f);
+	if(!r) return r;
+	if(rename(tmpFilename.c_str(), filename.c_str()) != 0)
+		return "cannot rename hash index snapshot to " + filename;
+	return true;
+}
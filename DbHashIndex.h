@@ -0,0 +1,68 @@
+/* in-memory index of the hash refs of a DB
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#ifndef __AZ__DBHASHINDEX_H__
+#define __AZ__DBHASHINDEX_H__
+
+#include "Return.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct DbIntf;
+
+/*
+ This answers the question "could the DB have a ref for this hash?" without any I/O.
+ Most pushed blocks are either already known (then we must ask the DB anyway to get the id)
+ or completely new. For the new ones, the index saves the ref lookup in the backend.
+
+ - a Bloom filter (BloomBitsPerEntry bits per entry): very small, answers most misses
+ - a hash table of the first 64 bits of each hash (open addressing): exact up to the
+   64 bit prefix, so practically no false positives remain
+
+ The hashes are SHA1/SHA256 output, i.e. already uniformly distributed, so we use
+ their bits directly for the table position and the Bloom filter bits.
+
+ Memory per 1M entries: Bloom filter 1.25MB, table 8 bytes per slot at a load of
+ at most 75%, i.e. 16MB (2^21 slots). So about 17MB per 1M blocks.
+
+ The index must see all pushes to the DB. That is given if it is built from the DB
+ (or loaded from a snapshot saved after the last push) and only this process pushes.
+ Otherwise it would wrongly tell that a hash is new and the entry would be stored again.
+ A snapshot is made for the hash ref generation of the DB (DbIntf::refGeneration), which
+ changes with each process which pushes, so a snapshot from before another push is not loaded.
+ Like the backends push(), it is not thread-safe.
+ */
+
+#define BloomBitsPerEntry 10
+#define BloomNumHashes 7
+
+struct DbHashIndex {
+	std::vector<uint64_t> table; // 0 means empty
+	size_t count;
+	std::vector<uint64_t> bloom;
+	size_t bloomCapacity; // number of entries the Bloom filter was sized for
+	
+	DbHashIndex() : count(0), bloomCapacity(0) { clear(); }
+	void clear();
+	bool mayContain(const std::string& hash) const;
+	void add(const std::string& hash);
+	size_t memoryUsage() const;
+	
+	// Reads all hash refs from the DB (of its current hash mode).
+	Return build(DbIntf& db);
+	// Snapshot of the table. The Bloom filter is rebuilt from it on load.
+	// load fails if the snapshot is not for the current hash mode and ref generation of the DB.
+	Return load(const std::string& filename, const DbIntf& db);
+	Return save(const std::string& filename, const DbIntf& db) const;
+	
+	// internal
+	static uint64_t keyForHash(const std::string& hash);
+	void insertKey(uint64_t key);
+	void bloomInsert(uint64_t key);
+	void rebuildBloom(size_t capacity);
+};
+
+#endif
@@ -4,9 +4,11 @@
  */
 
 #include "DbKyotoBackend.h"
+#include "DbDirIndex.h"
 #include "StringUtils.h"
 #include "Utils.h"
 #include <cstdio>
+#include <cstring>
 
 #include <iostream>
 using namespace std;
@@ -19,7 +21,7 @@ DbKyotoBackend::~DbKyotoBackend() {
 Return DbKyotoBackend::init() {
 	if(!db.open(filename, readonly ? PolyDB::OREADER : (PolyDB::OWRITER | PolyDB::OCREATE)))
 		return std::string() + "failed to open KyotoCabinet DB: " + db.error().name();
-	return true;
+	return initMeta();
 }
 
 typedef PolyDB KyotoDB;
@@ -32,11 +34,7 @@ static Return __addEntryToList(KyotoDB& db, const std::string& key, const std::s
 	return true;
 }
 
-static Return __getEntryList(KyotoDB& db, const std::string& key, std::list<std::string>& entries) {
-	std::string value;
-	if(!db.get(key, &value))
-		return std::string() + "error getting entry list: " + db.error().name();
-	
+static Return __parseEntryList(const std::string& value, std::list<std::string>& entries) {
 	size_t i = 0;
 	while(i < value.size()) {
 		uint8_t size = value[i];
@@ -50,6 +48,13 @@ static Return __getEntryList(KyotoDB& db, const std::string& key, std::list<std:
 	return true;
 }
 
+static Return __getEntryList(KyotoDB& db, const std::string& key, std::list<std::string>& entries) {
+	std::string value;
+	if(!db.get(key, &value))
+		return std::string() + "error getting entry list: " + db.error().name();
+	return __parseEntryList(value, entries);
+}
+
 static Return __saveNewDbEntry(KyotoDB& db, DbEntryId& id, const std::string& content) {
 	unsigned short triesNum = (id.size() <= 4) ? (2 << id.size()) : 64;
 	for(unsigned short i = 0; i < triesNum; ++i) {
@@ -66,16 +71,82 @@ static Return __saveNewDbEntry(KyotoDB& db, DbEntryId& id, const std::string& co
 	return __saveNewDbEntry(db, id, content);
 }
 
+// Trusted hash mode: the SHA256 ref is just the id and a hit needs no further read.
+static Return __pushTrusted(DbKyotoBackend& db, /*out*/ DbEntryId& id, const DbEntry& entry) {
+	if(!entry.haveSha256())
+		return "DB push: entry SHA256 not calculated";
+	
+	std::string sha256refkey = "sha256ref." + entry.sha256;
+	if(db.mayHaveRef(entry) && db.db.get(sha256refkey, &id) && !id.empty()) {
+		db.stats.countReuse(entry);
+		return true;
+	}
+	
+	std::string compressed;
+	db.compressForPush(entry, compressed);
+	id = "";
+	ASSERT( __saveNewDbEntry(db.db, id, compressed) );
+	if(!db.db.set(sha256refkey, id))
+		return std::string() + "DB push: error setting SHA256 ref: " + db.db.error().name();
+	db.addRefToIndex(entry);
+	
+	db.stats.pushNew++;
+	return true;
+}
+
+static Return __pushManyTrusted(DbKyotoBackend& db, /*out*/ std::vector<DbEntryId>& ids, const std::vector<DbEntry>& entries) {
+	for(size_t i = 0; i < entries.size(); ++i) {
+		if(!entries[i].haveSha256())
+			return "DB push: entry SHA256 not calculated";
+	}
+	
+	std::vector<std::string> sha256refkeys(entries.size());
+	std::vector<std::string> lookupKeys;
+	for(size_t i = 0; i < entries.size(); ++i) {
+		sha256refkeys[i] = "sha256ref." + entries[i].sha256;
+		if(db.mayHaveRef(entries[i])) lookupKeys.push_back(sha256refkeys[i]);
+	}
+	std::map<std::string, std::string> sha256refs;
+	if(db.db.get_bulk(lookupKeys, &sha256refs, /*atomic*/false) < 0)
+		return std::string() + "DB push: error getting SHA256 refs: " + db.db.error().name();
+	
+	std::vector<DbEntryId> refIds(entries.size());
+	for(size_t i = 0; i < entries.size(); ++i) {
+		std::map<std::string, std::string>::iterator r = sha256refs.find(sha256refkeys[i]);
+		if(r != sha256refs.end()) refIds[i] = r->second;
+	}
+	
+	DbPushBatch batch(ids, entries);
+	batch.resolveTrusted(refIds, db.stats);
+	std::vector<std::string> compressed;
+	db.compressForPushMany(entries, batch.newEntries, compressed);
+	
+	std::map<std::string, std::string> newSha256refs;
+	for(size_t j = 0; j < batch.newEntries.size(); ++j) {
+		size_t i = batch.newEntries[j];
+		ASSERT( __saveNewDbEntry(db.db, ids[i], compressed[i]) );
+		newSha256refs[sha256refkeys[i]] = ids[i];
+		db.addRefToIndex(entries[i]);
+	}
+	
+	if(db.db.set_bulk(newSha256refs, /*atomic*/false) < 0)
+		return std::string() + "DB push: error setting SHA256 refs: " + db.db.error().name();
+	
+	batch.finish();
+	return true;
+}
+
 Return DbKyotoBackend::push(/*out*/ DbEntryId& id, const DbEntry& entry) {
+	ASSERT( updateRefGeneration() );
+	if(trustedHash)
+		return __pushTrusted(*this, id, entry);
 	if(!entry.haveSha1())
 		return "DB push: entry SHA1 not calculated";
-	if(!entry.haveCompressed())
-		return "DB push: entry compression not calculated";
 	
 	// search for existing entry
 	std::string sha1refkey = "sha1ref." + entry.sha1;
 	std::list<std::string> sha1refs;
-	if(__getEntryList(db, sha1refkey, sha1refs))
+	if(mayHaveRef(entry) && __getEntryList(db, sha1refkey, sha1refs))
 		for(std::list<std::string>::iterator i = sha1refs.begin(); i != sha1refs.end(); ++i) {
 			DbEntryId otherId = *i;
 			DbEntry otherEntry;
@@ -83,18 +154,21 @@ Return DbKyotoBackend::push(/*out*/ DbEntryId& id, const DbEntry& entry) {
 				if(entry == otherEntry) {
 					// found
 					id = otherId;
-					stats.pushReuse++;
+					stats.countReuse(entry);
 					return true;
 				}
 			}
 		}
 
 	// write DB entry
+	std::string compressed;
+	compressForPush(entry, compressed);
 	id = "";
-	ASSERT( __saveNewDbEntry(db, id, entry.compressed) );
+	ASSERT( __saveNewDbEntry(db, id, compressed) );
 	
 	// create sha1 ref
 	ASSERT( __addEntryToList(db, sha1refkey, id) );
+	addRefToIndex(entry);
 	
 	stats.pushNew++;
 	return true;
@@ -111,14 +185,167 @@ Return DbKyotoBackend::get(/*out*/ DbEntry& entry, const DbEntryId& id) {
 	return true;
 }
 
-Return DbKyotoBackend::pushToDir(const std::string& path, const DbDirEntry& dirEntry) {
-	std::string key = "fs." + path;
-	std::string dirEntryRaw = dirEntry.serialized();
-	ASSERT( __addEntryToList(db, key, dirEntryRaw) );
+// Fetches all the given data entries which exist.
+static Return __getDataBulk(KyotoDB& db, const std::vector<DbEntryId>& ids, /*out*/ std::map<std::string, std::string>& recs) {
+	std::vector<std::string> keys(ids.size());
+	for(size_t i = 0; i < ids.size(); ++i)
+		keys[i] = "data." + ids[i];
+	if(db.get_bulk(keys, &recs, /*atomic*/false) < 0)
+		return std::string() + "DB get: error getting entries: " + db.error().name();
 	return true;
 }
 
+Return DbKyotoBackend::pushMany(/*out*/ std::vector<DbEntryId>& ids, const std::vector<DbEntry>& entries) {
+	ASSERT( updateRefGeneration() );
+	if(trustedHash)
+		return __pushManyTrusted(*this, ids, entries);
+	for(size_t i = 0; i < entries.size(); ++i) {
+		if(!entries[i].haveSha1())
+			return "DB push: entry SHA1 not calculated";
+	}
+	
+	// search for existing entries
+	std::vector<std::string> sha1refkeys(entries.size());
+	std::vector<std::string> lookupKeys;
+	std::vector<bool> lookedUp(entries.size());
+	for(size_t i = 0; i < entries.size(); ++i) {
+		sha1refkeys[i] = "sha1ref." + entries[i].sha1;
+		lookedUp[i] = mayHaveRef(entries[i]);
+		if(lookedUp[i]) lookupKeys.push_back(sha1refkeys[i]);
+	}
+	std::map<std::string, std::string> sha1refs;
+	if(db.get_bulk(lookupKeys, &sha1refs, /*atomic*/false) < 0)
+		return std::string() + "DB push: error getting SHA1 refs: " + db.error().name();
+	
+	std::vector< std::list<DbEntryId> > refs(entries.size());
+	std::vector<DbEntryId> candidateIds;
+	for(size_t i = 0; i < entries.size(); ++i) {
+		std::map<std::string, std::string>::iterator r = sha1refs.find(sha1refkeys[i]);
+		if(r == sha1refs.end()) continue;
+		ASSERT( __parseEntryList(r->second, refs[i]) );
+		candidateIds.insert(candidateIds.end(), refs[i].begin(), refs[i].end());
+	}
+	
+	std::map<std::string, std::string> candidateRecs;
+	ASSERT( __getDataBulk(db, candidateIds, candidateRecs) );
+	std::map<DbEntryId, DbEntry> candidates;
+	for(std::map<std::string, std::string>::iterator r = candidateRecs.begin(); r != candidateRecs.end(); ++r) {
+		DbEntry otherEntry;
+		otherEntry.compressed = r->second;
+		if(!otherEntry.uncompress()) continue;
+		otherEntry.calcSha1();
+		candidates[r->first.substr(strlen("data."))] = otherEntry;
+	}
+	
+	DbPushBatch batch(ids, entries);
+	batch.resolve(refs, candidates, stats);
+	std::vector<std::string> compressed;
+	compressForPushMany(entries, batch.newEntries, compressed);
+	
+	// write DB entries
+	std::map<std::string, std::string> changedSha1refs;
+	for(size_t j = 0; j < batch.newEntries.size(); ++j) {
+		size_t i = batch.newEntries[j];
+		ASSERT( __saveNewDbEntry(db, ids[i], compressed[i]) );
+		
+		addRefToIndex(entries[i]);
+		if(!lookedUp[i]) {
+			// we don't know the old list, so don't overwrite it
+			ASSERT( __addEntryToList(db, sha1refkeys[i], ids[i]) );
+			continue;
+		}
+		std::string& refList = sha1refs[sha1refkeys[i]]; // empty if it did not exist
+		refList += rawString<uint8_t>(ids[i].size()) + ids[i];
+		changedSha1refs[sha1refkeys[i]] = refList;
+	}
+	
+	// create sha1 refs
+	if(db.set_bulk(changedSha1refs, /*atomic*/false) < 0)
+		return std::string() + "DB push: error setting SHA1 refs: " + db.error().name();
+	
+	batch.finish();
+	return true;
+}
+
+Return DbKyotoBackend::getMany(/*out*/ std::vector<DbEntry>& entries, const std::vector<DbEntryId>& ids) {
+	std::map<std::string, std::string> recs;
+	ASSERT( __getDataBulk(db, ids, recs) );
+	
+	entries = std::vector<DbEntry>(ids.size());
+	for(size_t i = 0; i < ids.size(); ++i) {
+		std::map<std::string, std::string>::iterator r = recs.find("data." + ids[i]);
+		if(r == recs.end())
+			return "DB get: entry not found";
+		entries[i].compressed = r->second;
+		ASSERT( entries[i].uncompress() );
+		entries[i].calcSha1();
+	}
+	
+	return true;
+}
+
+Return DbKyotoBackend::existMany(/*out*/ std::vector<bool>& exist, const std::vector<DbEntryId>& ids) {
+	exist = std::vector<bool>(ids.size());
+	for(size_t i = 0; i < ids.size(); ++i) {
+		// we only want the value size, so don't let it copy anything
+		std::string key = "data." + ids[i];
+		char dummy;
+		exist[i] = db.get(&key[0], key.size(), &dummy, 0) >= 0;
+	}
+	return true;
+}
+
+Return DbKyotoBackend::iterateHashRefs(DbHashRefCallbackIntf& callback) {
+	std::string prefix = trustedHash ? "sha256ref." : "sha1ref.";
+	// The default DB is a hash DB, i.e. unordered, so we must go through all keys.
+	PolyDB::Cursor* cur = db.cursor();
+	cur->jump();
+	std::string key;
+	while(cur->get_key(&key, /*step*/true)) {
+		if(key.compare(0, prefix.size(), prefix) == 0)
+			callback.hashRef(key.substr(prefix.size()));
+	}
+	delete cur;
+	return true;
+}
+
+Return DbKyotoBackend::getMeta(/*out*/ std::string& value, const std::string& key) {
+	if(!db.get("meta." + key, &value))
+		return std::string() + "DB getMeta: error getting entry: " + db.error().name();
+	return true;
+}
+
+Return DbKyotoBackend::setMeta(const std::string& key, const std::string& value) {
+	if(!db.set("meta." + key, value))
+		return std::string() + "DB setMeta: error setting entry: " + db.error().name();
+	return true;
+}
+
+struct __KyotoKeyValue : DbKeyValueIntf {
+	KyotoDB& db;
+	__KyotoKeyValue(KyotoDB& _db) : db(_db) {}
+	bool get(/*out*/ std::string& value, const std::string& key) { return db.get(key, &value); }
+	Return set(const std::string& key, const std::string& value) {
+		if(!db.set(key, value))
+			return std::string() + "DB dir index: error setting entry: " + db.error().name();
+		return true;
+	}
+};
+
+Return DbKyotoBackend::pushToDir(const std::string& path, const DbDirEntry& dirEntry) {
+	__KyotoKeyValue kv(db);
+	ASSERT( dbDirIndexAdd(kv, path, dirEntry) );
+	// the old list too, for older tools, see DbDirIndex.h
+	return __addEntryToList(db, "fs." + path, dirEntry.serialized());
+}
+
 Return DbKyotoBackend::getDir(/*out*/ std::list<DbDirEntry>& dirList, const std::string& path) {
+	__KyotoKeyValue kv(db);
+	if(dbDirIndexHave(kv, path)) {
+		size_t cursor = 0;
+		return dbDirIndexList(kv, path, dirList, cursor, (size_t)-1);
+	}
+	
 	std::string key = "fs." + path;
 	std::list<std::string> entries;
 	ASSERT( __getEntryList(db, key, entries) );
@@ -128,10 +355,26 @@ Return DbKyotoBackend::getDir(/*out*/ std::list<DbDirEntry>& dirList, const std:
 	return true;
 }
 
+Return DbKyotoBackend::getDirEntry(/*out*/ DbDirEntry& dirEntry, /*out*/ bool& found, const std::string& path, const std::string& name) {
+	__KyotoKeyValue kv(db);
+	if(!dbDirIndexHave(kv, path))
+		return DbIntf::getDirEntry(dirEntry, found, path, name);
+	return dbDirIndexLookup(kv, path, name, dirEntry, found);
+}
+
+Return DbKyotoBackend::getDirPart(/*out*/ std::list<DbDirEntry>& dirList, const std::string& path, /*inout*/ size_t& cursor, size_t maxCount) {
+	__KyotoKeyValue kv(db);
+	if(!dbDirIndexHave(kv, path))
+		return DbIntf::getDirPart(dirList, path, cursor, maxCount);
+	return dbDirIndexList(kv, path, dirList, cursor, maxCount);
+}
+
 Return DbKyotoBackend::setFileRef(/*can be empty*/ const DbEntryId& id, const std::string& path) {
 	std::string key = "fs." + path;
 	if(!db.set(key, id))
 		return std::string() + "DB setFileRef: error setting entry: " + db.error().name();
+	__KyotoKeyValue kv(db);
+	ASSERT( dbDirIndexSetRef(kv, path, id) );
 	return true;
 }
 
@@ -142,3 +385,19 @@ Return DbKyotoBackend::getFileRef(/*out (can be empty)*/ DbEntryId& id, const st
 	return true;
 }
 
+Return DbKyotoBackend::setFileSize(uint64_t size, const std::string& path) {
+	if(!db.set("fssize." + path, rawString<uint64_t>(size)))
+		return std::string() + "DB setFileSize: error setting entry: " + db.error().name();
+	return true;
+}
+
+Return DbKyotoBackend::getFileSize(/*out*/ uint64_t& size, const std::string& path) {
+	std::string value;
+	if(!db.get("fssize." + path, &value))
+		return std::string() + "DB getFileSize: error getting entry: " + db.error().name();
+	if(value.size() != sizeof(uint64_t) || valueFromRaw<uint64_t>(&value[0]) == 0)
+		return "DB getFileSize: size unknown";
+	size = valueFromRaw<uint64_t>(&value[0]);
+	return true;
+}
+
@@ -7,87 +7,237 @@
 #include "DbPng.h"
 #include "StringUtils.h"
 #include "Sha1.h"
+#include "Mutex.h"
 #include <vector>
+#include <algorithm>
 #include <iostream>
 using namespace std;
 
 #define PngBlockSize 64
 
-Return DbPngEntryWriter::next() {
+#ifndef PngFetchCountDefault
+#define PngFetchCountDefault 8
+#endif
+
+// Block width in bytes. It is a power of two number of pixels, so the blocks
+// are on the same pixel grid as most screen content.
+// Bit depths < 8 count as 1 byte per pixel, like the PNG filters do it.
+static size_t __blockWidth(PngHeader& header) {
+	size_t bpp = header.bytesPerPixel();
+	if(bpp == 0) return PngBlockSize;
+	size_t pixels = 1;
+	while(pixels * 2 * bpp <= PngBlockSize) pixels *= 2;
+	return pixels * bpp;
+}
+
+// The scanlines of the block row like they are in the PNG (i.e. filtered), independently deflated.
+static Return __sliceBand(DbPngEntrySlicer& slicer, size_t blockHeight) {
+	PngScanlineBuffer& scanlines = slicer.reader.scanlines;
+	size_t size = 0;
+	for(size_t i = 0; i < blockHeight; ++i)
+		size += scanlines.rowSize(i);
+	PngDeflatedBand band;
+	if(slicer.reader.unfilter) {
+		std::string rows(scanlines.front(), size);
+		slicer.bandRefilter.header = slicer.reader.header;
+		for(size_t i = 0, offset = 0; i < blockHeight; offset += scanlines.rowSize(i), ++i)
+			ASSERT( slicer.bandRefilter.filter(&rows[offset], scanlines.rowSize(i)) );
+		ASSERT( slicer.bandDeflater.deflate(rows.data(), size, band) );
+	}
+	else
+		ASSERT( slicer.bandDeflater.deflate(scanlines.front(), size, band) );
+	
+	slicer.entries.push_back(DbEntry());
+	std::string& data = slicer.entries.back().data;
+	data.reserve(1 + 2 * sizeof(uint32_t) + band.data.size());
+	data += (char)DbEntryType_PngBand;
+	data += rawString<uint32_t>(band.adler);
+	data += rawString<uint32_t>(band.size);
+	data += band.data;
+	return true;
+}
+
+Return DbPngEntrySlicer::next() {
 	ASSERT( reader.read() );
 
-	while(true) {
-		bool isFinal = false;
-		if(reader.chunks.size() > 0) {
-			DbEntry entry;
-			entry.data += (char)DbEntryType_PngChunk;
-			entry.data += reader.chunks.front().type;
-			entry.data += reader.chunks.front().data;
-			reader.chunks.pop_front();
-			entry.prepare();
-			
-			DbEntryId id;
-			ASSERT( db->push(id, entry) );
-			contentChunkEntries.push_back(id);
+	while(reader.chunks.size() > 0) {
+		DbEntry entry;
+		entry.data += (char)DbEntryType_PngChunk;
+		entry.data += reader.chunks.front().type;
+		entry.data += reader.chunks.front().data;
+		reader.chunks.pop_front();
+		entries.push_back(entry);
+	}
+	
+	PngScanlineBuffer& scanlines = reader.scanlines;
+	while(scanlines.size() > 0 &&
+		  (scanlines.size() >= PngBlockSize || reader.hasFinishedReading)) {
+		size_t scanlineWidth = scanlines.rowSize(0);
+		uint8_t blockHeight = 0;
+		while(blockHeight < PngBlockSize && blockHeight < scanlines.size() &&
+			  scanlines.rowSize(blockHeight) == scanlineWidth)
+			++blockHeight;
+		
+		entries.push_back(DbEntry());
+		entries.back().data += (char)DbPngEntryType_BlockRow;
+		entries.back().data += rawString<uint8_t>( blockHeight );
+		if(bands)
+			ASSERT( __sliceBand(*this, blockHeight) );
+		
+		// the rows of the block directly follow each other in the buffer.
+		// the position of the block is only in the content list, so equal blocks share one entry.
+		// the first column are the filter type bytes, so the other blocks are aligned to the pixels
+		const char* rows = scanlines.front();
+		size_t blockWidth = __blockWidth(reader.header);
+		for(size_t x = 0; x < scanlineWidth; ) {
+			size_t w = (x == 0) ? 1 : std::min(blockWidth, scanlineWidth - x);
+			entries.push_back(DbEntry());
+			std::string& data = entries.back().data;
+			data.reserve(1 + blockHeight * w);
+			data += (char)DbEntryType_PngBlock;
+			for(size_t i = 0; i < blockHeight; ++i)
+				data.append(rows + i * scanlineWidth + x, w);
+			x += w;
+		}
+		
+		scanlines.popFront(blockHeight);
+	}
+	
+	return true;
+}
+
+Return dbPngGetUnfilter(DbIntf& db, bool& unfilter) {
+	std::string mode;
+	unfilter = false;
+	// no meta key (or no meta support at all) means the default, filtered storage
+	if(!db.getMeta(mode, "pngfilter")) return true;
+	if(mode == "unfiltered") unfilter = true;
+	else if(mode != "filtered") return "DB: unknown PNG filter mode '" + mode + "'";
+	return true;
+}
+
+Return dbPngSetUnfilter(DbIntf& db) {
+	return db.setMeta("pngfilter", "unfiltered");
+}
+
+Return dbPngGetDeflatedBands(DbIntf& db, bool& bands) {
+	std::string mode;
+	bands = false;
+	if(!db.getMeta(mode, "pngbands")) return true;
+	if(mode == "deflated") bands = true;
+	else if(mode != "none") return "DB: unknown PNG bands mode '" + mode + "'";
+	return true;
+}
+
+Return dbPngSetDeflatedBands(DbIntf& db) {
+	return db.setMeta("pngbands", "deflated");
+}
+
+Return DbPngEntryWriter::pushEntries(std::list<DbEntry>& entries) {
+	// swap the data over instead of copying it. the block row markers are not pushed
+	std::vector<DbEntry> batch;
+	batch.reserve(entries.size());
+	for(std::list<DbEntry>::iterator e = entries.begin(); e != entries.end(); ++e) {
+		if(e->data[0] == DbPngEntryType_BlockRow) continue;
+		batch.push_back(DbEntry());
+		batch.back().swap(*e);
+	}
+	
+	std::vector<DbEntryId> ids;
+	ASSERT( db->pushMany(ids, batch) );
+	size_t i = 0;
+	for(std::list<DbEntry>::iterator e = entries.begin(); e != entries.end(); ++e) {
+		if(!e->data.empty() && e->data[0] == DbPngEntryType_BlockRow) {
+			contentDataEntries.push_back(DbEntryId());
+			contentRowHeights.push_back(valueFromRaw<uint8_t>(&e->data[1]));
 			continue;
 		}
-		else if(reader.scanlines.size() > 0) {
-			if(reader.scanlines.size() >= PngBlockSize || reader.hasFinishedReading) {
-				size_t scanlineWidth = reader.scanlines.front().size();
-				uint8_t blockHeight = 0;
-				for(std::list<std::string>::iterator it = reader.scanlines.begin();
-					it != reader.scanlines.end() && blockHeight < PngBlockSize;
-					++it) {
-					if(it->size() != scanlineWidth) break;
-					++blockHeight;
-				}
-				
-				for(size_t x = 0; x < scanlineWidth; x += PngBlockSize) {
-					DbEntry entry;
-					entry.data += (char)DbEntryType_PngBlock;
-					entry.data += rawString<uint16_t>( x / PngBlockSize );
-					if(x == 0) entry.data += rawString<uint8_t>( blockHeight );
-					size_t i = 0;
-					for(std::list<std::string>::iterator it = reader.scanlines.begin(); i < blockHeight; ++it, ++i)
-						entry.data += it->substr(x, PngBlockSize);
-					entry.prepare();
-					
-					DbEntryId id;
-					ASSERT( db->push(id, entry) );
-					contentDataEntries.push_back(id);
-				}
-				
-				for(size_t i = 0; i < blockHeight; ++i)
-					reader.scanlines.pop_front();
-				continue;				
-			}
-			else
-				break;
+		const std::string& data = batch[i].data;
+		if(data[0] == DbEntryType_PngChunk) {
+			contentChunkEntries.push_back(ids[i]);
+			contentChunksSize += 12 + data.size() - 5; // len, type, data, CRC
 		}
-		else if(reader.hasFinishedReading) {
-			DbEntry entry;
-			entry.data += (char)DbEntryType_PngContentList;
-			for(std::list<DbEntryId>::iterator i = contentChunkEntries.begin(); i != contentChunkEntries.end(); ++i) {
-				if(i->size() > 255)
-					return "we have an ID with len > 255";
-				entry.data += rawString<uint8_t>(i->size());
-				entry.data += *i;
-			}
-			for(std::list<DbEntryId>::iterator i = contentDataEntries.begin(); i != contentDataEntries.end(); ++i) {
-				if(i->size() > 255)
+		else if(data[0] == DbEntryType_PngBand) {
+			contentRowBands.push_back(ids[i]);
+			contentRowBandSizes.push_back(data.size() - 1 - 2 * sizeof(uint32_t));
+			contentAdler = adler32_combine(contentAdler, valueFromRaw<uint32_t>(&data[1]),
+										   valueFromRaw<uint32_t>(&data[1 + sizeof(uint32_t)]));
+		}
+		else
+			contentDataEntries.push_back(ids[i]);
+		++i;
+	}
+	entries.clear();
+	return true;
+}
+
+Return DbPngEntryWriter::pushContentList() {
+	DbEntry entry;
+	entry.data += (char)DbEntryType_PngContentListVersioned;
+	if(slicer.bands) {
+		entry.data += rawString<uint8_t>(4);
+		entry.data += rawString<uint8_t>(DbPngContentFlag_Bands | DbPngContentFlag_Index |
+										 (slicer.reader.unfilter ? DbPngContentFlag_Unfiltered : 0));
+		// PngWriter writes the chunks, the IDAT chunks of the bands and IEND
+		uint64_t bandsSize = 0;
+		for(std::list<uint32_t>::iterator i = contentRowBandSizes.begin(); i != contentRowBandSizes.end(); ++i)
+			bandsSize += *i;
+		uint64_t streamSize = contentRowBands.empty() ? 0 : png_deflated_bands_stream_size(bandsSize);
+		contentOutputSize = contentChunksSize + png_idat_chunks_size(streamSize) + 12;
+		entry.data += rawString<uint64_t>(contentOutputSize);
+		entry.data += rawString<uint32_t>(contentChunksSize);
+		entry.data += rawString<uint32_t>(contentAdler);
+	}
+	else
+		entry.data += rawString<uint8_t>(slicer.reader.unfilter ? 3 : 2);
+	for(std::list<DbEntryId>::iterator i = contentChunkEntries.begin(); i != contentChunkEntries.end(); ++i) {
+		if(i->size() > 255)
+			return "we have an ID with len > 255";
+		entry.data += rawString<uint8_t>(i->size());
+		entry.data += *i;
+	}
+	std::list<uint8_t>::iterator rowHeight = contentRowHeights.begin();
+	std::list<DbEntryId>::iterator rowBand = contentRowBands.begin();
+	std::list<uint32_t>::iterator rowBandSize = contentRowBandSizes.begin();
+	for(std::list<DbEntryId>::iterator i = contentDataEntries.begin(); i != contentDataEntries.end(); ++i) {
+		if(i->empty()) {
+			// block row marker
+			entry.data += rawString<uint8_t>(0);
+			entry.data += rawString<uint8_t>(*rowHeight);
+			++rowHeight;
+			if(slicer.bands) {
+				if(rowBand == contentRowBands.end())
+					return "block row without band";
+				if(rowBand->size() > 255)
 					return "we have an ID with len > 255";
-				entry.data += rawString<uint8_t>(i->size());
-				entry.data += *i;
+				entry.data += rawString<uint8_t>(rowBand->size());
+				entry.data += *rowBand;
+				entry.data += rawString<uint32_t>(*rowBandSize);
+				++rowBand;
+				++rowBandSize;
 			}
-			entry.prepare();
-			DbEntryId id;
-			ASSERT( db->push(id, entry) );
-			contentId = id;
-			break;
+			continue;
 		}
-		
-		break;
+		if(i->size() > 255)
+			return "we have an ID with len > 255";
+		entry.data += rawString<uint8_t>(i->size());
+		entry.data += *i;
 	}
+	entry.prepare(db->trustedHash);
+	DbEntryId id;
+	ASSERT( db->push(id, entry) );
+	contentId = id;
+	return true;
+}
+
+Return DbPngEntryWriter::next() {
+	ASSERT( slicer.next() );
+	
+	prepareEntries(slicer.entries, db->trustedHash);
+	ASSERT( pushEntries(slicer.entries) );
+	
+	if(slicer.reader.hasFinishedReading)
+		ASSERT( pushContentList() );
 	
 	return true;
 }
@@ -122,24 +272,36 @@ static Return __finishBlock(DbPngEntryReader& png) {
 	return true;
 }
 
+static Return __startBlockRow(DbPngEntryReader& png, uint8_t blockHeight) {
+	ASSERT( __finishBlock(png) );
+	if(blockHeight == 0)
+		return "block height invalid";
+	png.blockList.blockHeight = blockHeight;
+	return true;
+}
+
 static Return __readBlock(DbPngEntryReader& png, const std::string& data) {
 	size_t offset = 1; // first was the DbEntry type
-	if(data.size() < offset + sizeof(uint16_t))
-		return "block entry too small (before reading x-offset)";
-	uint32_t x = valueFromRaw<uint16_t>(&data[offset]) * PngBlockSize;
-	offset += sizeof(uint16_t);
-	
-	if(x == 0) {
-		// new block row start
-		ASSERT( __finishBlock(png) );
-		if(data.size() < offset + sizeof(uint8_t))
-			return "block entry too small (before reading block height)";
-		png.blockList.blockHeight = valueFromRaw<uint8_t>(&data[offset]);
-		offset += sizeof(uint8_t);
+	if(png.content.version >= 2) {
+		// the block row was started by the marker in the content list
 		if(png.blockList.blockHeight == 0)
-			return "block height invalid";
+			return "block entry without block row";
 	}
-	
+	else {
+		if(data.size() < offset + sizeof(uint16_t))
+			return "block entry too small (before reading x-offset)";
+		uint32_t x = valueFromRaw<uint16_t>(&data[offset]) * PngBlockSize;
+		offset += sizeof(uint16_t);
+		
+		if(x == 0) {
+			// new block row start
+			if(data.size() < offset + sizeof(uint8_t))
+				return "block entry too small (before reading block height)";
+			ASSERT( __startBlockRow(png, valueFromRaw<uint8_t>(&data[offset])) );
+			offset += sizeof(uint8_t);
+		}
+	}
+
 	if(((data.size() - offset) % png.blockList.blockHeight) != 0)
 		return "block entry raw size is not a multiple of blockHeight";		
 	size_t blockWidth = (data.size() - offset) / png.blockList.blockHeight;
@@ -150,37 +312,328 @@ static Return __readBlock(DbPngEntryReader& png, const std::string& data) {
 	return true;
 }
 
-Return DbPngEntryReader::next() {
-	if(!haveContentEntries) {
-		DbEntry entry;
-		ASSERT( db->get(entry, contentId) );
-		if(entry.data.size() == 0)
-			return "content entry list data is empty";
-		if(entry.data[0] != DbEntryType_PngContentList)
-			return "content entry list data is invalid";			
-		size_t i = 1;
-		while(i < entry.data.size()) {
-			uint8_t size = entry.data[i];
+// Fetches up to n of the ids with one DB request (the ones which are not in the entry cache).
+// The block row markers in ids are not fetched; they become entries with empty data.
+static Return __fetchBatch(DbIntf& db, std::list<DbEntryId>& idsLeft, size_t n, /*out*/ std::list<DbEntry>& fetched, /*out*/ size_t& bytes) {
+	std::vector<DbEntryId> ids;
+	std::vector<bool> isMarker; // block row markers are not fetched
+	ids.reserve(n);
+	while(ids.size() < n && !idsLeft.empty()) {
+		isMarker.push_back(idsLeft.front().empty());
+		if(!isMarker.back())
+			ids.push_back(idsLeft.front());
+		idsLeft.pop_front();
+	}
+	
+	std::vector<DbEntry> entries;
+	ASSERT( db.getManyCached(entries, ids) );
+	size_t e = 0;
+	bytes = 0;
+	for(size_t i = 0; i < isMarker.size(); ++i) {
+		fetched.push_back(DbEntry());
+		if(!isMarker[i]) {
+			bytes += entries[e].data.size();
+			fetched.back().data.swap(entries[e++].data);
+		}
+	}
+	return true;
+}
+
+struct DbPngEntryPrefetcher : DontCopyTag {
+	DbIntf* db;
+	size_t batchSize, maxBytes;
+	std::list<DbEntryId> ids; // not fetched yet. only the thread uses them while it is running
+	size_t remaining; // entries which the reader has not taken yet. only the reader uses it
+	
+	// protected by the mutex
+	Mutex mutex;
+	Condition fetchedMore;
+	std::list<DbEntry> fetched;
+	size_t fetchedBytes;
+	bool running, stop;
+	Return result;
+	
+	pthread_t thread;
+	bool haveThread; // not joined yet
+	
+	DbPngEntryPrefetcher(DbIntf* _db, size_t _batchSize, size_t _maxBytes)
+	: db(_db), batchSize(_batchSize), maxBytes(_maxBytes), remaining(0),
+	fetchedBytes(0), running(false), stop(false), result(true), haveThread(false) {}
+};
+
+static void* __prefetchThread(void* p) {
+	DbPngEntryPrefetcher& pf = *(DbPngEntryPrefetcher*) p;
+	while(true) {
+		{
+			ScopedLock lock(pf.mutex);
+			// with enough waiting, we stop. the reader starts us again when it has taken them
+			if(pf.stop || pf.ids.empty() || pf.fetchedBytes >= pf.maxBytes) {
+				pf.running = false;
+				pf.fetchedMore.broadcast();
+				return NULL;
+			}
+		}
+		std::list<DbEntry> batch;
+		size_t bytes = 0;
+		Return r = __fetchBatch(*pf.db, pf.ids, pf.batchSize, batch, bytes);
+		ScopedLock lock(pf.mutex);
+		if(!r) {
+			pf.result = r;
+			pf.running = false;
+			pf.fetchedMore.broadcast();
+			return NULL;
+		}
+		pf.fetched.splice(pf.fetched.end(), batch);
+		pf.fetchedBytes += bytes;
+		pf.fetchedMore.broadcast();
+	}
+}
+
+// The mutex must be locked and the thread must not be running.
+static Return __startPrefetchThread(DbPngEntryPrefetcher& pf) {
+	// it has already left the mutex, so it can finish
+	if(pf.haveThread) pthread_join(pf.thread, NULL);
+	pf.haveThread = false;
+	pf.running = true;
+	if(pthread_create(&pf.thread, NULL, __prefetchThread, &pf) != 0) {
+		pf.running = false;
+		return "cannot start the prefetch thread";
+	}
+	pf.haveThread = true;
+	return true;
+}
+
+static Return __takePrefetched(DbPngEntryReader& png) {
+	if(png.prefetcher == NULL) {
+		png.prefetcher = new DbPngEntryPrefetcher(png.db, png.prefetchEntries, png.prefetchMaxBytes);
+		png.prefetcher->remaining = png.content.entries.size();
+		png.prefetcher->ids.swap(png.content.entries);
+	}
+	DbPngEntryPrefetcher& pf = *png.prefetcher;
+	ScopedLock lock(pf.mutex);
+	while(pf.fetched.empty()) {
+		ASSERT( pf.result );
+		if(!pf.running) {
+			if(pf.ids.empty()) return "prefetch: no entries left";
+			ASSERT( __startPrefetchThread(pf) );
+		}
+		pf.fetchedMore.wait(pf.mutex);
+	}
+	pf.remaining -= pf.fetched.size();
+	png.fetchedEntries.splice(png.fetchedEntries.end(), pf.fetched);
+	pf.fetchedBytes = 0;
+	// it fetches the next ones while we put these together
+	if(!pf.running && !pf.ids.empty() && pf.result)
+		ASSERT( __startPrefetchThread(pf) );
+	return true;
+}
+
+// Fetches the entries of the next block row with one DB request.
+// Before we know the image width, we just fetch a few entries (these are the PNG chunks).
+static Return __fetchEntries(DbPngEntryReader& png) {
+	if(png.prefetchEntries > 0)
+		return __takePrefetched(png);
+	size_t n = png.blocksPerRow ? png.blocksPerRow : PngFetchCountDefault;
+	size_t bytes = 0;
+	return __fetchBatch(*png.db, png.content.entries, n, png.fetchedEntries, bytes);
+}
+
+static bool __haveMoreEntries(DbPngEntryReader& png) {
+	if(!png.content.entries.empty() || !png.fetchedEntries.empty()) return true;
+	return png.prefetcher && png.prefetcher->remaining > 0;
+}
+
+Return DbPngContentList::read(DbIntf& db, const DbEntryId& contentId) {
+	DbEntry entry;
+	ASSERT( db.get(entry, contentId) );
+	if(entry.data.size() == 0)
+		return "content entry list data is empty";
+	size_t i = 1;
+	if(entry.data[0] == DbEntryType_PngContentList)
+		version = 1;
+	else if(entry.data[0] == DbEntryType_PngContentListVersioned && entry.data.size() >= 2) {
+		version = entry.data[1];
+		++i;
+		if(version < 2 || version > DbPngContentListVersion)
+			return "content entry list version is not supported";
+		if(version == 3)
+			flags = DbPngContentFlag_Unfiltered;
+		else if(version >= 4) {
+			if(i >= entry.data.size())
+				return "content entry list data is inconsistent";
+			flags = entry.data[i];
 			++i;
-			if(i + size > entry.data.size())
+			if(flags & ~(DbPngContentFlag_Unfiltered | DbPngContentFlag_Bands | DbPngContentFlag_Index))
+				return "content entry list flags are not supported";
+			if(flags & DbPngContentFlag_Index) {
+				if(!(flags & DbPngContentFlag_Bands))
+					return "content entry list has an index without bands";
+				if(i + sizeof(uint64_t) + 2 * sizeof(uint32_t) > entry.data.size())
+					return "content entry list data is inconsistent";
+				outputSize = valueFromRaw<uint64_t>(&entry.data[i]);
+				i += sizeof(uint64_t);
+				idatOffset = valueFromRaw<uint32_t>(&entry.data[i]);
+				i += sizeof(uint32_t);
+				adler = valueFromRaw<uint32_t>(&entry.data[i]);
+				i += sizeof(uint32_t);
+			}
+		}
+	}
+	else
+		return "content entry list data is invalid";			
+	while(i < entry.data.size()) {
+		uint8_t size = entry.data[i];
+		++i;
+		if(size == 0 && version >= 2) {
+			// block row marker
+			if(i >= entry.data.size())
 				return "content entry list data is inconsistent";
-			contentEntries.push_back( DbEntryId(entry.data.substr(i, size)) );
-			i += size;
+			entries.push_back(DbEntryId());
+			rowHeights.push_back(entry.data[i]);
+			++i;
+			if(flags & DbPngContentFlag_Bands) {
+				if(i >= entry.data.size())
+					return "content entry list data is inconsistent";
+				size = entry.data[i];
+				++i;
+				if(size == 0 || i + size > entry.data.size())
+					return "content entry list data is inconsistent";
+				rowBands.push_back( DbEntryId(entry.data.substr(i, size)) );
+				i += size;
+				if(flags & DbPngContentFlag_Index) {
+					if(i + sizeof(uint32_t) > entry.data.size())
+						return "content entry list data is inconsistent";
+					rowBandSizes.push_back(valueFromRaw<uint32_t>(&entry.data[i]));
+					i += sizeof(uint32_t);
+				}
+			}
+			continue;
 		}
-		haveContentEntries = true;
+		if(i + size > entry.data.size())
+			return "content entry list data is inconsistent";
+		entries.push_back( DbEntryId(entry.data.substr(i, size)) );
+		i += size;
+	}
+	return true;
+}
+
+// We only need the chunks (they come first, before the first block row marker) and the bands.
+static void __useBands(DbPngEntryReader& png) {
+	std::list<DbEntryId>::iterator i = png.content.entries.begin();
+	while(i != png.content.entries.end() && !i->empty()) ++i;
+	png.content.entries.erase(i, png.content.entries.end());
+	png.content.entries.splice(png.content.entries.end(), png.content.rowBands);
+	png.content.rowHeights.clear();
+}
+
+static Return __readBand(DbPngEntryReader& png, std::string& data) {
+	if(data.size() < 1 + 2 * sizeof(uint32_t))
+		return "band entry too small";
+	png.writer.deflatedBands.push_back(PngDeflatedBand());
+	PngDeflatedBand& band = png.writer.deflatedBands.back();
+	band.adler = valueFromRaw<uint32_t>(&data[1]);
+	band.size = valueFromRaw<uint32_t>(&data[1 + sizeof(uint32_t)]);
+	// after seek(), the output starts within the first band
+	if(data.size() <= 1 + 2 * sizeof(uint32_t) + png.bandSkip)
+		return "band entry is smaller than in the content index";
+	data.erase(0, 1 + 2 * sizeof(uint32_t) + png.bandSkip);
+	png.bandSkip = 0;
+	band.data.swap(data);
+	return true;
+}
+
+DbPngEntryReader::~DbPngEntryReader() {
+	if(prefetcher == NULL) return;
+	{
+		ScopedLock lock(prefetcher->mutex);
+		prefetcher->stop = true;
+	}
+	if(prefetcher->haveThread)
+		pthread_join(prefetcher->thread, NULL);
+	delete prefetcher;
+}
+
+Return DbPngEntryReader::readContentList() {
+	if(haveContentEntries) return true;
+	ASSERT( content.read(*db, contentId) );
+	writer.refilter = (content.flags & DbPngContentFlag_Unfiltered) != 0;
+	if(content.flags & DbPngContentFlag_Bands)
+		__useBands(*this);
+	haveContentEntries = true;
+	return true;
+}
+
+Return DbPngEntryReader::seek(uint64_t& offset) {
+	ASSERT( readContentList() );
+	const uint64_t idatChunkSize = PngDataChunkSize + 12;
+	if(!(content.flags & DbPngContentFlag_Index) || content.rowBandSizes.empty() ||
+	   offset < content.idatOffset + idatChunkSize) {
+		// from the beginning. that is not much more anyway
+		offset = 0;
+		return true;
+	}
+	uint64_t bandsSize = 0;
+	for(std::list<uint32_t>::iterator i = content.rowBandSizes.begin(); i != content.rowBandSizes.end(); ++i)
+		bandsSize += *i;
+	
+	// The IDAT chunk which contains offset. Its data must start within a band,
+	// not in the end of the zlib stream (PngWriter writes that with the last band).
+	uint64_t chunk = (offset - content.idatOffset) / idatChunkSize;
+	while(chunk > 0 && chunk * PngDataChunkSize >= 2 + bandsSize) --chunk;
+	if(chunk == 0) {
+		offset = 0;
 		return true;
 	}
+	uint64_t streamOffset = chunk * PngDataChunkSize;
+	
+	// the band which contains streamOffset. the chunk entries come before the bands
+	size_t skipEntries = content.entries.size() - content.rowBandSizes.size();
+	uint64_t bandOffset = 2; // the zlib header
+	for(std::list<uint32_t>::iterator i = content.rowBandSizes.begin(); bandOffset + *i <= streamOffset; ++i) {
+		bandOffset += *i;
+		++skipEntries;
+	}
+	std::list<DbEntryId>::iterator firstBand = content.entries.begin();
+	std::advance(firstBand, skipEntries);
+	content.entries.erase(content.entries.begin(), firstBand);
+	bandSkip = streamOffset - bandOffset;
+	writer.resumeBands(content.adler);
+	offset = content.idatOffset + chunk * idatChunkSize;
+	return true;
+}
+
+Return DbPngEntryReader::next() {
+	if(!haveContentEntries)
+		return readContentList();
 
-	if(contentEntries.size() > 0) {
+	if(__haveMoreEntries(*this)) {
+		if(fetchedEntries.empty())
+			ASSERT( __fetchEntries(*this) );
 		DbEntry entry;
-		ASSERT( db->get(entry, contentEntries.front()) );
-		contentEntries.pop_front();
-		if(entry.data.size() == 0)
-			return "content entry data is empty";
-		switch(entry.data[0]) {
+		entry.data.swap(fetchedEntries.front().data);
+		fetchedEntries.pop_front();
+		if(entry.data.size() == 0) {
+			if(content.version < 2)
+				return "content entry data is empty";
+			writer.hasAllChunks = true; // there wont be any more PngChunk entries
+			ASSERT( __startBlockRow(*this, content.rowHeights.front()) );
+			content.rowHeights.pop_front();
+		}
+		else switch(entry.data[0]) {
 			case DbEntryType_PngChunk: {
 				PngChunk chunk;
 				ASSERT( __readPngChunk(chunk, entry.data) );
+				if(chunk.type == "IHDR") {
+					PngHeader header;
+					// with bands, we just fetch a few of them at once
+					if(!(content.flags & DbPngContentFlag_Bands) && png_read_header(header, chunk)) {
+						size_t scanlineSize = header.scanlineSize(header.width);
+						if(content.version >= 2)
+							blocksPerRow = 1 + (scanlineSize - 1 + __blockWidth(header) - 1) / __blockWidth(header);
+						else
+							blocksPerRow = (scanlineSize + PngBlockSize - 1) / PngBlockSize;
+					}
+				}
 				writer.chunks.push_back(chunk);
 				break;
 			}
@@ -189,11 +642,16 @@ Return DbPngEntryReader::next() {
 				ASSERT( __readBlock(*this, entry.data) );
 				break;
 			}
+			case DbEntryType_PngBand: {
+				writer.hasAllChunks = true;
+				ASSERT( __readBand(*this, entry.data) );
+				break;
+			}
 			default:
 				return "content entry data is invalid";
 		}
 	}
-	if(contentEntries.size() == 0) {
+	if(!__haveMoreEntries(*this)) {
 		ASSERT( __finishBlock(*this) );
 		writer.hasAllChunks = true;
 		writer.hasAllScanlines = true;
@@ -13,16 +13,98 @@
 #include <string>
 #include <list>
 
-struct DbPngEntryWriter {
+/*
+ Content list formats:
+ - version 1 (DbEntryType_PngContentList): ([len][id])* of the chunk entries and then the block entries.
+   Each block entry carries its column index and, for column 0, the block row height.
+ - version 2 (DbEntryType_PngContentListVersioned, [2]): same, but each block row starts with
+   a [0][height] marker and the block entries contain only the pixel data. So equal blocks
+   at different positions are stored only once.
+   The first block of a block row holds the filter type bytes of its scanlines. The other blocks
+   are cut at pixel boundaries. The reader only needs the block widths, which follow from the sizes.
+ - version 3: same as version 2, but the block pixel data is unfiltered (see dbPngSetUnfilter).
+   The filter type bytes are kept, and the filters are applied again on extraction.
+ - version 4: the version byte is followed by a flags byte (DbPngContentFlag_*).
+   Without any flags, it is the same as version 2. With DbPngContentFlag_Unfiltered, the same as version 3.
+   With DbPngContentFlag_Bands, each block row marker [0][height] is followed by [len][id]
+   of the DbEntryType_PngBand entry of the block row: [type][uint32 adler32][uint32 size] raw deflate data
+   of the (filtered) scanlines of the block row, see PngDeflatedBand. The extraction just puts them together.
+   With DbPngContentFlag_Index (only together with bands), the flags byte is followed by
+   [uint64 output size][uint32 IDAT offset][uint32 adler32 of the zlib stream] and each band id
+   by [uint32 deflated band size]. As PngWriter just puts the bands together (see PngDeflatedBand),
+   this gives the exact size of the extracted PNG and the output offset of each band, so
+   the extraction can start at any IDAT chunk (DbPngEntryReader::seek).
+   Older versions are still written if there are no bands, so older readers can read them.
+ */
+#define DbPngContentListVersion 4
+#define DbPngContentFlag_Unfiltered 1
+#define DbPngContentFlag_Bands 2
+#define DbPngContentFlag_Index 4
+
+// DB-wide setting (meta "pngfilter" = "unfiltered"): the pushed PNGs are stored unfiltered,
+// so equal pixels are equal blocks, no matter which filters the PNG encoder has chosen.
+Return dbPngGetUnfilter(DbIntf& db, /*out*/ bool& unfilter);
+Return dbPngSetUnfilter(DbIntf& db);
+
+// DB-wide setting (meta "pngbands" = "deflated"): for each block row, the pushed PNGs also get
+// a deflated band (see DbPngContentFlag_Bands). That costs some space, but the extraction
+// doesn't need to deflate anything then.
+Return dbPngGetDeflatedBands(DbIntf& db, /*out*/ bool& bands);
+Return dbPngSetDeflatedBands(DbIntf& db);
+
+// Only in the slicer output, never pushed: starts a block row, followed by the height byte.
+#define DbPngEntryType_BlockRow 0
+
+// Cuts the PNG into DB entries. They are not prepared nor pushed yet,
+// so this doesn't need the DB and can run on any thread.
+struct DbPngEntrySlicer {
 	PngReader reader;
+	std::list<DbEntry> entries; // in push order
+	bool bands; // a DbEntryType_PngBand entry directly follows each block row marker
+	PngBandDeflater bandDeflater;
+	PngRefilter bandRefilter; // the bands are always filtered
+	
+	DbPngEntrySlicer(FILE* f, bool unfilter = false, bool _bands = false) : reader(f), bands(_bands) { reader.unfilter = unfilter; }
+	Return next();
+	operator bool() const { return !reader.hasFinishedReading; }
+};
+
+struct DbPngEntryWriter {
+	DbPngEntrySlicer slicer;
 	DbIntf* db;
 	std::list<DbEntryId> contentChunkEntries;
-	std::list<DbEntryId> contentDataEntries;
+	std::list<DbEntryId> contentDataEntries; // empty id = block row marker
+	std::list<uint8_t> contentRowHeights; // for each block row marker
+	std::list<DbEntryId> contentRowBands; // for each block row marker, if slicer.bands
+	// the index (DbPngContentFlag_Index), if slicer.bands
+	std::list<uint32_t> contentRowBandSizes;
+	uint32_t contentChunksSize; // PNG signature and chunks
+	uint32_t contentAdler;
 	DbEntryId contentId;
+	uint64_t contentOutputSize; // of the extracted PNG, if the content list has the index. otherwise 0
 	
-	DbPngEntryWriter(FILE* f, DbIntf* _db) : reader(f), db(_db) {}
+	DbPngEntryWriter(FILE* f, DbIntf* _db, bool unfilter = false, bool bands = false)
+	: slicer(f, unfilter, bands), db(_db), contentChunksSize(8), contentAdler(1), contentOutputSize(0) {}
 	Return next();
-	operator bool() const { return !reader.hasFinishedReading; }
+	Return pushEntries(std::list<DbEntry>& entries); // entries must be prepared. they are cleared
+	Return pushContentList(); // after all entries have been pushed
+	operator bool() const { return !slicer.reader.hasFinishedReading; }
+};
+
+// The content list entry of a PNG.
+struct DbPngContentList {
+	uint8_t version;
+	uint8_t flags; // DbPngContentFlag_*, also set for versions < 4
+	std::list<DbEntryId> entries; // empty id = block row marker (version >= 2)
+	std::list<uint8_t> rowHeights; // for each block row marker
+	std::list<DbEntryId> rowBands; // for each block row marker, with DbPngContentFlag_Bands
+	// with DbPngContentFlag_Index
+	uint64_t outputSize; // of the extracted PNG
+	uint32_t idatOffset; // in the extracted PNG
+	uint32_t adler; // of the zlib stream
+	std::list<uint32_t> rowBandSizes; // deflated size, for each band
+	DbPngContentList() : version(0), flags(0), outputSize(0), idatOffset(0), adler(1) {}
+	Return read(DbIntf& db, const DbEntryId& contentId);
 };
 
 struct DbPngEntryBlockList {
@@ -32,16 +114,41 @@ struct DbPngEntryBlockList {
 	DbPngEntryBlockList() : scanlineWidth(0), blockHeight(0) {}
 };
 
-struct DbPngEntryReader {
+#define DbPngPrefetchEntriesDefault 256 // for the tools, --prefetch
+#define DbPngPrefetchMaxBytesDefault (4 * 1024 * 1024)
+
+struct DbPngEntryPrefetcher;
+
+struct DbPngEntryReader : DontCopyTag {
 	PngWriter writer;
 	DbIntf* db;
 	DbEntryId contentId;
-	std::list<DbEntryId> contentEntries;
+	DbPngContentList content; // with bands, content.entries has the band ids instead of the blocks
 	bool haveContentEntries;
+	std::list<DbEntry> fetchedEntries; // fetched from DB, one block row at a time. empty data = block row marker
+	size_t blocksPerRow; // 0 if not known yet
 	DbPngEntryBlockList blockList;
 	
+	size_t bandSkip; // of the first band, after seek()
+	
+	// If set, a thread fetches the entries ahead (prefetchEntries with one DB request)
+	// while this one puts the PNG together. So the DB latency is not waited for each block row.
+	// The thread stops while prefetchMaxBytes of fetched data is waiting and is started again
+	// when it was taken. The DB must allow the access from another thread.
+	// 0 means that a block row is fetched when it is needed.
+	size_t prefetchEntries;
+	size_t prefetchMaxBytes;
+	DbPngEntryPrefetcher* prefetcher;
+	
 	DbPngEntryReader(WriteCallbackIntf* w, DbIntf* _db, const DbEntryId& _contentId)
-	: writer(w), db(_db), contentId(_contentId), haveContentEntries(false) {}
+	: writer(w), db(_db), contentId(_contentId), haveContentEntries(false), blocksPerRow(0), bandSkip(0),
+	prefetchEntries(0), prefetchMaxBytes(DbPngPrefetchMaxBytesDefault), prefetcher(NULL) {}
+	~DbPngEntryReader();
+	Return readContentList(); // if not done yet. next() does it otherwise
+	// Must be called before anything was written. If the content list has an index,
+	// it starts at the IDAT chunk which contains offset, otherwise at the beginning.
+	// offset is set to the output offset where it starts.
+	Return seek(/*inout*/ uint64_t& offset);
 	Return next();
 	operator bool() const { return !writer.hasFinishedWriting; }
 };
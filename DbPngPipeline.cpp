@@ -0,0 +1,244 @@
+/* parallel PNG -> DB ingest pipeline
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "DbPngPipeline.h"
+#include "Mutex.h"
+#include "Queue.h"
+
+#include <pthread.h>
+#include <cstdio>
+#include <algorithm>
+
+struct DbPngPipelineBatch {
+	std::list<DbEntry> entries;
+	bool prepared;
+	DbPngPipelineBatch() : prepared(false) {}
+};
+
+// The new entries of one pushMany of the writer, see DbCompressorIntf.
+struct DbPngPipelineCompressTask {
+	DbIntf& db;
+	const std::vector<DbEntry>& entries;
+	const std::vector<size_t>& indices;
+	std::vector<std::string>& compressed;
+	size_t partsLeft; // protected by the pipeline mutex
+	DbPngPipelineCompressTask(DbIntf& _db, const std::vector<DbEntry>& e, const std::vector<size_t>& i, std::vector<std::string>& c)
+	: db(_db), entries(e), indices(i), compressed(c), partsLeft(0) {}
+};
+
+// Either prepare a batch or compress task->indices[begin, end).
+struct DbPngPipelineJob {
+	DbPngPipelineBatch* batch;
+	DbPngPipelineCompressTask* task;
+	size_t begin, end;
+	DbPngPipelineJob(DbPngPipelineBatch* b = NULL) : batch(b), task(NULL), begin(0), end(0) {}
+	DbPngPipelineJob(DbPngPipelineCompressTask* t, size_t b, size_t e) : batch(NULL), task(t), begin(b), end(e) {}
+};
+
+struct DbPngPipelineState : DbCompressorIntf, DontCopyTag {
+	DbPngPipeline& pipeline;
+	const std::vector<std::string>& filenames;
+	std::vector<DbPngPipelineFile> files;
+
+	Mutex mutex;
+	Condition changed; // batch prepared, file finished, batch slot freed, writer moved on or compression part done
+	size_t nextFileToRead;
+	size_t writerFile;
+	size_t batchesInFlight;
+
+	BoundedQueue<DbPngPipelineJob> workQueue;
+
+	DbPngPipelineState(DbPngPipeline& p, const std::vector<std::string>& fns)
+	: pipeline(p), filenames(fns), files(fns.size()),
+	nextFileToRead(0), writerFile(0), batchesInFlight(0),
+	workQueue(2 * p.numWorkers) {
+		for(size_t i = 0; i < fns.size(); ++i)
+			files[i].filename = fns[i];
+	}
+
+	// Waits for a free batch slot. One slot is always kept for the file the writer is
+	// waiting for, otherwise readers of later files could take all of them and we would deadlock.
+	void addBatch(size_t fileIndex, DbPngPipelineBatch* batch) {
+		ScopedLock lock(mutex);
+		while(true) {
+			size_t limit = pipeline.maxBatchesInFlight;
+			if(fileIndex != writerFile) --limit;
+			if(batchesInFlight < limit) break;
+			changed.wait(mutex);
+		}
+		++batchesInFlight;
+		files[fileIndex].batches.push_back(batch);
+	}
+
+	// Called from the writer thread, within db->pushMany.
+	// The workers never wait for the writer, so they keep the queue moving.
+	void compressMany(DbIntf& db, const std::vector<DbEntry>& entries, const std::vector<size_t>& indices,
+					  /*out*/ std::vector<std::string>& compressed) {
+		DbPngPipelineCompressTask task(db, entries, indices, compressed);
+		size_t numParts = std::min(indices.size(), 2 * pipeline.numWorkers);
+		task.partsLeft = numParts;
+		for(size_t p = 0; p < numParts; ++p)
+			workQueue.push(DbPngPipelineJob(&task, indices.size() * p / numParts, indices.size() * (p + 1) / numParts));
+
+		ScopedLock lock(mutex);
+		while(task.partsLeft > 0)
+			changed.wait(mutex);
+	}
+};
+
+static void __readFile(DbPngPipelineState& state, size_t fileIndex) {
+	DbPngPipelineFile& file = state.files[fileIndex];
+	Return result = true;
+	size_t fileSize = 0;
+
+	FILE* f = fopen(file.filename.c_str(), "rb");
+	if(f == NULL)
+		result = "cannot open file";
+	else {
+		DbPngEntrySlicer slicer(f, state.pipeline.unfilter, state.pipeline.bands);
+		while(slicer) {
+			result = slicer.next();
+			if(!result) break;
+			if(slicer.entries.empty()) continue;
+
+			DbPngPipelineBatch* batch = new DbPngPipelineBatch();
+			batch->entries.swap(slicer.entries);
+			state.addBatch(fileIndex, batch);
+			state.workQueue.push(DbPngPipelineJob(batch));
+		}
+		fileSize = ftell(f);
+		fclose(f);
+	}
+
+	ScopedLock lock(state.mutex);
+	file.opened = f != NULL;
+	file.result = result;
+	file.fileSize = fileSize;
+	file.finishedReading = true;
+	state.changed.broadcast();
+}
+
+static void* __readerThread(void* p) {
+	DbPngPipelineState& state = *(DbPngPipelineState*)p;
+	while(true) {
+		size_t fileIndex = 0;
+		{
+			ScopedLock lock(state.mutex);
+			if(state.nextFileToRead >= state.files.size()) break;
+			fileIndex = state.nextFileToRead++;
+		}
+		__readFile(state, fileIndex);
+	}
+	return NULL;
+}
+
+static void* __workerThread(void* p) {
+	DbPngPipelineState& state = *(DbPngPipelineState*)p;
+	DbPngPipelineJob job;
+	while(state.workQueue.pop(job)) {
+		if(job.task != NULL) {
+			DbPngPipelineCompressTask& task = *job.task;
+			for(size_t j = job.begin; j < job.end; ++j)
+				task.db.compressForPush(task.entries[task.indices[j]], task.compressed[task.indices[j]]);
+
+			ScopedLock lock(state.mutex);
+			--task.partsLeft;
+			state.changed.broadcast();
+			continue;
+		}
+
+		prepareEntries(job.batch->entries, state.pipeline.db->trustedHash);
+
+		ScopedLock lock(state.mutex);
+		job.batch->prepared = true;
+		state.changed.broadcast();
+	}
+	return NULL;
+}
+
+static void __writeFile(DbPngPipelineState& state, size_t fileIndex) {
+	DbPngPipelineFile& file = state.files[fileIndex];
+	DbPngEntryWriter writer(NULL, state.pipeline.db, state.pipeline.unfilter, state.pipeline.bands);
+	Return pushResult = true;
+
+	{
+		ScopedLock lock(state.mutex);
+		state.writerFile = fileIndex;
+		state.changed.broadcast();
+	}
+
+	while(true) {
+		DbPngPipelineBatch* batch = NULL;
+		{
+			ScopedLock lock(state.mutex);
+			while(true) {
+				if(!file.batches.empty() && file.batches.front()->prepared) break;
+				if(file.batches.empty() && file.finishedReading) break;
+				state.changed.wait(state.mutex);
+			}
+			if(file.batches.empty()) break;
+			batch = file.batches.front();
+			file.batches.pop_front();
+		}
+
+		// After an error, we behave like the serial ingest and don't push anything more of this file.
+		if(pushResult)
+			pushResult = writer.pushEntries(batch->entries);
+		delete batch;
+
+		ScopedLock lock(state.mutex);
+		--state.batchesInFlight;
+		state.changed.broadcast();
+	}
+
+	// file.result and others are not touched by the readers anymore
+	if(file.result && pushResult)
+		pushResult = writer.pushContentList();
+	if(file.result && !pushResult)
+		file.result = pushResult;
+	file.contentId = writer.contentId;
+	file.contentOutputSize = writer.contentOutputSize;
+	file.numContentEntries = writer.contentChunkEntries.size() + writer.contentDataEntries.size();
+
+	if(state.pipeline.callback)
+		state.pipeline.callback->fileDone(file);
+}
+
+Return DbPngPipeline::push(const std::vector<std::string>& filenames) {
+	if(maxBatchesInFlight < 2)
+		return "DbPngPipeline: need at least 2 batches in flight";
+
+	DbPngPipelineState state(*this, filenames);
+	std::vector<pthread_t> readers(std::max(numReaders, (size_t)1));
+	std::vector<pthread_t> workers(std::max(numWorkers, (size_t)1));
+
+	size_t numWorkersStarted = 0, numReadersStarted = 0;
+	for(; numWorkersStarted < workers.size(); ++numWorkersStarted)
+		if(pthread_create(&workers[numWorkersStarted], NULL, __workerThread, &state) != 0)
+			break;
+	if(numWorkersStarted > 0)
+		for(; numReadersStarted < readers.size(); ++numReadersStarted)
+			if(pthread_create(&readers[numReadersStarted], NULL, __readerThread, &state) != 0)
+				break;
+
+	if(numReadersStarted > 0) {
+		// the writer hands the compression of new entries to the workers
+		DbCompressorIntf* oldCompressor = db->compressor;
+		db->compressor = &state;
+		for(size_t i = 0; i < state.files.size(); ++i)
+			__writeFile(state, i);
+		db->compressor = oldCompressor;
+	}
+
+	for(size_t i = 0; i < numReadersStarted; ++i)
+		pthread_join(readers[i], NULL);
+	state.workQueue.close();
+	for(size_t i = 0; i < numWorkersStarted; ++i)
+		pthread_join(workers[i], NULL);
+
+	if(numReadersStarted == 0)
+		return "DbPngPipeline: failed to start threads";
+	return true;
+}
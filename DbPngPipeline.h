@@ -0,0 +1,67 @@
+/* parallel PNG -> DB ingest pipeline
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#ifndef __AZ__DBPNGPIPELINE_H__
+#define __AZ__DBPNGPIPELINE_H__
+
+#include "Db.h"
+#include "DbPng.h"
+#include "Utils.h"
+#include <string>
+#include <vector>
+#include <list>
+
+/*
+ The stages are:
+ - reader threads: parse the PNG and slice it into entries (DbPngEntrySlicer)
+ - worker threads: prepare the entries (hashing). They also compress the new entries of each
+   pushMany of the writer, after the DB has resolved the refs, so duplicates are never compressed
+ - the writer: the thread which calls DbPngPipeline::push().
+   It pushes the entries into the DB, file by file and in the same order
+   as DbPngEntryWriter would do it. So the DB ends up exactly as with the serial ingest.
+
+ The number of entry batches in flight is limited, so memory usage stays bounded.
+ */
+
+struct DbPngPipelineBatch;
+
+struct DbPngPipelineFile {
+	std::string filename;
+	bool opened;
+	Return result; // of reading and pushing
+	size_t fileSize;
+	DbEntryId contentId;
+	uint64_t contentOutputSize; // see DbPngEntryWriter
+	size_t numContentEntries;
+
+	// internal state, protected by the pipeline mutex
+	std::list<DbPngPipelineBatch*> batches;
+	bool finishedReading;
+
+	DbPngPipelineFile()
+	: opened(false), fileSize(0), contentOutputSize(0), numContentEntries(0), finishedReading(false) {}
+};
+
+struct DbPngPipelineCallbackIntf {
+	// Called from the writer thread, in the order of the input files.
+	virtual void fileDone(const DbPngPipelineFile& file) = 0;
+};
+
+struct DbPngPipeline : DontCopyTag {
+	DbIntf* db;
+	DbPngPipelineCallbackIntf* callback;
+	size_t numReaders, numWorkers;
+	size_t maxBatchesInFlight;
+	bool unfilter; // see dbPngSetUnfilter
+	bool bands; // see dbPngSetDeflatedBands
+
+	DbPngPipeline(DbIntf* _db, DbPngPipelineCallbackIntf* cb, size_t numJobs, bool _unfilter = false, bool _bands = false)
+	: db(_db), callback(cb),
+	numReaders((numJobs + 1) / 2), numWorkers(numJobs ? numJobs : 1),
+	maxBatchesInFlight(8 * (numJobs ? numJobs : 1)), unfilter(_unfilter), bands(_bands) {}
+	Return push(const std::vector<std::string>& filenames);
+};
+
+#endif
@@ -17,7 +17,7 @@ Return DbRedisBackend::init() {
 		return "failed to init Redis";
 	if(!(redis->flags & REDIS_CONNECTED))
 		return "failed to connect to Redis server";		
-	return true;
+	return initMeta();
 }
 
 DbRedisBackend::~DbRedisBackend() {
@@ -31,7 +31,7 @@ struct RedisReplyWrapper : DontCopyTag {
 	redisReply* reply;
 	RedisReplyWrapper(void* r = NULL) : reply(NULL) { (*this) = r; }
 	~RedisReplyWrapper() { clear(); }
-	RedisReplyWrapper& operator=(void* r) { clear(); reply = (redisReply*)r; }
+	RedisReplyWrapper& operator=(void* r) { clear(); reply = (redisReply*)r; return *this; }
 	void clear() {
 		if(reply != NULL) {
 			freeReplyObject(reply);
@@ -45,6 +45,53 @@ struct RedisReplyWrapper : DontCopyTag {
 	}
 };
 
+// Redis pipelining: all commands are sent at once and then all replies are read.
+struct RedisCommandList {
+	std::vector< std::vector<std::string> > cmds;
+	void add(const std::string& a0, const std::string& a1) {
+		cmds.push_back(std::vector<std::string>());
+		cmds.back().push_back(a0); cmds.back().push_back(a1);
+	}
+	void add(const std::string& a0, const std::string& a1, const std::string& a2) {
+		add(a0, a1);
+		cmds.back().push_back(a2);
+	}
+	size_t size() const { return cmds.size(); }
+};
+
+struct RedisReplyList : DontCopyTag {
+	std::vector<redisReply*> replies;
+	~RedisReplyList() {
+		for(size_t i = 0; i < replies.size(); ++i)
+			if(replies[i] != NULL) freeReplyObject(replies[i]);
+	}
+	redisReply* operator[](size_t i) const { return replies[i]; }
+};
+
+static Return __redisPipeline(redisContext* redis, const RedisCommandList& cmds, RedisReplyList& replies) {
+	for(size_t i = 0; i < cmds.size(); ++i) {
+		const std::vector<std::string>& cmd = cmds.cmds[i];
+		std::vector<const char*> argv(cmd.size());
+		std::vector<size_t> argvlen(cmd.size());
+		for(size_t j = 0; j < cmd.size(); ++j) {
+			argv[j] = cmd[j].data();
+			argvlen[j] = cmd[j].size();
+		}
+		redisAppendCommandArgv(redis, cmd.size(), &argv[0], &argvlen[0]);
+	}
+	// read all replies before checking them, so that the connection stays in sync
+	for(size_t i = 0; i < cmds.size(); ++i) {
+		void* reply = NULL;
+		if(redisGetReply(redis, &reply) != REDIS_OK)
+			return "Redis: error reading pipelined reply";
+		replies.replies.push_back((redisReply*)reply);
+	}
+	for(size_t i = 0; i < cmds.size(); ++i)
+		if(replies[i]->type == REDIS_REPLY_ERROR)
+			return std::string() + "Redis: " + replies[i]->str;
+	return true;
+}
+
 static Return __saveNewDbEntry(redisContext* redis, const std::string& prefix, DbEntryId& id, const std::string& content) {
 	unsigned short triesNum = (id.size() <= 4) ? (2 << id.size()) : 64;
 	for(unsigned short i = 0; i < triesNum; ++i) {
@@ -63,21 +110,54 @@ static Return __saveNewDbEntry(redisContext* redis, const std::string& prefix, D
 	return __saveNewDbEntry(redis, prefix, id, content);
 }
 
+// Trusted hash mode: the SHA256 ref is just the id and a hit needs no further read.
+static Return __pushTrusted(DbRedisBackend& db, /*out*/ DbEntryId& id, const DbEntry& entry) {
+	if(!entry.haveSha256())
+		return "DB push: entry SHA256 not calculated";
+	
+	std::string sha256refkey = db.prefix + "sha256ref." + entry.sha256;
+	RedisReplyWrapper reply;
+	if(db.mayHaveRef(entry)) {
+		reply = redisCommand(db.redis, "GET %b", &sha256refkey[0], sha256refkey.size());
+		ASSERT( reply );
+		if(reply.reply->type == REDIS_REPLY_STRING && reply.reply->len > 0) {
+			id = std::string(reply.reply->str, reply.reply->len);
+			db.stats.countReuse(entry);
+			return true;
+		}
+	}
+	
+	std::string compressed;
+	db.compressForPush(entry, compressed);
+	id = "";
+	ASSERT( __saveNewDbEntry(db.redis, db.prefix, id, compressed) );
+	reply = redisCommand(db.redis, "SET %b %b", &sha256refkey[0], sha256refkey.size(), &id[0], id.size());
+	ASSERT( reply );
+	db.addRefToIndex(entry);
+	
+	db.stats.pushNew++;
+	return true;
+}
+
 Return DbRedisBackend::push(/*out*/ DbEntryId& id, const DbEntry& entry) {
-	if(!entry.haveSha1())
-		return "DB push: entry SHA1 not calculated";
-	if(!entry.haveCompressed())
-		return "DB push: entry compression not calculated";
 	if(redis == NULL)
 		return "DB push: Redis connection not initialized";
 	if(!(redis->flags & REDIS_CONNECTED))
 		return "DB push: Redis not connected";		
+	ASSERT( updateRefGeneration() );
+	if(trustedHash)
+		return __pushTrusted(*this, id, entry);
+	if(!entry.haveSha1())
+		return "DB push: entry SHA1 not calculated";
 	
 	// search for existing entry
 	std::string sha1refkey = prefix + "sha1ref." + entry.sha1;
-	RedisReplyWrapper reply( redisCommand(redis, "SMEMBERS %b", &sha1refkey[0], sha1refkey.size()) );
-	ASSERT( reply );
-	if(reply.reply->type == REDIS_REPLY_ARRAY)
+	RedisReplyWrapper reply;
+	if(mayHaveRef(entry)) {
+		reply = redisCommand(redis, "SMEMBERS %b", &sha1refkey[0], sha1refkey.size());
+		ASSERT( reply );
+	}
+	if(reply.reply != NULL && reply.reply->type == REDIS_REPLY_ARRAY)
 		for(int i = 0; i < reply.reply->elements; ++i) {
 			DbEntryId otherId = std::string(reply.reply->element[i]->str, reply.reply->element[i]->len);
 			DbEntry otherEntry;
@@ -85,24 +165,246 @@ Return DbRedisBackend::push(/*out*/ DbEntryId& id, const DbEntry& entry) {
 				if(entry == otherEntry) {
 					// found
 					id = otherId;
-					stats.pushReuse++;
+					stats.countReuse(entry);
 					return true;
 				}
 			}
 		}
 	
 	// write DB entry
+	std::string compressed;
+	compressForPush(entry, compressed);
 	id = "";
-	ASSERT( __saveNewDbEntry(redis, prefix, id, entry.compressed) );
+	ASSERT( __saveNewDbEntry(redis, prefix, id, compressed) );
 	
 	// create sha1 ref
 	reply = redisCommand(redis, "SADD %b %b", &sha1refkey[0], sha1refkey.size(), &id[0], id.size());
 	ASSERT( reply );
+	addRefToIndex(entry);
 	
 	stats.pushNew++;
 	return true;
 }
 
+// Like __saveNewDbEntry but for many entries; each round of tries is one round trip.
+static Return __saveNewDbEntries(redisContext* redis, const std::string& prefix,
+								 std::vector<DbEntryId>& ids, const std::vector<size_t>& indices,
+								 const std::vector<std::string>& contents) {
+	std::vector<size_t> pending(indices);
+	std::vector<DbEntryId> baseIds(ids.size());
+	std::vector<unsigned short> tries(ids.size());
+	while(!pending.empty()) {
+		RedisCommandList cmds;
+		std::vector<DbEntryId> newIds(pending.size());
+		for(size_t j = 0; j < pending.size(); ++j) {
+			size_t i = pending[j];
+			DbEntryId& id = baseIds[i];
+			unsigned short triesNum = (id.size() <= 4) ? (2 << id.size()) : 64;
+			if(tries[i] >= triesNum) {
+				id += (char)random();
+				tries[i] = 0;
+			}
+			tries[i]++;
+			newIds[j] = id;
+			newIds[j] += (char)random();
+			cmds.add("SETNX", prefix + "data." + newIds[j], contents[i]);
+		}
+		
+		RedisReplyList replies;
+		ASSERT( __redisPipeline(redis, cmds, replies) );
+		std::vector<size_t> stillPending;
+		for(size_t j = 0; j < pending.size(); ++j) {
+			if(replies[j]->type == REDIS_REPLY_INTEGER && replies[j]->integer == 1)
+				ids[pending[j]] = newIds[j];
+			else
+				stillPending.push_back(pending[j]);
+		}
+		pending.swap(stillPending);
+	}
+	return true;
+}
+
+static Return __pushManyTrusted(DbRedisBackend& db, /*out*/ std::vector<DbEntryId>& ids, const std::vector<DbEntry>& entries) {
+	for(size_t i = 0; i < entries.size(); ++i) {
+		if(!entries[i].haveSha256())
+			return "DB push: entry SHA256 not calculated";
+	}
+	
+	std::vector<size_t> lookup; // indices of the entries we must ask the DB for
+	for(size_t i = 0; i < entries.size(); ++i)
+		if(db.mayHaveRef(entries[i])) lookup.push_back(i);
+	
+	std::vector<DbEntryId> refIds(entries.size());
+	if(!lookup.empty()) {
+		RedisCommandList cmds;
+		cmds.cmds.push_back(std::vector<std::string>(1, "MGET"));
+		for(size_t k = 0; k < lookup.size(); ++k)
+			cmds.cmds.back().push_back(db.prefix + "sha256ref." + entries[lookup[k]].sha256);
+		RedisReplyList replies;
+		ASSERT( __redisPipeline(db.redis, cmds, replies) );
+		if(replies[0]->type != REDIS_REPLY_ARRAY || replies[0]->elements != lookup.size())
+			return "DB push: Redis: invalid MGET reply";
+		for(size_t k = 0; k < lookup.size(); ++k) {
+			redisReply* r = replies[0]->element[k];
+			if(r->type == REDIS_REPLY_STRING)
+				refIds[lookup[k]] = std::string(r->str, r->len);
+		}
+	}
+	
+	DbPushBatch batch(ids, entries);
+	batch.resolveTrusted(refIds, db.stats);
+	
+	std::vector<std::string> compressed;
+	db.compressForPushMany(entries, batch.newEntries, compressed);
+	ASSERT( __saveNewDbEntries(db.redis, db.prefix, ids, batch.newEntries, compressed) );
+	
+	if(!batch.newEntries.empty()) {
+		RedisCommandList cmds;
+		for(size_t j = 0; j < batch.newEntries.size(); ++j) {
+			size_t i = batch.newEntries[j];
+			cmds.add("SET", db.prefix + "sha256ref." + entries[i].sha256, ids[i]);
+			db.addRefToIndex(entries[i]);
+		}
+		RedisReplyList replies;
+		ASSERT( __redisPipeline(db.redis, cmds, replies) );
+	}
+	
+	batch.finish();
+	return true;
+}
+
+Return DbRedisBackend::pushMany(/*out*/ std::vector<DbEntryId>& ids, const std::vector<DbEntry>& entries) {
+	if(redis == NULL)
+		return "DB push: Redis connection not initialized";
+	if(!(redis->flags & REDIS_CONNECTED))
+		return "DB push: Redis not connected";
+	ASSERT( updateRefGeneration() );
+	if(trustedHash)
+		return __pushManyTrusted(*this, ids, entries);
+	for(size_t i = 0; i < entries.size(); ++i) {
+		if(!entries[i].haveSha1())
+			return "DB push: entry SHA1 not calculated";
+	}
+	
+	// search for existing entries
+	std::vector< std::list<DbEntryId> > refs(entries.size());
+	std::vector<DbEntryId> candidateIds;
+	{
+		std::vector<size_t> lookup; // indices of the entries we must ask the DB for
+		RedisCommandList cmds;
+		for(size_t i = 0; i < entries.size(); ++i) {
+			if(!mayHaveRef(entries[i])) continue;
+			lookup.push_back(i);
+			cmds.add("SMEMBERS", prefix + "sha1ref." + entries[i].sha1);
+		}
+		RedisReplyList replies;
+		ASSERT( __redisPipeline(redis, cmds, replies) );
+		for(size_t j = 0; j < lookup.size(); ++j) {
+			size_t i = lookup[j];
+			if(replies[j]->type != REDIS_REPLY_ARRAY) continue;
+			for(size_t k = 0; k < replies[j]->elements; ++k) {
+				DbEntryId otherId = std::string(replies[j]->element[k]->str, replies[j]->element[k]->len);
+				refs[i].push_back(otherId);
+				candidateIds.push_back(otherId);
+			}
+		}
+	}
+	
+	std::map<DbEntryId, DbEntry> candidates;
+	if(!candidateIds.empty()) {
+		RedisCommandList cmds;
+		cmds.cmds.push_back(std::vector<std::string>(1, "MGET"));
+		for(size_t k = 0; k < candidateIds.size(); ++k)
+			cmds.cmds.back().push_back(prefix + "data." + candidateIds[k]);
+		RedisReplyList replies;
+		ASSERT( __redisPipeline(redis, cmds, replies) );
+		if(replies[0]->type != REDIS_REPLY_ARRAY || replies[0]->elements != candidateIds.size())
+			return "DB push: Redis: invalid MGET reply";
+		for(size_t k = 0; k < candidateIds.size(); ++k) {
+			redisReply* r = replies[0]->element[k];
+			if(r->type != REDIS_REPLY_STRING) continue;
+			DbEntry otherEntry;
+			otherEntry.compressed = std::string(r->str, r->len);
+			if(!otherEntry.uncompress()) continue;
+			otherEntry.calcSha1();
+			candidates[candidateIds[k]] = otherEntry;
+		}
+	}
+	
+	DbPushBatch batch(ids, entries);
+	batch.resolve(refs, candidates, stats);
+	
+	// write DB entries
+	std::vector<std::string> compressed;
+	compressForPushMany(entries, batch.newEntries, compressed);
+	ASSERT( __saveNewDbEntries(redis, prefix, ids, batch.newEntries, compressed) );
+	
+	// create sha1 refs
+	if(!batch.newEntries.empty()) {
+		RedisCommandList cmds;
+		for(size_t j = 0; j < batch.newEntries.size(); ++j) {
+			size_t i = batch.newEntries[j];
+			cmds.add("SADD", prefix + "sha1ref." + entries[i].sha1, ids[i]);
+			addRefToIndex(entries[i]);
+		}
+		RedisReplyList replies;
+		ASSERT( __redisPipeline(redis, cmds, replies) );
+	}
+	
+	batch.finish();
+	return true;
+}
+
+Return DbRedisBackend::getMany(/*out*/ std::vector<DbEntry>& entries, const std::vector<DbEntryId>& ids) {
+	if(redis == NULL)
+		return "DB get: Redis connection not initialized";
+	if(!(redis->flags & REDIS_CONNECTED))
+		return "DB get: Redis not connected";
+	
+	entries = std::vector<DbEntry>(ids.size());
+	if(ids.empty()) return true;
+	
+	RedisCommandList cmds;
+	cmds.cmds.push_back(std::vector<std::string>(1, "MGET"));
+	for(size_t i = 0; i < ids.size(); ++i)
+		cmds.cmds.back().push_back(prefix + "data." + ids[i]);
+	RedisReplyList replies;
+	ASSERT( __redisPipeline(redis, cmds, replies) );
+	if(replies[0]->type != REDIS_REPLY_ARRAY || replies[0]->elements != ids.size())
+		return "DB get: Redis: invalid MGET reply";
+	
+	for(size_t i = 0; i < ids.size(); ++i) {
+		redisReply* r = replies[0]->element[i];
+		if(r->type == REDIS_REPLY_NIL)
+			return "DB get: entry not found";
+		if(r->type != REDIS_REPLY_STRING)
+			return "DB get: Redis: invalid GET reply";
+		entries[i].compressed = std::string(r->str, r->len);
+		ASSERT( entries[i].uncompress() );
+		entries[i].calcSha1();
+	}
+	
+	return true;
+}
+
+Return DbRedisBackend::existMany(/*out*/ std::vector<bool>& exist, const std::vector<DbEntryId>& ids) {
+	if(redis == NULL)
+		return "DB get: Redis connection not initialized";
+	if(!(redis->flags & REDIS_CONNECTED))
+		return "DB get: Redis not connected";
+	
+	RedisCommandList cmds;
+	for(size_t i = 0; i < ids.size(); ++i)
+		cmds.add("EXISTS", prefix + "data." + ids[i]);
+	RedisReplyList replies;
+	ASSERT( __redisPipeline(redis, cmds, replies) );
+	
+	exist = std::vector<bool>(ids.size());
+	for(size_t i = 0; i < ids.size(); ++i)
+		exist[i] = replies[i]->type == REDIS_REPLY_INTEGER && replies[i]->integer == 1;
+	return true;
+}
+
 Return DbRedisBackend::get(/*out*/ DbEntry& entry, const DbEntryId& id) {
 	if(redis == NULL)
 		return "DB get: Redis connection not initialized";
@@ -124,6 +426,46 @@ Return DbRedisBackend::get(/*out*/ DbEntry& entry, const DbEntryId& id) {
 	return true;
 }
 
+Return DbRedisBackend::iterateHashRefs(DbHashRefCallbackIntf& callback) {
+	std::string refprefix = prefix + (trustedHash ? "sha256ref." : "sha1ref.");
+	std::string pattern = refprefix + "*";
+	// SCAN in steps; KEYS would block the server while it goes through the whole keyspace.
+	// SCAN can return a key more than once.
+	std::string cursor = "0";
+	do {
+		RedisReplyWrapper reply( redisCommand(redis, "SCAN %b MATCH %b COUNT 1000", &cursor[0], cursor.size(), &pattern[0], pattern.size()) );
+		ASSERT( reply );
+		if(reply.reply->type != REDIS_REPLY_ARRAY || reply.reply->elements != 2
+		|| reply.reply->element[0]->type != REDIS_REPLY_STRING || reply.reply->element[1]->type != REDIS_REPLY_ARRAY)
+			return "DB iterateHashRefs: invalid SCAN reply";
+		cursor = std::string(reply.reply->element[0]->str, reply.reply->element[0]->len);
+		redisReply* keys = reply.reply->element[1];
+		for(size_t i = 0; i < keys->elements; ++i) {
+			std::string key(keys->element[i]->str, keys->element[i]->len);
+			if(key.size() > refprefix.size())
+				callback.hashRef(key.substr(refprefix.size()));
+		}
+	} while(cursor != "0");
+	return true;
+}
+
+Return DbRedisBackend::getMeta(/*out*/ std::string& value, const std::string& key) {
+	std::string metakey = prefix + "meta." + key;
+	RedisReplyWrapper reply( redisCommand(redis, "GET %b", &metakey[0], metakey.size()) );
+	ASSERT( reply );
+	if(reply.reply->type != REDIS_REPLY_STRING)
+		return "DB getMeta: entry not found";
+	value = std::string(reply.reply->str, reply.reply->len);
+	return true;
+}
+
+Return DbRedisBackend::setMeta(const std::string& key, const std::string& value) {
+	std::string metakey = prefix + "meta." + key;
+	RedisReplyWrapper reply( redisCommand(redis, "SET %b %b", &metakey[0], metakey.size(), &value[0], value.size()) );
+	ASSERT( reply );
+	return true;
+}
+
 Return DbRedisBackend::pushToDir(const std::string& path, const DbDirEntry& dirEntry) {
 	std::string key = prefix + "fs." + path;
 	std::string dirEntryRaw = dirEntry.serialized();
@@ -164,3 +506,23 @@ Return DbRedisBackend::getFileRef(/*out (can be empty)*/ DbEntryId& id, const st
 	return true;
 }
 
+Return DbRedisBackend::setFileSize(uint64_t size, const std::string& path) {
+	std::string key = prefix + "fssize." + path;
+	std::string value = rawString<uint64_t>(size);
+	RedisReplyWrapper reply( redisCommand(redis, "SET %b %b", &key[0], key.size(), &value[0], value.size()) );
+	ASSERT( reply );
+	return true;
+}
+
+Return DbRedisBackend::getFileSize(/*out*/ uint64_t& size, const std::string& path) {
+	std::string key = prefix + "fssize." + path;
+	RedisReplyWrapper reply( redisCommand(redis, "GET %b", &key[0], key.size()) );
+	ASSERT( reply );
+	if(reply.reply->type != REDIS_REPLY_STRING || reply.reply->len != sizeof(uint64_t))
+		return "DB getFileSize: size unknown";
+	size = valueFromRaw<uint64_t>(reply.reply->str);
+	if(size == 0)
+		return "DB getFileSize: size unknown";
+	return true;
+}
+
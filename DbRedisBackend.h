@@ -21,10 +21,18 @@ struct DbRedisBackend : DbIntf {
 	Return init();
 	Return push(/*out*/ DbEntryId& id, const DbEntry& entry);
 	Return get(/*out*/ DbEntry& entry, const DbEntryId& id);
+	Return pushMany(/*out*/ std::vector<DbEntryId>& ids, const std::vector<DbEntry>& entries);
+	Return getMany(/*out*/ std::vector<DbEntry>& entries, const std::vector<DbEntryId>& ids);
+	Return existMany(/*out*/ std::vector<bool>& exist, const std::vector<DbEntryId>& ids);
+	Return iterateHashRefs(DbHashRefCallbackIntf& callback);
+	Return getMeta(/*out*/ std::string& value, const std::string& key);
+	Return setMeta(const std::string& key, const std::string& value);
 	Return pushToDir(const std::string& path, const DbDirEntry& dirEntry);
 	Return getDir(/*out*/ std::list<DbDirEntry>& dirList, const std::string& path);
 	Return setFileRef(/*can be empty*/ const DbEntryId& id, const std::string& path);
 	Return getFileRef(/*out (can be empty)*/ DbEntryId& id, const std::string& path);
+	Return setFileSize(uint64_t size, const std::string& path);
+	Return getFileSize(/*out*/ uint64_t& size, const std::string& path);
 };
 
 #endif
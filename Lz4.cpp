@@ -0,0 +1,121 @@
+/* LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md)
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "Lz4.h"
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+
+// see the format description
+#define Lz4_MinMatch 4
+#define Lz4_LastLiterals 5 // the last bytes are always literals
+#define Lz4_MatchFindLimit 12 // the last match starts before that
+#define Lz4_MaxOffset 65535
+#define Lz4_HashLog 14
+#define Lz4_MaxRatio 255 // a length byte of 255 is the most output per input byte
+
+static inline uint32_t __read32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline size_t __hash(uint32_t v) {
+	return (v * 2654435761U) >> (32 - Lz4_HashLog);
+}
+
+static void __writeLength(std::string& out, size_t len) {
+	for(; len >= 255; len -= 255)
+		out += (char) 255;
+	out += (char) len;
+}
+
+static void __writeSequence(std::string& out, const uint8_t* literals, size_t literalLen, size_t offset, size_t matchLen) {
+	uint8_t token = (literalLen >= 15 ? 15 : literalLen) << 4;
+	if(matchLen > 0) token |= (matchLen - Lz4_MinMatch >= 15) ? 15 : matchLen - Lz4_MinMatch;
+	out += (char) token;
+	if(literalLen >= 15) __writeLength(out, literalLen - 15);
+	out.append((const char*) literals, literalLen);
+	if(matchLen == 0) return; // last sequence
+	out += (char) (offset & 0xff);
+	out += (char) (offset >> 8);
+	if(matchLen - Lz4_MinMatch >= 15) __writeLength(out, matchLen - Lz4_MinMatch - 15);
+}
+
+// Greedy, with a hash table of the last positions of 4 byte sequences (like LZ4_compress_default).
+void lz4_compress(const char* data, size_t size, /*out*/ std::string& out) {
+	const uint8_t* src = (const uint8_t*) data;
+	const uint8_t* end = src + size;
+	const uint8_t* anchor = src;
+	out.reserve(out.size() + size + size / 255 + 16);
+	if(size > Lz4_MatchFindLimit) {
+		std::vector<uint32_t> table(1 << Lz4_HashLog, 0); // position + 1, 0 is none
+		const uint8_t* matchLimit = end - Lz4_LastLiterals;
+		for(const uint8_t* ip = src; ip < end - Lz4_MatchFindLimit; ) {
+			uint32_t seq = __read32(ip);
+			size_t h = __hash(seq);
+			uint32_t ref = table[h];
+			table[h] = (ip - src) + 1;
+			const uint8_t* match = src + ref - 1;
+			if(ref == 0 || ip - match > Lz4_MaxOffset || __read32(match) != seq) {
+				++ip;
+				continue;
+			}
+			size_t len = Lz4_MinMatch;
+			while(ip + len < matchLimit && match[len] == ip[len]) ++len;
+			while(ip > anchor && match > src && ip[-1] == match[-1]) { --ip; --match; ++len; }
+			__writeSequence(out, anchor, ip - anchor, ip - match, len);
+			ip += len;
+			anchor = ip;
+		}
+	}
+	__writeSequence(out, anchor, end - anchor, 0, 0);
+}
+
+static bool __readLength(const uint8_t*& p, const uint8_t* end, size_t& len) {
+	while(true) {
+		if(p >= end) return false;
+		uint8_t b = *p++;
+		len += b;
+		if(b != 255) return true;
+	}
+}
+
+Return lz4_uncompress(const char* block, size_t blockSize, size_t size, /*out*/ std::string& data) {
+	// checked before the allocation, size comes from the stored entry
+	if(size / Lz4_MaxRatio > blockSize) return "LZ4 block: size too big for the block";
+	data.resize(size);
+	const uint8_t* p = (const uint8_t*) block;
+	const uint8_t* end = p + blockSize;
+	uint8_t* out = size > 0 ? (uint8_t*) &data[0] : NULL;
+	size_t pos = 0;
+	while(true) {
+		if(p >= end) return "LZ4 block: unexpected end";
+		uint8_t token = *p++;
+		size_t literalLen = token >> 4;
+		if(literalLen == 15 && !__readLength(p, end, literalLen)) return "LZ4 block: unexpected end in literal length";
+		if(literalLen > size_t(end - p) || literalLen > size - pos) return "LZ4 block: literals out of range";
+		if(literalLen > 0) memcpy(out + pos, p, literalLen);
+		p += literalLen;
+		pos += literalLen;
+		if(p == end) break; // the last sequence has no match
+		if(end - p < 2) return "LZ4 block: unexpected end in offset";
+		size_t offset = p[0] | (p[1] << 8);
+		p += 2;
+		size_t matchLen = token & 15;
+		if(matchLen == 15 && !__readLength(p, end, matchLen)) return "LZ4 block: unexpected end in match length";
+		matchLen += Lz4_MinMatch;
+		if(offset == 0 || offset > pos) return "LZ4 block: match offset out of range";
+		if(matchLen > size - pos) return "LZ4 block: match out of range";
+		if(offset >= matchLen)
+			memcpy(out + pos, out + pos - offset, matchLen);
+		else // it overlaps with itself, i.e. repeats the last offset bytes
+			for(size_t i = 0; i < matchLen; ++i)
+				out[pos + i] = out[pos + i - offset];
+		pos += matchLen;
+	}
+	if(pos != size) return "LZ4 block: size mismatch";
+	return true;
+}
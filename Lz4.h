@@ -0,0 +1,19 @@
+/* LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md)
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#ifndef __AZ__LZ4_H__
+#define __AZ__LZ4_H__
+
+#include "Return.h"
+#include <string>
+#include <stddef.h>
+
+// Appends the compressed block to out. It can be read by any LZ4 block decoder.
+void lz4_compress(const char* data, size_t size, /*out*/ std::string& out);
+// The block must decompress to exactly size bytes. Malformed input gives an error,
+// also a size which the block cannot have (about 255 times its size).
+Return lz4_uncompress(const char* block, size_t blockSize, size_t size, /*out*/ std::string& data);
+
+#endif
@@ -20,6 +20,15 @@ struct Mutex {
 	void unlock() { pthread_mutex_unlock(&m); }
 };
 
+struct Condition : DontCopyTag {
+	pthread_cond_t c;
+	Condition() { pthread_cond_init(&c, NULL); }
+	~Condition() { pthread_cond_destroy(&c); }
+	void wait(Mutex& m) { pthread_cond_wait(&c, &m.m); } // mutex must be locked
+	void signal() { pthread_cond_signal(&c); }
+	void broadcast() { pthread_cond_broadcast(&c); }
+};
+
 struct ScopedLock : DontCopyTag {
 	Mutex& mutex;
 	ScopedLock(Mutex& m) : mutex(m) { mutex.lock(); }
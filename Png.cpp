@@ -7,10 +7,6 @@
 #define Z_CompressionLevel 9
 #endif
 
-#ifndef PngDataChunkSize
-#define PngDataChunkSize 8192
-#endif
-
 #ifndef Z_BufSize
 #define Z_BufSize 1024*128
 #endif
@@ -21,6 +17,7 @@
 #include "StringUtils.h"
 
 #include <cstring>
+#include <algorithm>
 #include <stdint.h>
 #include <cassert>
 
@@ -81,8 +78,8 @@ PngReader::PngReader(FILE* f) {
 	stream.avail_in = 0;
 	stream.next_in = Z_NULL;
 	memset(&header, sizeof(PngHeader), 0);
-	incompleteScanlineOffset = 0;
 	hasInitialized = gotHeader = gotStreamEnd = gotEndChunk = hasFinishedReading = false;
+	unfilter = false;
 }
 
 static Return __PngReader_init(PngReader& png) {
@@ -93,7 +90,7 @@ static Return __PngReader_init(PngReader& png) {
 	return true;
 }
 
-static Return __PngReader_read_header(PngHeader& header, PngChunk& chunk) {
+Return png_read_header(PngHeader& header, const PngChunk& chunk) {
 	if(chunk.data.size() != PngHeader::SIZE)
 		return "IHDR size is invalid";
 	memcpy(&header, &chunk.data[0], PngHeader::SIZE);
@@ -135,7 +132,36 @@ size_t PngInterlacedPos::scanlineWidth(uint32_t width) {
 	return s;
 }
 
-static Return __PngReader_fill_scanlines(PngReader& png, char* data, size_t s) {
+void PngScanlineBuffer::popFront(size_t n) {
+	for(size_t i = 0; i < n && !rowSizes.empty(); ++i) {
+		start += rowSizes.front();
+		rowSizes.pop_front();
+	}
+}
+
+char* PngScanlineBuffer::reserve(size_t n) {
+	if(end + n > buffer.size() && start > 0) {
+		// compact. this is rare because the buffer keeps its size
+		memmove(&buffer[0], &buffer[start], end - start);
+		completeEnd -= start;
+		end -= start;
+		start = 0;
+	}
+	if(end + n > buffer.size())
+		buffer.resize(std::max(buffer.size() * 2, end + n));
+	return &buffer[end];
+}
+
+static Return __PngReader_unfilterRow(PngReader& png, size_t size) {
+	char* row = &png.scanlines.buffer[png.scanlines.completeEnd];
+	const char* prior = (png.priorScanline.size() == size - 1) ? &png.priorScanline[0] : NULL;
+	ASSERT( png_unfilter_scanline(row, prior, size, png.header.bytesPerPixel()) );
+	png.priorScanline.assign(row + 1, row + size);
+	return true;
+}
+
+// The new data was already written into png.scanlines; here we just find the rows.
+static Return __PngReader_fill_scanlines(PngReader& png) {
 	if(png.header.interlaceMethod > 1)
 		return "invalid/unknown interlace method";
 
@@ -143,28 +169,16 @@ static Return __PngReader_fill_scanlines(PngReader& png, char* data, size_t s) {
 	if(png.header.interlaceMethod == 1)
 		scanlineSize = png.header.scanlineSize(png.interlacedPos.scanlineWidth(png.header.width));
 	
-	while(s > 0) {
-		std::string& buf = png.incompleteScanline;
-		if(buf.size() != scanlineSize) {
-			if(png.incompleteScanlineOffset == 0)
-				buf = std::string(scanlineSize, 0);
-			else
-				return "fill scanlines: bad state";
-		}
-		
-		size_t nbytes_to_copy = std::min(s, scanlineSize - png.incompleteScanlineOffset);
-		memcpy(&buf[png.incompleteScanlineOffset], data, nbytes_to_copy);
-		png.incompleteScanlineOffset += nbytes_to_copy;
-		data += nbytes_to_copy;
-		s -= nbytes_to_copy;
-		
-		if(png.incompleteScanlineOffset == scanlineSize) {
-			png.scanlines.push_back(buf);
-			if(png.header.interlaceMethod == 1) {
-				png.interlacedPos.inc(png.header.height);
-				scanlineSize = png.header.scanlineSize(png.interlacedPos.scanlineWidth(png.header.width));
-			}
-			png.incompleteScanlineOffset = 0;
+	while(png.scanlines.incompleteSize() >= scanlineSize) {
+		if(png.unfilter)
+			ASSERT( __PngReader_unfilterRow(png, scanlineSize) );
+		png.scanlines.completeRow(scanlineSize);
+		if(png.header.interlaceMethod == 1) {
+			short pass = png.interlacedPos.pass;
+			png.interlacedPos.inc(png.header.height);
+			if(png.interlacedPos.pass != pass)
+				png.priorScanline.clear();
+			scanlineSize = png.header.scanlineSize(png.interlacedPos.scanlineWidth(png.header.width));
 		}
 	}
 	
@@ -175,9 +189,9 @@ static Return __PngReader_read_data(PngReader& png, PngChunk& chunk) {
 	png.stream.avail_in = chunk.data.size();
 	png.stream.next_in = (unsigned char*) &chunk.data[0];
 	while(true) {
-		char outputData[1024*128];
-		png.stream.avail_out = sizeof(outputData);
-		png.stream.next_out = (unsigned char*) outputData;
+		const size_t outputSize = 1024*128;
+		png.stream.avail_out = outputSize;
+		png.stream.next_out = (unsigned char*) png.scanlines.reserve(outputSize);
 		int ret = inflate(&png.stream, Z_NO_FLUSH);
 		switch(ret) {
 			case Z_STREAM_ERROR: return "zlib stream error / invalid compression level";
@@ -186,9 +200,10 @@ static Return __PngReader_read_data(PngReader& png, PngChunk& chunk) {
 			case Z_MEM_ERROR: return "zlib out-of-memory error";
 			case Z_STREAM_END: png.gotStreamEnd = true;
 		}
-		size_t out_size = sizeof(outputData) - png.stream.avail_out;
+		size_t out_size = outputSize - png.stream.avail_out;
 		if(out_size == 0) break;
-		ASSERT( __PngReader_fill_scanlines(png, outputData, out_size) );
+		png.scanlines.commit(out_size);
+		ASSERT( __PngReader_fill_scanlines(png) );
 	}
 	return true;
 }
@@ -211,7 +226,7 @@ static Return __PngReader_read(PngReader& png) {
 		chunk.data = ""; // reset because we don't want to keep this in the stored chunk list
 	}
 	else if(chunk.type == "IHDR") {
-		ASSERT( __PngReader_read_header(png.header, chunk) );
+		ASSERT( png_read_header(png.header, chunk) );
 		png.gotHeader = true;
 	}
 	else if(chunk.type == "IEND")
@@ -248,6 +263,16 @@ PngWriter::PngWriter(WriteCallbackIntf* w) {
 	stream.opaque = Z_NULL;
 	hasInitialized = hasFinishedWriting = false;
 	hasAllChunks = hasAllScanlines = false;
+	refilter = false;
+	hasStartedBands = fixedBandsAdler = false;
+	bandsAdler = adler32(0L, Z_NULL, 0);
+}
+
+void PngWriter::resumeBands(uint32_t adler) {
+	// the deflate stream is never initialized then. deflateEnd() handles that
+	hasInitialized = hasAllChunks = true;
+	hasStartedBands = fixedBandsAdler = true;
+	bandsAdler = adler;
 }
 
 PngWriter::~PngWriter() {
@@ -300,6 +325,81 @@ static Return __PngWriter_feedData(PngWriter& png, const std::string& data, bool
 	return true;
 }
 
+Return PngRefilter::filter(char* row, size_t size) {
+	if(size == 0) return "scanline is empty";
+	rawScanline.assign(row + 1, row + size);
+	const char* prior = (priorScanline.size() == size - 1) ? &priorScanline[0] : NULL;
+	ASSERT( png_filter_scanline(row, prior, size, header.bytesPerPixel()) );
+	priorScanline.swap(rawScanline);
+	if(header.interlaceMethod == 1) {
+		short pass = interlacedPos.pass;
+		interlacedPos.inc(header.height);
+		if(interlacedPos.pass != pass)
+			priorScanline.clear();
+	}
+	return true;
+}
+
+PngBandDeflater::PngBandDeflater() {
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+	hasInitialized = false;
+}
+
+PngBandDeflater::~PngBandDeflater() {
+	if(hasInitialized)
+		deflateEnd(&stream);
+}
+
+Return PngBandDeflater::deflate(const char* data, size_t size, PngDeflatedBand& band) {
+	if(!hasInitialized) {
+		// raw deflate (negative window bits), the zlib header comes from PngWriter
+		if(deflateInit2(&stream, Z_CompressionLevel, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return "failed to init deflate stream";
+		hasInitialized = true;
+	}
+	else if(deflateReset(&stream) != Z_OK) // no back-references into the band before
+		return "failed to reset deflate stream";
+	
+	band.data.clear();
+	band.adler = adler32(adler32(0L, Z_NULL, 0), (const Bytef*) data, size);
+	band.size = size;
+	stream.avail_in = size;
+	stream.next_in = (unsigned char*) data;
+	while(true) {
+		char outputData[Z_BufSize];
+		stream.avail_out = sizeof(outputData);
+		stream.next_out = (unsigned char*) outputData;
+		// the full flush ends it byte-aligned with an empty stored block
+		int ret = ::deflate(&stream, Z_FULL_FLUSH);
+		if(ret != Z_OK && ret != Z_BUF_ERROR)
+			return "failed to deflate band";
+		band.data.append(outputData, sizeof(outputData) - stream.avail_out);
+		if(stream.avail_out != 0) break;
+	}
+	return true;
+}
+
+// The zlib header, then the bands, then an empty final block and the adler32 of all of them.
+static Return __PngWriter_feedBand(PngWriter& png, const PngDeflatedBand& band, bool isFinal) {
+	if(!png.hasStartedBands) {
+		static const char zlibHeader[2] = { 0x78, (char)0xda }; // 32k window, level 9
+		ASSERT( __PngWriter_feedCompressedData(png, zlibHeader, sizeof(zlibHeader)) );
+		png.hasStartedBands = true;
+	}
+	ASSERT( __PngWriter_feedCompressedData(png, band.data.data(), band.data.size()) );
+	if(!png.fixedBandsAdler)
+		png.bandsAdler = adler32_combine(png.bandsAdler, band.adler, band.size);
+	if(isFinal) {
+		static const char finalBlock[2] = { 0x03, 0x00 }; // BFINAL, fixed Huffman, end-of-block code
+		ASSERT( __PngWriter_feedCompressedData(png, finalBlock, sizeof(finalBlock)) );
+		std::string adler = rawString<uint32_t>(png.bandsAdler);
+		ASSERT( __PngWriter_feedCompressedData(png, adler.data(), adler.size()) );
+	}
+	return true;
+}
+
 Return PngWriter::write() {
 	if(!hasInitialized) {
 		deflateInit(&stream, Z_CompressionLevel);
@@ -309,6 +409,8 @@ Return PngWriter::write() {
 	}
 	
 	if(chunks.size() > 0) {
+		if(chunks.front().type == "IHDR")
+			ASSERT( png_read_header(refilterState.header, chunks.front()) );
 		ASSERT( png_write_chunk(writer, chunks.front()) );
 		chunks.pop_front();
 		return true;
@@ -318,7 +420,7 @@ Return PngWriter::write() {
 	if(dataChunks.size() > 0) {
 		// We want to have the data chunk size = PngDataChunkSize.
 		// The only case where we cannot have this is at the very end.
-		if((scanlines.size() == 0 && hasAllScanlines) || dataChunks.front().size() == PngDataChunkSize) {
+		if((scanlines.size() == 0 && deflatedBands.size() == 0 && hasAllScanlines) || dataChunks.front().size() == PngDataChunkSize) {
 			PngChunk chunk;
 			chunk.type = "IDAT";
 			chunk.data = dataChunks.front();
@@ -328,7 +430,15 @@ Return PngWriter::write() {
 		}
 	}
 	
+	if(deflatedBands.size() > 0) {
+		ASSERT( __PngWriter_feedBand(*this, deflatedBands.front(), hasAllScanlines && deflatedBands.size() == 1) );
+		deflatedBands.pop_front();
+		return true;
+	}
+	
 	if(scanlines.size() > 0) {
+		if(refilter)
+			ASSERT( refilterState.filter(&scanlines.front()[0], scanlines.front().size()) );
 		ASSERT( __PngWriter_feedData(*this, scanlines.front(), hasAllScanlines && scanlines.size() == 1) );
 		scanlines.pop_front();
 		return true;
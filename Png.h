@@ -8,13 +8,21 @@
 
 #include "Return.h"
 #include "Utils.h"
+#include "PngFilter.h"
 
 #include <string>
 #include <list>
+#include <vector>
+#include <deque>
 #include <cstdio>
+#include <cstring>
 #include <zlib.h>
 #include <stdint.h>
 
+#ifndef PngDataChunkSize
+#define PngDataChunkSize 8192 // the IDAT chunks of PngWriter, the last one can be smaller
+#endif
+
 struct PngChunk {
 	std::string type;
 	std::string data;
@@ -52,8 +60,15 @@ struct PngHeader {
 	uint32_t scanlineSize(uint32_t width) {
 		return (width * samplesPerPixel() * bitDepth + 7) / 8 + /* filter type byte */ 1;
 	}
+	
+	// the best ones for this CPU. NULL if bytesPerPixel() is invalid
+	const PngFilterKernels* filterKernels() {
+		return png_filter_kernels(bytesPerPixel());
+	}
 };
 
+Return png_read_header(PngHeader& header, const PngChunk& chunk); // from IHDR chunk
+
 struct PngInterlacedPos {
 	short pass;
 	uint32_t row;
@@ -62,6 +77,28 @@ struct PngInterlacedPos {
 	size_t scanlineWidth(uint32_t width);
 };
 
+// Decoded scanlines. They are stored one after another in one buffer, so inflate
+// can write directly into it and the rows can be read without copying them.
+// Consumed rows are dropped from the front; the buffer is compacted only when it is full.
+struct PngScanlineBuffer {
+	std::vector<char> buffer;
+	size_t start; // begin of the first row
+	size_t completeEnd; // end of the last complete row
+	size_t end; // end of the data. [completeEnd,end) is the incomplete row
+	std::deque<size_t> rowSizes; // of the complete rows
+	
+	PngScanlineBuffer() : start(0), completeEnd(0), end(0) {}
+	size_t size() const { return rowSizes.size(); } // number of complete rows
+	size_t rowSize(size_t i) const { return rowSizes[i]; }
+	const char* front() const { return buffer.empty() ? NULL : &buffer[start]; } // the rows follow directly
+	size_t dataSize() const { return completeEnd - start; } // of the complete rows
+	void popFront(size_t n = 1);
+	char* reserve(size_t n); // gives space for n bytes at the end
+	void commit(size_t n) { end += n; }
+	size_t incompleteSize() const { return end - completeEnd; }
+	void completeRow(size_t s) { rowSizes.push_back(s); completeEnd += s; }
+};
+
 struct PngReader : DontCopyTag {
 	FILE* file;
 	z_stream stream;
@@ -70,15 +107,52 @@ struct PngReader : DontCopyTag {
 	std::list<PngChunk> chunks;
 	
 	PngInterlacedPos interlacedPos;
-	std::string incompleteScanline;
-	size_t incompleteScanlineOffset;
-	std::list<std::string> scanlines;
+	PngScanlineBuffer scanlines;
+	
+	// If set, the scanlines are unfiltered (but keep the filter type byte).
+	bool unfilter;
+	std::vector<char> priorScanline; // unfiltered, empty at the start of a pass
 	
 	PngReader(FILE* f = NULL);
 	~PngReader();
 	Return read();
 };
 
+// Applies the filters given by the filter type bytes of unfiltered scanlines (see PngReader::unfilter).
+// The scanlines must come in order, so it knows the prior scanline.
+struct PngRefilter {
+	PngHeader header; // from the IHDR chunk
+	PngInterlacedPos interlacedPos;
+	std::vector<char> priorScanline, rawScanline;
+	PngRefilter() { memset(&header, 0, sizeof(PngHeader)); }
+	Return filter(char* row, size_t size);
+};
+
+// Independently deflated scanlines: raw deflate without back-references into the data
+// before it, ending byte-aligned with a full flush. So PngWriter can put several of them
+// one after another into the zlib stream of IDAT without any recompression.
+struct PngDeflatedBand {
+	std::string data; // raw deflate data, without any zlib header
+	uint32_t adler; // adler32 of the scanlines
+	uint32_t size; // of the scanlines
+	PngDeflatedBand() : adler(1), size(0) {}
+};
+
+// The zlib stream of the bands in PngWriter: the zlib header, the bands, an empty final block and the adler32.
+inline uint64_t png_deflated_bands_stream_size(uint64_t bandsSize) { return 2 + bandsSize + 2 + 4; }
+// The size of the IDAT chunks (with len, type and CRC) of PngWriter for the given zlib stream size.
+inline uint64_t png_idat_chunks_size(uint64_t streamSize) {
+	return streamSize + 12 * ((streamSize + PngDataChunkSize - 1) / PngDataChunkSize);
+}
+
+struct PngBandDeflater : DontCopyTag {
+	z_stream stream;
+	bool hasInitialized;
+	PngBandDeflater();
+	~PngBandDeflater();
+	Return deflate(const char* data, size_t size, /*out*/ PngDeflatedBand& band);
+};
+
 struct PngWriter : DontCopyTag {
 	WriteCallbackIntf* writer;
 	z_stream stream;
@@ -87,10 +161,24 @@ struct PngWriter : DontCopyTag {
 	std::list<std::string> dataChunks;
 	bool hasInitialized, hasFinishedWriting; // these are set from write()
 	bool hasAllChunks, hasAllScanlines; // these are expected to be set from outside
+	
+	// If set, the scanlines are unfiltered and we apply the filter given by their filter type byte.
+	bool refilter;
+	PngRefilter refilterState;
+	
+	// Instead of scanlines, the data can also be given already deflated.
+	// Then the zlib stream is just stitched together, see PngDeflatedBand.
+	std::list<PngDeflatedBand> deflatedBands;
+	bool hasStartedBands;
+	bool fixedBandsAdler; // bandsAdler is given, see resumeBands()
+	uint32_t bandsAdler; // combined from the bands
 
 	PngWriter(WriteCallbackIntf* w = NULL);
 	~PngWriter();
 	Return write();
+	// Starts within the zlib stream of the bands, i.e. without the PNG signature, the chunks
+	// and the zlib header. adler is the adler32 of all the bands (also those before).
+	void resumeBands(uint32_t adler);
 };
 
 #endif
@@ -0,0 +1,546 @@
+/* PNG filter kernels
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "PngFilter.h"
+#include <cstring>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PngFilter_X86
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <immintrin.h>
+#define PngFilter_SSE2 __attribute__((target("sse2")))
+#define PngFilter_SSSE3 __attribute__((target("ssse3")))
+#define PngFilter_AVX2 __attribute__((target("avx2")))
+#endif
+
+/*
+ Unfiltering Sub, Average and Paeth depends on the left pixel, so it goes pixel by pixel.
+ The SIMD versions of these use one register per pixel (Average, Paeth)
+ or a prefix sum within the register (Sub).
+ Filtering has no such dependency and is done for 16 (SSE) or 32 (AVX2) bytes at once.
+ It goes backwards through the row, so the left neighbours are still unfiltered.
+ */
+
+// Written without branches (the compiler uses cmov), because they are unpredictable here.
+static inline uint8_t __paeth(int a, int b, int c) {
+	int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+	int bc = (pb <= pc) ? b : c;
+	return (pa <= pb && pa <= pc) ? a : bc;
+}
+
+// scalar
+
+// These start at row[start] and are also used for the remaining bytes of the SIMD versions.
+template<size_t BPP> static inline void __unfilterSubFrom(uint8_t* row, size_t start, size_t size) {
+	for(size_t i = (start > BPP) ? start : BPP; i < size; ++i)
+		row[i] += row[i - BPP];
+}
+
+static inline void __unfilterUpFrom(uint8_t* row, const uint8_t* prior, size_t start, size_t size) {
+	for(size_t i = start; i < size; ++i)
+		row[i] += prior[i];
+}
+
+template<size_t BPP> static inline void __unfilterAvgFrom(uint8_t* row, const uint8_t* prior, size_t start, size_t size) {
+	size_t i = start;
+	for(; i < BPP && i < size; ++i)
+		row[i] += prior[i] >> 1;
+	for(; i < size; ++i)
+		row[i] += (row[i - BPP] + prior[i]) >> 1;
+}
+
+template<size_t BPP> static inline void __unfilterPaethFrom(uint8_t* row, const uint8_t* prior, size_t start, size_t size) {
+	size_t i = start;
+	for(; i < BPP && i < size; ++i)
+		row[i] += prior[i];
+	for(; i < size; ++i)
+		row[i] += __paeth(row[i - BPP], prior[i], prior[i - BPP]);
+}
+
+// These filter row[0,size) backwards.
+template<size_t BPP> static inline void __filterSubTo(uint8_t* row, size_t size) {
+	for(size_t i = size; i > BPP; --i)
+		row[i - 1] -= row[i - 1 - BPP];
+}
+
+static inline void __filterUpTo(uint8_t* row, const uint8_t* prior, size_t size) {
+	for(size_t i = size; i > 0; --i)
+		row[i - 1] -= prior[i - 1];
+}
+
+template<size_t BPP> static inline void __filterAvgTo(uint8_t* row, const uint8_t* prior, size_t size) {
+	size_t i = size;
+	for(; i > BPP; --i)
+		row[i - 1] -= (row[i - 1 - BPP] + prior[i - 1]) >> 1;
+	for(; i > 0; --i)
+		row[i - 1] -= prior[i - 1] >> 1;
+}
+
+template<size_t BPP> static inline void __filterPaethTo(uint8_t* row, const uint8_t* prior, size_t size) {
+	size_t i = size;
+	for(; i > BPP; --i)
+		row[i - 1] -= __paeth(row[i - 1 - BPP], prior[i - 1], prior[i - 1 - BPP]);
+	for(; i > 0; --i)
+		row[i - 1] -= prior[i - 1];
+}
+
+template<size_t BPP> static void __unfilterSub(uint8_t* row, const uint8_t*, size_t size) { __unfilterSubFrom<BPP>(row, 0, size); }
+static void __unfilterUp(uint8_t* row, const uint8_t* prior, size_t size) { __unfilterUpFrom(row, prior, 0, size); }
+template<size_t BPP> static void __unfilterAvg(uint8_t* row, const uint8_t* prior, size_t size) { __unfilterAvgFrom<BPP>(row, prior, 0, size); }
+template<size_t BPP> static void __unfilterPaeth(uint8_t* row, const uint8_t* prior, size_t size) { __unfilterPaethFrom<BPP>(row, prior, 0, size); }
+template<size_t BPP> static void __filterSub(uint8_t* row, const uint8_t*, size_t size) { __filterSubTo<BPP>(row, size); }
+static void __filterUp(uint8_t* row, const uint8_t* prior, size_t size) { __filterUpTo(row, prior, size); }
+template<size_t BPP> static void __filterAvg(uint8_t* row, const uint8_t* prior, size_t size) { __filterAvgTo<BPP>(row, prior, size); }
+template<size_t BPP> static void __filterPaeth(uint8_t* row, const uint8_t* prior, size_t size) { __filterPaethTo<BPP>(row, prior, size); }
+
+#ifdef PngFilter_X86
+
+// SSE2
+
+static PngFilter_SSE2 void __unfilterUp_sse2(uint8_t* row, const uint8_t* prior, size_t size) {
+	size_t i = 0;
+	for(; i + 16 <= size; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prior + i));
+		_mm_storeu_si128((__m128i*)(row + i), _mm_add_epi8(x, b));
+	}
+	__unfilterUpFrom(row, prior, i, size);
+}
+
+// Sums up each byte with the same bytes of all the pixels left of it in the register.
+template<size_t BPP> static inline PngFilter_SSE2 __m128i __prefixSum_sse2(__m128i x) {
+	x = _mm_add_epi8(x, _mm_slli_si128(x, BPP));
+	if(2 * BPP < 16) x = _mm_add_epi8(x, _mm_slli_si128(x, 2 * BPP));
+	if(4 * BPP < 16) x = _mm_add_epi8(x, _mm_slli_si128(x, 4 * BPP));
+	if(8 * BPP < 16) x = _mm_add_epi8(x, _mm_slli_si128(x, 8 * BPP));
+	return x;
+}
+
+// The pixel at [pos, pos + BPP), repeated over the whole register.
+template<size_t BPP, size_t POS> static inline PngFilter_SSE2 __m128i __broadcastPixel_sse2(__m128i x) {
+	x = _mm_srli_si128(x, POS);
+	x = _mm_slli_si128(x, 16 - BPP);
+	x = _mm_srli_si128(x, 16 - BPP);
+	x = _mm_or_si128(x, _mm_slli_si128(x, BPP));
+	if(2 * BPP < 16) x = _mm_or_si128(x, _mm_slli_si128(x, 2 * BPP));
+	if(4 * BPP < 16) x = _mm_or_si128(x, _mm_slli_si128(x, 4 * BPP));
+	if(8 * BPP < 16) x = _mm_or_si128(x, _mm_slli_si128(x, 8 * BPP));
+	return x;
+}
+
+// We go in steps of whole pixels. For bpp 3 and 6, the last bytes of each register
+// are done twice, so we load the next register before we store the current one.
+template<size_t BPP> static PngFilter_SSE2 void __unfilterSub_sse2(uint8_t* row, const uint8_t*, size_t size) {
+	const size_t STEP = 16 - 16 % BPP;
+	size_t i = 0;
+	if(size >= 16) {
+		__m128i carry = _mm_setzero_si128(); // last pixel of the previous register
+		__m128i x = _mm_loadu_si128((const __m128i*)row);
+		for(; i + STEP + 16 <= size; i += STEP) {
+			__m128i next = _mm_loadu_si128((const __m128i*)(row + i + STEP));
+			x = _mm_add_epi8(__prefixSum_sse2<BPP>(x), carry);
+			_mm_storeu_si128((__m128i*)(row + i), x);
+			carry = __broadcastPixel_sse2<BPP, STEP - BPP>(x);
+			x = next;
+		}
+		x = _mm_add_epi8(__prefixSum_sse2<BPP>(x), carry);
+		_mm_storeu_si128((__m128i*)(row + i), x);
+		i += 16;
+	}
+	__unfilterSubFrom<BPP>(row, i, size);
+}
+
+// Pixels are loaded with 4 or 8 bytes (single moves), i.e. for bpp 3 and 6 with some bytes
+// of the next pixel. These are computed as well but not stored. We store exactly
+// the pixel, otherwise the store would overlap with the next load, which is slow.
+// For bpp 1 and 2, one register per pixel is slower than the scalar code, so we use that.
+template<size_t BPP> struct __Pixel {
+	static const size_t LOAD = (BPP <= 4) ? 4 : 8;
+};
+
+template<size_t BPP> static inline PngFilter_SSE2 __m128i __loadPixel_sse2(const uint8_t* p) {
+	uint64_t v = 0;
+	memcpy(&v, p, __Pixel<BPP>::LOAD);
+	return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)&v), _mm_setzero_si128());
+}
+
+template<size_t BPP> static inline PngFilter_SSE2 void __storePixel_sse2(uint8_t* p, __m128i x) {
+	uint64_t v;
+	_mm_storel_epi64((__m128i*)&v, _mm_packus_epi16(x, x));
+	memcpy(p, &v, BPP);
+}
+
+template<size_t BPP> static PngFilter_SSE2 void __unfilterAvg_sse2(uint8_t* row, const uint8_t* prior, size_t size) {
+	if(BPP <= 2) { __unfilterAvgFrom<BPP>(row, prior, 0, size); return; } // see __Pixel
+	const __m128i mask = _mm_set1_epi16(0xff);
+	__m128i a = _mm_setzero_si128();
+	size_t i = 0;
+	for(; i + __Pixel<BPP>::LOAD <= size; i += BPP) {
+		__m128i b = __loadPixel_sse2<BPP>(prior + i);
+		__m128i x = __loadPixel_sse2<BPP>(row + i);
+		a = _mm_and_si128(_mm_add_epi16(x, _mm_srli_epi16(_mm_add_epi16(a, b), 1)), mask);
+		__storePixel_sse2<BPP>(row + i, a);
+	}
+	__unfilterAvgFrom<BPP>(row, prior, i, size);
+}
+
+// a, b, c and the result are 16 bit
+static inline PngFilter_SSE2 __m128i __paethPredictor_sse2(__m128i a, __m128i b, __m128i c) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i pa = _mm_sub_epi16(b, c);
+	__m128i pb = _mm_sub_epi16(a, c);
+	__m128i pc = _mm_add_epi16(pa, pb);
+	pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+	pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+	pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+	__m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+	__m128i notB = _mm_cmpgt_epi16(pb, pc);
+	__m128i bc = _mm_or_si128(_mm_and_si128(notB, c), _mm_andnot_si128(notB, b));
+	return _mm_or_si128(_mm_and_si128(notA, bc), _mm_andnot_si128(notA, a));
+}
+
+template<size_t BPP> static PngFilter_SSE2 void __unfilterPaeth_sse2(uint8_t* row, const uint8_t* prior, size_t size) {
+	if(BPP <= 2) { __unfilterPaethFrom<BPP>(row, prior, 0, size); return; } // see __Pixel
+	const __m128i mask = _mm_set1_epi16(0xff);
+	__m128i a = _mm_setzero_si128(), c = _mm_setzero_si128();
+	size_t i = 0;
+	for(; i + __Pixel<BPP>::LOAD <= size; i += BPP) {
+		__m128i b = __loadPixel_sse2<BPP>(prior + i);
+		__m128i x = __loadPixel_sse2<BPP>(row + i);
+		a = _mm_and_si128(_mm_add_epi16(x, __paethPredictor_sse2(a, b, c)), mask);
+		__storePixel_sse2<BPP>(row + i, a);
+		c = b;
+	}
+	__unfilterPaethFrom<BPP>(row, prior, i, size);
+}
+
+template<size_t BPP> static PngFilter_SSE2 void __filterSub_sse2(uint8_t* row, const uint8_t*, size_t size) {
+	size_t i = size;
+	for(; i >= 16 + BPP; i -= 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(row + i - 16));
+		__m128i a = _mm_loadu_si128((const __m128i*)(row + i - 16 - BPP));
+		_mm_storeu_si128((__m128i*)(row + i - 16), _mm_sub_epi8(x, a));
+	}
+	__filterSubTo<BPP>(row, i);
+}
+
+static PngFilter_SSE2 void __filterUp_sse2(uint8_t* row, const uint8_t* prior, size_t size) {
+	size_t i = size;
+	for(; i >= 16; i -= 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(row + i - 16));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prior + i - 16));
+		_mm_storeu_si128((__m128i*)(row + i - 16), _mm_sub_epi8(x, b));
+	}
+	__filterUpTo(row, prior, i);
+}
+
+// floor((a + b) / 2). _mm_avg_epu8 rounds up.
+static inline PngFilter_SSE2 __m128i __avgFloor_sse2(__m128i a, __m128i b) {
+	return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+template<size_t BPP> static PngFilter_SSE2 void __filterAvg_sse2(uint8_t* row, const uint8_t* prior, size_t size) {
+	size_t i = size;
+	for(; i >= 16 + BPP; i -= 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(row + i - 16));
+		__m128i a = _mm_loadu_si128((const __m128i*)(row + i - 16 - BPP));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prior + i - 16));
+		_mm_storeu_si128((__m128i*)(row + i - 16), _mm_sub_epi8(x, __avgFloor_sse2(a, b)));
+	}
+	__filterAvgTo<BPP>(row, prior, i);
+}
+
+template<size_t BPP> static PngFilter_SSE2 void __filterPaeth_sse2(uint8_t* row, const uint8_t* prior, size_t size) {
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = size;
+	for(; i >= 16 + BPP; i -= 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(row + i - 16));
+		__m128i a = _mm_loadu_si128((const __m128i*)(row + i - 16 - BPP));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prior + i - 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(prior + i - 16 - BPP));
+		__m128i lo = __paethPredictor_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+		__m128i hi = __paethPredictor_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+		_mm_storeu_si128((__m128i*)(row + i - 16), _mm_sub_epi8(x, _mm_packus_epi16(lo, hi)));
+	}
+	__filterPaethTo<BPP>(row, prior, i);
+}
+
+// SSSE3: Paeth with _mm_abs_epi16. The other kernels are the SSE2 ones.
+
+static inline PngFilter_SSSE3 __m128i __paethPredictor_ssse3(__m128i a, __m128i b, __m128i c) {
+	__m128i pa = _mm_sub_epi16(b, c);
+	__m128i pb = _mm_sub_epi16(a, c);
+	__m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+	pa = _mm_abs_epi16(pa);
+	pb = _mm_abs_epi16(pb);
+	__m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+	__m128i notB = _mm_cmpgt_epi16(pb, pc);
+	__m128i bc = _mm_or_si128(_mm_and_si128(notB, c), _mm_andnot_si128(notB, b));
+	return _mm_or_si128(_mm_and_si128(notA, bc), _mm_andnot_si128(notA, a));
+}
+
+template<size_t BPP> static PngFilter_SSSE3 void __unfilterPaeth_ssse3(uint8_t* row, const uint8_t* prior, size_t size) {
+	if(BPP <= 2) { __unfilterPaethFrom<BPP>(row, prior, 0, size); return; } // see __Pixel
+	const __m128i mask = _mm_set1_epi16(0xff);
+	__m128i a = _mm_setzero_si128(), c = _mm_setzero_si128();
+	size_t i = 0;
+	for(; i + __Pixel<BPP>::LOAD <= size; i += BPP) {
+		__m128i b = __loadPixel_sse2<BPP>(prior + i);
+		__m128i x = __loadPixel_sse2<BPP>(row + i);
+		a = _mm_and_si128(_mm_add_epi16(x, __paethPredictor_ssse3(a, b, c)), mask);
+		__storePixel_sse2<BPP>(row + i, a);
+		c = b;
+	}
+	__unfilterPaethFrom<BPP>(row, prior, i, size);
+}
+
+template<size_t BPP> static PngFilter_SSSE3 void __filterPaeth_ssse3(uint8_t* row, const uint8_t* prior, size_t size) {
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = size;
+	for(; i >= 16 + BPP; i -= 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(row + i - 16));
+		__m128i a = _mm_loadu_si128((const __m128i*)(row + i - 16 - BPP));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prior + i - 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(prior + i - 16 - BPP));
+		__m128i lo = __paethPredictor_ssse3(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+		__m128i hi = __paethPredictor_ssse3(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+		_mm_storeu_si128((__m128i*)(row + i - 16), _mm_sub_epi8(x, _mm_packus_epi16(lo, hi)));
+	}
+	__filterPaethTo<BPP>(row, prior, i);
+}
+
+// AVX2: 32 bytes for Up and for the filtering. Unfiltering Sub, Average and Paeth
+// is pixel by pixel, so these are the SSE2/SSSE3 ones.
+
+static PngFilter_AVX2 void __unfilterUp_avx2(uint8_t* row, const uint8_t* prior, size_t size) {
+	size_t i = 0;
+	for(; i + 32 <= size; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(row + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(prior + i));
+		_mm256_storeu_si256((__m256i*)(row + i), _mm256_add_epi8(x, b));
+	}
+	__unfilterUpFrom(row, prior, i, size);
+}
+
+template<size_t BPP> static PngFilter_AVX2 void __filterSub_avx2(uint8_t* row, const uint8_t*, size_t size) {
+	size_t i = size;
+	for(; i >= 32 + BPP; i -= 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(row + i - 32));
+		__m256i a = _mm256_loadu_si256((const __m256i*)(row + i - 32 - BPP));
+		_mm256_storeu_si256((__m256i*)(row + i - 32), _mm256_sub_epi8(x, a));
+	}
+	__filterSubTo<BPP>(row, i);
+}
+
+static PngFilter_AVX2 void __filterUp_avx2(uint8_t* row, const uint8_t* prior, size_t size) {
+	size_t i = size;
+	for(; i >= 32; i -= 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(row + i - 32));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(prior + i - 32));
+		_mm256_storeu_si256((__m256i*)(row + i - 32), _mm256_sub_epi8(x, b));
+	}
+	__filterUpTo(row, prior, i);
+}
+
+template<size_t BPP> static PngFilter_AVX2 void __filterAvg_avx2(uint8_t* row, const uint8_t* prior, size_t size) {
+	const __m256i one = _mm256_set1_epi8(1);
+	size_t i = size;
+	for(; i >= 32 + BPP; i -= 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(row + i - 32));
+		__m256i a = _mm256_loadu_si256((const __m256i*)(row + i - 32 - BPP));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(prior + i - 32));
+		__m256i avg = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+		_mm256_storeu_si256((__m256i*)(row + i - 32), _mm256_sub_epi8(x, avg));
+	}
+	__filterAvgTo<BPP>(row, prior, i);
+}
+
+static inline PngFilter_AVX2 __m256i __paethPredictor_avx2(__m256i a, __m256i b, __m256i c) {
+	__m256i pa = _mm256_sub_epi16(b, c);
+	__m256i pb = _mm256_sub_epi16(a, c);
+	__m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+	pa = _mm256_abs_epi16(pa);
+	pb = _mm256_abs_epi16(pb);
+	__m256i notA = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+	__m256i notB = _mm256_cmpgt_epi16(pb, pc);
+	__m256i bc = _mm256_blendv_epi8(b, c, notB);
+	return _mm256_blendv_epi8(a, bc, notA);
+}
+
+// unpack and pack work within the 128 bit lanes, so the byte order stays the same
+template<size_t BPP> static PngFilter_AVX2 void __filterPaeth_avx2(uint8_t* row, const uint8_t* prior, size_t size) {
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = size;
+	for(; i >= 32 + BPP; i -= 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(row + i - 32));
+		__m256i a = _mm256_loadu_si256((const __m256i*)(row + i - 32 - BPP));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(prior + i - 32));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(prior + i - 32 - BPP));
+		__m256i lo = __paethPredictor_avx2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero));
+		__m256i hi = __paethPredictor_avx2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero));
+		_mm256_storeu_si256((__m256i*)(row + i - 32), _mm256_sub_epi8(x, _mm256_packus_epi16(lo, hi)));
+	}
+	__filterPaethTo<BPP>(row, prior, i);
+}
+
+#endif // PngFilter_X86
+
+#define __PngFilter_Scalar(BPP) \
+	{ "scalar", BPP, \
+	{ NULL, __unfilterSub<BPP>, __unfilterUp, __unfilterAvg<BPP>, __unfilterPaeth<BPP> }, \
+	{ NULL, __filterSub<BPP>, __filterUp, __filterAvg<BPP>, __filterPaeth<BPP> } }
+
+static const PngFilterKernels __kernelsScalar[] = {
+	__PngFilter_Scalar(1), __PngFilter_Scalar(2), __PngFilter_Scalar(3),
+	__PngFilter_Scalar(4), __PngFilter_Scalar(6), __PngFilter_Scalar(8)
+};
+
+#ifdef PngFilter_X86
+
+#define __PngFilter_SSE2(BPP) \
+	{ "sse2", BPP, \
+	{ NULL, __unfilterSub_sse2<BPP>, __unfilterUp_sse2, __unfilterAvg_sse2<BPP>, __unfilterPaeth_sse2<BPP> }, \
+	{ NULL, __filterSub_sse2<BPP>, __filterUp_sse2, __filterAvg_sse2<BPP>, __filterPaeth_sse2<BPP> } }
+
+#define __PngFilter_SSSE3(BPP) \
+	{ "ssse3", BPP, \
+	{ NULL, __unfilterSub_sse2<BPP>, __unfilterUp_sse2, __unfilterAvg_sse2<BPP>, __unfilterPaeth_ssse3<BPP> }, \
+	{ NULL, __filterSub_sse2<BPP>, __filterUp_sse2, __filterAvg_sse2<BPP>, __filterPaeth_ssse3<BPP> } }
+
+#define __PngFilter_AVX2(BPP) \
+	{ "avx2", BPP, \
+	{ NULL, __unfilterSub_sse2<BPP>, __unfilterUp_avx2, __unfilterAvg_sse2<BPP>, __unfilterPaeth_ssse3<BPP> }, \
+	{ NULL, __filterSub_avx2<BPP>, __filterUp_avx2, __filterAvg_avx2<BPP>, __filterPaeth_avx2<BPP> } }
+
+static const PngFilterKernels __kernelsSSE2[] = {
+	__PngFilter_SSE2(1), __PngFilter_SSE2(2), __PngFilter_SSE2(3),
+	__PngFilter_SSE2(4), __PngFilter_SSE2(6), __PngFilter_SSE2(8)
+};
+
+static const PngFilterKernels __kernelsSSSE3[] = {
+	__PngFilter_SSSE3(1), __PngFilter_SSSE3(2), __PngFilter_SSSE3(3),
+	__PngFilter_SSSE3(4), __PngFilter_SSSE3(6), __PngFilter_SSSE3(8)
+};
+
+static const PngFilterKernels __kernelsAVX2[] = {
+	__PngFilter_AVX2(1), __PngFilter_AVX2(2), __PngFilter_AVX2(3),
+	__PngFilter_AVX2(4), __PngFilter_AVX2(6), __PngFilter_AVX2(8)
+};
+
+#ifndef bit_AVX2
+#define bit_AVX2 (1 << 5)
+#endif
+
+static int __detectCpuIsa() {
+	unsigned int a, b, c, d;
+	if(!__get_cpuid(1, &a, &b, &c, &d)) return PngFilterIsa_Scalar;
+	if(!(d & bit_SSE2)) return PngFilterIsa_Scalar;
+	if(!(c & bit_SSSE3)) return PngFilterIsa_SSE2;
+	// AVX2 also needs the OS to save the YMM registers
+	if(!(c & bit_OSXSAVE) || !(c & bit_AVX)) return PngFilterIsa_SSSE3;
+	unsigned int xcr0, xcr0High;
+	__asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0High) : "c"(0));
+	if((xcr0 & 6) != 6) return PngFilterIsa_SSSE3;
+	if(__get_cpuid_max(0, NULL) < 7) return PngFilterIsa_SSSE3;
+	__cpuid_count(7, 0, a, b, c, d);
+	if(!(b & bit_AVX2)) return PngFilterIsa_SSSE3;
+	return PngFilterIsa_AVX2;
+}
+
+#else
+
+static int __detectCpuIsa() { return PngFilterIsa_Scalar; }
+
+#endif // PngFilter_X86
+
+int png_filter_cpu_isa() {
+	// the detection gives always the same, so it doesn't matter if two threads do it
+	static int isa = -1;
+	if(isa < 0) isa = __detectCpuIsa();
+	return isa;
+}
+
+const PngFilterKernels* png_filter_kernels(size_t bpp, int isa) {
+	int i = -1;
+	switch(bpp) {
+		case 1: i = 0; break;
+		case 2: i = 1; break;
+		case 3: i = 2; break;
+		case 4: i = 3; break;
+		case 6: i = 4; break;
+		case 8: i = 5; break;
+	}
+	if(i < 0 || isa < 0 || isa > png_filter_cpu_isa()) return NULL;
+	switch(isa) {
+		case PngFilterIsa_Scalar: return &__kernelsScalar[i];
+#ifdef PngFilter_X86
+		case PngFilterIsa_SSE2: return &__kernelsSSE2[i];
+		case PngFilterIsa_SSSE3: return &__kernelsSSSE3[i];
+		case PngFilterIsa_AVX2: return &__kernelsAVX2[i];
+#endif
+	}
+	return NULL;
+}
+
+const PngFilterKernels* png_filter_kernels(size_t bpp) {
+	return png_filter_kernels(bpp, png_filter_cpu_isa());
+}
+
+Return png_unfilter_scanline(char* _row, const char* _prior, size_t size, size_t bpp) {
+	if(size == 0) return "scanline is empty";
+	uint8_t type = _row[0];
+	if(type > 4) return "invalid filter type";
+	const PngFilterKernels* kernels = png_filter_kernels(bpp);
+	if(kernels == NULL) return "invalid bytes per pixel";
+	uint8_t* row = (uint8_t*) _row + 1;
+	const uint8_t* prior = (const uint8_t*) _prior;
+	size -= 1;
+	if(type == 0) return true; // None
+	if(prior) {
+		kernels->unfilter[type](row, prior, size);
+		return true;
+	}
+	// first scanline of a pass: prior is all 0
+	switch(type) {
+		case 1: case 4: // Sub; Paeth is the same here
+			kernels->unfilter[1](row, NULL, size);
+			break;
+		case 3: // Average
+			for(size_t i = bpp; i < size; ++i)
+				row[i] += row[i - bpp] >> 1;
+			break;
+	}
+	return true;
+}
+
+Return png_filter_scanline(char* _row, const char* _prior, size_t size, size_t bpp) {
+	if(size == 0) return "scanline is empty";
+	uint8_t type = _row[0];
+	if(type > 4) return "invalid filter type";
+	const PngFilterKernels* kernels = png_filter_kernels(bpp);
+	if(kernels == NULL) return "invalid bytes per pixel";
+	uint8_t* row = (uint8_t*) _row + 1;
+	const uint8_t* prior = (const uint8_t*) _prior;
+	size -= 1;
+	if(type == 0) return true; // None
+	if(prior) {
+		kernels->filter[type](row, prior, size);
+		return true;
+	}
+	// first scanline of a pass: prior is all 0
+	switch(type) {
+		case 1: case 4: // Sub; Paeth is the same here
+			kernels->filter[1](row, NULL, size);
+			break;
+		case 3: // Average
+			for(size_t i = size; i > bpp; --i)
+				row[i - 1] -= row[i - 1 - bpp] >> 1;
+			break;
+	}
+	return true;
+}
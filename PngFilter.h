@@ -0,0 +1,42 @@
+/* PNG filter kernels (http://www.w3.org/TR/PNG/#9Filters)
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#ifndef __AZ__PNGFILTER_H__
+#define __AZ__PNGFILTER_H__
+
+#include "Return.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// row is the scanline with the filter type byte in front, size includes it.
+// prior is the previous unfiltered scanline of the pass (without the filter type byte)
+// or NULL for the first scanline of a pass. Both work in place and keep the filter type byte.
+// They use the kernels of png_filter_kernels(bpp).
+Return png_unfilter_scanline(char* row, const char* prior, size_t size, size_t bpp);
+Return png_filter_scanline(char* row, const char* prior, size_t size, size_t bpp);
+
+// A kernel works in place on the scanline data (without the filter type byte).
+// prior is never NULL here.
+typedef void (*PngFilterKernel)(uint8_t* row, const uint8_t* prior, size_t size);
+
+struct PngFilterKernels {
+	const char* name;
+	size_t bpp;
+	PngFilterKernel unfilter[5]; // by filter type. None (0) is NULL
+	PngFilterKernel filter[5];
+};
+
+#define PngFilterIsa_Scalar 0
+#define PngFilterIsa_SSE2 1
+#define PngFilterIsa_SSSE3 2
+#define PngFilterIsa_AVX2 3
+#define PngFilterIsa_Count 4
+
+int png_filter_cpu_isa(); // the best one this CPU supports, via cpuid
+// NULL if bpp is not one of 1,2,3,4,6,8 or if the CPU doesn't support the isa.
+const PngFilterKernels* png_filter_kernels(size_t bpp, int isa);
+const PngFilterKernels* png_filter_kernels(size_t bpp); // for png_filter_cpu_isa()
+
+#endif
@@ -0,0 +1,57 @@
+/* bounded blocking queue for passing work between threads
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#ifndef __AZ__QUEUE_H__
+#define __AZ__QUEUE_H__
+
+#include "Mutex.h"
+#include "Utils.h"
+#include <list>
+
+template<typename T>
+struct BoundedQueue : DontCopyTag {
+	Mutex mutex;
+	Condition notEmpty, notFull;
+	std::list<T> queue;
+	size_t size, maxSize;
+	bool closed;
+
+	BoundedQueue(size_t _maxSize) : size(0), maxSize(_maxSize ? _maxSize : 1), closed(false) {}
+
+	// Blocks while the queue is full. Returns false if the queue was closed.
+	bool push(const T& v) {
+		ScopedLock lock(mutex);
+		while(size >= maxSize && !closed)
+			notFull.wait(mutex);
+		if(closed) return false;
+		queue.push_back(v);
+		++size;
+		notEmpty.signal();
+		return true;
+	}
+
+	// Blocks while the queue is empty. Returns false if the queue was closed and nothing is left.
+	bool pop(T& v) {
+		ScopedLock lock(mutex);
+		while(size == 0 && !closed)
+			notEmpty.wait(mutex);
+		if(size == 0) return false;
+		v = queue.front();
+		queue.pop_front();
+		--size;
+		notFull.signal();
+		return true;
+	}
+
+	// Wakes up all waiters. Remaining entries can still be popped.
+	void close() {
+		ScopedLock lock(mutex);
+		closed = true;
+		notEmpty.broadcast();
+		notFull.broadcast();
+	}
+};
+
+#endif
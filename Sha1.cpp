@@ -131,7 +131,7 @@ static void SHA1_Transform(uint32_t state[5], const uint8_t buffer[64])
     CHAR64LONG16* block;
 
 #ifdef SHA1HANDSOFF
-    static uint8_t workspace[64];
+    uint8_t workspace[64]; /* not static: we are called from several threads */
     block = (CHAR64LONG16*)workspace;
     memcpy(block, buffer, 64);
 #else
@@ -179,6 +179,398 @@ static void SHA1_Transform(uint32_t state[5], const uint8_t buffer[64])
 }
 
 
+/* Fast paths, all of them give exactly the same as SHA1_Transform():
+ * - SHA-NI (x86 SHA extensions) for a single message,
+ * - multi-buffer: 4 (SSE2) or 8 (AVX2) independent messages in the lanes of a register.
+ * The lane code is SHA1_Transform() again (the R0-R4 macros) on GCC vector types.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define Sha1_X86
+#endif
+
+static void __sha1Blocks_scalar(uint32_t state[5], const uint8_t* data, size_t blocks) {
+	for(; blocks > 0; --blocks, data += 64)
+		SHA1_Transform(state, data);
+}
+
+typedef void (*Sha1BlocksFunc)(uint32_t state[5], const uint8_t* data, size_t blocks);
+
+// The padded last block(s) of a message of the given size, rest are its last size % 64 bytes.
+// Returns the number of blocks (1 or 2) in tail.
+static size_t __sha1PadTail(uint8_t tail[128], const uint8_t* rest, size_t restSize, size_t size) {
+	size_t tailBlocks = (restSize + 1 + 8 > 64) ? 2 : 1;
+	memset(tail, 0, 128);
+	if(restSize > 0) memcpy(tail, rest, restSize);
+	tail[restSize] = 0x80;
+	uint64_t bits = uint64_t(size) << 3;
+	for(int k = 0; k < 8; ++k)
+		tail[tailBlocks * 64 - 1 - k] = uint8_t(bits >> (k * 8));
+	return tailBlocks;
+}
+
+#ifdef Sha1_X86
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#ifndef bit_SHA
+#define bit_SHA (1 << 29)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2 (1 << 5)
+#endif
+
+// Bitmask of the supported isas.
+static int __detectCpuIsa() {
+	int s = 1 << Sha1Isa_Scalar;
+	unsigned int a, b, c, d;
+	if(!__get_cpuid(1, &a, &b, &c, &d)) return s;
+	if(d & bit_SSE2) s |= 1 << Sha1Isa_SSE2;
+	if(__get_cpuid_max(0, NULL) < 7) return s;
+	unsigned int c1 = c;
+	__cpuid_count(7, 0, a, b, c, d);
+	if((b & bit_SHA) && (c1 & bit_SSSE3) && (c1 & bit_SSE4_1)) s |= 1 << Sha1Isa_SHANI;
+	// AVX2 also needs the OS to save the YMM registers
+	if(!(c1 & bit_OSXSAVE) || !(c1 & bit_AVX)) return s;
+	unsigned int xcr0, xcr0High;
+	__asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0High) : "c"(0));
+	if(((xcr0 & 6) == 6) && (b & bit_AVX2)) s |= 1 << Sha1Isa_AVX2;
+	return s;
+}
+
+static __attribute__((target("sha,ssse3,sse4.1")))
+void __sha1Blocks_shani(uint32_t state[5], const uint8_t* data, size_t blocks) {
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) state), 0x1B);
+	__m128i E0 = _mm_set_epi32(state[4], 0, 0, 0), E1;
+	__m128i MSG0, MSG1, MSG2, MSG3;
+
+	for(; blocks > 0; --blocks, data += 64) {
+		const __m128i abcdSave = abcd, E0Save = E0;
+
+		/* Rounds 0-3 */
+		MSG0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), mask);
+		E0 = _mm_add_epi32(E0, MSG0);
+		E1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 0);
+		/* Rounds 4-7 */
+		MSG1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 0);
+		MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+		/* Rounds 8-11 */
+		MSG2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 0);
+		MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+		MSG0 = _mm_xor_si128(MSG0, MSG2);
+		/* Rounds 12-15 */
+		MSG3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = abcd;
+		MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 0);
+		MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+		MSG1 = _mm_xor_si128(MSG1, MSG3);
+		/* Rounds 16-19 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG0);
+		E1 = abcd;
+		MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 0);
+		MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+		MSG2 = _mm_xor_si128(MSG2, MSG0);
+		/* Rounds 20-23 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = abcd;
+		MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 1);
+		MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+		MSG3 = _mm_xor_si128(MSG3, MSG1);
+		/* Rounds 24-27 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = abcd;
+		MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 1);
+		MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+		MSG0 = _mm_xor_si128(MSG0, MSG2);
+		/* Rounds 28-31 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = abcd;
+		MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 1);
+		MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+		MSG1 = _mm_xor_si128(MSG1, MSG3);
+		/* Rounds 32-35 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG0);
+		E1 = abcd;
+		MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 1);
+		MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+		MSG2 = _mm_xor_si128(MSG2, MSG0);
+		/* Rounds 36-39 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = abcd;
+		MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 1);
+		MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+		MSG3 = _mm_xor_si128(MSG3, MSG1);
+		/* Rounds 40-43 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = abcd;
+		MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 2);
+		MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+		MSG0 = _mm_xor_si128(MSG0, MSG2);
+		/* Rounds 44-47 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = abcd;
+		MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 2);
+		MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+		MSG1 = _mm_xor_si128(MSG1, MSG3);
+		/* Rounds 48-51 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG0);
+		E1 = abcd;
+		MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 2);
+		MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+		MSG2 = _mm_xor_si128(MSG2, MSG0);
+		/* Rounds 52-55 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = abcd;
+		MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 2);
+		MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+		MSG3 = _mm_xor_si128(MSG3, MSG1);
+		/* Rounds 56-59 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = abcd;
+		MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 2);
+		MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+		MSG0 = _mm_xor_si128(MSG0, MSG2);
+		/* Rounds 60-63 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = abcd;
+		MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 3);
+		MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+		MSG1 = _mm_xor_si128(MSG1, MSG3);
+		/* Rounds 64-67 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG0);
+		E1 = abcd;
+		MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 3);
+		MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+		MSG2 = _mm_xor_si128(MSG2, MSG0);
+		/* Rounds 68-71 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = abcd;
+		MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 3);
+		MSG3 = _mm_xor_si128(MSG3, MSG1);
+		/* Rounds 72-75 */
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = abcd;
+		MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 3);
+		/* Rounds 76-79 */
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 3);
+
+		E0 = _mm_sha1nexte_epu32(E0, E0Save);
+		abcd = _mm_add_epi32(abcd, abcdSave);
+	}
+
+	_mm_storeu_si128((__m128i*) state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = _mm_extract_epi32(E0, 3);
+}
+
+typedef uint32_t Sha1Vec4 __attribute__((vector_size(16)));
+typedef uint32_t Sha1Vec8 __attribute__((vector_size(32)));
+
+template<typename V, size_t L> union Sha1Lanes {
+	V v;
+	uint32_t l[L];
+};
+
+// The words of the message blocks are already big endian here.
+#undef blk0
+#define blk0(i) block->l[i]
+
+// One block of each lane. Must be inlined into the target specific function
+// so that the vector code is compiled for that target.
+template<typename V, size_t L>
+static inline __attribute__((always_inline))
+void __sha1LanesTransform(V state[5], const uint8_t* const blocks[L]) {
+	V a, b, c, d, e;
+	struct { V l[16]; } workspace, *block = &workspace;
+	for(size_t i = 0; i < 16; ++i) {
+		Sha1Lanes<V,L> w;
+		for(size_t j = 0; j < L; ++j) {
+			uint32_t x;
+			memcpy(&x, blocks[j] + i * 4, 4);
+			w.l[j] = __builtin_bswap32(x);
+		}
+		block->l[i] = w.v;
+	}
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+
+    R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3);
+    R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7);
+    R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11);
+    R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15);
+    R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19);
+    R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23);
+    R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27);
+    R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31);
+    R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35);
+    R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39);
+    R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43);
+    R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47);
+    R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51);
+    R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55);
+    R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59);
+    R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63);
+    R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67);
+    R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71);
+    R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75);
+    R4(e,a,b,c,d,76); R4(d,e,a,b,c,77); R4(c,d,e,a,b,78); R4(b,c,d,e,a,79);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+#undef blk0
+
+// A message in a lane: first its full blocks from the data, then the padded tail.
+struct Sha1Lane {
+	size_t msg;
+	const uint8_t* data;
+	size_t fullBlocks;
+	uint8_t tail[128];
+	size_t tailBlocks;
+	size_t tailPos;
+	bool active;
+	Sha1Lane() : active(false) {}
+	void start(size_t i, const char* d, size_t size) {
+		msg = i;
+		data = (const uint8_t*) d;
+		fullBlocks = size / 64;
+		tailBlocks = __sha1PadTail(tail, data + fullBlocks * 64, size % 64, size);
+		tailPos = 0;
+		active = true;
+	}
+	// The next block, NULL when finished.
+	const uint8_t* next() {
+		if(fullBlocks > 0) {
+			fullBlocks--;
+			data += 64;
+			return data - 64;
+		}
+		if(tailPos < tailBlocks)
+			return tail + 64 * tailPos++;
+		return NULL;
+	}
+};
+
+template<typename V, size_t L>
+static inline __attribute__((always_inline))
+void __sha1ManyLanes(std::string* digests, const char* const* data, const size_t* sizes, size_t n) {
+	static const uint8_t zeroBlock[64] = {0};
+	static const uint32_t init[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	Sha1Lanes<V,L> state[5];
+	Sha1Lane lanes[L];
+	const uint8_t* blocks[L];
+	size_t nextMsg = 0;
+	while(true) {
+		size_t active = 0;
+		for(size_t j = 0; j < L; ++j) {
+			Sha1Lane& lane = lanes[j];
+			blocks[j] = lane.active ? lane.next() : NULL;
+			if(blocks[j] == NULL && lane.active) {
+				// finished
+				std::string& digest = digests[lane.msg];
+				digest.resize(SHA1_DIGEST_SIZE);
+				for(size_t i = 0; i < SHA1_DIGEST_SIZE; i++)
+					digest[i] = (char) ((state[i>>2].l[j] >> ((3-(i & 3)) * 8)) & 255);
+				lane.active = false;
+			}
+			if(blocks[j] == NULL && nextMsg < n) {
+				lane.start(nextMsg, data[nextMsg], sizes[nextMsg]);
+				nextMsg++;
+				for(int k = 0; k < 5; ++k) state[k].l[j] = init[k];
+				blocks[j] = lane.next();
+			}
+			if(blocks[j] == NULL) blocks[j] = zeroBlock; // idle lane
+			else active++;
+		}
+		if(active == 0) break;
+		V s[5] = { state[0].v, state[1].v, state[2].v, state[3].v, state[4].v };
+		__sha1LanesTransform<V,L>(s, blocks);
+		for(int k = 0; k < 5; ++k) state[k].v = s[k];
+	}
+}
+
+static void __sha1Many_sse2(std::string* digests, const char* const* data, const size_t* sizes, size_t n) {
+	__sha1ManyLanes<Sha1Vec4, 4>(digests, data, sizes, n);
+}
+
+static __attribute__((target("avx2")))
+void __sha1Many_avx2(std::string* digests, const char* const* data, const size_t* sizes, size_t n) {
+	__sha1ManyLanes<Sha1Vec8, 8>(digests, data, sizes, n);
+}
+
+#else
+
+static int __detectCpuIsa() { return 1 << Sha1Isa_Scalar; }
+
+#endif // Sha1_X86
+
+bool sha1_cpu_supports(int isa) {
+	// the detection gives always the same, so it doesn't matter if two threads do it
+	static int supported = -1;
+	if(supported < 0) supported = __detectCpuIsa();
+	if(isa < 0 || isa >= Sha1Isa_Count) return false;
+	return (supported & (1 << isa)) != 0;
+}
+
+const char* sha1_isa_name(int isa) {
+	switch(isa) {
+		case Sha1Isa_Scalar: return "scalar";
+		case Sha1Isa_SSE2: return "SSE2 (4 lanes)";
+		case Sha1Isa_AVX2: return "AVX2 (8 lanes)";
+		case Sha1Isa_SHANI: return "SHA-NI";
+	}
+	return "unknown";
+}
+
+static Sha1BlocksFunc __sha1Blocks(int isa) {
+#ifdef Sha1_X86
+	if(isa == Sha1Isa_SHANI) return __sha1Blocks_shani;
+#endif
+	return __sha1Blocks_scalar;
+}
+
+static Sha1BlocksFunc __sha1BestBlocks() {
+	static Sha1BlocksFunc f = NULL;
+	if(f == NULL) f = __sha1Blocks(sha1_cpu_supports(Sha1Isa_SHANI) ? Sha1Isa_SHANI : Sha1Isa_Scalar);
+	return f;
+}
+
+
 /* SHA1Init - Initialize new context */
 Sha1Context::Sha1Context()
 {
@@ -207,11 +599,11 @@ void Sha1Context::update(const char* d, size_t len)
     if ((context->count[0] += len << 3) < (len << 3)) context->count[1]++;
     context->count[1] += (len >> 29);
     if ((j + len) > 63) {
+        Sha1BlocksFunc blocks = __sha1BestBlocks();
         memcpy(&context->buffer[j], data, (i = 64-j));
-        SHA1_Transform(context->state, context->buffer);
-        for ( ; i + 63 < len; i += 64) {
-            SHA1_Transform(context->state, data + i);
-        }
+        blocks(context->state, context->buffer, 1);
+        blocks(context->state, data + i, (len - i) / 64);
+        i += (len - i) / 64 * 64;
         j = 0;
     }
     else i = 0;
@@ -271,8 +663,42 @@ std::string calc_sha1(const char* data, size_t size) {
 }
 */
 
+// Like Sha1Context but without the copying into the context buffer.
+static std::string __sha1Message(Sha1BlocksFunc blocks, const char* data, size_t size) {
+	static const uint32_t init[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	uint32_t state[5];
+	memcpy(state, init, sizeof(state));
+	size_t fullBlocks = size / 64, rest = size % 64;
+	blocks(state, (const uint8_t*) data, fullBlocks);
+	uint8_t tail[128];
+	size_t tailBlocks = __sha1PadTail(tail, (const uint8_t*) data + fullBlocks * 64, rest, size);
+	blocks(state, tail, tailBlocks);
+	std::string digest(SHA1_DIGEST_SIZE, 0);
+	for(size_t i = 0; i < SHA1_DIGEST_SIZE; i++)
+		digest[i] = (char) ((state[i>>2] >> ((3-(i & 3)) * 8)) & 255);
+	return digest;
+}
+
 std::string calc_sha1(const char* data, size_t size) {
-	Sha1Context c;
-	c.update(data, size);
-	return c.final();
+	return __sha1Message(__sha1BestBlocks(), data, size);
+}
+
+void calc_sha1_many(std::string* digests, const char* const* data, const size_t* sizes, size_t n) {
+	// With all 8 lanes filled, AVX2 is a bit faster than SHA-NI (see bench-sha1).
+	int isa = Sha1Isa_Scalar;
+	if(n >= 8 && sha1_cpu_supports(Sha1Isa_AVX2)) isa = Sha1Isa_AVX2;
+	else if(sha1_cpu_supports(Sha1Isa_SHANI)) isa = Sha1Isa_SHANI;
+	else if(n > 1 && sha1_cpu_supports(Sha1Isa_AVX2)) isa = Sha1Isa_AVX2;
+	else if(n > 1 && sha1_cpu_supports(Sha1Isa_SSE2)) isa = Sha1Isa_SSE2;
+	calc_sha1_many(digests, data, sizes, n, isa);
+}
+
+void calc_sha1_many(std::string* digests, const char* const* data, const size_t* sizes, size_t n, int isa) {
+#ifdef Sha1_X86
+	if(isa == Sha1Isa_SSE2) { __sha1Many_sse2(digests, data, sizes, n); return; }
+	if(isa == Sha1Isa_AVX2) { __sha1Many_avx2(digests, data, sizes, n); return; }
+#endif
+	Sha1BlocksFunc blocks = __sha1Blocks(isa);
+	for(size_t i = 0; i < n; ++i)
+		digests[i] = __sha1Message(blocks, data[i], sizes[i]);
 }
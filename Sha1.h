@@ -25,4 +25,18 @@ inline std::string calc_sha1(const std::string& data) {
 	return calc_sha1(&data[0], data.size());
 }
 
+// calc_sha1() uses SHA-NI (x86 SHA extensions) if the CPU has it.
+// calc_sha1_many() hashes n independent messages, the same as calc_sha1() on each.
+// It hashes 4 (SSE2) or 8 (AVX2) of them at once in the lanes of a register.
+#define Sha1Isa_Scalar 0
+#define Sha1Isa_SSE2 1 // only multi-buffer
+#define Sha1Isa_AVX2 2 // only multi-buffer
+#define Sha1Isa_SHANI 3
+#define Sha1Isa_Count 4
+
+bool sha1_cpu_supports(int isa); // via cpuid
+const char* sha1_isa_name(int isa);
+void calc_sha1_many(std::string* digests, const char* const* data, const size_t* sizes, size_t n);
+void calc_sha1_many(std::string* digests, const char* const* data, const size_t* sizes, size_t n, int isa); // isa must be supported
+
 #endif /* __SHA1_H */
@@ -0,0 +1,30 @@
+/* SHA-256 (FIPS 180-2)
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#ifndef __AZ__SHA256_H__
+#define __AZ__SHA256_H__
+
+#include <string>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+struct Sha256Context {
+	uint32_t state[8];
+	uint64_t count; // in bytes
+	uint8_t buffer[64];
+	
+	Sha256Context();
+	void update(const char* data, size_t len);
+	std::string final();
+};
+
+std::string calc_sha256(const char* data, size_t s);
+
+inline std::string calc_sha256(const std::string& data) {
+	return calc_sha256(&data[0], data.size());
+}
+
+#endif
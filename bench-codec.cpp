@@ -0,0 +1,120 @@
+/* benchmark for the codecs of the stored entries (see DbCodec.h)
+ * on the entries of some PNGs, by entry type
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "DbPng.h"
+#include "DbCodec.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include <iostream>
+using namespace std;
+
+struct BenchResult {
+	size_t dataSize;
+	size_t compressedSize;
+	double compressTime, uncompressTime; // in secs
+	BenchResult() : dataSize(0), compressedSize(0), compressTime(0), uncompressTime(0) {}
+};
+
+static Return readEntries(const std::string& filename, std::vector<std::string>& entries) {
+	FILE* f = fopen(filename.c_str(), "rb");
+	if(f == NULL) return "cannot open " + filename;
+	DbPngEntrySlicer slicer(f);
+	Return r = true;
+	while(slicer) {
+		r = slicer.next();
+		if(!r) break;
+		for(std::list<DbEntry>::iterator e = slicer.entries.begin(); e != slicer.entries.end(); ++e)
+			if(e->data[0] != DbPngEntryType_BlockRow)
+				entries.push_back(e->data);
+		slicer.entries.clear();
+	}
+	fclose(f);
+	if(!r) return filename + ": " + r.errmsg;
+	return true;
+}
+
+static Return bench(const DbCodec& codec, const std::vector<std::string>& entries, BenchResult* res) {
+	std::vector<std::string> compressed(entries.size());
+	for(size_t i = 0; i < entries.size(); ++i) {
+		BenchResult& r = res[(uint8_t) entries[i][0]];
+		clock_t start = clock();
+		codec.compress(entries[i], compressed[i]);
+		r.compressTime += double(clock() - start) / CLOCKS_PER_SEC;
+		r.dataSize += entries[i].size();
+		r.compressedSize += compressed[i].size();
+	}
+	for(size_t i = 0; i < entries.size(); ++i) {
+		BenchResult& r = res[(uint8_t) entries[i][0]];
+		std::string data;
+		clock_t start = clock();
+		ASSERT( dbCodecUncompress(compressed[i], data) );
+		r.uncompressTime += double(clock() - start) / CLOCKS_PER_SEC;
+		if(data != entries[i]) return codec.name() + ": uncompress(compress(data)) != data";
+	}
+	return true;
+}
+
+static void printResult(const std::string& name, const BenchResult& r) {
+	if(r.dataSize == 0) return;
+	cout << "  " << name << ": "
+	<< "compress " << int(r.dataSize / 1024.0 / 1024.0 / r.compressTime) << " MB/s, "
+	<< "uncompress " << int(r.dataSize / 1024.0 / 1024.0 / r.uncompressTime) << " MB/s, "
+	<< "ratio " << (double(r.dataSize) / r.compressedSize)
+	<< " (" << (r.dataSize / 1024) << " KB -> " << (r.compressedSize / 1024) << " KB)" << endl;
+}
+
+int main(int argc, char** argv) {
+	std::vector<std::string> codecNames;
+	int argi = 1;
+	while(argc > argi + 1 && std::string(argv[argi]) == "--codec") {
+		codecNames.push_back(argv[argi + 1]);
+		argi += 2;
+	}
+	if(argc <= argi) {
+		cerr << "usage: " << argv[0] << " [--codec codec]... pngfile..." << endl;
+		return 1;
+	}
+	if(codecNames.empty()) {
+		static const char* defaultNames[] = { "stored", "lz4", "deflate-1", "deflate-9", "zstd-1", "zstd-3", "zstd-19", NULL };
+		for(const char** n = defaultNames; *n; ++n)
+			codecNames.push_back(*n);
+	}
+
+	std::vector<std::string> entries;
+	for(int i = argi; i < argc; ++i) {
+		Return r = readEntries(argv[i], entries);
+		if(!r) {
+			cerr << "error: " << r.errmsg << endl;
+			return 1;
+		}
+	}
+
+	for(size_t i = 0; i < codecNames.size(); ++i) {
+		DbCodec codec;
+		Return r = DbCodec::FromName(codec, codecNames[i]);
+		BenchResult res[256];
+		if(r) r = bench(codec, entries, res);
+		if(!r) {
+			cerr << "error: " << r.errmsg << endl;
+			return 1;
+		}
+		BenchResult total;
+		for(int t = 0; t < 256; ++t) {
+			total.dataSize += res[t].dataSize;
+			total.compressedSize += res[t].compressedSize;
+			total.compressTime += res[t].compressTime;
+			total.uncompressTime += res[t].uncompressTime;
+		}
+		cout << codec.name() << ":" << endl;
+		printResult("chunks", res[DbEntryType_PngChunk]);
+		printResult("blocks", res[DbEntryType_PngBlock]);
+		printResult("all", total);
+	}
+	return 0;
+}
@@ -0,0 +1,43 @@
+/* benchmark for the CRC implementations (see Crc.h)
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "Crc.h"
+
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include <iostream>
+using namespace std;
+
+// GB/s over totalSize bytes in buffers of the given size.
+static double bench(int impl, const std::vector<char>& buf, size_t size, size_t totalSize) {
+	uint32_t c = 0xffffffff;
+	clock_t start = clock();
+	for(size_t n = 0; n < totalSize; n += size)
+		c = update_crc(c, &buf[0], size, impl);
+	double time = double(clock() - start) / CLOCKS_PER_SEC;
+	if(c == 0) cout << "(zero CRC)" << endl; // so that it is not optimized away
+	return totalSize / 1024.0 / 1024.0 / 1024.0 / time;
+}
+
+int main(int argc, char** argv) {
+	size_t totalSize = 1024 * 1024 * 1024;
+	if(argc > 1) totalSize = atoi(argv[1]) * 1024 * 1024;
+
+	// 13: IHDR, 80: DbFileBackend tree chunk, 8k: zlib IDAT chunks, 1M: big values
+	static const size_t sizeList[] = { 13, 80, 8192, 1024 * 1024 };
+	std::vector<char> buf(sizeList[sizeof(sizeList)/sizeof(sizeList[0]) - 1]);
+	for(size_t i = 0; i < buf.size(); ++i)
+		buf[i] = random() & 0xff;
+
+	for(int impl = CrcImpl_Bytewise; impl < CrcImpl_Count; ++impl) {
+		if(!crc_cpu_supports(impl)) continue;
+		cout << crc_impl_name(impl) << ":";
+		for(size_t i = 0; i < sizeof(sizeList)/sizeof(sizeList[0]); ++i)
+			cout << " " << sizeList[i] << " bytes " << bench(impl, buf, sizeList[i], totalSize);
+		cout << " GB/s" << endl;
+	}
+	return 0;
+}
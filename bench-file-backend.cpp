@@ -0,0 +1,75 @@
+/* benchmark for the writes of DbFileBackend: syscalls and time per push
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "DbFileBackend.h"
+#include "StringUtils.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include <iostream>
+using namespace std;
+
+// Block-like entries, about half of them are pushed more than once.
+static void makeEntries(size_t num, std::vector<DbEntry>& entries) {
+	srandom(1);
+	for(size_t i = 0; i < num; ++i) {
+		size_t v = random() % (num / 2 + 1);
+		std::string data(1, (char) DbEntryType_PngBlock);
+		data += rawString<uint32_t>(v);
+		for(size_t k = 0; k < 300; ++k)
+			data += (char) ((v * 7 + k) & 0xff);
+		entries.push_back(DbEntry(data));
+	}
+}
+
+static Return bench(const std::string& filename, const std::vector<DbEntry>& entries, size_t batchSize) {
+	remove(filename.c_str());
+	DbFileBackend db(filename);
+	ASSERT( db.init() );
+	DbFileIoStats start = db.ioStats;
+	clock_t startTime = clock();
+	for(size_t i = 0; i < entries.size(); i += batchSize) {
+		if(batchSize == 1) {
+			DbEntryId id;
+			ASSERT( db.push(id, entries[i]) );
+			continue;
+		}
+		std::vector<DbEntry> batch(entries.begin() + i, entries.begin() + std::min(i + batchSize, entries.size()));
+		std::vector<DbEntryId> ids;
+		ASSERT( db.pushMany(ids, batch) );
+	}
+	double time = double(clock() - startTime) / CLOCKS_PER_SEC;
+
+	double n = entries.size();
+	cout << "batch " << batchSize << ": "
+		<< (db.ioStats.writeCalls - start.writeCalls) / n << " writes, "
+		<< (db.ioStats.readCalls - start.readCalls) / n << " reads, "
+		<< (db.ioStats.writeBytes - start.writeBytes) / n << " bytes written per push ("
+		<< db.stats.pushNew << " new), "
+		<< (db.ioStats.flushes - start.flushes) << " flushes, "
+		<< time * 1000 * 1000 / n << " us per push" << endl;
+	remove(filename.c_str());
+	return true;
+}
+
+int main(int argc, char** argv) {
+	size_t num = 10000;
+	if(argc > 1) num = atoi(argv[1]);
+	std::string filename = "bench-file-backend.pngdb";
+
+	std::vector<DbEntry> entries;
+	makeEntries(num, entries);
+	static const size_t batchSizes[] = { 1, 16, 256 };
+	for(size_t i = 0; i < sizeof(batchSizes)/sizeof(batchSizes[0]); ++i) {
+		Return r = bench(filename, entries, batchSizes[i]);
+		if(!r) {
+			cerr << "error: " << r.errmsg << endl;
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,194 @@
+/* benchmark for the PNG (un)filtering of the unfiltered storage (dbPngSetUnfilter)
+ * and for the filter kernels (--kernels)
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "Png.h"
+#include "DbPng.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include <iostream>
+using namespace std;
+
+struct BenchResult {
+	size_t dataSize; // scanline bytes
+	double time; // in secs
+	BenchResult() : dataSize(0), time(0) {}
+	void add(size_t size, clock_t start) {
+		dataSize += size;
+		time += double(clock() - start) / CLOCKS_PER_SEC;
+	}
+};
+
+struct BenchImage {
+	std::vector<char> data; // the filtered scanlines
+	std::vector<size_t> rowSizes;
+	std::vector<bool> passStart; // prior scanline is zero
+	size_t bpp;
+};
+
+static Return readImage(const std::string& filename, BenchImage& img) {
+	FILE* f = fopen(filename.c_str(), "rb");
+	if(f == NULL) return "cannot open " + filename;
+	PngReader reader(f);
+	Return r = true;
+	while(!reader.hasFinishedReading) {
+		r = reader.read();
+		if(!r) break;
+		while(reader.scanlines.size() > 0) {
+			size_t s = reader.scanlines.rowSize(0);
+			img.passStart.push_back(img.rowSizes.empty() || img.rowSizes.back() != s);
+			img.rowSizes.push_back(s);
+			img.data.insert(img.data.end(), reader.scanlines.front(), reader.scanlines.front() + s);
+			reader.scanlines.popFront();
+		}
+	}
+	img.bpp = reader.header.bytesPerPixel();
+	fclose(f);
+	if(!r) return filename + ": " + r.errmsg;
+	return true;
+}
+
+static Return unfilterImage(BenchImage& img, std::vector<char>& data) {
+	size_t offset = 0;
+	for(size_t i = 0; i < img.rowSizes.size(); ++i) {
+		const char* prior = img.passStart[i] ? NULL : &data[offset - img.rowSizes[i] + 1];
+		ASSERT( png_unfilter_scanline(&data[offset], prior, img.rowSizes[i], img.bpp) );
+		offset += img.rowSizes[i];
+	}
+	return true;
+}
+
+// Backwards, so the prior scanline is still unfiltered.
+static Return filterImage(BenchImage& img, std::vector<char>& data) {
+	size_t offset = data.size();
+	for(size_t i = img.rowSizes.size(); i > 0; --i) {
+		offset -= img.rowSizes[i - 1];
+		const char* prior = img.passStart[i - 1] ? NULL : &data[offset - img.rowSizes[i - 1] + 1];
+		ASSERT( png_filter_scanline(&data[offset], prior, img.rowSizes[i - 1], img.bpp) );
+	}
+	return true;
+}
+
+static Return slice(const std::string& filename, bool unfilter, BenchResult& res) {
+	FILE* f = fopen(filename.c_str(), "rb");
+	if(f == NULL) return "cannot open " + filename;
+	clock_t start = clock();
+	DbPngEntrySlicer slicer(f, unfilter);
+	Return r = true;
+	while(slicer) {
+		r = slicer.next();
+		if(!r) break;
+		slicer.entries.clear();
+	}
+	res.add(slicer.reader.stream.total_out, start);
+	fclose(f);
+	if(!r) return filename + ": " + r.errmsg;
+	return true;
+}
+
+static Return bench(const std::string& filename, size_t rounds, BenchResult* res) {
+	BenchImage img;
+	ASSERT( readImage(filename, img) );
+	for(size_t i = 0; i < rounds; ++i) {
+		std::vector<char> data(img.data);
+		clock_t start = clock();
+		ASSERT( unfilterImage(img, data) );
+		res[0].add(data.size(), start);
+		start = clock();
+		ASSERT( filterImage(img, data) );
+		res[1].add(data.size(), start);
+		if(data != img.data) return filename + ": filter(unfilter(data)) != data";
+		ASSERT( slice(filename, false, res[2]) );
+		ASSERT( slice(filename, true, res[3]) );
+	}
+	return true;
+}
+
+// A full HD image with random data, for each kernel.
+static void benchKernels(size_t rounds) {
+	static const size_t bppList[] = { 1, 2, 3, 4, 6, 8 };
+	static const char* filterNames[] = { "None", "Sub", "Up", "Average", "Paeth" };
+	const size_t width = 1920, height = 1080;
+	for(size_t i = 0; i < sizeof(bppList)/sizeof(bppList[0]); ++i) {
+		size_t rowSize = width * bppList[i];
+		std::vector<uint8_t> data(rowSize * height);
+		for(size_t j = 0; j < data.size(); ++j)
+			data[j] = random() & 0xff;
+		for(int isa = PngFilterIsa_Scalar; isa < PngFilterIsa_Count; ++isa) {
+			const PngFilterKernels* k = png_filter_kernels(bppList[i], isa);
+			if(k == NULL) continue;
+			cout << "bpp " << k->bpp << ", " << k->name << ":";
+			for(int type = 1; type <= 4; ++type) {
+				BenchResult unfilterRes, filterRes;
+				for(size_t n = 0; n < rounds; ++n) {
+					// the first row is the prior of the others
+					clock_t start = clock();
+					for(size_t y = 1; y < height; ++y)
+						k->unfilter[type](&data[y * rowSize], &data[(y - 1) * rowSize], rowSize);
+					unfilterRes.add(data.size() - rowSize, start);
+					start = clock();
+					for(size_t y = height - 1; y > 0; --y)
+						k->filter[type](&data[y * rowSize], &data[(y - 1) * rowSize], rowSize);
+					filterRes.add(data.size() - rowSize, start);
+				}
+				cout << " " << filterNames[type] << " "
+				<< int(unfilterRes.dataSize / 1024.0 / 1024.0 / unfilterRes.time) << "/"
+				<< int(filterRes.dataSize / 1024.0 / 1024.0 / filterRes.time);
+			}
+			cout << " MB/s (unfilter/filter)" << endl;
+		}
+	}
+}
+
+static void printResult(const std::string& name, const BenchResult& res) {
+	cout << name << ": "
+	<< (res.dataSize / 1024.0 / 1024.0 / res.time) << " MB/s"
+	<< " (" << (res.dataSize / 1024 / 1024) << " MB in " << res.time << " secs)"
+	<< endl;
+}
+
+int main(int argc, char** argv) {
+	size_t rounds = 5;
+	bool kernels = false;
+	int argi = 1;
+	while(argc > argi) {
+		std::string arg = argv[argi];
+		if(arg == "-n" && argc > argi + 1) {
+			rounds = atoi(argv[argi + 1]);
+			argi += 2;
+		}
+		else if(arg == "--kernels") {
+			kernels = true;
+			argi++;
+		}
+		else break;
+	}
+	if(kernels) {
+		benchKernels(rounds);
+		return 0;
+	}
+	if(argc <= argi) {
+		cerr << "usage: " << argv[0] << " [-n rounds] (--kernels | pngfile...)" << endl;
+		return 1;
+	}
+
+	BenchResult res[4];
+	for(int i = argi; i < argc; ++i) {
+		Return r = bench(argv[i], rounds, res);
+		if(!r) {
+			cerr << "error: " << r.errmsg << endl;
+			return 1;
+		}
+	}
+
+	printResult("unfilter", res[0]);
+	printResult("filter", res[1]);
+	printResult("slicer", res[2]);
+	printResult("slicer with unfilter", res[3]);
+	return 0;
+}
@@ -0,0 +1,153 @@
+/* benchmark for slicing PNGs into DB entries:
+ * the contiguous scanline buffer vs. the old one-string-per-row path
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "Png.h"
+#include "DbPng.h"
+#include "StringUtils.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <iostream>
+using namespace std;
+
+#define PngBlockSize 64
+
+static size_t allocCount = 0;
+
+// All allocations go through these two. They are not inlined, otherwise GCC sees the
+// free() of a pointer from operator new and warns about it (-Wmismatched-new-delete).
+__attribute__((noinline)) void* operator new(size_t s) {
+	allocCount++;
+	void* p = malloc(s ? s : 1);
+	if(p == NULL) throw std::bad_alloc();
+	return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) throw() { free(p); }
+
+void* operator new[](size_t s) { return operator new(s); }
+void operator delete[](void* p) throw() { operator delete(p); }
+#if __cplusplus >= 201402L
+void operator delete(void* p, size_t) throw() { operator delete(p); }
+void operator delete[](void* p, size_t) throw() { operator delete(p); }
+#endif
+
+struct BenchResult {
+	size_t allocs;
+	size_t dataSize; // decoded scanline bytes
+	double pixels;
+	double time; // in secs
+	BenchResult() : allocs(0), dataSize(0), pixels(0), time(0) {}
+};
+
+// This is how it was done before the scanline buffer: PngReader copied each row
+// into its own std::string and the slicer took each 64 byte part with substr().
+static Return sliceOld(FILE* f, BenchResult& res) {
+	PngReader reader(f);
+	std::list<std::string> scanlines;
+	std::list<DbEntry> entries;
+	while(!reader.hasFinishedReading) {
+		ASSERT( reader.read() );
+		reader.chunks.clear();
+		while(reader.scanlines.size() > 0) {
+			scanlines.push_back(std::string(reader.scanlines.front(), reader.scanlines.rowSize(0)));
+			reader.scanlines.popFront();
+		}
+		
+		while(scanlines.size() > 0 &&
+			  (scanlines.size() >= PngBlockSize || reader.hasFinishedReading)) {
+			size_t scanlineWidth = scanlines.front().size();
+			uint8_t blockHeight = 0;
+			for(std::list<std::string>::iterator it = scanlines.begin();
+				it != scanlines.end() && blockHeight < PngBlockSize;
+				++it) {
+				if(it->size() != scanlineWidth) break;
+				++blockHeight;
+			}
+			
+			for(size_t x = 0; x < scanlineWidth; x += PngBlockSize) {
+				DbEntry entry;
+				entry.data += (char)DbEntryType_PngBlock;
+				entry.data += rawString<uint16_t>( x / PngBlockSize );
+				if(x == 0) entry.data += rawString<uint8_t>( blockHeight );
+				size_t i = 0;
+				for(std::list<std::string>::iterator it = scanlines.begin(); i < blockHeight; ++it, ++i)
+					entry.data += it->substr(x, PngBlockSize);
+				entries.push_back(entry);
+			}
+			
+			for(size_t i = 0; i < blockHeight; ++i)
+				scanlines.pop_front();
+		}
+		entries.clear();
+	}
+	res.dataSize += reader.stream.total_out;
+	res.pixels += double(reader.header.width) * reader.header.height;
+	return true;
+}
+
+static Return sliceNew(FILE* f, BenchResult& res) {
+	DbPngEntrySlicer slicer(f);
+	while(slicer) {
+		ASSERT( slicer.next() );
+		slicer.entries.clear();
+	}
+	res.dataSize += slicer.reader.stream.total_out;
+	res.pixels += double(slicer.reader.header.width) * slicer.reader.header.height;
+	return true;
+}
+
+static Return bench(const std::string& filename, bool newPath, size_t rounds, BenchResult& res) {
+	for(size_t i = 0; i < rounds; ++i) {
+		FILE* f = fopen(filename.c_str(), "rb");
+		if(f == NULL) return "cannot open " + filename;
+		size_t allocsBefore = allocCount;
+		clock_t start = clock();
+		Return r = newPath ? sliceNew(f, res) : sliceOld(f, res);
+		res.time += double(clock() - start) / CLOCKS_PER_SEC;
+		res.allocs += allocCount - allocsBefore;
+		fclose(f);
+		if(!r) return filename + ": " + r.errmsg;
+	}
+	return true;
+}
+
+static void printResult(const std::string& name, const BenchResult& res) {
+	cout << name << ": "
+	<< (res.allocs / (res.pixels / 1000000)) << " allocs/megapixel, "
+	<< (res.dataSize / 1024.0 / 1024.0 / res.time) << " MB/s"
+	<< " (" << (res.dataSize / 1024 / 1024) << " MB in " << res.time << " secs)"
+	<< endl;
+}
+
+int main(int argc, char** argv) {
+	size_t rounds = 5;
+	int argi = 1;
+	if(argc > argi + 1 && std::string(argv[argi]) == "-n") {
+		rounds = atoi(argv[argi + 1]);
+		argi += 2;
+	}
+	if(argc <= argi) {
+		cerr << "usage: " << argv[0] << " [-n rounds] pngfile..." << endl;
+		return 1;
+	}
+	
+	BenchResult oldRes, newRes;
+	for(int i = argi; i < argc; ++i) {
+		Return r = bench(argv[i], false, rounds, oldRes);
+		if(r) r = bench(argv[i], true, rounds, newRes);
+		if(!r) {
+			cerr << "error: " << r.errmsg << endl;
+			return 1;
+		}
+	}
+	
+	printResult("old (string per row)", oldRes);
+	printResult("new (scanline buffer)", newRes);
+	return 0;
+}
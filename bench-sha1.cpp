@@ -0,0 +1,48 @@
+/* benchmark for the SHA1 implementations (see Sha1.h)
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "Sha1.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include <iostream>
+using namespace std;
+
+// Hashes count messages of the given size, in batches of batchSize.
+static double bench(int isa, size_t size, size_t count, size_t batchSize) {
+	std::vector<char> buf(size * batchSize);
+	for(size_t i = 0; i < buf.size(); ++i)
+		buf[i] = random() & 0xff;
+	std::vector<const char*> data(batchSize);
+	std::vector<size_t> sizes(batchSize, size);
+	std::vector<std::string> digests(batchSize);
+	for(size_t i = 0; i < batchSize; ++i)
+		data[i] = &buf[i * size];
+	clock_t start = clock();
+	for(size_t n = 0; n < count; n += batchSize)
+		calc_sha1_many(&digests[0], &data[0], &sizes[0], batchSize, isa);
+	double time = double(clock() - start) / CLOCKS_PER_SEC;
+	return count * size / 1024.0 / 1024.0 / time;
+}
+
+int main(int argc, char** argv) {
+	size_t totalSize = 256 * 1024 * 1024;
+	if(argc > 1) totalSize = atoi(argv[1]) * 1024 * 1024;
+
+	// 64: smallest blocks, 1537: a typical PNG block entry, 64k: PNG chunks
+	static const size_t sizeList[] = { 64, 1537, 65536 };
+	for(int isa = Sha1Isa_Scalar; isa < Sha1Isa_Count; ++isa) {
+		if(!sha1_cpu_supports(isa)) continue;
+		cout << sha1_isa_name(isa) << ":";
+		for(size_t i = 0; i < sizeof(sizeList)/sizeof(sizeList[0]); ++i) {
+			size_t size = sizeList[i];
+			cout << " " << size << " bytes " << int(bench(isa, size, totalSize / size, 64));
+		}
+		cout << " MB/s" << endl;
+	}
+	return 0;
+}
@@ -69,8 +69,11 @@ function srclink() {
 BINS=("test-png-dumpchunks.cpp" "test-png-reader.cpp"
 	"pnginfo.cpp"
 	"db-push.cpp" "db-push-dir.cpp"
-	"db-list-dir.cpp" "db-extract-file.cpp"
-	"db-fuse.cpp")
+	"db-list-dir.cpp" "db-extract-file.cpp" "db-train-dict.cpp" "db-file-convert.cpp" "db-file-compact.cpp"
+	"db-fuse.cpp"
+	"test-png-filter.cpp" "test-sha1.cpp" "test-crc.cpp" "test-codec.cpp" "test-cache.cpp" "test-dir-index.cpp" "test-file-backend.cpp"
+	"bench-png-slicer.cpp" "bench-png-filter.cpp" "bench-sha1.cpp" "bench-crc.cpp"
+	"bench-codec.cpp" "bench-file-backend.cpp")
 
 # compile all sources
 OBJS=()
@@ -83,6 +86,11 @@ for f in hiredis/*.c; do
 	srccompile "$f"
 	OBJS=($OBJS "$BUILDDIR/${f/.c/.o}")
 done
+for f in zstd/*/*.c; do
+	Cflags[$f]="-DZSTD_DISABLE_ASM"
+	srccompile "$f"
+	OBJS=($OBJS "$BUILDDIR/${f/.c/.o}")
+done
 for f in kyotocabinet/*.cc; do
 	srccompile "$f"
 	OBJS=($OBJS "$BUILDDIR/${f/.cc/.o}")
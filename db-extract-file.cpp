@@ -1,4 +1,4 @@
-/* simple tool to extract a single file from the DB
+/* simple tool to extract files from the DB
  * by Albert Zeyer, 2011
  * code under LGPL
  */
@@ -6,6 +6,7 @@
 #include "Png.h"
 #include "DbDefBackend.h"
 #include "DbPng.h"
+#include "DbEntryCache.h"
 #include "StringUtils.h"
 #include "FileUtils.h"
 
@@ -15,11 +16,7 @@
 #include <iostream>
 using namespace std;
 
-Return _main(const std::string& filename) {
-	DbDefBackend db;
-	db.setReadOnly(true);
-	ASSERT( db.init() );
-	
+static Return extractFile(DbIntf& db, const std::string& filename, size_t prefetchEntries) {
 	DbEntryId fileEntryId;
 	ASSERT( db.getFileRef(fileEntryId, filename) );
 	cout << "entry id: " << hexString(fileEntryId) << endl;
@@ -32,8 +29,11 @@ Return _main(const std::string& filename) {
 	if(!fileEntryId.empty()) {
 		FileWriteCallback writer(f);
 		DbPngEntryReader dbPngReader(&writer, &db, fileEntryId);
+		dbPngReader.prefetchEntries = prefetchEntries;
 		while(dbPngReader)
 			ASSERT( dbPngReader.next() );
+		if((dbPngReader.content.flags & DbPngContentFlag_Index) && dbPngReader.content.outputSize != (uint64_t)ftell(f))
+			return "the written size differs from the size in the content index";
 	}
 	
 	cout << "wrote " << ftell(f) << " bytes" << endl;
@@ -42,15 +42,42 @@ Return _main(const std::string& filename) {
 	return true;
 }
 
+// The files share one entry cache, so the blocks which they have in common are read only once.
+static Return _main(const std::list<std::string>& filenames, size_t entryCacheSize, size_t prefetchEntries) {
+	DbDefBackend db;
+	db.setReadOnly(true);
+	ASSERT( db.init() );
+	
+	DbEntryCache entryCache(entryCacheSize * 1024 * 1024);
+	if(entryCacheSize > 0) db.entryCache = &entryCache;
+	Return r = true;
+	for(std::list<std::string>::const_iterator i = filenames.begin(); r && i != filenames.end(); ++i)
+		r = extractFile(db, *i, prefetchEntries);
+	db.entryCache = NULL;
+	if(entryCacheSize > 0)
+		cout << "entry cache: " << entryCache.stats().summary() << endl;
+	return r;
+}
+
 int main(int argc, char** argv) {
-	if(argc <= 1) {
+	std::list<std::string> filenames;
+	size_t entryCacheSize = DbEntryCacheDefaultSize;
+	size_t prefetchEntries = DbPngPrefetchEntriesDefault;
+	for(int i = 1; i < argc; ++i) {
+		if(std::string(argv[i]) == "--entry-cache-size" && i + 1 < argc)
+			entryCacheSize = atoi(argv[++i]);
+		else if(std::string(argv[i]) == "--prefetch" && i + 1 < argc)
+			prefetchEntries = atoi(argv[++i]);
+		else
+			filenames.push_back(argv[i]);
+	}
+	if(filenames.empty()) {
 		cerr << "please give me a filename" << endl;
 		return 1;
 	}
 	
-	std::string filename = argv[1];
 	srandom(time(NULL));
-	Return r = _main(filename);
+	Return r = _main(filenames, entryCacheSize, prefetchEntries);
 	if(!r) {
 		cerr << "error: " << r.errmsg << endl;
 		return 1;
@@ -0,0 +1,54 @@
+/* tool to show the used and unused space of a DbFileBackend file and to compact it
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "DbFileBackend.h"
+
+#include <ctime>
+#include <cstdlib>
+#include <iostream>
+using namespace std;
+
+static Return _main(const std::string& filename, bool statsOnly) {
+	DbFileBackend db(filename, /*readonly*/ statsOnly);
+	ASSERT( db.init() );
+	
+	DbFileSpaceStats stats;
+	ASSERT( db.spaceStats(stats) );
+	if(statsOnly) {
+		cout << stats.summary() << endl;
+		return true;
+	}
+	
+	cout << "before: " << stats.summary() << endl;
+	ASSERT( db.compact() );
+	ASSERT( db.spaceStats(stats) );
+	cout << "after: " << stats.summary() << endl;
+	return true;
+}
+
+int main(int argc, char** argv) {
+	std::string filename = "db.pngdb";
+	bool statsOnly = false;
+	for(int i = 1; i < argc; ++i) {
+		if(std::string(argv[i]) == "--stats")
+			statsOnly = true;
+		else if(argv[i][0] == '-') {
+			cerr << "usage: " << argv[0] << " [--stats] [db file]" << endl;
+			return 1;
+		}
+		else
+			filename = argv[i];
+	}
+	
+	srandom(time(NULL));
+	Return r = _main(filename, statsOnly);
+	if(!r) {
+		cerr << "error: " << r.errmsg << endl;
+		return 1;
+	}
+	
+	cout << "success" << endl;
+	return 0;
+}
@@ -0,0 +1,49 @@
+/* tool to convert an older DbFileBackend file (with the trie) into one with the B+tree
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "DbFileBackend.h"
+#include "FileUtils.h"
+
+#include <ctime>
+#include <cstdlib>
+#include <cstdio>
+#include <sys/stat.h>
+#include <iostream>
+using namespace std;
+
+static Return _main(const std::string& srcFilename, const std::string& destFilename) {
+	struct stat st;
+	if(stat(destFilename.c_str(), &st) == 0)
+		return destFilename + " already exists";
+	
+	DbFileBackend src(srcFilename, /*readonly*/ true);
+	ASSERT( src.init() );
+	if(!src.hasTrie())
+		cout << srcFilename << " has the B+tree already, copying anyway" << endl;
+	
+	DbFileBackend dest(destFilename);
+	ASSERT( dest.init() );
+	size_t numKeys = 0;
+	ASSERT( src.copyTo(dest, numKeys) );
+	cout << "copied " << numKeys << " keys" << endl;
+	return true;
+}
+
+int main(int argc, char** argv) {
+	if(argc <= 2) {
+		cerr << "usage: " << argv[0] << " old.pngdb new.pngdb" << endl;
+		return 1;
+	}
+	
+	srandom(time(NULL));
+	Return r = _main(argv[1], argv[2]);
+	if(!r) {
+		cerr << "error: " << r.errmsg << endl;
+		return 1;
+	}
+	
+	cout << "success" << endl;
+	return 0;
+}
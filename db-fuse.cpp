@@ -9,8 +9,12 @@
 #include "DbPng.h"
 #include "Mutex.h"
 #include "SmartPointer.h"
+#include "Cache.h"
+#include "DbEntryCache.h"
 
 #include <string>
+#include <vector>
+#include <cstdlib>
 #include <errno.h>
 #include <fcntl.h>
 #include <cstring>
@@ -35,9 +39,9 @@ static DbIntf* db = NULL;
 #define CHECK_RET(x, err_ret, err_msg) \
 	{ Return ___r = (x); if(!___r) { debugPrint(cerr, err_msg + ": " + ___r.errmsg); return err_ret; } }
 
-// Currently, the size we return here is not exactly correct (it is the size
-// of the files when we pushed them to the DB but they will likely be somewhat
-// different when you get them out).
+// If the exact size is not known (see DbIntf::getFileSize), the size we return here
+// is not exactly correct (it is the size of the files when we pushed them to the DB
+// but they will likely be somewhat different when you get them out).
 // If this size is smaller then what we would return here, we get into trouble
 // that many readers would skip the rest of the data and thus the PNG seems
 // incomplete.
@@ -45,6 +49,26 @@ static DbIntf* db = NULL;
 // than the actual file we would return here.
 #define SAFETY_ADDED_SIZE 1000000
 
+#ifndef FILE_CACHE_SHARDS
+#define FILE_CACHE_SHARDS 16
+#endif
+#define FILE_CACHE_DEFAULT_SIZE 256 // MB, --cache-size
+
+// With an index, a read which is further away than this from the generated data
+// starts again near its offset (see DbPngEntryReader::seek).
+#define SEEK_DISTANCE (16 * PngDataChunkSize)
+
+// db_readdir gets the dir entries in parts of this size (see DbIntf::getDirPart).
+#define READDIR_PART_SIZE 256
+
+// The size of the file at path as we tell it, for db_getattr and db_readdir.
+static off_t __fileSize(const std::string& path, const DbDirEntry& dirEntry) {
+	uint64_t size = 0;
+	if(!(dirEntry.mode & S_IFDIR) && db->getFileSize(size, path))
+		return size;
+	return dirEntry.size + /* to be sure */ SAFETY_ADDED_SIZE;
+}
+
 static int db_getattr(const char *path, struct stat *stbuf) {
     memset(stbuf, 0, sizeof(struct stat));
 	debugPrint(cout, "db_getattr: " + path);
@@ -59,69 +83,71 @@ static int db_getattr(const char *path, struct stat *stbuf) {
 		std::string basename = baseFilename(filename);
 		std::string dirname = dirName(filename);
 		
-		std::list<DbDirEntry> dirList;
-		CHECK_RET(db->getDir(dirList, dirname), -ENOENT, "db_getattr: getDir failed");
+		DbDirEntry dirEntry;
+		bool found = false;
+		CHECK_RET(db->getDirEntry(dirEntry, found, dirname, basename), -ENOENT, "db_getattr: getDirEntry failed");
 		
-		for(std::list<DbDirEntry>::iterator i = dirList.begin(); i != dirList.end(); ++i)
-			if(i->name == basename) {
-				stbuf->st_mode = i->mode;
-				stbuf->st_nlink = 1;
-				stbuf->st_size = i->size + /* to be sure */ SAFETY_ADDED_SIZE;
-				break;
-			}
+		if(found) {
+			stbuf->st_mode = dirEntry.mode;
+			stbuf->st_nlink = 1;
+			stbuf->st_size = __fileSize(dirname + "/" + basename, dirEntry);
+		}
 	}
 	
 	CHECK_RET(stbuf->st_mode != 0, -ENOENT, "db_getattr: not found");
 	return 0;
 }
 
-static int db_open(const char *path, struct fuse_file_info *fi) {
-	if(*path == '/') ++path; // skip '/' at the beginning
-	std::string filename = path;
-	filename = dirName(filename) + "/" + baseFilename(filename);
-	
-	debugPrint(cout, "db_open: " + filename);
-
-	DbEntryId id;
-	CHECK_RET(db->getFileRef(id, filename), -ENOENT, "db_open: fileref not found");
-		
-	CHECK_RET((fi->flags & O_ACCMODE) == O_RDONLY, -EACCES, "db_open: only reading allowed");
-	
-    return 0;
-}
-
 static int db_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
               off_t offset, struct fuse_file_info *fi) {
 	if(*path == '/') ++path; // skip '/' at the beginning
 	
-	std::list<DbDirEntry> dirList;
-	CHECK_RET(db->getDir(dirList, path), -ENOENT, "db_readdir: getDir failed");
+	// We pass the offset of the next entry to the filler, so FUSE calls us again
+	// with it once its buffer is full: 1 and 2 are "." and "..", then the dir cursor + 2.
+	if(offset < 1 && filler(buf, ".", NULL, 1)) return 0;
+	if(offset < 2 && filler(buf, "..", NULL, 2)) return 0;
 	
-    filler(buf, ".", NULL, 0);           /* Current directory (.)  */
-    filler(buf, "..", NULL, 0);          /* Parent directory (..)  */
-
-	for(std::list<DbDirEntry>::iterator i = dirList.begin(); i != dirList.end(); ++i) {
-		struct stat stbuf;
-		memset(&stbuf, 0, sizeof(struct stat));
-		stbuf.st_mode = i->mode;
-		stbuf.st_nlink = 1;
-		stbuf.st_size = i->size + /* to be sure */ SAFETY_ADDED_SIZE;
-		filler(buf, i->name.c_str(), &stbuf, 0);
+	size_t cursor = (offset > 2) ? (offset - 2) : 0;
+	while(true) {
+		std::list<DbDirEntry> dirList;
+		CHECK_RET(db->getDirPart(dirList, path, cursor, READDIR_PART_SIZE), -ENOENT, "db_readdir: getDirPart failed");
+		if(dirList.empty()) break;
+		
+		off_t nextOffset = cursor + 2 - dirList.size();
+		for(std::list<DbDirEntry>::iterator i = dirList.begin(); i != dirList.end(); ++i) {
+			struct stat stbuf;
+			memset(&stbuf, 0, sizeof(struct stat));
+			stbuf.st_mode = i->mode;
+			stbuf.st_nlink = 1;
+			stbuf.st_size = __fileSize(std::string(path) + "/" + i->name, *i);
+			if(filler(buf, i->name.c_str(), &stbuf, ++nextOffset)) return 0;
+		}
+		if(dirList.size() != READDIR_PART_SIZE) break; // the last part, see DbIntf::getDirPart
 	}
 	
     return 0;
 }
 
 
+// --prefetch, see DbPngEntryReader::prefetchEntries
+static size_t prefetchEntries = DbPngPrefetchEntriesDefault;
+
+static DbPngEntryReader* newDbPngReader(WriteCallbackIntf* w, const DbEntryId& fileEntryId) {
+	DbPngEntryReader* reader = new DbPngEntryReader(w, db, fileEntryId);
+	reader->prefetchEntries = prefetchEntries;
+	return reader;
+}
+
 struct FileContent : WriteCallbackIntf {
 	Mutex mutex;
 	DbEntryId fileEntryId;
 	std::string data;
+	uint64_t dataOffset; // in the file
 	bool finished;
-	DbPngEntryReader dbPngReader;
+	SmartPointer<DbPngEntryReader> dbPngReader;
 	
 	FileContent(const std::string& _fileEntryId)
-	: fileEntryId(_fileEntryId), finished(false), dbPngReader(this, db, fileEntryId) {}
+	: fileEntryId(_fileEntryId), dataOffset(0), finished(false), dbPngReader(newDbPngReader(this, fileEntryId)) {}
 	
 	Return write(const char* d, size_t s) {
 		// we already locked the mutex here
@@ -129,80 +155,113 @@ struct FileContent : WriteCallbackIntf {
 		return true;
 	}
 	
+	size_t memoryUsage() {
+		ScopedLock lock(mutex);
+		return sizeof(FileContent) + data.capacity();
+	}
+	
+	bool canSeek() { return (dbPngReader->content.flags & DbPngContentFlag_Index) != 0; }
+	
+	Return restartAt(off_t offset) {
+		dbPngReader = newDbPngReader(this, fileEntryId);
+		uint64_t start = offset;
+		ASSERT( dbPngReader->seek(start) );
+		data = "";
+		dataOffset = start;
+		finished = false;
+		return true;
+	}
+	
 	int read(char* buf, size_t size, off_t offset) {
 		ScopedLock lock(mutex);
 		
-		while(!finished && offset + size > data.size()) {
-			if(dbPngReader) {
-				CHECK_RET(dbPngReader.next(), -EIO, "db_read: reading failed");
+		CHECK_RET(dbPngReader->readContentList(), -EIO, "db_read: reading content list failed");
+		if(canSeek() && ((uint64_t)offset < dataOffset || (uint64_t)offset > dataOffset + data.size() + SEEK_DISTANCE))
+			CHECK_RET(restartAt(offset), -EIO, "db_read: seeking failed");
+		
+		while(!finished && offset + size > dataOffset + data.size()) {
+			if(*dbPngReader.get()) {
+				CHECK_RET(dbPngReader->next(), -EIO, "db_read: reading failed");
 			} else
 				finished = true;
 		}
 		
-		if(offset >= data.size()) // Reading behind the content.
+		if((uint64_t)offset >= dataOffset + data.size()) // Reading behind the content.
 			return 0;
 		
-		if (offset + size > data.size()) // Trim the read to the file size.
-			size = data.size() - offset;
+		if (offset + size > dataOffset + data.size()) // Trim the read to the file size.
+			size = dataOffset + data.size() - offset;
 		
-		memcpy(buf, &data[offset], size); // Provide the content.	
+		memcpy(buf, &data[offset - dataOffset], size); // Provide the content.	
 		return size;
 	}
 };
 
-struct FileCache {
-	static const size_t NUM_ENTRIES = 20;
-	Mutex mutex;
-	typedef std::list< SmartPointer<FileContent> > CacheList;
-	CacheList cache;
+// The generated files, shared by all open files. A file which is open has its own reference
+// (in fuse_file_info::fh), so it stays even if the cache doesn't keep it.
+static Cache<FileContent>* fileCache = NULL;
+
+static int db_open(const char *path, struct fuse_file_info *fi) {
+	if(*path == '/') ++path; // skip '/' at the beginning
+	std::string filename = path;
+	filename = dirName(filename) + "/" + baseFilename(filename);
 	
-	SmartPointer<FileContent> getContent(const DbEntryId& fileEntryId) {
-		ScopedLock lock(mutex);
-		for(CacheList::iterator i = cache.begin(); i != cache.end(); ++i) {
-			// i->fileEntryId can be accessed safely because we never write it again
-			if((*i)->fileEntryId == fileEntryId) {
-				// found it
-				// now push to front of cacheList
-				SmartPointer<FileContent> content = *i;
-				cache.erase(i);
-				cache.push_front(content);
-				return content;
-			}
-		}
+	debugPrint(cout, "db_open: " + filename);
+
+	DbEntryId id;
+	CHECK_RET(db->getFileRef(id, filename), -ENOENT, "db_open: fileref not found");
 		
-		// not found -> create new
-		SmartPointer<FileContent> content = new FileContent(fileEntryId);
-		cache.push_front(content);
-		// pop old entries
-		while(cache.size() > NUM_ENTRIES)
-			cache.pop_back();
-		return content;
-	}
+	CHECK_RET((fi->flags & O_ACCMODE) == O_RDONLY, -EACCES, "db_open: only reading allowed");
 	
-	int read(const DbEntryId& fileEntryId, char* buf, size_t size, off_t offset) {
-		return getContent(fileEntryId)->read(buf, size, offset);
+	// id.empty() is allowed and means we have an empty file
+	fi->fh = 0;
+	if(id.empty()) return 0;
+	
+	SmartPointer<FileContent> content = fileCache->get(id);
+	if(content.get() == NULL) {
+		content = new FileContent(id);
+		fileCache->put(id, content, content->memoryUsage());
 	}
-};
+	fi->fh = (uintptr_t) new SmartPointer<FileContent>(content);
+	return 0;
+}
 
 static int db_read(const char *path, char *buf, size_t size, off_t offset,
            struct fuse_file_info *fi) {
-	if(*path == '/') ++path; // skip '/' at the beginning
-	if(*path == '\0') return -EISDIR; // this is the root-dir, not a file
-	
-	std::string filename = path;
-	filename = dirName(filename) + "/" + baseFilename(filename);
-	
-	DbEntryId fileEntryId;
-	CHECK_RET(db->getFileRef(fileEntryId, filename), -ENOENT, "db_read: getFileRef failed");
-
-	// fileEntryId.empty() is allowed and means we have an empty file
-	if(fileEntryId.empty()) return 0;
+	if(fi->fh == 0) return 0; // empty file
+	SmartPointer<FileContent>& content = *(SmartPointer<FileContent>*) (uintptr_t) fi->fh;
+	int ret = content->read(buf, size, offset);
+	fileCache->resize(content->fileEntryId, content.get(), content->memoryUsage());
+	return ret;
+}
 
-	static FileCache fileCache;
-	return fileCache.read(fileEntryId, buf, size, offset);
+static int db_release(const char *path, struct fuse_file_info *fi) {
+	delete (SmartPointer<FileContent>*) (uintptr_t) fi->fh;
+	fi->fh = 0;
+	return 0;
 }
 
 int main(int argc, char **argv) {
+	size_t cacheSize = FILE_CACHE_DEFAULT_SIZE;
+	size_t entryCacheSize = DbEntryCacheDefaultSize;
+	// the other arguments are for FUSE
+	std::vector<char*> fuseArgv;
+	for(int i = 0; i < argc; ++i) {
+		if(std::string(argv[i]) == "--cache-size" && i + 1 < argc) {
+			cacheSize = atoi(argv[++i]);
+			continue;
+		}
+		if(std::string(argv[i]) == "--entry-cache-size" && i + 1 < argc) {
+			entryCacheSize = atoi(argv[++i]);
+			continue;
+		}
+		if(std::string(argv[i]) == "--prefetch" && i + 1 < argc) {
+			prefetchEntries = atoi(argv[++i]);
+			continue;
+		}
+		fuseArgv.push_back(argv[i]);
+	}
+	
 	DbDefBackend dbInst;
 	db = &dbInst;
 	db->setReadOnly(true);
@@ -217,6 +276,19 @@ int main(int argc, char **argv) {
 	ops.getattr = db_getattr;	/* To provide size, permissions, etc. */
 	ops.open = db_open;			/* To enforce read-only access.       */
 	ops.read = db_read;			/* To provide file content.           */
+	ops.release = db_release;	/* To free the open file.             */
 	ops.readdir = db_readdir;	/* To provide directory listing.      */
-    return fuse_main(argc, argv, &ops, NULL);
+	
+	Cache<FileContent> cache(cacheSize * 1024 * 1024, FILE_CACHE_SHARDS);
+	fileCache = &cache;
+	// the blocks which many files share, for the generation of the files
+	DbEntryCache entryCache(entryCacheSize * 1024 * 1024);
+	if(entryCacheSize > 0) db->entryCache = &entryCache;
+	int ret = fuse_main(fuseArgv.size(), &fuseArgv[0], &ops, NULL);
+	
+	cout << "file cache: " << cache.stats().summary() << endl;
+	if(db->entryCache)
+		cout << "entry cache: " << entryCache.stats().summary() << endl;
+	db->entryCache = NULL;
+	return ret;
 }
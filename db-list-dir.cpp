@@ -15,34 +15,43 @@
 #include <iostream>
 using namespace std;
 
+#define LIST_PART_SIZE 1024
+
 DbDefBackend* db = NULL;
 
+// The entries are read in parts, and with a dir index, they also have the file refs.
 static Return listDir(const std::string& path) {
-	std::list<DbDirEntry> dirList;
-	ASSERT( db->getDir(dirList, path) );
-	
-	for(std::list<DbDirEntry>::iterator i = dirList.begin(); i != dirList.end(); ++i) {
-		if(i->mode & S_IFREG)
-			cout << "file: ";
-		else if(i->mode & S_IFDIR)
-			cout << "dir: ";
-		else
-			cout << hexString(i->mode) << ": ";
-		cout << path << "/" << i->name;
-		if(i->mode & S_IFREG) {
-			cout << ", " << i->size << " bytes";
-			DbEntryId id;
-			ASSERT( db->getFileRef(id, path + "/" + i->name) );
-			if(id.size() > 0)
-				cout << ", ref=" << hexString(id);
+	size_t cursor = 0;
+	while(true) {
+		std::list<DbDirEntry> dirList;
+		ASSERT( db->getDirPart(dirList, path, cursor, LIST_PART_SIZE) );
+		if(dirList.empty()) break;
+		
+		for(std::list<DbDirEntry>::iterator i = dirList.begin(); i != dirList.end(); ++i) {
+			if(i->mode & S_IFREG)
+				cout << "file: ";
+			else if(i->mode & S_IFDIR)
+				cout << "dir: ";
 			else
-				cout << ", empty";
+				cout << hexString(i->mode) << ": ";
+			cout << path << "/" << i->name;
+			if(i->mode & S_IFREG) {
+				cout << ", " << i->size << " bytes";
+				DbEntryId id = i->ref;
+				if(!i->haveRef)
+					ASSERT( db->getFileRef(id, path + "/" + i->name) );
+				if(id.size() > 0)
+					cout << ", ref=" << hexString(id);
+				else
+					cout << ", empty";
+			}
+			else if(i->mode & S_IFDIR)
+				cout << "/";
+			cout << endl;
+			if(i->mode & S_IFDIR)
+				ASSERT( listDir(path + "/" + i->name) );
 		}
-		else if(i->mode & S_IFDIR)
-			cout << "/";
-		cout << endl;
-		if(i->mode & S_IFDIR)
-			ASSERT( listDir(path + "/" + i->name) );
+		if(dirList.size() != LIST_PART_SIZE) break; // the last part, see DbIntf::getDirPart
 	}
 	
 	return true;
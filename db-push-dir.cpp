@@ -6,23 +6,74 @@
 #include "Png.h"
 #include "DbDefBackend.h"
 #include "DbPng.h"
+#include "DbPngPipeline.h"
+#include "DbHashIndex.h"
 #include "StringUtils.h"
 #include "FileUtils.h"
 
 #include <ctime>
 #include <cstdlib>
 #include <cstdio>
+#include <vector>
 #include <iostream>
 using namespace std;
 
-Return _main(const std::string& dirname) {
+static void printStats(DbIntf& db, const std::string& filename) {
+	cout << filename << ": "
+	<< (100.0f * float(db.stats.pushReuse) / (db.stats.pushNew + db.stats.pushReuse)) << "%, "
+	<< db.stats.pushReuse << " / " << db.stats.pushNew
+	<< endl;
+}
+
+struct PushDirCallback : DbPngPipelineCallbackIntf {
+	DbIntf& db;
+	PushDirCallback(DbIntf& _db) : db(_db) {}
+	void fileDone(const DbPngPipelineFile& file) {
+		std::string basename = baseFilename(file.filename);
+		if(!file.opened) {
+			cerr << "error: " << basename << ": cannot open file" << endl;
+			return;
+		}
+		if(!file.result)
+			cerr << "error: " << basename << ": " << file.result.errmsg << endl;
+		db.pushToDir("", DbDirEntry::File(basename, file.fileSize));
+		db.setFileRef(file.contentId, "/" + basename);
+		db.setFileSize(file.contentOutputSize, "/" + basename);
+		printStats(db, basename);
+	}
+};
+
+Return _main(const std::string& dirname, size_t numJobs, bool trustedHash, bool unfilter, bool bands, const std::list<std::string>& codecSpecs, const std::string& hashIndexFile) {
 	DbDefBackend db;
 	ASSERT( db.init() );
+	if(trustedHash)
+		ASSERT( db.setTrustedHash() );
+	if(unfilter)
+		ASSERT( dbPngSetUnfilter(db) );
+	ASSERT( dbPngGetUnfilter(db, unfilter) );
+	if(bands)
+		ASSERT( dbPngSetDeflatedBands(db) );
+	ASSERT( dbPngGetDeflatedBands(db, bands) );
+	for(std::list<std::string>::const_iterator i = codecSpecs.begin(); i != codecSpecs.end(); ++i)
+		ASSERT( db.setCodecFromSpec(*i) );
+	
+	DbHashIndex hashIndex;
+	if(!hashIndexFile.empty()) {
+		Return r = hashIndex.load(hashIndexFile, db);
+		if(!r) {
+			cout << "hash index: " << r.errmsg << ", building it from the DB" << endl;
+			ASSERT( hashIndex.build(db) );
+		}
+		cout << "hash index: " << hashIndex.count << " hashes, "
+		<< (hashIndex.memoryUsage() / 1024) << " KB" << endl;
+		db.hashIndex = &hashIndex;
+	}
 	
 	DirIter dir(dirname);
 	if(dir.dir == NULL)
 		return "cannot open directory " + dirname;
 	
+	std::vector<std::string> filenames;
 	for(; dir; dir.next()) {
 		if(dir.filename.size() <= 4) continue;
 		if(dir.filename.substr(dir.filename.size()-4) != ".png") continue;
@@ -33,43 +84,97 @@ Return _main(const std::string& dirname) {
 			// skip files we already have in DB
 			continue;
 		
+		filenames.push_back(filename);
+	}
+	
+	if(numJobs > 1) {
+		PushDirCallback callback(db);
+		DbPngPipeline pipeline(&db, &callback, numJobs, unfilter, bands);
+		ASSERT( pipeline.push(filenames) );
+	}
+	else for(size_t i = 0; i < filenames.size(); ++i) {
+		const std::string& filename = filenames[i];
+		std::string basename = baseFilename(filename);
+		
 		FILE* f = fopen(filename.c_str(), "rb");
 		if(f == NULL) {
-			cerr << "error: " << dir.filename << ": cannot open file" << endl;
+			cerr << "error: " << basename << ": cannot open file" << endl;
 			continue;
 		}
 		
-		DbPngEntryWriter dbPngWriter(f, &db);
+		DbPngEntryWriter dbPngWriter(f, &db, unfilter, bands);
 		while(dbPngWriter) {
 			Return r = dbPngWriter.next();		
 			if(!r) {
-				cerr << "error: " << dir.filename << ": " << r.errmsg << endl;
+				cerr << "error: " << basename << ": " << r.errmsg << endl;
 				break;
 			}
 		}
-		db.pushToDir("", DbDirEntry::File(baseFilename(filename), ftell(f)));
-		db.setFileRef(dbPngWriter.contentId, "/" + baseFilename(filename));
+		db.pushToDir("", DbDirEntry::File(basename, ftell(f)));
+		db.setFileRef(dbPngWriter.contentId, "/" + basename);
+		db.setFileSize(dbPngWriter.contentOutputSize, "/" + basename);
 		fclose(f);
 		
-		cout << dir.filename << ": "
-		<< (100.0f * float(db.stats.pushReuse) / (db.stats.pushNew + db.stats.pushReuse)) << "%, "
-		<< db.stats.pushReuse << " / " << db.stats.pushNew
-		<< endl;
+		printStats(db, basename);
 	}
 	
+	cout << "compression skipped: " << db.stats.compressSkipped << " entries, "
+	<< (db.stats.compressSkippedBytes / 1024 / 1024.0) << " MB" << endl;
+	
+	if(db.hashIndex) {
+		cout << "hash index: " << db.stats.refLookupsSkipped << " ref lookups skipped, "
+		<< hashIndex.count << " hashes, " << (hashIndex.memoryUsage() / 1024) << " KB" << endl;
+		ASSERT( hashIndex.save(hashIndexFile, db) );
+	}
 	return true;
 }
 
 int main(int argc, char** argv) {
-	if(argc <= 1) {
+	size_t numJobs = 1;
+	bool trustedHash = false;
+	bool unfilter = false;
+	bool bands = false;
+	std::list<std::string> codecSpecs;
+	std::string hashIndexFile;
+	int argi = 1;
+	while(argc > argi + 1) {
+		std::string arg = argv[argi];
+		if(arg == "-j") {
+			numJobs = atoi(argv[argi + 1]);
+			argi += 2;
+		}
+		else if(arg == "--trusted-hash") {
+			trustedHash = true;
+			argi++;
+		}
+		else if(arg == "--unfilter") {
+			unfilter = true;
+			argi++;
+		}
+		else if(arg == "--deflated-bands") {
+			bands = true;
+			argi++;
+		}
+		else if(arg == "--codec" && argc > argi + 2) {
+			codecSpecs.push_back(argv[argi + 1]);
+			argi += 2;
+		}
+		else if(arg == "--hash-index" && argc > argi + 2) {
+			hashIndexFile = argv[argi + 1];
+			argi += 2;
+		}
+		else break;
+	}
+	if(argc <= argi) {
 		cerr << "please give me a dirname" << endl;
+		cerr << "usage: " << argv[0] << " [-j numJobs] [--trusted-hash] [--unfilter] [--deflated-bands] [--codec [type=]codec]... [--hash-index file] dirname" << endl;
 		return 1;
 	}
 	
 	srandom(time(NULL));
 
-	std::string dirname = argv[1];
-	Return r = _main(dirname);
+	std::string dirname = argv[argi];
+	Return r = _main(dirname, numJobs, trustedHash, unfilter, bands, codecSpecs, hashIndexFile);
 	if(!r) {
 		cerr << "error: " << r.errmsg << endl;
 		return 1;
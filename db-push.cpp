@@ -14,38 +14,70 @@
 #include <iostream>
 using namespace std;
 
-Return _main(const std::string& filename) {
+Return _main(const std::string& filename, bool trustedHash, bool unfilter, bool bands, const std::list<std::string>& codecSpecs) {
 	FILE* f = fopen(filename.c_str(), "rb");
 	if(f == NULL)
 		return "cannot open " + filename;
 	
 	DbDefBackend db;
 	ASSERT( db.init() );
-	DbPngEntryWriter dbPngWriter(f, &db);
+	if(trustedHash)
+		ASSERT( db.setTrustedHash() );
+	if(unfilter)
+		ASSERT( dbPngSetUnfilter(db) );
+	ASSERT( dbPngGetUnfilter(db, unfilter) );
+	if(bands)
+		ASSERT( dbPngSetDeflatedBands(db) );
+	ASSERT( dbPngGetDeflatedBands(db, bands) );
+	for(std::list<std::string>::const_iterator i = codecSpecs.begin(); i != codecSpecs.end(); ++i)
+		ASSERT( db.setCodecFromSpec(*i) );
+	DbPngEntryWriter dbPngWriter(f, &db, unfilter, bands);
 	while(dbPngWriter)
 		ASSERT( dbPngWriter.next() );
 	
 	ASSERT( db.pushToDir("", DbDirEntry::File(baseFilename(filename), ftell(f))) );
 	ASSERT( db.setFileRef(dbPngWriter.contentId, "/" + baseFilename(filename)) );
+	ASSERT( db.setFileSize(dbPngWriter.contentOutputSize, "/" + baseFilename(filename)) );
 	fclose(f);
 
 	cout << "content id: " << hexString(dbPngWriter.contentId) << endl;
 	cout << "num content entries: " << dbPngWriter.contentChunkEntries.size() + dbPngWriter.contentDataEntries.size() << endl;		
 	cout << "db stats: push new: " << db.stats.pushNew << endl;
 	cout << "db stats: push reuse: " << db.stats.pushReuse << endl;
+	cout << "db stats: compression skipped: " << db.stats.compressSkipped << " entries, "
+	<< db.stats.compressSkippedBytes << " bytes" << endl;
 	
 	return true;
 }
 
 int main(int argc, char** argv) {
-	if(argc <= 1) {
+	bool trustedHash = false;
+	bool unfilter = false;
+	bool bands = false;
+	std::list<std::string> codecSpecs;
+	int argi = 1;
+	while(argc > argi + 1) {
+		std::string arg = argv[argi];
+		if(arg == "--trusted-hash")
+			trustedHash = true;
+		else if(arg == "--unfilter")
+			unfilter = true;
+		else if(arg == "--deflated-bands")
+			bands = true;
+		else if(arg == "--codec" && argc > argi + 2)
+			codecSpecs.push_back(argv[++argi]);
+		else break;
+		argi++;
+	}
+	if(argc <= argi) {
 		cerr << "please give me a filename" << endl;
+		cerr << "usage: " << argv[0] << " [--trusted-hash] [--unfilter] [--deflated-bands] [--codec [type=]codec]... filename" << endl;
 		return 1;
 	}
 	
-	std::string filename = argv[1];
+	std::string filename = argv[argi];
 	srandom(time(NULL));
-	Return r = _main(filename);
+	Return r = _main(filename, trustedHash, unfilter, bands, codecSpecs);
 	if(!r) {
 		cerr << "error: " << r.errmsg << endl;
 		return 1;
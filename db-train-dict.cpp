@@ -0,0 +1,139 @@
+/* tool to train a zstd dictionary on the block entries of the DB
+ * and to use it for the new block entries (see DbCodec.h)
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "DbDefBackend.h"
+#include "DbPng.h"
+#include "DbCodec.h"
+#include "StringUtils.h"
+
+#include <ctime>
+#include <cstdlib>
+#include <cstdio>
+#include <set>
+#include <vector>
+#include <iostream>
+using namespace std;
+
+struct Sampler {
+	DbIntf& db;
+	size_t maxSamples;
+	std::set<DbEntryId> seen;
+	size_t numBlocks; // all different ones seen so far
+	std::vector<std::string> samples; // reservoir sample of the blocks
+	Sampler(DbIntf& _db, size_t n) : db(_db), maxSamples(n), numBlocks(0) {}
+	
+	void addBlock(const std::string& data) {
+		numBlocks++;
+		if(samples.size() < maxSamples)
+			samples.push_back(data);
+		else {
+			size_t i = random() % numBlocks;
+			if(i < maxSamples) samples[i] = data;
+		}
+	}
+	
+	Return addFile(const DbEntryId& contentId) {
+		DbPngContentList content;
+		ASSERT( content.read(db, contentId) );
+		std::vector<DbEntryId> ids;
+		for(std::list<DbEntryId>::iterator i = content.entries.begin(); i != content.entries.end(); ++i)
+			if(!i->empty() && seen.insert(*i).second)
+				ids.push_back(*i);
+		std::vector<DbEntry> fetched;
+		ASSERT( db.getMany(fetched, ids) );
+		for(size_t i = 0; i < fetched.size(); ++i)
+			if(!fetched[i].data.empty() && fetched[i].data[0] == DbEntryType_PngBlock)
+				addBlock(fetched[i].data);
+		return true;
+	}
+	
+	Return addDir(const std::string& path) {
+		std::list<DbDirEntry> dirList;
+		ASSERT( db.getDir(dirList, path) );
+		for(std::list<DbDirEntry>::iterator i = dirList.begin(); i != dirList.end(); ++i) {
+			if(i->mode & S_IFDIR) {
+				ASSERT( addDir(path + "/" + i->name) );
+			}
+			else if(i->mode & S_IFREG) {
+				DbEntryId id;
+				ASSERT( db.getFileRef(id, path + "/" + i->name) );
+				if(!id.empty())
+					ASSERT_EXT( addFile(id), path + "/" + i->name );
+			}
+		}
+		return true;
+	}
+};
+
+static size_t compressedSize(const DbCodec& codec, const std::vector<std::string>& samples) {
+	size_t size = 0;
+	for(size_t i = 0; i < samples.size(); ++i) {
+		std::string compressed;
+		codec.compress(samples[i], compressed);
+		size += compressed.size();
+	}
+	return size;
+}
+
+Return _main(size_t numSamples, size_t dictSize, int level) {
+	DbDefBackend db;
+	ASSERT( db.init() );
+	
+	Sampler sampler(db, numSamples);
+	ASSERT( sampler.addDir("") );
+	cout << "sampled " << sampler.samples.size() << " of " << sampler.numBlocks << " blocks" << endl;
+	
+	std::string dict;
+	ASSERT( dbCodecTrainDict(sampler.samples, dictSize, dict) );
+	ASSERT( db.addCodecDict(dict) );
+	DbCodec codec(DbCodec_ZstdDict, level);
+	ASSERT( db.setCodec("block", codec) );
+	cout << "dictionary " << db.codecs.dictId << ": " << dict.size() << " bytes" << endl;
+	
+	// the samples were used for the training, so this is a bit optimistic
+	size_t dataSize = 0;
+	for(size_t i = 0; i < sampler.samples.size(); ++i)
+		dataSize += sampler.samples[i].size();
+	size_t withoutDict = compressedSize(DbCodec(DbCodec_Zstd, level), sampler.samples);
+	size_t withDict = compressedSize(db.codecs.forEntry(rawString<uint8_t>(DbEntryType_PngBlock)), sampler.samples);
+	cout << "samples: " << dataSize << " bytes, " << DbCodec(DbCodec_Zstd, level).name() << ": " << withoutDict
+	<< " bytes, " << codec.name() << ": " << withDict << " bytes" << endl;
+	cout << "new block entries use " << codec.name() << endl;
+	
+	return true;
+}
+
+int main(int argc, char** argv) {
+	size_t numSamples = 10000;
+	size_t dictSize = 64 * 1024;
+	int level = 3;
+	int argi = 1;
+	while(argc > argi + 1) {
+		std::string arg = argv[argi];
+		if(arg == "--samples")
+			numSamples = atoi(argv[argi + 1]);
+		else if(arg == "--size")
+			dictSize = atoi(argv[argi + 1]);
+		else if(arg == "--level")
+			level = atoi(argv[argi + 1]);
+		else break;
+		argi += 2;
+	}
+	if(argc > argi) {
+		cerr << "usage: " << argv[0] << " [--samples N] [--size dictBytes] [--level zstdLevel]" << endl;
+		return 1;
+	}
+	
+	srandom(time(NULL));
+	Return r = _main(numSamples, dictSize, level);
+	if(!r) {
+		cerr << "error: " << r.errmsg << endl;
+		return 1;
+	}
+	
+	cout << "success" << endl;
+	return 0;
+}
@@ -41,10 +41,7 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	size_t s = 0;
-	for(std::list<std::string>::iterator i = reader.scanlines.begin(); i != reader.scanlines.end(); ++i)
-		s += i->size();
-	cout << "uncompressed data stream size: " << s << endl;		
+	cout << "uncompressed data stream size: " << reader.scanlines.dataSize() << endl;
 	cout << "number scanlines: " << reader.scanlines.size() << endl;
 	
 	cout << "success" << endl;
@@ -0,0 +1,146 @@
+/* checks the sharded cache (see Cache.h)
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "Cache.h"
+
+#include <cstdlib>
+#include <sstream>
+#include <iostream>
+#include <pthread.h>
+using namespace std;
+
+struct Value {
+	int n;
+	Value(int _n) : n(_n) {}
+};
+
+static std::string key(int n) {
+	std::ostringstream s;
+	s << "key" << n;
+	return s.str();
+}
+
+static Return checkBasic() {
+	Cache<Value> cache(1000, 1);
+	if(cache.get(key(1)).get() != NULL) return "got a value from the empty cache";
+	if(!cache.put(key(1), new Value(1), 100)) return "value was not admitted into the empty cache";
+	SmartPointer<Value> v = cache.get(key(1));
+	if(v.get() == NULL || v->n != 1) return "value not found";
+	cache.put(key(1), new Value(2), 200);
+	if(cache.get(key(1))->n != 2) return "value was not replaced";
+	CacheStats stats = cache.stats();
+	if(stats.hits != 2 || stats.misses != 1) return "hit/miss counters wrong";
+	if(stats.hitBytes != 300) return "hit bytes counter wrong";
+	if(stats.entries != 1 || stats.bytes != 200) return "size counters wrong";
+	cache.resize(key(1), v.get(), 300); // not the current value anymore
+	if(cache.stats().bytes != 200) return "resize of an old value changed the size";
+	return true;
+}
+
+// A scan over many keys which are used only once must not evict the often used ones.
+static Return checkScanResistance() {
+	Cache<Value> cache(100 * 10, 1);
+	for(int round = 0; round < 5; ++round)
+		for(int i = 0; i < 10; ++i)
+			if(cache.get(key(i)).get() == NULL)
+				cache.put(key(i), new Value(i), 100);
+	for(int i = 100; i < 2100; ++i)
+		if(cache.get(key(i)).get() == NULL)
+			cache.put(key(i), new Value(i), 100);
+	int hot = 0;
+	for(int i = 0; i < 10; ++i)
+		if(cache.get(key(i)).get() != NULL) ++hot;
+	CacheStats stats = cache.stats();
+	if(hot < 9) {
+		std::ostringstream s;
+		s << "only " << hot << " of the 10 often used entries are left after a scan";
+		return s.str();
+	}
+	if(stats.bytes > 1000) return "over budget";
+	if(stats.rejections == 0) return "no rejections counted";
+	return true;
+}
+
+// A growing entry evicts others, but the budget always holds.
+static Return checkResize() {
+	Cache<Value> cache(1000, 1);
+	for(int i = 0; i < 5; ++i)
+		cache.put(key(i), new Value(i), 100);
+	SmartPointer<Value> v = cache.get(key(0));
+	cache.resize(key(0), v.get(), 800);
+	CacheStats stats = cache.stats();
+	if(stats.bytes > 1000) return "over budget after resize";
+	if(stats.evictions == 0) return "no evictions counted";
+	if(cache.get(key(0)).get() != v.get()) return "resized entry was evicted";
+	return true;
+}
+
+// Short keys like the DB entry ids must be spread over all shards and found again
+// after the index of the shards has grown.
+static Return checkShards() {
+	Cache<Value> cache(1000000, 16);
+	for(int i = 0; i < 1600; ++i)
+		cache.put(std::string((const char*)&i, 3), new Value(i), 100);
+	for(size_t i = 0; i < cache.numShards; ++i)
+		if(cache.shards[i].stats.entries < 50 || cache.shards[i].stats.entries > 150) {
+			std::ostringstream s;
+			s << "shard " << i << " has " << cache.shards[i].stats.entries << " of 1600 entries";
+			return s.str();
+		}
+	for(int i = 0; i < 1600; ++i) {
+		SmartPointer<Value> v = cache.get(std::string((const char*)&i, 3));
+		if(v.get() == NULL || v->n != i) return "entry not found after the index has grown";
+	}
+	return true;
+}
+
+static Cache<Value>* threadCache = NULL;
+
+static void* __cacheThread(void* p) {
+	size_t seed = (size_t)p;
+	for(int n = 0; n < 100000; ++n) {
+		seed = seed * 1103515245 + 12345;
+		int i = (seed >> 8) % 2000;
+		SmartPointer<Value> v = threadCache->get(key(i));
+		if(v.get() == NULL)
+			threadCache->put(key(i), new Value(i), 10 + i % 100);
+		else if(v->n != i)
+			return (void*)"wrong value";
+	}
+	return NULL;
+}
+
+static Return checkThreads() {
+	Cache<Value> cache(20000, 8);
+	threadCache = &cache;
+	pthread_t threads[8];
+	for(size_t i = 0; i < 8; ++i)
+		pthread_create(&threads[i], NULL, __cacheThread, (void*)i);
+	Return r = true;
+	for(size_t i = 0; i < 8; ++i) {
+		void* ret = NULL;
+		pthread_join(threads[i], &ret);
+		if(ret) r = (const char*)ret;
+	}
+	ASSERT( r );
+	CacheStats stats = cache.stats();
+	if(stats.hits + stats.misses != 8 * 100000) return "lost some counts";
+	if(stats.bytes > 20000) return "over budget";
+	return true;
+}
+
+int main(int argc, char** argv) {
+	Return r = checkBasic();
+	if(r) r = checkScanResistance();
+	if(r) r = checkResize();
+	if(r) r = checkShards();
+	if(r) r = checkThreads();
+	if(!r) {
+		cout << "error: " << r.errmsg << endl;
+		return 1;
+	}
+	cout << "success" << endl;
+	return 0;
+}
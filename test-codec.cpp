@@ -0,0 +1,115 @@
+/* checks the codecs of the stored entries (see DbCodec.h)
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "DbCodec.h"
+#include "Lz4.h"
+#include "StringUtils.h"
+
+#include <cstdlib>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <zlib.h>
+using namespace std;
+
+static const char* codecNames[] = { "stored", "lz4", "deflate-0", "deflate-9", "zstd-1", "zstd-19", NULL };
+
+// Random data where each byte repeats an earlier one with the given probability,
+// so there are matches of all lengths and offsets.
+static std::string testData(size_t size, int repeatPercent) {
+	std::string s(size, 0);
+	for(size_t i = 0; i < size; ++i) {
+		if(i > 0 && (random() % 100) < repeatPercent)
+			s[i] = s[i - 1 - random() % std::min(i, (size_t)70000)];
+		else
+			s[i] = random() & 0xff;
+	}
+	return s;
+}
+
+static Return checkRoundtrip(const DbCodec& codec, const std::string& data) {
+	std::string compressed, uncompressed;
+	codec.compress(data, compressed);
+	if(compressed.empty() || (uint8_t) compressed[0] != codec.id)
+		return codec.name() + ": codec id missing";
+	Return r = dbCodecUncompress(compressed, uncompressed);
+	if(r && uncompressed != data) r = "data differs";
+	if(!r) {
+		std::ostringstream s;
+		s << codec.name() << ": roundtrip failed for " << data.size() << " bytes: " << r.errmsg;
+		return s.str();
+	}
+	return true;
+}
+
+// Entries of older DBs are the plain zlib stream.
+static Return checkOldEntries() {
+	std::string data = testData(10000, 80);
+	std::string compressed(compressBound(data.size()), 0);
+	uLongf size = compressed.size();
+	compress2((Bytef*) &compressed[0], &size, (const Bytef*) data.data(), data.size(), 9);
+	compressed.resize(size);
+	std::string uncompressed;
+	ASSERT( dbCodecUncompress(compressed, uncompressed) );
+	if(uncompressed != data) return "old zlib entry: data differs";
+	return true;
+}
+
+// Malformed LZ4 blocks must give an error, not a crash.
+static Return checkLz4Malformed() {
+	std::string data = testData(5000, 90);
+	std::string block;
+	lz4_compress(data.data(), data.size(), block);
+	for(size_t n = 0; n < 2000; ++n) {
+		std::string b = block;
+		if(n % 2) b.resize(random() % b.size());
+		else b[random() % b.size()] ^= 1 << (random() % 8);
+		std::string out;
+		lz4_uncompress(b.data(), b.size(), data.size(), out);
+	}
+	return true;
+}
+
+// A corrupt size in the entry must give an error before anything is allocated for it.
+static Return checkHugeSizes() {
+	std::string data;
+	std::string lz4 = std::string(1, (char) DbCodec_Lz4) + rawString<uint32_t>(0xffffffff);
+	lz4_compress("abc", 3, lz4);
+	if(dbCodecUncompress(lz4, data)) return "LZ4 entry with a huge size was accepted";
+	
+	// zstd frame (little endian): magic, single segment with an 8 byte content size (1 TB), an empty raw last block
+	const char frame[] = "\x28\xb5\x2f\xfd" "\xe0" "\x00\x00\x00\x00\x00\x01\x00\x00" "\x01\x00\x00";
+	std::string zstd = std::string(1, (char) DbCodec_Zstd) + std::string(frame, sizeof(frame) - 1);
+	if(dbCodecUncompress(zstd, data)) return "zstd entry with a huge size was accepted";
+	return true;
+}
+
+int main(int argc, char** argv) {
+	srandom(42);
+	for(const char** n = codecNames; *n; ++n) {
+		DbCodec codec;
+		Return r = DbCodec::FromName(codec, *n);
+		for(size_t size = 0; r && size < 100000; size += (size < 300) ? 1 : 7919)
+			for(int repeat = 0; r && repeat <= 100; repeat += 25)
+				r = checkRoundtrip(codec, testData(size, repeat));
+		if(r && codec.name() != *n) r = std::string("name of codec ") + *n + " is " + codec.name();
+		if(!r) {
+			cout << "error: " << r.errmsg << endl;
+			return 1;
+		}
+		cout << codec.name() << ": ok" << endl;
+	}
+
+	Return r = checkOldEntries();
+	if(r) r = checkLz4Malformed();
+	if(r) r = checkHugeSizes();
+	if(!r) {
+		cout << "error: " << r.errmsg << endl;
+		return 1;
+	}
+
+	cout << "success" << endl;
+	return 0;
+}
@@ -0,0 +1,83 @@
+/* checks the CRC implementations (see Crc.h) against each other and crc_combine
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "Crc.h"
+#include "Return.h"
+
+#include <cstdlib>
+#include <vector>
+#include <sstream>
+#include <iostream>
+using namespace std;
+
+static std::string describe(int impl, size_t offset, size_t size) {
+	std::ostringstream s;
+	s << crc_impl_name(impl) << ": wrong CRC for offset " << offset << ", size " << size;
+	return s.str();
+}
+
+// All sizes up to a few folding blocks and some big ones, also at unaligned offsets.
+static Return checkRandom(int impl, const std::vector<char>& buf) {
+	for(size_t size = 0; size < 20000; size += (size < 600) ? 1 : 997) {
+		for(size_t offset = 0; offset < 16; offset += 5) {
+			uint32_t init = random();
+			uint32_t ref = update_crc(init, &buf[offset], size, CrcImpl_Bytewise);
+			if(update_crc(init, &buf[offset], size, impl) != ref)
+				return describe(impl, offset, size);
+		}
+	}
+	return true;
+}
+
+static Return checkCombine(const std::vector<char>& buf) {
+	for(size_t n = 0; n < 2000; ++n) {
+		size_t size = random() % 5000;
+		size_t split = (size > 0) ? random() % (size + 1) : 0;
+		uint32_t crc1 = calc_crc(&buf[0], split);
+		uint32_t crc2 = calc_crc(&buf[split], size - split);
+		if(crc_combine(crc1, crc2, size - split) != calc_crc(&buf[0], size)) {
+			std::ostringstream s;
+			s << "crc_combine wrong for size " << size << ", split at " << split;
+			return s.str();
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	srandom(42);
+	std::vector<char> buf(30000);
+	for(size_t i = 0; i < buf.size(); ++i)
+		buf[i] = random() & 0xff;
+
+	// check value of CRC-32 (as in PNG and zlib)
+	if(calc_crc("123456789", 9) != 0xcbf43926) {
+		cout << "error: wrong CRC for the check value" << endl;
+		return 1;
+	}
+
+	for(int impl = CrcImpl_Bytewise + 1; impl < CrcImpl_Count; ++impl) {
+		if(!crc_cpu_supports(impl)) {
+			cout << crc_impl_name(impl) << ": not supported by the CPU" << endl;
+			continue;
+		}
+		Return r = checkRandom(impl, buf);
+		if(!r) {
+			cout << "error: " << r.errmsg << endl;
+			return 1;
+		}
+		cout << crc_impl_name(impl) << ": ok" << endl;
+	}
+
+	Return r = checkCombine(buf);
+	if(!r) {
+		cout << "error: " << r.errmsg << endl;
+		return 1;
+	}
+	cout << "crc_combine: ok" << endl;
+
+	cout << "success" << endl;
+	return 0;
+}
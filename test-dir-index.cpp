@@ -0,0 +1,100 @@
+/* checks the directory index (see DbDirIndex.h)
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "DbDirIndex.h"
+#include "StringUtils.h"
+
+#include <map>
+#include <sstream>
+#include <iostream>
+using namespace std;
+
+struct MapKeyValue : DbKeyValueIntf {
+	std::map<std::string, std::string> values;
+	bool get(/*out*/ std::string& value, const std::string& key) {
+		std::map<std::string, std::string>::iterator i = values.find(key);
+		if(i == values.end()) return false;
+		value = i->second;
+		return true;
+	}
+	Return set(const std::string& key, const std::string& value) {
+		values[key] = value;
+		return true;
+	}
+};
+
+static std::string name(size_t n) {
+	std::ostringstream s;
+	s << "file" << n << ".png";
+	return s.str();
+}
+
+static std::string ref(size_t n) {
+	return "R" + rawString<uint16_t>(n + 1);
+}
+
+// A dir with an old list ("fs." dir) gets these entries into the index on the first push.
+static Return checkMigration(MapKeyValue& db) {
+	for(size_t i = 0; i < 100; ++i) {
+		std::string entry = DbDirEntry::File(name(i), 1000 + i).serialized();
+		db.values["fs.old"] += rawString<uint8_t>(entry.size()) + entry;
+		db.values["fs.old/" + name(i)] = ref(i);
+	}
+	if(dbDirIndexHave(db, "old")) return "index before the first push";
+	ASSERT( dbDirIndexAdd(db, "old", DbDirEntry::File(name(100), 1100)) );
+	ASSERT( dbDirIndexSetRef(db, "old/" + name(100), ref(100)) );
+
+	std::list<DbDirEntry> dirList;
+	size_t cursor = 0;
+	ASSERT( dbDirIndexList(db, "old", dirList, cursor, 1000) );
+	if(dirList.size() != 101 || cursor != 101) return "migrated dir has the wrong number of entries";
+	size_t n = 0;
+	for(std::list<DbDirEntry>::iterator i = dirList.begin(); i != dirList.end(); ++i, ++n)
+		if(i->name != name(n) || i->size != 1000 + n || !i->haveRef || i->ref != ref(n))
+			return "migrated entry " + name(n) + " is wrong";
+	return true;
+}
+
+static Return checkPaging(MapKeyValue& db) {
+	const size_t N = 3 * DbDirIndexPageSize + 5;
+	for(size_t i = 0; i < N; ++i) {
+		ASSERT( dbDirIndexAdd(db, "new", DbDirEntry::File(name(i), i)) );
+		ASSERT( dbDirIndexSetRef(db, "new/" + name(i), ref(i)) );
+	}
+	// pushed again: replaced in place, the ref stays until the next setFileRef
+	ASSERT( dbDirIndexAdd(db, "new", DbDirEntry::File(name(7), 77)) );
+
+	DbDirEntry dirEntry;
+	bool found = false;
+	ASSERT( dbDirIndexLookup(db, "new", name(7), dirEntry, found) );
+	if(!found || dirEntry.size != 77) return "lookup of the replaced entry failed";
+	ASSERT( dbDirIndexLookup(db, "new", "nothing", dirEntry, found) );
+	if(found) return "lookup found a missing entry";
+
+	size_t cursor = 0;
+	size_t n = 0;
+	while(true) {
+		std::list<DbDirEntry> dirList;
+		ASSERT( dbDirIndexList(db, "new", dirList, cursor, 10) );
+		if(dirList.empty()) break;
+		for(std::list<DbDirEntry>::iterator i = dirList.begin(); i != dirList.end(); ++i, ++n)
+			if(i->name != name(n) || i->size != (n == 7 ? (size_t)77 : n) || i->ref != ref(n))
+				return "listed entry " + name(n) + " is wrong";
+	}
+	if(n != N || cursor != N) return "listing has the wrong number of entries";
+	return true;
+}
+
+int main(int argc, char** argv) {
+	MapKeyValue db;
+	Return r = checkMigration(db);
+	if(r) r = checkPaging(db);
+	if(!r) {
+		cout << "error: " << r.errmsg << endl;
+		return 1;
+	}
+	cout << "success" << endl;
+	return 0;
+}
@@ -0,0 +1,225 @@
+/* checks the B+tree, the free space, the value chains, the compaction and the trie conversion of DbFileBackend
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "DbFileBackend.h"
+#include "StringUtils.h"
+#include "Crc.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+using namespace std;
+
+static std::string key(int n) {
+	std::ostringstream s;
+	s << "test" << n;
+	return s.str();
+}
+
+static std::string value(int n, size_t size) {
+	std::string v(size, 'a' + n % 26);
+	v[0] = n & 0xff;
+	return v;
+}
+
+// Values which get longer are chains of chunks. If they get shorter again, the rest is free.
+static Return checkFreeSpace(const std::string& filename) {
+	DbFileBackend db(filename);
+	ASSERT( db.init() );
+	for(int i = 0; i < 100; ++i) {
+		ASSERT( db.setMeta(key(i), value(i, 10)) );
+		ASSERT( db.setMeta(key(i), value(i, 1000)) );
+	}
+	for(int i = 0; i < 100; i += 2)
+		ASSERT( db.setMeta(key(i), value(i, 5)) );
+
+	DbFileSpaceStats stats;
+	ASSERT( db.spaceStats(stats) );
+	if(stats.freeBytes < 50 * 1000) return "the unused chunks are not free: " + stats.summary();
+	if(stats.deadBytes > 0) return "dead bytes with free space management: " + stats.summary();
+
+	// new values go into the free extents
+	size_t fileSize = db.fileSize;
+	for(int i = 100; i < 150; ++i)
+		ASSERT( db.setMeta(key(i), value(i, 900)) );
+	if(db.fileSize - fileSize > 50 * 900 / 4) return "the free extents were not used"; // only some B+tree pages are new
+
+	for(int i = 0; i < 150; ++i) {
+		std::string v;
+		ASSERT( db.getMeta(v, key(i)) );
+		if(v != value(i, (i >= 100) ? 900 : (i % 2 == 0) ? 5 : 1000)) return "wrong value for " + key(i);
+	}
+	return true;
+}
+
+static Return checkReopenAndCompact(const std::string& filename) {
+	DbFileBackend db(filename);
+	ASSERT( db.init() );
+	DbFileSpaceStats before;
+	ASSERT( db.spaceStats(before) );
+	if(before.freeExtents == 0) return "the free extents are gone after reopening";
+
+	ASSERT( db.compact() );
+	DbFileSpaceStats after;
+	ASSERT( db.spaceStats(after) );
+	if(after.freeBytes > 0 || after.deadBytes > 0) return "free or dead space after compaction: " + after.summary();
+	if(after.fileSize >= before.fileSize) return "compaction didn't make the file smaller";
+	if(after.valueDataBytes != before.valueDataBytes) return "compaction changed the values";
+
+	for(int i = 0; i < 150; ++i) {
+		std::string v;
+		ASSERT( db.getMeta(v, key(i)) );
+		if(v != value(i, (i >= 100) ? 900 : (i % 2 == 0) ? 5 : 1000)) return "wrong value after compaction for " + key(i);
+	}
+	return true;
+}
+
+// A value which grows step by step has only a few chunks, see DbFile_ChainGrowth.
+static Return checkChains(const std::string& filename) {
+	remove(filename.c_str());
+	DbFileBackend db(filename);
+	ASSERT( db.init() );
+	DbFileSpaceStats before;
+	ASSERT( db.spaceStats(before) );
+	for(int i = 1; i <= 100; ++i)
+		ASSERT( db.setMeta("grow", value(0, i * 100)) );
+
+	DbFileSpaceStats stats;
+	ASSERT( db.spaceStats(stats) );
+	if(stats.valueChunks - before.valueChunks > 10) return "too many chunks for a growing value: " + stats.summary();
+	std::string v;
+	ASSERT( db.getMeta(v, "grow") );
+	if(v != value(0, 100 * 100)) return "wrong value after growing";
+	remove(filename.c_str());
+	return true;
+}
+
+// Like the SHA1 refs: random, so they go into all the leaves.
+static std::string randomKey(int n) {
+	std::ostringstream s;
+	s << "random.";
+	unsigned int x = n * 2654435761u + 1;
+	for(int i = 0; i < 4; ++i) {
+		x = x * 1103515245u + 12345u;
+		s << std::hex << x;
+	}
+	return s.str();
+}
+
+// Like a compaction: in order, so always the rightmost leaf.
+static std::string seqKey(int n) {
+	std::ostringstream s;
+	s << "seq." << (100000000 + n);
+	return s.str();
+}
+
+#define BTreeTestKeys 20000
+
+static Return checkBTreeKeys(DbFileBackend& db) {
+	for(int i = 0; i < BTreeTestKeys; ++i) {
+		std::string v;
+		ASSERT_EXT( db.getMeta(v, randomKey(i)), "B+tree lookup of " + randomKey(i) );
+		if(v != value(i, 10)) return "wrong value for " + randomKey(i);
+		ASSERT_EXT( db.getMeta(v, seqKey(i)), "B+tree lookup of " + seqKey(i) );
+		if(v != value(i, 20)) return "wrong value for " + seqKey(i);
+	}
+	std::string v;
+	if(db.getMeta(v, randomKey(BTreeTestKeys))) return "B+tree lookup found a missing key";
+	return true;
+}
+
+// So many keys that the inner pages are split too.
+static Return checkBTree(const std::string& filename) {
+	remove(filename.c_str());
+	{
+		DbFileBackend db(filename);
+		ASSERT( db.init() );
+		for(int i = 0; i < BTreeTestKeys; ++i) {
+			ASSERT( db.setMeta(randomKey(i), value(i, 10)) );
+			ASSERT( db.setMeta(seqKey(i), value(i, 20)) );
+		}
+		ASSERT( checkBTreeKeys(db) );
+		DbFileSpaceStats stats;
+		ASSERT( db.spaceStats(stats) );
+		if(stats.treeLevels < 3) return "the inner pages were not split: " + stats.summary();
+	}
+	{
+		DbFileBackend db(filename, /*readonly*/ true);
+		ASSERT( db.init() );
+		ASSERT_EXT( checkBTreeKeys(db), "after reopening" );
+	}
+	remove(filename.c_str());
+	return true;
+}
+
+// An older DB file, as it was created before the B+tree: the signature and an empty trie root
+// chunk (see DbFile_TreeChunk). The backend still writes into the trie if it has one.
+static Return createTrieFile(const std::string& filename) {
+	static const char signature[] = {(char)137,'A','Z','P','N','G','D','B',13,10,26,10};
+	std::string data(sizeof(uint64_t) * 5, '\0'); // the value ref and the 4 subtree refs
+	data += rawString<uint32_t>(calc_crc(data));
+	std::ofstream f(filename.c_str(), std::ios::binary);
+	f << std::string(signature, sizeof(signature)) << rawString<uint8_t>(1) << rawString<uint32_t>(sizeof(uint64_t) * 5) << data;
+	f.close();
+	if(!f) return "cannot write " + filename;
+	return true;
+}
+
+// What db-file-convert does.
+static Return checkConvert(const std::string& trieFilename, const std::string& filename) {
+	remove(trieFilename.c_str());
+	remove(filename.c_str());
+	ASSERT( createTrieFile(trieFilename) );
+	{
+		DbFileBackend db(trieFilename);
+		ASSERT( db.init() );
+		if(!db.hasTrie()) return "the old file has no trie";
+		for(int i = 0; i < 1000; ++i)
+			ASSERT( db.setMeta(key(i), value(i, 100)) );
+	}
+	
+	DbFileBackend src(trieFilename, /*readonly*/ true);
+	ASSERT( src.init() );
+	if(!src.hasTrie()) return "the old file has no trie after reopening";
+	{
+		DbFileBackend dest(filename);
+		ASSERT( dest.init() );
+		size_t numKeys = 0;
+		ASSERT( src.copyTo(dest, numKeys) );
+		if(numKeys < 1000) return "not all keys were copied";
+	}
+	
+	DbFileBackend db(filename, /*readonly*/ true);
+	ASSERT( db.init() );
+	if(db.hasTrie()) return "the converted file has the trie";
+	for(int i = 0; i < 1000; ++i) {
+		std::string v;
+		ASSERT_EXT( db.getMeta(v, key(i)), "converted lookup of " + key(i) );
+		if(v != value(i, 100)) return "wrong converted value for " + key(i);
+	}
+	remove(trieFilename.c_str());
+	remove(filename.c_str());
+	return true;
+}
+
+int main() {
+	std::string filename = "test-file-backend.pngdb";
+	remove(filename.c_str());
+
+	Return r = checkBTree(filename);
+	if(r) r = checkConvert("test-file-backend-trie.pngdb", filename);
+	if(r) r = checkChains(filename);
+	if(r) r = checkFreeSpace(filename);
+	if(r) r = checkReopenAndCompact(filename);
+	remove(filename.c_str());
+	if(!r) {
+		cerr << "error: " << r.errmsg << endl;
+		return 1;
+	}
+	cout << "success" << endl;
+	return 0;
+}
@@ -0,0 +1,113 @@
+/* checks the SIMD PNG filter kernels against the scalar ones
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "PngFilter.h"
+
+#include <cstdlib>
+#include <vector>
+#include <sstream>
+#include <iostream>
+using namespace std;
+
+static const size_t bppList[] = { 1, 2, 3, 4, 6, 8 };
+static const char* filterNames[] = { "None", "Sub", "Up", "Average", "Paeth" };
+
+static std::string describe(int type, size_t bpp, size_t size) {
+	std::ostringstream s;
+	s << filterNames[type] << ", bpp=" << bpp << ", size=" << size;
+	return s.str();
+}
+
+// Runs the kernel and the scalar one on a copy of row and compares the results.
+static Return check(const PngFilterKernels& k, int type, bool unfilter,
+					const std::vector<uint8_t>& row, const std::vector<uint8_t>& prior) {
+	const PngFilterKernels& ref = *png_filter_kernels(k.bpp, PngFilterIsa_Scalar);
+	std::vector<uint8_t> a(row), b(row);
+	if(unfilter) {
+		k.unfilter[type](&a[0], &prior[0], a.size());
+		ref.unfilter[type](&b[0], &prior[0], b.size());
+	}
+	else {
+		k.filter[type](&a[0], &prior[0], a.size());
+		ref.filter[type](&b[0], &prior[0], b.size());
+	}
+	if(a != b)
+		return std::string(k.name) + ": " + (unfilter ? "unfilter" : "filter")
+		+ " differs for " + describe(type, k.bpp, row.size());
+	if(!unfilter) {
+		ref.unfilter[type](&a[0], &prior[0], a.size());
+		if(a != row)
+			return "unfilter(filter(row)) != row for " + describe(type, k.bpp, row.size());
+	}
+	return true;
+}
+
+static void randomize(std::vector<uint8_t>& v) {
+	for(size_t i = 0; i < v.size(); ++i)
+		v[i] = random() & 0xff;
+}
+
+// All row sizes up to a few registers (to get all the remaining byte cases) and some big ones.
+static Return checkRandom(const PngFilterKernels& k) {
+	for(size_t size = 1; size < 1000; size += (size < 200) ? 1 : 97) {
+		for(int n = 0; n < 4; ++n) {
+			std::vector<uint8_t> row(size), prior(size);
+			randomize(row);
+			randomize(prior);
+			for(int type = 1; type <= 4; ++type) {
+				ASSERT( check(k, type, true, row, prior) );
+				ASSERT( check(k, type, false, row, prior) );
+			}
+		}
+	}
+	return true;
+}
+
+// With bpp 1, every (left, up, upper left) byte triple is in this row,
+// so Average and Paeth see all inputs of their predictors.
+// For unfiltering, we filter it first, so the left bytes are the same after unfiltering.
+static Return checkAllPredictorInputs(const PngFilterKernels& k) {
+	std::vector<uint8_t> row, prior;
+	row.reserve(256 * 256 * 256 * 2);
+	prior.reserve(row.capacity());
+	for(int left = 0; left < 256; ++left)
+		for(int upLeft = 0; upLeft < 256; ++upLeft)
+			for(int up = 0; up < 256; ++up) {
+				row.push_back(left);
+				row.push_back(random() & 0xff);
+				prior.push_back(upLeft);
+				prior.push_back(up);
+			}
+	const PngFilterKernels& ref = *png_filter_kernels(1, PngFilterIsa_Scalar);
+	for(int type = 3; type <= 4; ++type) {
+		ASSERT( check(k, type, false, row, prior) );
+		// the unfiltered left bytes are the ones of row again
+		std::vector<uint8_t> filtered(row);
+		ref.filter[type](&filtered[0], &prior[0], filtered.size());
+		ASSERT( check(k, type, true, filtered, prior) );
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	srandom(42);
+	cout << "cpu: " << png_filter_kernels(1)->name << endl;
+	for(int isa = PngFilterIsa_Scalar + 1; isa < PngFilterIsa_Count; ++isa) {
+		for(size_t i = 0; i < sizeof(bppList)/sizeof(bppList[0]); ++i) {
+			const PngFilterKernels* k = png_filter_kernels(bppList[i], isa);
+			if(k == NULL) continue;
+			Return r = checkRandom(*k);
+			if(r && k->bpp == 1) r = checkAllPredictorInputs(*k);
+			if(!r) {
+				cout << "error: " << r.errmsg << endl;
+				return 1;
+			}
+			cout << k->name << ", bpp " << k->bpp << ": ok" << endl;
+		}
+	}
+
+	cout << "success" << endl;
+	return 0;
+}
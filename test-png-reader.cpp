@@ -36,10 +36,7 @@ int main(int argc, char** argv) {
 			haveSeenHeader = true;
 		}
 		
-		size_t s = 0;
-		for(std::list<std::string>::iterator i = reader.scanlines.begin(); i != reader.scanlines.end(); ++i)
-			s += i->size();
-		cout << "at " << ftell(f) << ": got " << s << " uncompressed" << endl;		
+		cout << "at " << ftell(f) << ": got " << reader.scanlines.dataSize() << " uncompressed" << endl;
 	}
 	
 	cout << "success" << endl;
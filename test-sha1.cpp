@@ -0,0 +1,113 @@
+/* checks the SHA-NI and multi-buffer SHA1 against the FIPS test vectors and the scalar code
+ * by Albert Zeyer, 2011
+ * code under LGPL
+ */
+
+#include "Sha1.h"
+#include "Return.h"
+#include "StringUtils.h"
+
+#include <cstdlib>
+#include <vector>
+#include <sstream>
+#include <iostream>
+using namespace std;
+
+struct TestVector {
+	std::string data;
+	const char* digest;
+};
+
+static std::vector<TestVector> fipsVectors() {
+	std::vector<TestVector> v(3);
+	v[0].data = "abc";
+	v[0].digest = "A9993E364706816ABA3E25717850C26C9CD0D89D";
+	v[1].data = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	v[1].digest = "84983E441C3BD26EBAAE4AA1F95129E5E54670F1";
+	v[2].data = std::string(1000000, 'a');
+	v[2].digest = "34AA973CD4C4DAA4F61EEB2BDBAD27316534016F";
+	return v;
+}
+
+static Return checkFips(int isa) {
+	std::vector<TestVector> v = fipsVectors();
+	for(size_t i = 0; i < v.size(); ++i) {
+		const char* data = v[i].data.data();
+		size_t size = v[i].data.size();
+		std::string digest;
+		calc_sha1_many(&digest, &data, &size, 1, isa);
+		if(hexString(digest) != v[i].digest)
+			return std::string(sha1_isa_name(isa)) + ": wrong digest for FIPS test vector " + hexString(v[i].data.substr(0, 8));
+	}
+	return true;
+}
+
+// Hashes everything via the Sha1Context with the given update sizes, i.e. the original code path.
+static std::string sha1Context(const std::string& data, size_t step) {
+	Sha1Context c;
+	for(size_t i = 0; i < data.size(); i += step)
+		c.update(&data[i], std::min(step, data.size() - i));
+	return c.final();
+}
+
+// Messages of all sizes up to a few blocks (all the padding cases) and some big ones,
+// in random order, so that the lanes get messages of different lengths.
+static Return checkRandom(int isa) {
+	std::vector<std::string> msgs;
+	for(size_t size = 0; size < 5000; size += (size < 300) ? 1 : 331) {
+		std::string s(size, 0);
+		for(size_t i = 0; i < size; ++i) s[i] = random() & 0xff;
+		msgs.push_back(s);
+	}
+	for(size_t i = msgs.size(); i > 1; --i)
+		std::swap(msgs[i - 1], msgs[random() % i]);
+	std::vector<const char*> data(msgs.size());
+	std::vector<size_t> sizes(msgs.size());
+	for(size_t i = 0; i < msgs.size(); ++i) {
+		data[i] = msgs[i].data();
+		sizes[i] = msgs[i].size();
+	}
+	// also fewer messages than lanes
+	for(size_t n = 1; n <= msgs.size(); ++n) {
+		if(n > 10) n = msgs.size();
+		std::vector<std::string> digests(n);
+		calc_sha1_many(&digests[0], &data[0], &sizes[0], n, isa);
+		for(size_t i = 0; i < n; ++i) {
+			if(digests[i] != sha1Context(msgs[i], 17)) {
+				std::ostringstream s;
+				s << sha1_isa_name(isa) << ": wrong digest for message " << i << " (size " << sizes[i] << ") of " << n;
+				return s.str();
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	srandom(42);
+	for(int isa = Sha1Isa_Scalar; isa < Sha1Isa_Count; ++isa) {
+		if(!sha1_cpu_supports(isa)) {
+			cout << sha1_isa_name(isa) << ": not supported by the CPU" << endl;
+			continue;
+		}
+		Return r = checkFips(isa);
+		if(r) r = checkRandom(isa);
+		if(!r) {
+			cout << "error: " << r.errmsg << endl;
+			return 1;
+		}
+		cout << sha1_isa_name(isa) << ": ok" << endl;
+	}
+
+	// calc_sha1 and Sha1Context use the best single-buffer one
+	std::vector<TestVector> v = fipsVectors();
+	for(size_t i = 0; i < v.size(); ++i) {
+		if(hexString(calc_sha1(v[i].data)) != v[i].digest || hexString(sha1Context(v[i].data, 1000)) != v[i].digest) {
+			cout << "error: calc_sha1 or Sha1Context wrong for FIPS test vector " << i << endl;
+			return 1;
+		}
+	}
+
+	cout << "success" << endl;
+	return 0;
+}